@@ -0,0 +1,804 @@
+/*
+ * checkpoint.h
+ *
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "model.h"
+
+using namespace std;
+
+
+/**
+ * Flat binary checkpoint of the weights of a Model.
+ *
+ *   [header 64 bytes][index: count entries of 128 bytes][tensor data ...]
+ *
+ * The index and every tensor start on a 64 byte boundary. A tensor is stored as its raw
+ * column-major floats, exactly as cuMat holds it on the device, so loading is one
+ * cudaMemcpy per tensor straight out of the mapped file, no archive and no element loops.
+ * Entries are named "<graph name>.<n>" for the n-th tensor of Graph::getBuffers() and
+ * "<graph name>.q<n>" for the int8 tensors of Graph::getInt8Buffers() (rows of ld bytes).
+ * save_checkpoint() can store the float tensors as fp16 or bf16 instead, half the size,
+ * they are widened back to float on the device when loaded.
+ *
+ * A sharded checkpoint keeps only the header and the index in path and the tensors in the
+ * shard files "<path>.0" .. "<path>.<shards-1>", the offset of an entry is then the offset
+ * in its shard. The shards are balanced by size.
+ *
+ * Only the weights are stored: load_checkpoint() fills a model built with the same graphs
+ * (and folded the same way), unlike Model::load() which also creates the graphs.
+ *
+ * Files of version 1 (float32, no shards) and 2 (float32, sharded) are still read, their
+ * index is converted to the current entries on open.
+ */
+
+#define CHECKPOINT_MAGIC "DNNBCKPT"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGN 64
+
+#define CHECKPOINT_FLOAT32 0
+#define CHECKPOINT_INT8 1
+#define CHECKPOINT_FP16 2
+#define CHECKPOINT_BF16 3
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t file_size;
+    uint32_t shards;        // 0: the tensors follow the index in this file
+    char reserved[20];
+};
+
+struct CheckpointEntry {
+    char name[96];
+    int32_t dtype;
+    int32_t shard;
+    int32_t rows;
+    int32_t cols;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+/**
+ * Index entry of version 1 files: float32 tensors only and no shards (the header had
+ * shards as reserved zeros). CheckpointFile converts it to a CheckpointEntry.
+ */
+struct CheckpointEntryV1 {
+    char name[104];
+    int32_t rows;
+    int32_t cols;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+// version 2: float32 only, with shards
+struct CheckpointEntryV2 {
+    char name[100];
+    int32_t shard;
+    int32_t rows;
+    int32_t cols;
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader must be 64 bytes");
+static_assert(sizeof(CheckpointEntry) == 128, "CheckpointEntry must be 128 bytes");
+static_assert(sizeof(CheckpointEntryV1) == 128, "CheckpointEntryV1 must be 128 bytes");
+static_assert(sizeof(CheckpointEntryV2) == 128, "CheckpointEntryV2 must be 128 bytes");
+
+
+inline uint64_t checkpoint_align(uint64_t offset){
+    return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+inline string checkpoint_entry_name(const string &graph_name, int n){
+    return graph_name + "." + to_string(n);
+}
+
+// a device tensor of a graph as it is stored
+struct CheckpointTensor {
+    string name;
+    char *device;
+    int rows, cols, dtype;
+    uint64_t bytes;
+};
+
+inline vector<CheckpointTensor> checkpoint_tensors(const string &graph_name, Graph *g){
+    vector<CheckpointTensor> tensors;
+
+    vector<Variable *> buffers = g->getBuffers();
+    for (int n = 0; n < buffers.size(); n++) {
+        cuMat &m = buffers[n]->data;
+        tensors.push_back({checkpoint_entry_name(graph_name, n), (char *) m.mDevice, m.rows, m.cols,
+                           CHECKPOINT_FLOAT32, (uint64_t) m.rows * m.cols * sizeof(float)});
+    }
+
+    vector<cuMatInt8 *> int8_buffers = g->getInt8Buffers();
+    for (int n = 0; n < int8_buffers.size(); n++) {
+        cuMatInt8 *m = int8_buffers[n];
+        tensors.push_back({graph_name + ".q" + to_string(n), m->mDevice, m->rows, m->ld,
+                           CHECKPOINT_INT8, (uint64_t) m->bytes()});
+    }
+
+    return tensors;
+}
+
+inline bool checkpoint_is_half(int dtype){
+    return dtype == CHECKPOINT_FP16 || dtype == CHECKPOINT_BF16;
+}
+
+inline string checkpoint_shard_path(const string &path, int shard){
+    return path + "." + to_string(shard);
+}
+
+
+/**
+ * Builds the index of all tensors of the model and returns the size of the file at path.
+ * With shards > 1 the tensors go to the lightest shard so far and shard_sizes gets the
+ * size of every shard file. The float tensors are stored as dtype.
+ */
+inline uint64_t checkpoint_index(Model &model, vector<CheckpointEntry> &entries, vector<char *> &tensors,
+                                 int shards = 1, vector<uint64_t> *shard_sizes = NULL,
+                                 int dtype = CHECKPOINT_FLOAT32){
+
+    for (auto gs : model.graphs) {
+        // G() reads the weights of a lazily loaded graph first
+        for (CheckpointTensor &t : checkpoint_tensors(gs.first, model.G(gs.first))) {
+            if (t.name.size() >= sizeof(((CheckpointEntry *)0)->name)) {
+                cout << "checkpoint: graph name too long " << gs.first << endl;
+                continue;
+            }
+
+            CheckpointEntry e;
+            memset(&e, 0, sizeof(e));
+            strncpy(e.name, t.name.c_str(), sizeof(e.name) - 1);
+            e.dtype = t.dtype;
+            e.rows = t.rows;
+            e.cols = t.cols;
+            e.bytes = t.bytes;
+            if (t.dtype == CHECKPOINT_FLOAT32 && checkpoint_is_half(dtype)) {
+                e.dtype = dtype;
+                e.bytes = (uint64_t) t.rows * t.cols * sizeof(unsigned short);
+            }
+
+            entries.push_back(e);
+            tensors.push_back(t.device);
+        }
+    }
+
+    uint64_t offset = checkpoint_align(sizeof(CheckpointHeader) + entries.size() * sizeof(CheckpointEntry));
+
+    if (shards <= 1) {
+        for (CheckpointEntry &e : entries) {
+            e.offset = offset;
+            offset = checkpoint_align(offset + e.bytes);
+        }
+        return offset;
+    }
+
+    vector<uint64_t> sizes(shards, 0);
+    for (CheckpointEntry &e : entries) {
+        e.shard = min_element(sizes.begin(), sizes.end()) - sizes.begin();
+        e.offset = sizes[e.shard];
+        sizes[e.shard] = checkpoint_align(e.offset + e.bytes);
+    }
+    if (shard_sizes != NULL) *shard_sizes = sizes;
+
+    return offset;
+}
+
+
+inline CheckpointHeader checkpoint_header(vector<CheckpointEntry> &entries, uint64_t file_size, int shards = 0){
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.count = entries.size();
+    header.index_offset = sizeof(CheckpointHeader);
+    header.data_offset = checkpoint_align(sizeof(CheckpointHeader) + entries.size() * sizeof(CheckpointEntry));
+    header.file_size = file_size;
+    header.shards = shards;
+
+    return header;
+}
+
+
+/**
+ * Writes the tensors of shard at their offsets through the host buffer staging and pads
+ * the file to end. fp16 and bf16 entries are rounded on the device first.
+ */
+inline void checkpoint_write_data(std::ofstream &ofs, vector<CheckpointEntry> &entries, vector<char *> &tensors,
+                                  int shard, uint64_t end, vector<char> &staging){
+
+    char zeros[CHECKPOINT_ALIGN] = {0};
+    cuMatHalf half;
+
+    for (int i = 0; i < entries.size(); i++) {
+        if (entries[i].shard != shard) continue;
+
+        uint64_t pos = ofs.tellp();
+        if (pos < entries[i].offset) ofs.write(zeros, entries[i].offset - pos);
+
+        const char *src = tensors[i];
+        if (checkpoint_is_half(entries[i].dtype)) {
+            half.dtype = entries[i].dtype == CHECKPOINT_BF16 ? HALF_BF16 : HALF_FP16;
+            half.from((const float *) tensors[i], entries[i].rows, entries[i].cols);
+            src = (const char *) half.mDevice;
+        }
+
+        if (staging.size() < entries[i].bytes) staging.resize(entries[i].bytes);
+        cudaError_t error = cudaMemcpy(staging.data(), src, entries[i].bytes, cudaMemcpyDeviceToHost);
+        if (error != cudaSuccess) printf("save_checkpoint cudaMemcpy error\n");
+
+        ofs.write(staging.data(), entries[i].bytes);
+    }
+    uint64_t pos = ofs.tellp();
+    if (pos < end) ofs.write(zeros, end - pos);
+}
+
+/**
+ * Writes the weights of model to path, split into shards files when shards > 1, the float
+ * weights as dtype (CHECKPOINT_FP16 or CHECKPOINT_BF16 halve the file). Returns false on
+ * an I/O error.
+ * Blocks until the files are written, see CheckpointWriter for saving during training.
+ */
+inline bool save_checkpoint(Model &model, string path, int shards = 1, int dtype = CHECKPOINT_FLOAT32){
+
+    vector<CheckpointEntry> entries;
+    vector<char *> tensors;
+    vector<uint64_t> shard_sizes;
+    uint64_t file_size = checkpoint_index(model, entries, tensors, shards, &shard_sizes, dtype);
+
+    CheckpointHeader header = checkpoint_header(entries, file_size, shards > 1 ? shards : 0);
+
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    if (!ofs) {
+        cout << "save_checkpoint: cannot open " << path << endl;
+        return false;
+    }
+
+    ofs.write((const char *) &header, sizeof(header));
+    if (!entries.empty()) ofs.write((const char *) entries.data(), entries.size() * sizeof(CheckpointEntry));
+
+    // one host staging buffer for all tensors
+    vector<char> staging;
+
+    if (shards <= 1) {
+        checkpoint_write_data(ofs, entries, tensors, 0, file_size, staging);
+    }
+    else {
+        char zeros[CHECKPOINT_ALIGN] = {0};
+        uint64_t pos = ofs.tellp();
+        if (pos < file_size) ofs.write(zeros, file_size - pos);
+
+        for (int k = 0; k < shards; k++) {
+            std::ofstream ofs_shard(checkpoint_shard_path(path, k), std::ios::binary | std::ios::trunc);
+            checkpoint_write_data(ofs_shard, entries, tensors, k, shard_sizes[k], staging);
+            ofs_shard.close();
+            if (!ofs_shard) {
+                cout << "save_checkpoint: write error " << checkpoint_shard_path(path, k) << endl;
+                return false;
+            }
+        }
+    }
+
+    ofs.close();
+    if (!ofs) {
+        cout << "save_checkpoint: write error " << path << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Saves checkpoints in the background while training continues.
+ *
+ * save() only snapshots the weights: one device to device copy of every tensor into a
+ * device arena laid out like the data section of the file, queued on the default stream
+ * so the following optimizer updates run after it. A writer thread then copies the arena
+ * to the host in chunks on its own stream, alternating between two pinned buffers so the
+ * next chunk is copied while the previous one is written with pwrite(). The file is written
+ * as "<path>.tmp", fsync'ed and renamed over path, so path always holds a complete
+ * checkpoint. A save() while the previous one is still writing waits for it first.
+ *
+ * The arena costs as much device memory as the weights, it is kept between saves.
+ */
+class CheckpointWriter {
+public:
+
+    size_t chunk_bytes = 4 * 1024 * 1024;
+
+    CheckpointWriter(){
+        cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking);
+        cudaEventCreateWithFlags(&snapshot_done, cudaEventDisableTiming);
+        for (int i = 0; i < 2; i++) cudaEventCreateWithFlags(&chunk_done[i], cudaEventDisableTiming);
+    }
+
+    ~CheckpointWriter(){
+        wait();
+
+        if (arena != NULL){
+            cudaFree(arena);
+            mallocCounter.down(arena_bytes);
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pinned[i] != NULL) cudaFreeHost(pinned[i]);
+            cudaEventDestroy(chunk_done[i]);
+        }
+        cudaEventDestroy(snapshot_done);
+        cudaStreamDestroy(stream);
+    }
+
+    /**
+     * Snapshots the weights of model and starts writing them to path.
+     * Returns false if the previous save failed.
+     */
+    bool save(Model &model, string path){
+        bool last_ok = wait();
+
+        entries.clear();
+        vector<char *> tensors;
+        uint64_t file_size = checkpoint_index(model, entries, tensors);
+        header = checkpoint_header(entries, file_size);
+
+        uint64_t bytes = file_size - header.data_offset;
+        if (bytes > arena_bytes){
+            if (arena != NULL){
+                cudaFree(arena);
+                mallocCounter.down(arena_bytes);
+            }
+            cudaError_t error = cudaMalloc((void **) &arena, bytes);
+            if (error != cudaSuccess) {
+                printf("CheckpointWriter cudaMalloc error\n");
+                arena = NULL;
+                arena_bytes = 0;
+                return false;
+            }
+            // the alignment gaps are written as they are
+            cudaMemset(arena, 0x00, bytes);
+            arena_bytes = bytes;
+            mallocCounter.up(arena_bytes);
+        }
+
+        for (int i = 0; i < entries.size(); i++) {
+            cudaMemcpyAsync(arena + (entries[i].offset - header.data_offset), tensors[i],
+                            entries[i].bytes, cudaMemcpyDeviceToDevice, 0);
+        }
+        cudaEventRecord(snapshot_done, 0);
+
+        if (pinned[0] == NULL) {
+            for (int i = 0; i < 2; i++) cudaMallocHost((void **) &pinned[i], chunk_bytes);
+        }
+
+        running = true;
+        writer = new thread(&CheckpointWriter::write, this, path);
+
+        return last_ok;
+    }
+
+    /**
+     * Waits for the running save to finish and returns whether it succeeded.
+     */
+    bool wait(){
+        if (writer != NULL) {
+            writer->join();
+            delete writer;
+            writer = NULL;
+        }
+        return ok;
+    }
+
+    bool busy(){
+        return running;
+    }
+
+private:
+
+    vector<CheckpointEntry> entries;
+    CheckpointHeader header;
+
+    char *arena = NULL;
+    uint64_t arena_bytes = 0;
+
+    char *pinned[2] = {NULL, NULL};
+    cudaStream_t stream;
+    cudaEvent_t snapshot_done;
+    cudaEvent_t chunk_done[2];
+
+    thread *writer = NULL;
+    atomic<bool> running{false};
+    bool ok = true;
+
+    void write(string path){
+        ok = write_file(path);
+        running = false;
+    }
+
+    bool write_file(string path){
+        string tmp = path + ".tmp";
+
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            cout << "CheckpointWriter: cannot open " << tmp << endl;
+            return false;
+        }
+
+        bool ok = pwrite_all(fd, (const char *) &header, sizeof(header), 0)
+                  && pwrite_all(fd, (const char *) entries.data(), entries.size() * sizeof(CheckpointEntry), header.index_offset);
+
+        uint64_t bytes = header.file_size - header.data_offset;
+        int chunks = (bytes + chunk_bytes - 1) / chunk_bytes;
+
+        // copy chunk c+1 while chunk c is written
+        cudaStreamWaitEvent(stream, snapshot_done, 0);
+        if (chunks > 0) issue_chunk(0, bytes);
+        for (int c = 0; c < chunks && ok; c++) {
+            if (c + 1 < chunks) issue_chunk(c + 1, bytes);
+
+            cudaEventSynchronize(chunk_done[c % 2]);
+            uint64_t pos = (uint64_t) c * chunk_bytes;
+            ok = pwrite_all(fd, pinned[c % 2], min((uint64_t) chunk_bytes, bytes - pos), header.data_offset + pos);
+        }
+        cudaStreamSynchronize(stream);
+
+        if (ok && fsync(fd) != 0) ok = false;
+        if (::close(fd) != 0) ok = false;
+
+        if (!ok) {
+            cout << "CheckpointWriter: write error " << tmp << endl;
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        if (rename(tmp.c_str(), path.c_str()) != 0) {
+            cout << "CheckpointWriter: cannot rename " << tmp << " to " << path << endl;
+            return false;
+        }
+
+        // make the rename itself durable
+        size_t slash = path.rfind('/');
+        string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+        int dir_fd = ::open(dir.c_str(), O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            ::close(dir_fd);
+        }
+
+        return true;
+    }
+
+    void issue_chunk(int c, uint64_t bytes){
+        uint64_t pos = (uint64_t) c * chunk_bytes;
+        cudaMemcpyAsync(pinned[c % 2], arena + pos, min((uint64_t) chunk_bytes, bytes - pos),
+                        cudaMemcpyDeviceToHost, stream);
+        cudaEventRecord(chunk_done[c % 2], stream);
+    }
+
+    static bool pwrite_all(int fd, const char *p, size_t n, uint64_t offset){
+        while (n > 0) {
+            ssize_t w = pwrite(fd, p, n, offset);
+            if (w <= 0) return false;
+            p += w;
+            n -= w;
+            offset += w;
+        }
+        return true;
+    }
+};
+
+
+/**
+ * Read only mapping of a checkpoint file and its shard files with the validated header
+ * and index. Mapping reads nothing yet, the pages of a tensor are read when it is loaded,
+ * so loading a few graphs only reads their tensors. The index of an older version is
+ * converted to the current entries when the file is opened.
+ */
+class CheckpointFile {
+public:
+
+    const CheckpointHeader *header = NULL;
+    map<string, const CheckpointEntry *> entries;
+
+    // the index file first, then the shards
+    vector<int> fds;
+    vector<size_t> sizes;
+    vector<const char *> bases;
+
+    ~CheckpointFile(){
+        close();
+    }
+
+    bool open(string path){
+        close();
+
+        if (!map_file(path) || sizes[0] < sizeof(CheckpointHeader)) {
+            cout << "checkpoint: " << path << " is not a checkpoint" << endl;
+            close();
+            return false;
+        }
+
+        header = (const CheckpointHeader *) bases[0];
+        if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+            || header->version < 1 || header->version > CHECKPOINT_VERSION
+            || header->file_size != sizes[0]
+            || header->index_offset + (uint64_t) header->count * sizeof(CheckpointEntry) > sizes[0]) {
+            cout << "checkpoint: bad header or version " << path << endl;
+            close();
+            return false;
+        }
+
+        for (int k = 0; k < header->shards; k++) {
+            if (!map_file(checkpoint_shard_path(path, k))) {
+                close();
+                return false;
+            }
+        }
+
+        const CheckpointEntry *index = (const CheckpointEntry *) (bases[0] + header->index_offset);
+        if (header->version < CHECKPOINT_VERSION) {
+            if (!upgrade_index(bases[0] + header->index_offset)) {
+                close();
+                return false;
+            }
+            index = upgraded.data();
+        }
+
+        for (int i = 0; i < header->count; i++) {
+            const CheckpointEntry &e = index[i];
+            if (e.shard < 0 || e.shard >= max((int) header->shards, 1)
+                || e.offset + e.bytes > sizes[header->shards == 0 ? 0 : e.shard + 1]) {
+                cout << "checkpoint: truncated entry " << string(e.name, strnlen(e.name, sizeof(e.name))) << endl;
+                close();
+                return false;
+            }
+            entries[string(e.name, strnlen(e.name, sizeof(e.name)))] = &e;
+        }
+
+        return true;
+    }
+
+    void close(){
+        for (int i = 0; i < bases.size(); i++) munmap((void *) bases[i], sizes[i]);
+        for (int fd : fds) ::close(fd);
+        bases.clear();
+        sizes.clear();
+        fds.clear();
+        header = NULL;
+        entries.clear();
+        upgraded.clear();
+    }
+
+    // address of the data of e in the mapping
+    const char *data(const CheckpointEntry *e){
+        return bases[header->shards == 0 ? 0 : e->shard + 1] + e->offset;
+    }
+
+    /**
+     * Finds the entry of t, NULL if it is missing or its shape or type differs. A float
+     * tensor also matches an fp16 or bf16 entry.
+     */
+    const CheckpointEntry *find(const CheckpointTensor &t){
+        auto it = entries.find(t.name);
+
+        if (it == entries.end() || it->second->rows != t.rows || it->second->cols != t.cols
+            || (it->second->dtype != t.dtype
+                && !(t.dtype == CHECKPOINT_FLOAT32 && checkpoint_is_half(it->second->dtype)))) {
+            cout << "checkpoint: no matching tensor for " << t.name << endl;
+            return NULL;
+        }
+        return it->second;
+    }
+
+    /**
+     * Uploads the tensors of graph g stored under name to the device. Returns false if
+     * one is missing or has another shape.
+     */
+    bool load(string name, Graph *g){
+        bool ok = true;
+
+        for (CheckpointTensor &t : checkpoint_tensors(name, g)) {
+            const CheckpointEntry *e = find(t);
+            if (e == NULL) {
+                ok = false;
+                continue;
+            }
+
+            upload(t.device, e);
+        }
+
+        return ok;
+    }
+
+    /**
+     * Copies the data of e to device, widening fp16 and bf16 to float. The 16 bit values go
+     * through staging (at least rows * cols elements) if given, else through a temporary;
+     * worker threads pass their own so that they do not allocate.
+     */
+    void upload(char *device, const CheckpointEntry *e, cuMatHalf *staging = NULL){
+        if (!checkpoint_is_half(e->dtype)) {
+            cudaError_t error = cudaMemcpy(device, data(e), e->bytes, cudaMemcpyHostToDevice);
+            if (error != cudaSuccess) printf("checkpoint::upload cudaMemcpy error\n");
+            return;
+        }
+
+        cuMatHalf temp;
+        if (staging == NULL) {
+            temp.new_matrix(e->rows, e->cols);
+            staging = &temp;
+        }
+        cudaError_t error = cudaMemcpy(staging->mDevice, data(e), e->bytes, cudaMemcpyHostToDevice);
+        if (error != cudaSuccess) printf("checkpoint::upload cudaMemcpy error\n");
+        half_to_float_kernel_exec(staging->mDevice, (float *) device, e->rows * e->cols, e->dtype == CHECKPOINT_BF16);
+    }
+
+private:
+
+    // the index of an older version as current entries
+    vector<CheckpointEntry> upgraded;
+
+    bool upgrade_index(const char *index){
+        upgraded.resize(header->count);
+
+        for (int i = 0; i < header->count; i++) {
+            CheckpointEntry &e = upgraded[i];
+            memset(&e, 0, sizeof(e));
+            string name;
+
+            e.dtype = CHECKPOINT_FLOAT32;
+            if (header->version == 1) {
+                const CheckpointEntryV1 &v1 = ((const CheckpointEntryV1 *) index)[i];
+                name = string(v1.name, strnlen(v1.name, sizeof(v1.name)));
+                e.rows = v1.rows;
+                e.cols = v1.cols;
+                e.offset = v1.offset;
+                e.bytes = v1.bytes;
+            } else {
+                const CheckpointEntryV2 &v2 = ((const CheckpointEntryV2 *) index)[i];
+                name = string(v2.name, strnlen(v2.name, sizeof(v2.name)));
+                e.shard = v2.shard;
+                e.rows = v2.rows;
+                e.cols = v2.cols;
+                e.offset = v2.offset;
+                e.bytes = v2.bytes;
+            }
+
+            if (name.size() >= sizeof(e.name)) {
+                cout << "checkpoint: name too long for version " << CHECKPOINT_VERSION << " " << name << endl;
+                return false;
+            }
+            memcpy(e.name, name.c_str(), name.size());
+        }
+        return true;
+    }
+
+    bool map_file(string path){
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cout << "checkpoint: cannot open " << path << endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        void *p = st.st_size == 0 ? NULL : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            cout << "checkpoint: mmap failed " << path << endl;
+            ::close(fd);
+            return false;
+        }
+
+        fds.push_back(fd);
+        sizes.push_back(st.st_size);
+        bases.push_back((const char *) p);
+        return true;
+    }
+};
+
+
+/**
+ * Loads the weights in path into the graphs of model, only into the graphs in names
+ * when it is not empty (e.g. the layers to fine-tune). The tensors are read by threads
+ * threads, a shard is always read by a single thread.
+ */
+inline bool load_checkpoint(Model &model, string path, const vector<string> &names = vector<string>(), int threads = 4){
+
+    CheckpointFile file;
+    if (!file.open(path)) return false;
+
+    vector<const CheckpointEntry *> items;
+    vector<char *> tensors;
+    bool ok = true;
+
+    for (auto gs : model.graphs) {
+        if (!names.empty() && find(names.begin(), names.end(), gs.first) == names.end()) continue;
+
+        for (CheckpointTensor &t : checkpoint_tensors(gs.first, gs.second)) {
+            const CheckpointEntry *e = file.find(t);
+            if (e == NULL) {
+                ok = false;
+                continue;
+            }
+            items.push_back(e);
+            tensors.push_back(t.device);
+        }
+        model.pending.erase(gs.first);
+    }
+
+    threads = max(1, min(threads, (int) items.size()));
+    if (file.header->shards > 0) threads = min(threads, (int) file.header->shards);
+
+    // every thread widens its fp16 / bf16 tensors through its own buffer, allocated here
+    // because cuMat allocations (mallocCounter) are not thread safe
+    vector<size_t> half_size(threads, 0);
+    for (int i = 0; i < items.size(); i++) {
+        int key = file.header->shards > 0 ? items[i]->shard : i;
+        if (checkpoint_is_half(items[i]->dtype))
+            half_size[key % threads] = max(half_size[key % threads], (size_t) items[i]->rows * items[i]->cols);
+    }
+    vector<cuMatHalf> staging(threads);
+    for (int t = 0; t < threads; t++) {
+        if (half_size[t] > 0) staging[t].new_matrix(half_size[t], 1);
+    }
+
+    vector<thread *> ts;
+    for (int t = 0; t < threads; t++) {
+        ts.push_back(new thread([&, t](){
+            for (int i = 0; i < items.size(); i++) {
+                int key = file.header->shards > 0 ? items[i]->shard : i;
+                if (key % threads != t) continue;
+
+                file.upload(tensors[i], items[i], &staging[t]);
+            }
+        }));
+    }
+    for (thread *th : ts) {
+        th->join();
+        delete th;
+    }
+
+    return ok;
+}
+
+
+/**
+ * Loads the graphs of model from file on their first Model::G() call. file has to stay
+ * open as long as graphs are pending.
+ */
+inline void load_checkpoint_lazy(Model &model, CheckpointFile &file){
+
+    for (auto gs : model.graphs) model.pending.insert(gs.first);
+
+    model.lazy_loader = [&file](const string &name, Graph *g){
+        file.load(name, g);
+    };
+}
+
+
+#endif /* CHECKPOINT_H_ */
@@ -0,0 +1,120 @@
+/*
+ * cuMatHalf.h
+ */
+
+#ifndef CUMATHALF_H_
+#define CUMATHALF_H_
+
+#include<iostream>
+#include<cuda_runtime_api.h>
+#include<cublas_v2.h>
+
+#include "cuMat.h"
+
+#define HALF_FP16 0
+#define HALF_BF16 1
+
+/**
+ * Column-major 16 bit matrix on the device like cuMat, holding fp16 or bf16 values (dtype).
+ * It is the compute copy of float data: from() rounds a cuMat to 16 bits, to() widens it
+ * back, and gemm() multiplies 16 bit operands with fp32 accumulation into a float cuMat.
+ */
+class cuMatHalf {
+
+public:
+
+    unsigned short *mDevice = NULL;
+    int rows = 0;
+    int cols = 0;
+    int dtype = HALF_FP16;
+
+
+    cuMatHalf() {
+    }
+
+    cuMatHalf(int dtype) {
+        this->dtype = dtype;
+    }
+
+    ~cuMatHalf() {
+        del_matrix();
+    }
+
+    size_t bytes() {
+        return (size_t) rows * cols * sizeof(*mDevice);
+    }
+
+    void new_matrix(int rows, int cols) {
+        if (this->rows != rows || this->cols != cols) {
+            del_matrix();
+
+            this->rows = rows;
+            this->cols = cols;
+
+            cudaError_t error = cudaMalloc((void**) &mDevice, bytes());
+            if (error != cudaSuccess) printf("cuMatHalf::new_matrix cudaMalloc error\n");
+            cudaMemset(mDevice, 0x00, bytes());
+            mallocCounter.up(bytes());
+        }
+    }
+
+    void del_matrix() {
+        if (mDevice != NULL) {
+            cudaFree(mDevice);
+            mDevice = NULL;
+            mallocCounter.down(bytes());
+        }
+        rows = 0;
+        cols = 0;
+    }
+
+    void from(const float *x, int rows, int cols) {
+        new_matrix(rows, cols);
+        float_to_half_kernel_exec(x, mDevice, rows * cols, dtype == HALF_BF16);
+    }
+
+    void from(const cuMat &m) {
+        from(m.mDevice, m.rows, m.cols);
+    }
+
+    void to(float *x) {
+        half_to_float_kernel_exec(mDevice, x, rows * cols, dtype == HALF_BF16);
+    }
+
+    void to(cuMat &m) {
+        m.new_matrix(rows, cols);
+        to(m.mDevice);
+    }
+
+    /**
+     * r = op(this) * op(b) + beta * r, op() transposes when ta / tb. The products are
+     * summed in fp32 and r stays float; cuBLAS uses tensor cores where the GPU has them
+     * (bf16 needs sm_80).
+     */
+    void gemm(bool ta, const cuMatHalf &b, bool tb, cuMat &r, float beta = 1) {
+        int m = ta ? cols : rows;
+        int k = ta ? rows : cols;
+        int n = tb ? b.rows : b.cols;
+
+        if (dtype != b.dtype || k != (tb ? b.cols : b.rows) || r.rows != m || r.cols != n) {
+            cout << "cuMatHalf::gemm shape error " << m << "x" << k << " " << r.rows << "x" << r.cols << endl;
+            return;
+        }
+
+        cudaDataType type = dtype == HALF_BF16 ? CUDA_R_16BF : CUDA_R_16F;
+        float alpha = 1;
+
+        cublasStatus_t stat = cublasGemmEx(r.cudaHandle,
+                ta ? CUBLAS_OP_T : CUBLAS_OP_N, tb ? CUBLAS_OP_T : CUBLAS_OP_N,
+                m, n, k,
+                &alpha, mDevice, type, rows,
+                b.mDevice, type, b.rows,
+                &beta, r.mDevice, CUDA_R_32F, r.rows,
+                CUBLAS_COMPUTE_32F, CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+        if (stat != CUBLAS_STATUS_SUCCESS)
+            cout << "cannot cublasGemmEx cuMatHalf::gemm" << endl;
+        cudaThreadSynchronize();
+    }
+};
+
+#endif /* CUMATHALF_H_ */
@@ -0,0 +1,106 @@
+/*
+ * cuMatInt8.h
+ */
+
+#ifndef CUMATINT8_H_
+#define CUMATINT8_H_
+
+#include<iostream>
+#include<cuda_runtime_api.h>
+
+#include "cuMat.h"
+
+/**
+ * Symmetric int8 matrix on the device for inference, stored row by row with every row
+ * padded to ld (a multiple of 4) so that 4 values can be read as one int for __dp4a.
+ * The scales are kept by the caller as float cuMats.
+ */
+class cuMatInt8 {
+
+public:
+
+    char *mDevice = NULL;
+    int rows = 0;
+    int cols = 0;
+    int ld = 0;
+
+
+    cuMatInt8() {
+    }
+
+    cuMatInt8(int rows, int cols) {
+        new_matrix(rows, cols);
+    }
+
+    ~cuMatInt8() {
+        del_matrix();
+    }
+
+    size_t bytes() {
+        return (size_t) rows * ld;
+    }
+
+    void new_matrix(int rows, int cols) {
+        if (this->rows != rows || this->cols != cols) {
+            del_matrix();
+
+            this->rows = rows;
+            this->cols = cols;
+            this->ld = (cols + 3) / 4 * 4;
+
+            cudaError_t error = cudaMalloc((void**) &mDevice, bytes());
+            if (error != cudaSuccess) printf("cuMatInt8::new_matrix cudaMalloc error\n");
+            cudaMemset(mDevice, 0x00, bytes());
+            mallocCounter.up(bytes());
+        }
+    }
+
+    void del_matrix() {
+        if (mDevice != NULL) {
+            cudaFree(mDevice);
+            mDevice = NULL;
+            mallocCounter.down(bytes());
+        }
+        rows = 0;
+        cols = 0;
+        ld = 0;
+    }
+
+    /**
+     * Row i = row i of w (rows x cols) quantized with its own scale[i] = max_j |w_ij| / 127,
+     * e.g. one scale per output channel of a weight matrix.
+     */
+    void quantize_rows(const cuMat &w, cuMat &scale) {
+        new_matrix(w.rows, w.cols);
+        scale.new_matrix(w.rows, 1);
+
+        quantize_rows_kernel_exec(w.mDevice, mDevice, scale.mDevice, w.rows, w.cols, ld);
+    }
+
+    /**
+     * Row j = column j of x quantized with the single scale (1 x 1), n columns of cols
+     * values. inner > 1 reads the im2col layout of a batch, see quantize_cols_kernel.
+     */
+    void quantize_cols(const cuMat &x, int cols, int n, int inner, const cuMat &scale) {
+        new_matrix(n, cols);
+
+        quantize_cols_kernel_exec(x.mDevice, mDevice, scale.mDevice, cols, n, ld, inner);
+    }
+
+    /**
+     * r(i, j) = this_i . q_j * scale[i] * q_scale + b[i], the int32 dot products dequantized
+     * in the epilogue. inner > 1 writes r in the layout of a batch of conv outputs.
+     */
+    void dot_dequantize(const cuMatInt8 &q, const cuMat &scale, const cuMat &q_scale, const cuMat *b,
+                        cuMat &r, int inner = 1) {
+        if (ld != q.ld) {
+            cout << "cuMatInt8::dot_dequantize shape error " << cols << " " << q.cols << endl;
+            return;
+        }
+
+        int8_gemm_kernel_exec(mDevice, q.mDevice, scale.mDevice, q_scale.mDevice,
+                              b == NULL ? NULL : b->mDevice, r.mDevice, rows, q.rows, ld, inner);
+    }
+};
+
+#endif /* CUMATINT8_H_ */
@@ -335,4 +335,157 @@ public:
 };
 
 
+/**
+ * Block sparse (BSR) matrix on the device: the rows x cols matrix is cut into block x block
+ * blocks and only the blocks with a non zero value are kept, each as block*block column-major
+ * values. s_d_dot() runs cusparseSbsrmm, which reads a whole block per column index, so
+ * block pruned weights multiply faster than as CSR. rows and cols are multiples of block.
+ */
+class cuMatBsr {
+
+public:
+
+    int rows = 0;
+    int cols = 0;
+    int block = 1;
+
+    // block rows, block columns and stored blocks
+    int mb = 0;
+    int kb = 0;
+    int nnzb = 0;
+
+    cusparseHandle_t cuHandle;
+    cusparseMatDescr_t descr;
+
+    float *bsrValDevice = NULL;
+    int *bsrRowPtrDevice = NULL;
+    int *bsrColIndDevice = NULL;
+
+
+    cuMatBsr() {
+        cusparseCreate(&cuHandle);
+        cusparseCreateMatDescr(&descr);
+        cusparseSetMatType(descr, CUSPARSE_MATRIX_TYPE_GENERAL);
+        cusparseSetMatIndexBase(descr, CUSPARSE_INDEX_BASE_ZERO);
+    }
+
+    ~cuMatBsr() {
+        del_matrix();
+        cusparseDestroyMatDescr(descr);
+        cusparseDestroy(cuHandle);
+    }
+
+    size_t bytes() {
+        return (size_t) nnzb * block * block * sizeof(*bsrValDevice)
+               + (mb + 1) * sizeof(*bsrRowPtrDevice) + (size_t) nnzb * sizeof(*bsrColIndDevice);
+    }
+
+    // fraction of the blocks that are stored
+    float density() {
+        return mb * kb == 0 ? 0 : nnzb / ((float) mb * kb);
+    }
+
+    void del_matrix() {
+        if (bsrRowPtrDevice != NULL) {
+            mallocCounter.down(bytes());
+            cudaFree(bsrValDevice);
+            cudaFree(bsrRowPtrDevice);
+            cudaFree(bsrColIndDevice);
+            bsrValDevice = NULL;
+            bsrRowPtrDevice = NULL;
+            bsrColIndDevice = NULL;
+        }
+        rows = cols = mb = kb = nnzb = 0;
+    }
+
+    /**
+     * Stores the dense w in blocks of block x block, the all zero blocks are dropped.
+     * Built on the host, it is meant to run once per pruned weight.
+     */
+    bool from_dense(const cuMat &w, int block) {
+        if (block <= 0 || w.rows % block != 0 || w.cols % block != 0) {
+            cout << "cuMatBsr::from_dense " << w.rows << "x" << w.cols << " is not a multiple of block " << block << endl;
+            return false;
+        }
+        del_matrix();
+
+        vector<float> h(w.rows * w.cols);
+        cudaError_t error = cudaMemcpy(h.data(), w.mDevice, h.size() * sizeof(float), cudaMemcpyDeviceToHost);
+        if (error != cudaSuccess) printf("cuMatBsr::from_dense cudaMemcpy error\n");
+
+        this->rows = w.rows;
+        this->cols = w.cols;
+        this->block = block;
+        mb = rows / block;
+        kb = cols / block;
+
+        vector<int> row_ptr(mb + 1, 0);
+        vector<int> col_ind;
+        vector<float> val;
+        for (int bi = 0; bi < mb; bi++) {
+            for (int bj = 0; bj < kb; bj++) {
+                bool nonzero = false;
+                for (int jj = 0; jj < block && !nonzero; jj++) {
+                    for (int ii = 0; ii < block; ii++) {
+                        if (h[IDX2F(bi * block + ii, bj * block + jj, rows)] != 0) {
+                            nonzero = true;
+                            break;
+                        }
+                    }
+                }
+                if (!nonzero) continue;
+
+                col_ind.push_back(bj);
+                for (int jj = 0; jj < block; jj++) {
+                    for (int ii = 0; ii < block; ii++) val.push_back(h[IDX2F(bi * block + ii, bj * block + jj, rows)]);
+                }
+            }
+            row_ptr[bi + 1] = col_ind.size();
+        }
+        nnzb = col_ind.size();
+
+        cudaMalloc((void**) &bsrValDevice, max(val.size(), (size_t) 1) * sizeof(*bsrValDevice));
+        cudaMalloc((void**) &bsrRowPtrDevice, row_ptr.size() * sizeof(*bsrRowPtrDevice));
+        cudaMalloc((void**) &bsrColIndDevice, max(col_ind.size(), (size_t) 1) * sizeof(*bsrColIndDevice));
+        mallocCounter.up(bytes());
+
+        error = cudaMemcpy(bsrValDevice, val.data(), val.size() * sizeof(*bsrValDevice), cudaMemcpyHostToDevice);
+        if (error != cudaSuccess) printf("cuMatBsr::from_dense cudaMemcpy error: bsrValDevice\n");
+        error = cudaMemcpy(bsrRowPtrDevice, row_ptr.data(), row_ptr.size() * sizeof(*bsrRowPtrDevice), cudaMemcpyHostToDevice);
+        if (error != cudaSuccess) printf("cuMatBsr::from_dense cudaMemcpy error: bsrRowPtrDevice\n");
+        error = cudaMemcpy(bsrColIndDevice, col_ind.data(), col_ind.size() * sizeof(*bsrColIndDevice), cudaMemcpyHostToDevice);
+        if (error != cudaSuccess) printf("cuMatBsr::from_dense cudaMemcpy error: bsrColIndDevice\n");
+
+        return true;
+    }
+
+    // r = this * b + beta * r
+    void s_d_dot(const cuMat &b, cuMat &r, float beta = 0) {
+        if (b.rows != cols || r.rows != rows || r.cols != b.cols) {
+            cout << "cuMatBsr::s_d_dot shape error " << rows << "x" << cols << " " << b.rows << "x" << b.cols << endl;
+            return;
+        }
+        if (nnzb == 0) {
+            r.mul(beta, r);
+            return;
+        }
+
+        float alpha = 1;
+        cusparseStatus_t status = cusparseSbsrmm(cuHandle,
+                CUSPARSE_DIRECTION_COLUMN,
+                CUSPARSE_OPERATION_NON_TRANSPOSE,
+                CUSPARSE_OPERATION_NON_TRANSPOSE,
+                mb, b.cols, kb, nnzb,
+                &alpha, descr,
+                bsrValDevice, bsrRowPtrDevice, bsrColIndDevice, block,
+                b.mDevice, b.rows,
+                &beta, r.mDevice, r.rows);
+
+        if (status != CUSPARSE_STATUS_SUCCESS)
+            cout << "ERROR cuMatBsr::s_d_dot cusparseSbsrmm" << endl;
+        cudaThreadSynchronize();
+    }
+};
+
+
 #endif /* CUMATSPARSE_H_ */
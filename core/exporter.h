@@ -0,0 +1,196 @@
+/*
+ * exporter.h
+ *
+ */
+
+#ifndef EXPORTER_H_
+#define EXPORTER_H_
+
+#include <typeinfo>
+#include <cmath>
+#include <vector>
+#include <map>
+
+#include "variable.h"
+#include "function.h"
+#include "plan.h"
+#include "../runtime/graph_file.h"
+
+using namespace std;
+
+
+/**
+ * Ahead-of-time export of an inference forward for the standalone CPU runtime
+ * (runtime/, no CUDA, Boost or cuBLAS needed to run it). The forward is captured with
+ * a Plan, every recorded function becomes one operator and the weights it reads are
+ * stored with the graph:
+ *
+ *   Plan plan;
+ *   plan.begin();
+ *   PVariable h = forward_one_step(model, x, false);
+ *   plan.end();
+ *
+ *   Exporter exporter;
+ *   exporter.build(plan, {x}, {h});
+ *   exporter.save("model.dnng");
+ *   exporter.save_reference("model.ref", {x}, {h});  // for runtime/test
+ *
+ * Capture with the layers in inference mode (Dropout::isTrain(false), BatchNorm
+ * setTrainStatus(false)): a BatchNorm is exported with its running statistics as a
+ * per row scale and shift. int8 and BSR sparse layers have to be switched back to their
+ * float weights (set_int8(false), set_sparse(false)) before the capture.
+ */
+class Exporter {
+public:
+    GraphFile graph;
+    map<Variable *, int> tensors;
+
+    bool build(Plan &plan, vector<PVariable> inputs, vector<PVariable> outputs){
+        graph = GraphFile();
+        tensors.clear();
+
+        for (int i = 0; i < inputs.size(); i++){
+            Variable *x = inputs[i].get();
+            tensors[x] = graph.add_tensor(TENSOR_INPUT, x->data.rows, x->data.cols, "input" + to_string(i));
+            graph.inputs.push_back(tensors[x]);
+        }
+
+        for (Plan::Step &s : plan.steps){
+            if (s.output == NULL){
+                cout << "Exporter: " << s.f->name << " has no output" << endl;
+                return false;
+            }
+            if (!add(s.f, s.inputs, s.output.get())) return false;
+        }
+
+        for (PVariable &y : outputs){
+            auto it = tensors.find(y.get());
+            if (it == tensors.end()){
+                cout << "Exporter: an output was not computed by the captured plan" << endl;
+                return false;
+            }
+            graph.outputs.push_back(it->second);
+        }
+        return graph.check();
+    }
+
+    bool save(string path){
+        return graph.save(path);
+    }
+
+    /**
+     * The inputs and the outputs computed for them by the training code, runtime/test
+     * runs the exported model on the inputs and compares.
+     */
+    bool save_reference(string path, vector<PVariable> inputs, vector<PVariable> outputs){
+        GraphFile ref;
+        for (PVariable &x : inputs){
+            int t = ref.add_tensor(TENSOR_INPUT, x->data.rows, x->data.cols);
+            ref.tensors[t].data = host(x->data);
+            ref.inputs.push_back(t);
+        }
+        for (PVariable &y : outputs){
+            int t = ref.add_tensor(TENSOR_CONST, y->data.rows, y->data.cols);
+            ref.tensors[t].data = host(y->data);
+            ref.outputs.push_back(t);
+        }
+        return ref.save(path);
+    }
+
+private:
+
+    vector<float> host(cuMat &m){
+        vector<float> v(m.rows * m.cols);
+        cudaMemcpy(v.data(), m.mDevice, v.size() * sizeof(float), cudaMemcpyDeviceToHost);
+        return v;
+    }
+
+    int constant(const vector<float> &data, int rows, int cols){
+        int t = graph.add_tensor(TENSOR_CONST, rows, cols);
+        graph.tensors[t].data = data;
+        return t;
+    }
+
+    // the tensor of v, a variable no function computed is a weight (shared weights are stored once)
+    int tensor(Variable *v){
+        auto it = tensors.find(v);
+        if (it != tensors.end()) return it->second;
+
+        int t = constant(host(v->data), v->data.rows, v->data.cols);
+        graph.tensors[t].name = v->name;
+        tensors[v] = t;
+        return t;
+    }
+
+    bool add(Function *f, vector<PVariable> &inputs, Variable *output){
+        vector<int> in;
+        for (PVariable &v : inputs) in.push_back(tensor(v.get()));
+
+        int r = graph.add_tensor(TENSOR_ACTIVATION, output->data.rows, output->data.cols, f->name);
+
+        const type_info &id = typeid(*f);
+
+        if (id == typeid(FunctionLinear) || id == typeid(FunctionLinearHalf)){
+            FunctionLinear *l = (FunctionLinear *)f;
+            in.push_back(tensor(l->w));
+            if (!l->noBias) in.push_back(tensor(l->b));
+            graph.add_op(OP_LINEAR, in, r, {l->isTranspose, !l->noBias});
+        }
+        else if (id == typeid(FunctionReLU)) graph.add_op(OP_RELU, in, r);
+        else if (id == typeid(FunctionSigmoid)) graph.add_op(OP_SIGMOID, in, r);
+        else if (id == typeid(FunctionTanh)) graph.add_op(OP_TANH, in, r);
+        else if (id == typeid(FunctionSoftmax)) graph.add_op(OP_SOFTMAX, in, r);
+        else if (id == typeid(FunctionPlus)) graph.add_op(OP_PLUS, in, r);
+        else if (id == typeid(FunctionMinus)) graph.add_op(OP_MINUS, in, r);
+        else if (id == typeid(FunctionMul)) graph.add_op(OP_MUL, in, r);
+        else if (id == typeid(FunctionIdentity)) graph.add_op(OP_COPY, in, r);
+        else if (id == typeid(FunctionDropout)){
+            cout << "Exporter: " << f->name << " was captured in training mode, exported as identity" << endl;
+            graph.add_op(OP_COPY, in, r);
+        }
+        else if (id == typeid(FunctionScaleShift)){
+            FunctionScaleShift *ss = (FunctionScaleShift *)f;
+            in.push_back(tensor(ss->scale));
+            in.push_back(tensor(ss->shift));
+            graph.add_op(OP_SCALE_SHIFT, in, r);
+        }
+        else if (id == typeid(FunctionBatchNorm)){
+            FunctionBatchNorm *bn = (FunctionBatchNorm *)f;
+            if (bn->is_train) cout << "Exporter: " << f->name << " was captured in training mode, exported with its running statistics" << endl;
+
+            vector<float> gamma = host(bn->gamma->data), beta = host(bn->beta->data);
+            vector<float> mean = host(bn->x_mean->data), var = host(bn->x_var->data);
+
+            // same epsilon as batch_norm_kernel
+            vector<float> scale(gamma.size()), shift(gamma.size());
+            for (int i = 0; i < gamma.size(); i++){
+                scale[i] = gamma[i] / std::sqrt(var[i] + 1e-5);
+                shift[i] = beta[i] - mean[i] * scale[i];
+            }
+            in.push_back(constant(scale, scale.size(), 1));
+            in.push_back(constant(shift, shift.size(), 1));
+            graph.add_op(OP_SCALE_SHIFT, in, r);
+        }
+        else if (id == typeid(FunctionConv2D)){
+            FunctionConv2D *c = (FunctionConv2D *)f;
+            in.push_back(tensor(c->w));
+            in.push_back(tensor(c->b));
+            graph.add_op(OP_CONV2D, in, r, {c->channel_num, c->w_size, c->h_size, c->filter_size, c->filter_num,
+                                            c->stride, c->padding, c->groups, c->dilation, c->outputDim_w, c->outputDim_h});
+        }
+        else if (id == typeid(FunctionPooling)){
+            FunctionPooling *p = (FunctionPooling *)f;
+            graph.add_op(OP_MAX_POOL, in, r, {p->width, p->height, p->depth, p->windowWidth, p->windowHeight,
+                                              p->stride, p->padding});
+        }
+        else {
+            cout << "Exporter: " << f->name << " is not supported by the runtime" << endl;
+            return false;
+        }
+
+        tensors[output] = r;
+        return true;
+    }
+};
+
+#endif /* EXPORTER_H_ */
@@ -19,7 +19,18 @@ using namespace std;
 
 int func_id = 0;
 
+FunctionRecorder *gRecorder = NULL;
+
 PVariable variable_construct_for_function(Function *f, int rows, int cols) {
+
+    // replayed by a Plan: reuse the buffer recorded at capture time
+    if (f->bound_output != NULL && f->bound_output->data.rows == rows && f->bound_output->data.cols == cols) {
+        PVariable r = f->bound_output;
+        f->bound_output = NULL;
+        r->creator = f;
+        return r;
+    }
+
     PVariable r = PVariable(variable_construct(rows, cols), variable_destroy);
     r->creator = f;
 
@@ -59,10 +70,11 @@ void Function::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PVaria
 
 PVariable Function::forward(PVariable v){
 
-    v->forward_count++;
+    if (!gNoGrad) v->forward_count++;
 
     inputs.push_back(v);
     PVariable r = forward(inputs, outputs);
+    forward_done(r);
 
     return r;
 }
@@ -70,39 +82,54 @@ PVariable Function::forward(PVariable v){
 
 PVariable Function::forward(PVariable v1, PVariable v2){
 
-    v1->forward_count++;
-    v2->forward_count++;
+    if (!gNoGrad) v1->forward_count++;
+    if (!gNoGrad) v2->forward_count++;
 
     inputs.push_back(v1);
     inputs.push_back(v2);
     PVariable r = forward(inputs, outputs);
+    forward_done(r);
 
     return r;
 }
 
 PVariable Function::forward(PVariable v1, PVariable v2, PVariable v3){
 
-    v1->forward_count++;
-    v2->forward_count++;
-    v3->forward_count++;
+    if (!gNoGrad) v1->forward_count++;
+    if (!gNoGrad) v2->forward_count++;
+    if (!gNoGrad) v3->forward_count++;
 
     inputs.push_back(v1);
     inputs.push_back(v2);
     inputs.push_back(v3);
     PVariable r = forward(inputs, outputs);
+    forward_done(r);
 
     return r;
 }
 
 PVariable Function::forward(PVariable v1, PVariable v2, PVariable v3, PVariable v4){
-    v1->forward_count++;
-    v2->forward_count++;
+    if (!gNoGrad) v1->forward_count++;
+    if (!gNoGrad) v2->forward_count++;
 
     inputs.push_back(v1);
     inputs.push_back(v2);
     inputs.push_back(v3);
     inputs.push_back(v4);
     PVariable r = forward(inputs, outputs);
+    forward_done(r);
+
+    return r;
+}
+
+PVariable Function::forward(const vector<PVariable> &xs){
+
+    for (PVariable x : xs) {
+        if (!gNoGrad) x->forward_count++;
+        inputs.push_back(x);
+    }
+    PVariable r = forward(inputs, outputs);
+    forward_done(r);
 
     return r;
 }
@@ -111,8 +138,8 @@ PVariable Function::forward(PVariable v1, PVariable v2, PVariable v3, PVariable
                             PVariable v5, PVariable v6, PVariable v7, PVariable v8,
                             PVariable v9, PVariable v10, PVariable v11, PVariable v12
 ){
-    v1->forward_count++;
-    v2->forward_count++;
+    if (!gNoGrad) v1->forward_count++;
+    if (!gNoGrad) v2->forward_count++;
 
 
     inputs.push_back(v1);
@@ -128,6 +155,7 @@ PVariable Function::forward(PVariable v1, PVariable v2, PVariable v3, PVariable
     inputs.push_back(v11);
     inputs.push_back(v12);
     PVariable r = forward(inputs, outputs);
+    forward_done(r);
 
     return r;
 }
@@ -151,6 +179,43 @@ void Function::clip_grad(Variable *v){
 
 void Function::reset_state(){}
 
+/**
+ * Drop the intermediates saved for backward.
+ */
+void Function::release(){
+    release_saved();
+    is_released = true;
+}
+
+/**
+ * Rebuild the intermediates dropped by release().
+ */
+void Function::restore(){
+    if (!is_released) return;
+    recompute_saved();
+    is_released = false;
+}
+
+/**
+ * Called after every forward.
+ * In inference mode the function forgets its inputs and the result is not linked
+ * to it; since Graph does not record it either, it is freed with its saved tensors
+ * as soon as the layer returns.
+ */
+void Function::forward_done(PVariable r){
+    if (gRecorder != NULL) gRecorder->forward_called(this, r);
+
+    if (gNoGrad) {
+        init();
+        if (r != NULL) r->creator = NULL;
+    } else if (is_checkpoint) {
+        release();
+    }
+}
+
+void Function::release_saved(){}
+void Function::recompute_saved(){}
+
 
 
 FunctionPlus::FunctionPlus() : Function() {
@@ -257,7 +322,12 @@ void FunctionInverse::backward(cuMat &p_grad, vector<PVariable > &inputs, vector
 
     PVariable v = inputs.at(0);
 
-    if (v->isGetGrad) v->grad += p_grad * v->data.inverse_d();
+    if (rr.get() == NULL || rr->data.cols != v->data.cols){
+        rr = PVariable(new Variable(v->data.rows, v->data.cols, false));
+    }
+    v->data.inverse_d(rr->data);
+
+    if (v->isGetGrad) rr->data.mul_plus(p_grad, v->grad, 1.0, 1.0);
 }
 
 FunctionSqrt::FunctionSqrt() : Function() {
@@ -280,7 +350,12 @@ void FunctionSqrt::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PV
 
     PVariable v = inputs.at(0);
 
-    if (v->isGetGrad) v->grad += p_grad * v->data.sqrt_d();
+    if (rr.get() == NULL || rr->data.cols != v->data.cols){
+        rr = PVariable(new Variable(v->data.rows, v->data.cols, false));
+    }
+    v->data.sqrt_d(rr->data, 1e-8);
+
+    if (v->isGetGrad) rr->data.mul_plus(p_grad, v->grad, 1.0, 1.0);
 }
 
 
@@ -290,7 +365,7 @@ PVariable FunctionSin::forward(vector<PVariable > &inputs, vector<PVariable > &o
     PVariable v1 = inputs.at(0);
 
     PVariable r;
-    r = PVariable(new Variable(this, v1->data.rows, v1->data.cols));
+    r = variable_construct_for_function(this, v1->data.rows, v1->data.cols);
     outputs.push_back(r);
 
     v1->data.sin(r->data);
@@ -299,9 +374,11 @@ PVariable FunctionSin::forward(vector<PVariable > &inputs, vector<PVariable > &o
 void FunctionSin::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PVariable > &outputs){
     PVariable v1 = inputs.at(0);
 
-    if (rr.get() == NULL) rr = PVariable(new Variable(this, v1->data.rows, v1->data.cols));
+    if (rr.get() == NULL || rr->data.cols != v1->data.cols){
+        rr = PVariable(new Variable(v1->data.rows, v1->data.cols, false));
+    }
     v1->data.cos(rr->data);
-    if (v1->isGetGrad) v1->grad += p_grad * rr->data;
+    if (v1->isGetGrad) rr->data.mul_plus(p_grad, v1->grad, 1.0, 1.0);
 }
 
 FunctionCos::FunctionCos() : Function() { }
@@ -310,7 +387,7 @@ PVariable FunctionCos::forward(vector<PVariable > &inputs, vector<PVariable > &o
     PVariable v1 = inputs.at(0);
 
     PVariable r;
-    r = PVariable(new Variable(this, v1->data.rows, v1->data.cols));
+    r = variable_construct_for_function(this, v1->data.rows, v1->data.cols);
     outputs.push_back(r);
     v1->data.cos(r->data);
     return r;
@@ -319,9 +396,11 @@ PVariable FunctionCos::forward(vector<PVariable > &inputs, vector<PVariable > &o
 void FunctionCos::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PVariable > &outputs){
     PVariable v1 = inputs.at(0);
 
-    if (rr.get() == NULL) rr = PVariable(new Variable(this, v1->data.rows, v1->data.cols));
+    if (rr.get() == NULL || rr->data.cols != v1->data.cols){
+        rr = PVariable(new Variable(v1->data.rows, v1->data.cols, false));
+    }
     v1->data.sin(rr->data);
-    if (v1->isGetGrad) v1->grad += p_grad * rr->data * (-1.0);
+    if (v1->isGetGrad) rr->data.mul_plus(p_grad, v1->grad, -1.0, 1.0);
 }
 
 FunctionLog::FunctionLog() : Function() {}
@@ -330,7 +409,7 @@ PVariable FunctionLog::forward(vector<PVariable > &inputs, vector<PVariable > &o
     PVariable v1 = inputs.at(0);
 
     PVariable r;
-    r = PVariable(new Variable(this, v1->data.rows, v1->data.cols));
+    r = variable_construct_for_function(this, v1->data.rows, v1->data.cols);
     outputs.push_back(r);
     v1->data.log(r->data, 0);
     return r;
@@ -339,7 +418,12 @@ PVariable FunctionLog::forward(vector<PVariable > &inputs, vector<PVariable > &o
 void FunctionLog::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PVariable > &outputs){
     PVariable v1 = inputs.at(0);
 
-    if (v1->isGetGrad) v1->grad += p_grad * 1.0/v1->data;
+    if (rr.get() == NULL || rr->data.cols != v1->data.cols){
+        rr = PVariable(new Variable(v1->data.rows, v1->data.cols, false));
+    }
+    v1->data.inverse(rr->data);
+
+    if (v1->isGetGrad) rr->data.mul_plus(p_grad, v1->grad, 1.0, 1.0);
 }
 
 
@@ -414,7 +498,7 @@ PVariable FunctionLinear::forward(vector<PVariable > &inputs, vector<PVariable >
     int w_size = w->data.rows;
     if (isTranspose) w_size = w->data.cols;
 
-    PVariable r = PVariable(new Variable(this, w_size, x->data.cols));
+    PVariable r = variable_construct_for_function(this, w_size, x->data.cols);
 
 
 
@@ -427,7 +511,7 @@ PVariable FunctionLinear::forward(vector<PVariable > &inputs, vector<PVariable >
 
     if (!noBias) b->data.dot(i1, r->data);
     if (!isTranspose) w->data.dot_plus(x->data, r->data);
-    else w->data.transpose().dot_plus(x->data, r->data);
+    else w->data.transpose_dot_plus(x->data, r->data);
     //r->data = w->data.dot(x->data) + b->data.dot(i1);
 
     return r;
@@ -438,17 +522,12 @@ void FunctionLinear::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<
 
     if (x->isGetGrad){
         if (!isTranspose) w->data.transpose_dot_plus(p_grad, x->grad);
-        else w->data.transpose().transpose_dot_plus(p_grad, x->grad);
+        else w->data.dot_plus(p_grad, x->grad);
     }
     //x->grad += w->data.transpose().dot(p_grad);
 
     if (!isTranspose) p_grad.dot_transpose_plus(x->data, w->grad);
-    else {
-        cuMat tmpwg = w->grad.transpose();
-        tmpwg *= 0;
-        p_grad.dot_transpose_plus(x->data, tmpwg);
-        w->grad += tmpwg.transpose();
-    }
+    else x->data.dot_transpose_plus(p_grad, w->grad);
     //w->grad += p_grad.dot(x->data.transpose());
 
 
@@ -520,7 +599,7 @@ PVariable FunctionSparseLinear::forward(vector<PVariable > &inputs, vector<PVari
 
     outputs.push_back(r);
 
-    PVariable r2 = PVariable(new Variable(this, w->data.rows, x->data.cols));
+    PVariable r2 = variable_construct_for_function(this, w->data.rows, x->data.cols);
     r->data.relu(r2->data);
     //r->data.sigmoid(r2->data);
 
@@ -663,6 +742,33 @@ void FunctionEmbed::fromHostArray(){
 
 
 
+FunctionEmbedding::FunctionEmbedding(Variable *w) : Function() {
+    name = "FunctionEmbedding";
+    this->w = w;
+}
+
+PVariable FunctionEmbedding::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs.at(0);
+
+    PVariable r = variable_construct_for_function(this, w->data.rows, x->data.cols);
+
+    w->data.embed_gather(x->data, r->data);
+
+    return r;
+}
+
+void FunctionEmbedding::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs.at(0);
+
+    w->alloc_grad();
+    p_grad.embed_scatter_add(x->data, w->grad);
+    w->add_grad_cols(x->data);
+}
+
+
+
 FunctionReLU::FunctionReLU() : Function() {
     name = "FunctionReLU";
 }
@@ -672,7 +778,7 @@ PVariable FunctionReLU::forward(vector<PVariable > &inputs, vector<PVariable > &
 
     PVariable x = inputs.at(0);
 
-    PVariable r = PVariable(new Variable(this, x->data.rows, x->data.cols));
+    PVariable r = variable_construct_for_function(this, x->data.rows, x->data.cols);
 
     x->data.relu(r->data);
 
@@ -685,7 +791,7 @@ void FunctionReLU::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PV
 
 
     if (rr.get() == NULL || rr->data.cols != x->data.cols){
-        rr = PVariable(new Variable(x->data.rows, x->data.cols));
+        rr = PVariable(new Variable(x->data.rows, x->data.cols, false));
     }
 
     x->data.relu_d(rr->data);
@@ -718,8 +824,8 @@ void FunctionPReLU::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<P
 
 
     if (xd.get() == NULL || xd->data.cols != x->data.cols){
-        xd = PVariable(new Variable(x->data.rows, x->data.cols));
-        ad = PVariable(new Variable(x->data.rows, x->data.cols));
+        xd = PVariable(new Variable(x->data.rows, x->data.cols, false));
+        ad = PVariable(new Variable(x->data.rows, x->data.cols, false));
     }
 
     x->data.prelu_d(a->data, xd->data, ad->data);
@@ -750,7 +856,7 @@ void FunctionSigmoid::backward(cuMat &p_grad, vector<PVariable > &inputs, vector
 
 
     if (rr.get() == NULL || rr->data.cols != x->data.cols){
-        rr = PVariable(new Variable(x->data.rows, x->data.cols));
+        rr = PVariable(new Variable(x->data.rows, x->data.cols, false));
     }
     x->data.sigmoid_d(rr->data);
 
@@ -777,7 +883,7 @@ void FunctionTanh::backward(cuMat &p_grad, vector<PVariable > &inputs, vector<PV
 
 
     if (rr.get() == NULL || rr->data.cols != x->data.cols){
-        rr = PVariable(new Variable(x->data.rows, x->data.cols));
+        rr = PVariable(new Variable(x->data.rows, x->data.cols, false));
     }
     x->data.tanh_d(rr->data);
 
@@ -791,7 +897,7 @@ PVariable FunctionSoftmax::forward(vector<PVariable > &inputs, vector<PVariable
 
     PVariable x = inputs.at(0);
 
-    PVariable r = PVariable(new Variable(x->data.rows, x->data.cols));
+    PVariable r = PVariable(new Variable(x->data.rows, x->data.cols, false));
 
     outputs.push_back(r);
 
@@ -812,7 +918,7 @@ PVariable FunctionSoftmaxCrossEntropy::forward(vector<PVariable > &inputs, vecto
     PVariable t = inputs.at(1);
 
     if (rr3.get() == NULL || rr3->data.cols != x->data.cols){
-        rr3 = PVariable(new Variable(x->data.rows, x->data.cols));
+        rr3 = PVariable(new Variable(x->data.rows, x->data.cols, false));
     }
 
     x->data.softmax(rr3->data);
@@ -827,7 +933,7 @@ PVariable FunctionSoftmaxCrossEntropy::forward(vector<PVariable > &inputs, vecto
 
     sum /= rr3->data.cols;
 
-    PVariable r = PVariable(new Variable(this, loss.rows, loss.cols));
+    PVariable r = variable_construct_for_function(this, loss.rows, loss.cols);
 
     outputs.push_back(r);
 
@@ -841,7 +947,10 @@ void FunctionSoftmaxCrossEntropy::backward(cuMat &p_grad, vector<PVariable > &in
     PVariable t = inputs.at(1);
     PVariable y = rr;
 
-    if (x->isGetGrad) x->grad += y->data - t->data;
+    if (x->isGetGrad) {
+        y->data.mul_plus(gLossScale, x->grad);
+        t->data.mul_plus(-gLossScale, x->grad);
+    }
 }
 
 
@@ -886,7 +995,7 @@ void FunctionMeanSquaredError::backward(cuMat &p_grad, vector<PVariable > &input
 
     x->data.minus(t->data, rr->data);
     float batch_size = rr->data.cols;
-    if (x->isGetGrad) x->grad.plus(rr->data, x->grad);
+    if (x->isGetGrad) rr->data.mul_plus(gLossScale, x->grad);
 }
 
 
@@ -899,12 +1008,12 @@ PVariable FunctionDropout::forward(vector<PVariable > &inputs, vector<PVariable
 
     PVariable x = inputs.at(0);
 
-    PVariable r = PVariable(new Variable(this, x->data.rows, x->data.cols));
+    PVariable r = variable_construct_for_function(this, x->data.rows, x->data.cols);
 
     outputs.push_back(r);
 
     if (rr.get() == NULL || rr->data.cols != x->data.cols){
-        rr = PVariable(new Variable(x->data.rows, x->data.cols));
+        rr = PVariable(new Variable(x->data.rows, x->data.cols, false));
     }
 
     x->data.dropout(r->data, rr->data, p);
@@ -942,6 +1051,137 @@ void FunctionIdentity::backward(cuMat &p_grad, vector<PVariable> &inputs, vector
 
 
 
+FunctionConcat::FunctionConcat() : Function() {
+    name = "FunctionConcat";
+}
+
+PVariable FunctionConcat::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    int cols = 0;
+    for (PVariable x : inputs) cols += x->data.cols;
+
+    PVariable r = variable_construct_for_function(this, inputs[0]->data.rows, cols);
+
+    int col = 0;
+    for (PVariable x : inputs) {
+        r->data.copy_cols(x->data, 0, x->data.cols, col);
+        col += x->data.cols;
+    }
+
+    return r;
+}
+
+void FunctionConcat::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    int col = 0;
+    for (PVariable x : inputs) {
+        if (x->isGetGrad) p_grad.mul_plus_cols(1.0, col, x->data.cols, x->grad, 0);
+        col += x->data.cols;
+    }
+}
+
+
+FunctionAttention::FunctionAttention(int heads, float scale, Variable *v) : Function() {
+    name = "FunctionAttention";
+    this->heads = heads;
+    this->scale = scale;
+    this->v = v;
+}
+
+PVariable FunctionAttention::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable q = inputs.at(0);
+    PVariable keys = inputs.at(1);
+    PVariable values = inputs.at(2);
+
+    PVariable r = variable_construct_for_function(this, values->data.rows, q->data.cols);
+    outputs.push_back(r);
+
+    lse.new_matrix(heads, q->data.cols);
+    q->data.attention_forward(keys->data, values->data, v == NULL ? NULL : &v->data, heads, scale, r->data, lse);
+
+    return r;
+}
+
+void FunctionAttention::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable q = inputs.at(0);
+    PVariable keys = inputs.at(1);
+    PVariable values = inputs.at(2);
+    PVariable r = outputs.at(0);
+
+    p_grad.attention_backward(q->data, keys->data, values->data, v == NULL ? NULL : &v->data, heads, scale,
+                              r->data, lse,
+                              q->isGetGrad ? &q->grad : NULL,
+                              keys->isGetGrad ? &keys->grad : NULL,
+                              values->isGetGrad ? &values->grad : NULL,
+                              v == NULL ? NULL : &v->grad);
+}
+
+
+FunctionSequenceMask::FunctionSequenceMask(int active) : Function() {
+    name = "FunctionSequenceMask";
+    this->active = active;
+}
+
+PVariable FunctionSequenceMask::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable h = inputs.at(0);
+    PVariable h_prev = inputs.at(1);
+
+    int cols = h->data.cols;
+
+    PVariable r = variable_construct_for_function(this, h->data.rows, cols);
+
+    r->data.copy_cols(h->data, 0, active, 0);
+    r->data.copy_cols(h_prev->data, active, cols - active, active);
+
+    return r;
+}
+
+void FunctionSequenceMask::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable h = inputs.at(0);
+    PVariable h_prev = inputs.at(1);
+
+    if (h->isGetGrad) p_grad.mul_plus_cols(1.0, 0, active, h->grad, 0);
+    if (h_prev->isGetGrad) p_grad.mul_plus_cols(1.0, active, p_grad.cols - active, h_prev->grad, active);
+}
+
+
+void CellMask::save(cuMat &c){
+    if (!masked(c.cols)) return;
+
+    ended = cuMat(c.rows, c.cols - active);
+    ended.copy_cols(c, active, ended.cols, 0);
+}
+
+void CellMask::restore(cuMat &c_next){
+    if (masked(c_next.cols)) c_next.copy_cols(ended, 0, ended.cols, active);
+}
+
+void CellMask::begin_backward(cuMat &gc_next){
+    if (!masked(gc_next.cols)) return;
+
+    ended = cuMat(gc_next.rows, gc_next.cols - active);
+    ended.copy_cols(gc_next, active, ended.cols, 0);
+
+    cuMat zeros(gc_next.rows, ended.cols);
+    gc_next.copy_cols(zeros, 0, zeros.cols, active);
+}
+
+void CellMask::end_backward(cuMat &gc_next, Variable *c, bool c_overwritten){
+    if (!masked(gc_next.cols)) return;
+
+    gc_next.copy_cols(ended, 0, ended.cols, active);
+
+    // c->grad may be gc_next, then it already holds the gradient
+    if (!c->isGetGrad || &c->grad == &gc_next) return;
+    if (c_overwritten) c->grad.copy_cols(ended, 0, ended.cols, active);
+    else ended.mul_plus_cols(1.0, 0, ended.cols, c->grad, active);
+}
+
+
 // LSTM ----------------------------------
 FunctionLSTM::FunctionLSTM() : Function() {
     name = "FunctionLSTM";
@@ -955,63 +1195,130 @@ PVariable FunctionLSTM::forward(vector<PVariable> &inputs, vector<PVariable> &ou
 
     int offset = x->data.rows/4;
 
-    this->i = x->data.sliceRows(0, offset);
-    this->f = x->data.sliceRows(offset, offset);
-    this->g = x->data.sliceRows(offset*2, offset);
-    this->o = x->data.sliceRows(offset*3, offset);
+    PVariable r = variable_construct_for_function(this, offset, x->data.cols);
 
-    cuMat _i = this->i;
-    cuMat _f = this->f;
-    cuMat _g = this->g;
-    cuMat _o = this->o;
+    cell_mask.save(c->data);
+    x->data.lstm_forward(c->data, c_next->data, r->data);
+    cell_mask.restore(c_next->data);
 
-    this->i.sigmoid(_i);
-    this->f.sigmoid(_f);
-    this->g.tanh(_g);
-    this->o.sigmoid(_o);
+    return r;
+}
 
-    c_next->data = _g * _i + _f * c->data;
 
-    cuMat tmp = c_next->data;
-    c_next->data.tanh(tmp);
+// the gates are recomputed from x (the pre-activations) inside the kernel, nothing is saved.
+void FunctionLSTM::backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs){
 
-    PVariable r = variable_construct_for_function(this, x->data.rows, x->data.cols);
+    PVariable x = inputs.at(0);
+    PVariable c = inputs.at(1);
+    PVariable c_next = inputs.at(2);
 
+    cell_mask.begin_backward(c_next->grad);
+    x->data.lstm_backward(c->data, c_next->data, gh, c_next->grad, c->grad,
+                          x->isGetGrad ? &x->grad : NULL);
+    cell_mask.end_backward(c_next->grad, c.get(), true);
+}
 
-    r->data = _o * tmp;
 
-    return r;
+// SequenceLSTM ----------------------------------
+FunctionSequenceLSTM::FunctionSequenceLSTM(Variable *x_w, Variable *x_b, Variable *h_w, Variable *h_b, int seq_len,
+                                           vector<int> batch_sizes) : Function() {
+    name = "FunctionSequenceLSTM";
+    this->x_w = x_w;
+    this->x_b = x_b;
+    this->h_w = h_w;
+    this->h_b = h_b;
+    this->seq_len = seq_len;
+    this->batch_sizes = batch_sizes;
 }
 
+// sequences still running at step t
+static int active_columns(const vector<int> &batch_sizes, int t, int batch) {
+    return batch_sizes.empty() ? batch : batch_sizes[t];
+}
 
-void FunctionLSTM::backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs){
+/**
+ * All input projections are one GEMM, only h_w * h_{t-1} is left in the time loop.
+ */
+void FunctionSequenceLSTM::forward_sequence(cuMat &x, cuMat &h_all) {
+
+    int batch = x.cols / seq_len;
+    int hidden = h_w->data.cols;
+
+    if (ones.cols != x.cols){
+        ones = cuMat(1, x.cols);
+        ones.ones();
+    }
+
+    gates.new_matrix(x_w->data.rows, x.cols);
+    x_b->data.dot(ones, gates);
+    h_b->data.dot_plus(ones, gates);
+    x_w->data.dot_plus(x, gates);
+
+    // c_0 is never written, so it stays zero
+    c_all.new_matrix(hidden, (seq_len + 1) * batch);
+
+    // the steps only write the running columns
+    if (!batch_sizes.empty()) h_all.fill(0);
+
+    for (int t = 0; t < seq_len; t++) {
+        int active = active_columns(batch_sizes, t, batch);
+        if (t > 0) h_w->data.dot_plus_cols(h_all, (t - 1) * batch, active, gates, t * batch);
+        gates.lstm_step_forward(c_all, h_all, t, batch, active);
+    }
+}
+
+PVariable FunctionSequenceLSTM::forward(vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
     PVariable x = inputs.at(0);
-    PVariable c = inputs.at(1);
-    PVariable c_next = inputs.at(2);
 
-    int offset = x->data.rows/4;
+    PVariable r = variable_construct_for_function(this, h_w->data.cols, x->data.cols);
+    outputs.push_back(r);
 
-    cuMat co = c_next->data.tanh();
+    forward_sequence(x->data, r->data);
+
+    return r;
+}
+
+void FunctionSequenceLSTM::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
+
+    PVariable x = inputs.at(0);
+    PVariable h = outputs.at(0);
 
-    c->grad = gh * this->o * co.tanh_d() + c_next->grad;
+    int batch = x->data.cols / seq_len;
+    int hidden = h_w->data.cols;
 
-    cuMat gg = c->grad * this->i * this->g.tanh_d();
+    // dh_t = p_grad_t + h_w^T * dgates_{t+1}, filled from the last step backwards
+    cuMat dh = p_grad;
+    cuMat dc(hidden, batch);
+    cuMat dgates(gates.rows, gates.cols);
 
-    cuMat gi = c->grad * this->g * this->i.sigmoid_d();
+    // a sequence joins at its last step with dc still zero, the gates of ended ones stay zero
+    for (int t = seq_len - 1; t >= 0; t--) {
+        if (t < seq_len - 1) {
+            h_w->data.transpose_dot_plus_cols(dgates, (t + 1) * batch, active_columns(batch_sizes, t + 1, batch), dh, t * batch);
+        }
+        gates.lstm_step_backward(c_all, dh, dc, dgates, t, batch, active_columns(batch_sizes, t, batch));
+    }
 
-    cuMat gf = c->grad * c->data * this->f.sigmoid_d();
+    // the weight gradients of all steps are single GEMMs
+    dgates.dot_transpose_plus(x->data, x_w->grad);
+    if (seq_len > 1) dgates.dot_transpose_plus_cols(batch, h->data, 0, (seq_len - 1) * batch, h_w->grad);
+    dgates.dot_transpose_plus(ones, x_b->grad);
+    dgates.dot_transpose_plus(ones, h_b->grad);
 
-    cuMat go = gh * co * this->o.sigmoid_d();
+    if (x->isGetGrad) x_w->data.transpose_dot_plus(dgates, x->grad);
+}
 
-    c->grad *= this->f;
+void FunctionSequenceLSTM::release_saved() {
+    gates.release();
+    c_all.release();
+}
 
-    cuMat tmp = x->grad;
-    tmp.joinRows(gi, 0, offset);
-    tmp.joinRows(gf, offset, offset);
-    tmp.joinRows(gg, offset*2, offset);
-    tmp.joinRows(go, offset*3, offset);
-    if (x->isGetGrad) x->grad += tmp;
+void FunctionSequenceLSTM::recompute_saved() {
+    PVariable x = inputs.at(0);
+
+    cuMat h_all(h_w->data.cols, x->data.cols);
+    forward_sequence(x->data, h_all);
 }
 
 
@@ -1039,20 +1346,13 @@ PVariable FunctionFullLSTM::forward(vector<PVariable> &inputs, vector<PVariable>
     PVariable c = inputs.at(2);
     PVariable c_next = inputs.at(3);
 
-    cuMat ones(1, x->data.cols);
-    ones.ones();
-
-    f_hat = f_c_w->data.dot(c->data) + f_h_w->data.dot(h->data) + f_x_w->data.dot(x->data) + f_x_b->data.dot(ones);
-    f = f_hat.sigmoid();
-    i_hat = i_c_w->data.dot(c->data) + i_h_w->data.dot(h->data) + i_x_w->data.dot(x->data) + i_x_b->data.dot(ones);
-    i = i_hat.sigmoid();
-    g_hat = g_h_w->data.dot(h->data) + g_x_w->data.dot(x->data) + g_x_b->data.dot(ones);
-    g = g_hat.tanh();
+    forward_gates(x->data, h->data, c->data);
 
+    cell_mask.save(c->data);
     c_next->data = c->data * f + i * g;
+    cell_mask.restore(c_next->data);
 
-    o_hat = o_c_w->data.dot(c_next->data) + o_h_w->data.dot(h->data) + o_x_w->data.dot(x->data) + o_x_b->data.dot(ones);
-    o = o_hat.sigmoid();
+    forward_output_gate(x->data, h->data, c_next->data);
 
     PVariable h_next = variable_construct_for_function(this, f_x_w->data.rows, x->data.cols);
 
@@ -1077,15 +1377,32 @@ void FunctionFullLSTM::backward(cuMat &delta_h, vector<PVariable> &inputs, vecto
     PVariable g_for_grad = inputs.at(10);
     PVariable g_next_for_grad = inputs.at(11);
 
+    cell_mask.begin_backward(c_next->grad);
+
     cuMat ones(1, x->data.cols);
     ones.ones();
 
-    cuMat delta_o = delta_h *  c_next->data.tanh() * o_hat.sigmoid_d();
-    c_next->grad += delta_h * o * c_next->data.tanh_d() + o_c_w->data.transpose().dot(delta_o);
+    cuMat co = c_next->data.tanh();
+
+    cuMat delta_o = o_hat.sigmoid_d();
+    delta_o *= delta_h;
+    delta_o *= co;
+
+    // c_next->grad += delta_h * o * tanh_d(c_next) + o_c_w^T delta_o
+    c_next->data.tanh_d(co);
+    co *= o;
+    co.mul_plus(delta_h, c_next->grad, 1.0, 1.0);
+    o_c_w->data.transpose_dot_plus(delta_o, c_next->grad);
 
-    cuMat delta_i = c_next->grad * g * i_hat.sigmoid_d();
-    cuMat delta_f = c_next->grad * c->data * f_hat.sigmoid_d();
-    cuMat delta_g = c_next->grad * i * g_hat.tanh_d();
+    cuMat delta_i = i_hat.sigmoid_d();
+    delta_i *= c_next->grad;
+    delta_i *= g;
+    cuMat delta_f = f_hat.sigmoid_d();
+    delta_f *= c_next->grad;
+    delta_f *= c->data;
+    cuMat delta_g = g_hat.tanh_d();
+    delta_g *= c_next->grad;
+    delta_g *= i;
 
 
     i_for_grad->grad = delta_i;
@@ -1094,42 +1411,185 @@ void FunctionFullLSTM::backward(cuMat &delta_h, vector<PVariable> &inputs, vecto
     g_for_grad->grad = delta_g;
 
 
-    c->grad = c_next->grad * f + i_c_w->data.transpose().dot(delta_i) + f_c_w->data.transpose().dot(delta_f);
+    // c->grad = c_next->grad * f + i_c_w^T delta_i + f_c_w^T delta_f
+    if (c.get() != c_next.get()) c->grad = c_next->grad;
+    c->grad *= f;
+    i_c_w->data.transpose_dot_plus(delta_i, c->grad);
+    f_c_w->data.transpose_dot_plus(delta_f, c->grad);
 
 
-    o_c_w->grad += delta_o.dot(c_next->grad.transpose());
-    i_c_w->grad += i_next_for_grad->grad.dot(c_next->grad.transpose());
-    f_c_w->grad += f_next_for_grad->grad.dot(c_next->grad.transpose());
+    delta_o.dot_transpose_plus(c_next->grad, o_c_w->grad);
+    i_next_for_grad->grad.dot_transpose_plus(c_next->grad, i_c_w->grad);
+    f_next_for_grad->grad.dot_transpose_plus(c_next->grad, f_c_w->grad);
 
 
-    x->grad += g_x_w->data.transpose().dot(delta_g)
-               + i_x_w->data.transpose().dot(delta_i)
-               + f_x_w->data.transpose().dot(delta_f)
-               + o_x_w->data.transpose().dot(delta_o);
+    if (x->isGetGrad) {
+        g_x_w->data.transpose_dot_plus(delta_g, x->grad);
+        i_x_w->data.transpose_dot_plus(delta_i, x->grad);
+        f_x_w->data.transpose_dot_plus(delta_f, x->grad);
+        o_x_w->data.transpose_dot_plus(delta_o, x->grad);
+    }
+
 
+    if (h->isGetGrad) {
+        g_h_w->data.transpose_dot_plus(delta_g, h->grad);
+        i_h_w->data.transpose_dot_plus(delta_i, h->grad);
+        f_h_w->data.transpose_dot_plus(delta_f, h->grad);
+        o_h_w->data.transpose_dot_plus(delta_o, h->grad);
+    }
 
-    h->grad += g_h_w->data.transpose().dot(delta_g)
-               + i_h_w->data.transpose().dot(delta_i)
-               + f_h_w->data.transpose().dot(delta_f)
-               + o_h_w->data.transpose().dot(delta_o);
 
+    delta_g.dot_transpose_plus(x->data, g_x_w->grad);
+    g_next_for_grad->grad.dot_transpose_plus(h->data, g_h_w->grad);
+    delta_i.dot_transpose_plus(x->data, i_x_w->grad);
+    i_next_for_grad->grad.dot_transpose_plus(h->data, i_h_w->grad);
+    delta_f.dot_transpose_plus(x->data, f_x_w->grad);
+    f_next_for_grad->grad.dot_transpose_plus(h->data, f_h_w->grad);
+    delta_o.dot_transpose_plus(x->data, o_x_w->grad);
+    o_next_for_grad->grad.dot_transpose_plus(h->data, o_h_w->grad);
 
-    g_x_w->grad += delta_g.dot(x->data.transpose());
-    g_h_w->grad += g_next_for_grad->grad.dot(h->data.transpose());
-    i_x_w->grad += delta_i.dot(x->data.transpose());
-    i_h_w->grad += i_next_for_grad->grad.dot(h->data.transpose());
-    f_x_w->grad += delta_f.dot(x->data.transpose());
-    f_h_w->grad += f_next_for_grad->grad.dot(h->data.transpose());
-    o_x_w->grad += delta_o.dot(x->data.transpose());
-    o_h_w->grad += o_next_for_grad->grad.dot(h->data.transpose());
 
+    delta_g.dot_transpose_plus(ones, g_x_b->grad);
+    delta_i.dot_transpose_plus(ones, i_x_b->grad);
+    delta_f.dot_transpose_plus(ones, f_x_b->grad);
+    delta_o.dot_transpose_plus(ones, o_x_b->grad);
 
-    g_x_b->grad += delta_g.dot(ones.transpose());
-    i_x_b->grad += delta_i.dot(ones.transpose());
-    f_x_b->grad += delta_f.dot(ones.transpose());
-    o_x_b->grad += delta_o.dot(ones.transpose());
+    cell_mask.end_backward(c_next->grad, c.get(), true);
 }
 
+void FunctionFullLSTM::forward_gates(cuMat &x, cuMat &h, cuMat &c) {
+
+    cuMat ones(1, x.cols);
+    ones.ones();
+
+    f_hat = f_c_w->data.dot(c) + f_h_w->data.dot(h) + f_x_w->data.dot(x) + f_x_b->data.dot(ones);
+    f = f_hat.sigmoid();
+    i_hat = i_c_w->data.dot(c) + i_h_w->data.dot(h) + i_x_w->data.dot(x) + i_x_b->data.dot(ones);
+    i = i_hat.sigmoid();
+    g_hat = g_h_w->data.dot(h) + g_x_w->data.dot(x) + g_x_b->data.dot(ones);
+    g = g_hat.tanh();
+}
+
+void FunctionFullLSTM::forward_output_gate(cuMat &x, cuMat &h, cuMat &c_next) {
+
+    cuMat ones(1, x.cols);
+    ones.ones();
+
+    o_hat = o_c_w->data.dot(c_next) + o_h_w->data.dot(h) + o_x_w->data.dot(x) + o_x_b->data.dot(ones);
+    o = o_hat.sigmoid();
+}
+
+void FunctionFullLSTM::release_saved() {
+    f.release(); i.release(); g.release(); o.release();
+    f_hat.release(); i_hat.release(); g_hat.release(); o_hat.release();
+}
+
+// c_next->data is kept by the next step, so only the gates have to be rebuilt.
+void FunctionFullLSTM::recompute_saved() {
+    PVariable x = inputs.at(0);
+    PVariable h = inputs.at(1);
+    PVariable c = inputs.at(2);
+    PVariable c_next = inputs.at(3);
+
+    forward_gates(x->data, h->data, c->data);
+    forward_output_gate(x->data, h->data, c_next->data);
+}
+
+
+
+// PeepholeLSTM ----------------------------------
+FunctionPeepholeLSTM::FunctionPeepholeLSTM(Variable *w_x, Variable *w_h, Variable *b, Variable *peep,
+                                           Variable *ln_gamma, Variable *ln_beta) : Function() {
+    name = "FunctionPeepholeLSTM";
+    this->w_x = w_x;
+    this->w_h = w_h;
+    this->b = b;
+    this->peep = peep;
+    this->ln_gamma = ln_gamma;
+    this->ln_beta = ln_beta;
+}
+
+void FunctionPeepholeLSTM::forward_gates(cuMat &x, cuMat &h) {
+
+    if (ones.cols != x.cols){
+        ones = cuMat(1, x.cols);
+        ones.ones();
+    }
+
+    a.new_matrix(w_x->data.rows, x.cols);
+    b->data.dot(ones, a);
+    w_x->data.dot_plus(x, a);
+    w_h->data.dot_plus(h, a);
+
+    if (ln_gamma != NULL) a.gate_layer_norm(4, rstd);
+}
+
+PVariable FunctionPeepholeLSTM::forward(vector<PVariable> &inputs, vector<PVariable> &outputs) {
+
+    PVariable x = inputs.at(0);
+    PVariable h = inputs.at(1);
+    PVariable c = inputs.at(2);
+    PVariable c_next = inputs.at(3);
+
+    forward_gates(x->data, h->data);
+
+    PVariable r = variable_construct_for_function(this, w_h->data.cols, x->data.cols);
+
+    a.peephole_lstm_forward(ln_gamma == NULL ? NULL : &ln_gamma->data, ln_beta == NULL ? NULL : &ln_beta->data,
+                            peep->data, c->data, c_next->data, r->data);
+    cell_mask.save(c->data);
+    cell_mask.restore(c_next->data);
+
+    return r;
+}
+
+// the gates are recomputed from a inside the kernel, only a (and rstd) is kept from the forward.
+void FunctionPeepholeLSTM::backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs) {
+
+    PVariable x = inputs.at(0);
+    PVariable h = inputs.at(1);
+    PVariable c = inputs.at(2);
+    PVariable c_next = inputs.at(3);
+
+    cuMat ga(a.rows, a.cols);
+    cuMat gpeep(peep->data.rows, a.cols);
+
+    cell_mask.begin_backward(c_next->grad);
+    a.peephole_lstm_backward(ln_gamma == NULL ? NULL : &ln_gamma->data, ln_beta == NULL ? NULL : &ln_beta->data,
+                             peep->data, c->data, c_next->data, gh, c_next->grad,
+                             c->isGetGrad ? &c->grad : NULL, ga, gpeep);
+    cell_mask.end_backward(c_next->grad, c.get(), false);
+
+    gpeep.dot_transpose_plus(ones, peep->grad);
+
+    if (ln_gamma != NULL) {
+        ga.dot_transpose_plus(ones, ln_beta->grad);
+
+        // gpeep is reused for ga * xhat
+        gpeep.new_matrix(a.rows, a.cols);
+        a.gate_layer_norm_backward(4, ln_gamma->data, rstd, ga, gpeep);
+        gpeep.dot_transpose_plus(ones, ln_gamma->grad);
+    }
+
+    ga.dot_transpose_plus(ones, b->grad);
+    ga.dot_transpose_plus(x->data, w_x->grad);
+    ga.dot_transpose_plus(h->data, w_h->grad);
+
+    if (x->isGetGrad) w_x->data.transpose_dot_plus(ga, x->grad);
+    if (h->isGetGrad) w_h->data.transpose_dot_plus(ga, h->grad);
+}
+
+void FunctionPeepholeLSTM::release_saved() {
+    a.release();
+    rstd.release();
+}
+
+void FunctionPeepholeLSTM::recompute_saved() {
+    PVariable x = inputs.at(0);
+    PVariable h = inputs.at(1);
+
+    forward_gates(x->data, h->data);
+}
 
 
 FunctionGRU::FunctionGRU(Variable *w_r, Variable *u_r, Variable *b_r,
@@ -1177,197 +1637,228 @@ void FunctionGRU::backward(cuMat &delta_h, vector<PVariable> &inputs, vector<PVa
     PVariable x = inputs[0];
     PVariable h = inputs[1];
 
-    cuMat zeros(w_z->data.rows, x->data.cols);
-    //ones.ones();
     cuMat ones_b(1, x->data.cols);
     ones_b.ones();
 
-    cuMat delta4 = (zeros - z) * delta_h;
-    cuMat delta5 = delta_h * h->data;
-    cuMat delta6 = zeros - delta5;
-    cuMat delta7 = delta_h * g;
-    cuMat delta8 = delta_h * z;
+    // delta10 = delta_h * z * tanh_d(g_hat)
+    cuMat delta10 = g_hat.tanh_d();
+    delta10 *= delta_h;
+    delta10 *= z;
+
+    // delta11 = delta_h * (g - h) * sigmoid_d(z_hat)
+    cuMat delta11 = z_hat.sigmoid_d();
+    delta11 *= delta_h;
+    cuMat delta11_h = delta11;
+    delta11 *= g;
+    delta11_h.mul_plus(h->data, delta11, -1.0, 1.0);
+
+    cuMat delta13(w_g->data.cols, x->data.cols);
+    w_g->data.transpose_dot_plus(delta10, delta13);
+
+    // delta18 = delta13 * h * sigmoid_d(r_hat)
+    cuMat delta18 = r_hat.sigmoid_d();
+    delta18 *= delta13;
+    delta18 *= h->data;
+
+    if (h->isGetGrad) {
+        // (1 - z) * delta_h from h * (1 - z)
+        delta_h.mul_plus(1.0, h->grad);
+        z.mul_plus(delta_h, h->grad, -1.0, 1.0);
+        delta13.mul_plus(r, h->grad, 1.0, 1.0);
+        w_r->data.transpose_dot_plus(delta18, h->grad);
+        w_z->data.transpose_dot_plus(delta11, h->grad);
+    }
+    if (x->isGetGrad) {
+        u_g->data.transpose_dot_plus(delta10, x->grad);
+        u_z->data.transpose_dot_plus(delta11, x->grad);
+        u_r->data.transpose_dot_plus(delta18, x->grad);
+    }
 
-    cuMat delta9 = delta6 + delta7;
+    delta18.dot_transpose_plus(h->data, w_r->grad);
+    delta18.dot_transpose_plus(x->data, u_r->grad);
+    delta11.dot_transpose_plus(h->data, w_z->grad);
+    delta11.dot_transpose_plus(x->data, u_z->grad);
 
-    cuMat delta10 = delta8 * g_hat.tanh_d();
-    cuMat delta11 = delta9 * z_hat.sigmoid_d();
+    // delta13 is not needed any more, reuse it for h * r
+    h->data.mul(r, delta13);
+    delta10.dot_transpose_plus(delta13, w_g->grad);
+    delta10.dot_transpose_plus(x->data, u_g->grad);
 
+    delta18.dot_transpose_plus(ones_b, b_r->grad);
+    delta11.dot_transpose_plus(ones_b, b_z->grad);
+    delta10.dot_transpose_plus(ones_b, b_g->grad);
 
-    cuMat delta12 = u_g->data.transpose().dot(delta10);
-    cuMat delta13 = w_g->data.transpose().dot(delta10);
-    cuMat delta14 = u_z->data.transpose().dot(delta11);
-    cuMat delta15 = w_z->data.transpose().dot(delta11);
+}
 
-    cuMat delta16 = delta13 * h->data;
-    cuMat delta17 = delta13 * r;
-    cuMat delta18 = delta16 * r_hat.sigmoid_d();
-    cuMat delta19 = delta17 + delta4;
-    cuMat delta20 = u_r->data.transpose().dot(delta18);
-    cuMat delta21 = w_r->data.transpose().dot(delta18);
-    cuMat delta22 = delta21 + delta15;
-    h->grad += delta19 + delta22;
-    x->grad += delta12 + delta14 + delta20;
 
-    w_r->grad += delta18.dot(h->data.transpose());
-    u_r->grad += delta18.dot(x->data.transpose());
-    w_z->grad += delta11.dot(h->data.transpose());
-    u_z->grad += delta11.dot(x->data.transpose());
+FunctionSequenceGRU::FunctionSequenceGRU(Variable *w_x, Variable *b_x, Variable *w_h, Variable *b_h, int seq_len,
+                                         vector<int> batch_sizes) : Function() {
+    name = "FunctionSequenceGRU";
+    this->w_x = w_x;
+    this->b_x = b_x;
+    this->w_h = w_h;
+    this->b_h = b_h;
+    this->seq_len = seq_len;
+    this->batch_sizes = batch_sizes;
+}
 
-    w_g->grad += delta10.dot((h->data * r).transpose());
-    u_g->grad += delta10.dot(x->data.transpose());
+void FunctionSequenceGRU::forward_sequence(cuMat &x, cuMat &h_all) {
 
-    b_r->grad += delta18.dot(ones_b.transpose());
-    b_z->grad += delta11.dot(ones_b.transpose());
-    b_g->grad += delta10.dot(ones_b.transpose());
+    int batch = x.cols / seq_len;
+    int hidden = w_h->data.cols;
 
-}
+    if (ones.cols != x.cols){
+        ones = cuMat(1, x.cols);
+        ones.ones();
+    }
 
+    gx.new_matrix(w_x->data.rows, x.cols);
+    b_x->data.dot(ones, gx);
+    w_x->data.dot_plus(x, gx);
 
-FunctionBatchNorm::FunctionBatchNorm(int element_size, int channel_num, Variable *gamma, Variable *beta, Variable *x_mean, Variable *x_var) {
-    this->gamma = gamma;
-    this->beta = beta;
+    gh.new_matrix(w_h->data.rows, x.cols);
+    b_h->data.dot(ones, gh);
 
-    this->x_mean = x_mean;
-    this->x_var = x_var;
+    // the state before the first step, never written
+    h0.new_matrix(hidden, batch);
 
-    this->element_size = element_size;
-    this->channel_num = channel_num;
+    if (!batch_sizes.empty()) h_all.fill(0);
+
+    for (int t = 0; t < seq_len; t++) {
+        int active = active_columns(batch_sizes, t, batch);
+        if (t > 0) w_h->data.dot_plus_cols(h_all, (t - 1) * batch, active, gh, t * batch);
+        gx.gru_step_forward(gh, h0, h_all, t, batch, active);
+    }
+}
+
+PVariable FunctionSequenceGRU::forward(vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-    xhat.resize(channel_num);
-    rmu.resize(channel_num);
-    xmu.resize(channel_num);
-    ivar.resize(channel_num);
-    sqrtvar.resize(channel_num);
-    var.resize(channel_num);
+    PVariable x = inputs.at(0);
+
+    PVariable r = variable_construct_for_function(this, w_h->data.cols, x->data.cols);
+    outputs.push_back(r);
+
+    forward_sequence(x->data, r->data);
 
+    return r;
 }
 
+void FunctionSequenceGRU::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-PVariable FunctionBatchNorm::forward(vector<PVariable> &inputs, vector<PVariable> &outputs) {
+    PVariable x = inputs.at(0);
+    PVariable h = outputs.at(0);
 
-    PVariable x_org = inputs[0];
+    int batch = x->data.cols / seq_len;
 
-    PVariable r = variable_construct_for_function(this, x_org->data.rows, x_org->data.cols);
+    cuMat dh = p_grad;
+    cuMat dgx(gx.rows, gx.cols);
+    cuMat dgh(gh.rows, gh.cols);
 
-    for(int i=0; i<channel_num; i++) {
+    for (int t = seq_len - 1; t >= 0; t--) {
+        int active = active_columns(batch_sizes, t, batch);
+        gx.gru_step_backward(gh, h0, h->data, dh, dgx, dgh, t, batch, active);
+        if (t > 0) w_h->data.transpose_dot_plus_cols(dgh, t * batch, active, dh, (t - 1) * batch);
+    }
 
-        int idx = i*element_size;
-        cuMat x_data = x_org->data.sliceRows(idx, element_size);
+    dgx.dot_transpose_plus(x->data, w_x->grad);
+    if (seq_len > 1) dgh.dot_transpose_plus_cols(batch, h->data, 0, (seq_len - 1) * batch, w_h->grad);
+    dgx.dot_transpose_plus(ones, b_x->grad);
+    dgh.dot_transpose_plus(ones, b_h->grad);
 
-        int N = x_data.cols;
-        int D = x_data.rows;
+    if (x->isGetGrad) w_x->data.transpose_dot_plus(dgx, x->grad);
+}
 
-        cuMat ones(D, N);
-        ones.ones();
+void FunctionSequenceGRU::release_saved() {
+    gx.release();
+    gh.release();
+}
 
+void FunctionSequenceGRU::recompute_saved() {
+    PVariable x = inputs.at(0);
 
-        //step 1
-        if (is_train) rmu[i] = 1.0 / N * x_data.batch_sum();
-        else{
-            rmu[i] = cuMat(element_size, 1);
-            rmu[i].memSetDevice(this->x_mean->data.mDevice + idx);
-        }
-        cuMat mu = rmu[i].vec_to_mat(N);
+    cuMat h_all(w_h->data.cols, x->data.cols);
+    forward_sequence(x->data, h_all);
+}
 
-        //step 2
-        xmu[i] = x_data - mu;
 
-        //step 3
-        cuMat sq = xmu[i] * xmu[i];
+FunctionBatchNorm::FunctionBatchNorm(int element_size, int channel_num, Variable *gamma, Variable *beta, Variable *x_mean, Variable *x_var) {
+    name = "FunctionBatchNorm";
 
-        //step 4
-        if (is_train) var[i] = 1.0 / N * sq.batch_sum();
-        else {
-            var[i] = cuMat(element_size, 1);
-            var[i].memSetDevice(x_var->data.mDevice + idx);
-            var[i] = ((float) N) / (((float) N) - 1.0) * var[i];
-        } //use unbiased variance
+    this->gamma = gamma;
+    this->beta = beta;
+
+    this->x_mean = x_mean;
+    this->x_var = x_var;
 
-        //step 5
-        sqrtvar[i] = var[i].sqrt();
+    this->element_size = element_size;
+    this->channel_num = channel_num;
+}
 
-        //step 6
-        ivar[i] = sqrtvar[i].inverse();
-        cuMat tmp = ivar[i].vec_to_mat(N);
 
-        //step 7
-        xhat[i] = xmu[i] * tmp;
+PVariable FunctionBatchNorm::forward(vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-        //step 8
-        cuMat gamma_tmp(element_size, 1);
-        gamma_tmp.memSetDevice(gamma->data.mDevice + idx);
-        cuMat gammax = xhat[i].mat_vec_mul(gamma_tmp, 0);
+    PVariable x = inputs[0];
 
-        //step 9
-        cuMat beta_tmp(element_size, 1);
-        beta_tmp.memSetDevice(beta->data.mDevice + idx);
-        cuMat r_c = gammax + ones.mat_vec_mul(beta_tmp, 0);
-        r->data.joinRows(r_c, idx, element_size);
+    PVariable r = variable_construct_for_function(this, x->data.rows, x->data.cols);
 
-    }
+    float lam = lambda;
+    if (is_first != NULL && *is_first) lam = 0.0;
+
+    x->data.batch_norm_forward(gamma->data, beta->data, &x_mean->data, &x_var->data, mean, rstd, r->data, is_train, lam);
 
     return r;
 }
 
-void FunctionBatchNorm::backward(cuMat &dout_org, vector<PVariable> &inputs, vector<PVariable> &outputs) {
+void FunctionBatchNorm::release_saved() {
+    mean.release();
+    rstd.release();
+}
 
+// only the statistics are rebuilt, the running statistics are left as they are
+void FunctionBatchNorm::recompute_saved() {
     PVariable x = inputs[0];
 
-    for(int i=0; i<channel_num; i++) {
+    cuMat r(x->data.rows, x->data.cols);
+    x->data.batch_norm_forward(gamma->data, beta->data, is_train ? NULL : &x_mean->data, is_train ? NULL : &x_var->data,
+                               mean, rstd, r, is_train, lambda);
+}
 
-        int idx = i*element_size;
-        cuMat dout = dout_org.sliceRows(idx, element_size);
+void FunctionBatchNorm::backward(cuMat &dout, vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-        int N = dout.cols;
-        int D = dout.rows;
+    PVariable x = inputs[0];
 
+    x->data.batch_norm_backward(gamma->data, mean, rstd, dout, gamma->grad, beta->grad,
+                                x->isGetGrad ? &x->grad : NULL, is_train);
+}
 
-        //step 9
-        beta->grad.memSetDeviceRow(dout.batch_sum().mDevice, i);
-        cuMat dgammax = dout;
 
-        //step 8
-        cuMat tmp = dgammax * xhat[i];
-        gamma->grad.memSetDeviceRow(tmp.batch_sum().mDevice, i);
-        cuMat gamma_tmp(element_size, 1);
-        gamma_tmp.memSetDevice(gamma->data.mDevice + idx);
-        cuMat dxhat = dgammax.mat_vec_mul(gamma_tmp, 0);
+FunctionScaleShift::FunctionScaleShift(Variable *scale, Variable *shift) : Function() {
+    name = "FunctionScaleShift";
+    this->scale = scale;
+    this->shift = shift;
+}
 
-        //step 7
-        tmp = dxhat * xmu[i];
-        cuMat divar = tmp.batch_sum();
-        cuMat dxmu1 = dxhat.mat_vec_mul(ivar[i], 0);
+PVariable FunctionScaleShift::forward(vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-        //step 6
-        //tmp = sqrtvar.inverse_d();
-        tmp = -1.0 * sqrtvar[i].inverse() * sqrtvar[i].inverse();
-        cuMat dsqrtvar = tmp * divar;
+    PVariable x = inputs[0];
 
-        //step 5
-        cuMat dvar = var[i].sqrt_d() * dsqrtvar;
+    PVariable r = variable_construct_for_function(this, x->data.rows, x->data.cols);
 
-        //step 4
-        cuMat dsq = 1.0 / N * dvar.vec_to_mat(N);
+    x->data.row_affine(scale->data, &shift->data, r->data);
 
-        //step 3
-        cuMat dxmu2 = 2.0 * xmu[i] * dsq;
+    return r;
+}
 
-        //step 2
-        cuMat dx1 = dxmu1 + dxmu2;
-        cuMat dmu = -1.0 * dx1.batch_sum();
+void FunctionScaleShift::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-        //step 1
-        cuMat dx2 = 1.0 / N * dmu.vec_to_mat(N);
+    PVariable x = inputs[0];
 
-        //step0
-        cuMat dx3 = dx1 + dx2;
-        x->grad.joinRows(dx3, idx, element_size);
-    }
+    if (x->isGetGrad) p_grad.row_affine(scale->data, NULL, x->grad, true);
 }
 
 
-FunctionConv2D::FunctionConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_size, int filter_num, int stride, int padding){
+FunctionConv2D::FunctionConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_size, int filter_num, int stride, int padding,
+                               int groups, int dilation){
 
     this->batch_num = batch_num;
     this->channel_num = channel_num;
@@ -1377,6 +1868,8 @@ FunctionConv2D::FunctionConv2D(Variable *w, Variable *b, int batch_num, int chan
     this->filter_num = filter_num;
     this->stride = stride;
     this->padding = padding;
+    this->groups = groups;
+    this->dilation = dilation;
 
     this->w = w;
     this->b = b;
@@ -1385,10 +1878,10 @@ FunctionConv2D::FunctionConv2D(Variable *w, Variable *b, int batch_num, int chan
 
     /**
     * Each dimension h and w of the output images is computed as followed:
-    * outputDim = 1 + (inputDim + 2*pad - filterDim)/convolutionStride
+    * outputDim = 1 + (inputDim + 2*pad - (dilation*(filterDim-1)+1))/convolutionStride
     */
-    this->outputDim_w = 1 + (w_size + (padding+padding) - filter_size) / stride;
-    this->outputDim_h = 1 + (h_size + (padding+padding) - filter_size) / stride;
+    this->outputDim_w = 1 + (w_size + (padding+padding) - (dilation*(filter_size-1)+1)) / stride;
+    this->outputDim_h = 1 + (h_size + (padding+padding) - (dilation*(filter_size-1)+1)) / stride;
 
     ones = new Variable(this->outputDim_w * this->outputDim_h, 1);
     ones->ones();
@@ -1398,76 +1891,331 @@ FunctionConv2D::~FunctionConv2D(){
     delete ones;
 }
 
-cuMat FunctionConv2D::forward_one(cuMat &data){
+/*
+ * The samples of the minibatch are independent, so they are run together:
+ * one im2col launch and strided batched GEMMs instead of a loop over batch_num.
+ * Each sample's weight gradient is a partial, the partials are summed at the end.
+ * Group g uses the columns of its channels in cols and the rows g*filter_num/groups.. of w.
+ */
+PVariable FunctionConv2D::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs[0];
 
-    int output_dim_w, output_dim_h;
+    PVariable r = variable_construct_for_function(this, filter_num * outputDim_w * outputDim_h, batch_num);
 
-    cuMat stacked = data.im2col(w_size, h_size, channel_num, filter_size, filter_size, stride, stride, padding, padding, padding, padding, output_dim_w, output_dim_h);
+    int out_size = outputDim_w * outputDim_h;
+    int col_size = filter_size * filter_size * channel_num;
+    int group_cols = col_size / groups;
+    int group_filters = filter_num / groups;
 
-    cols.push_back(stacked);
+    cols.new_matrix(out_size, col_size * batch_num);
+    x->data.im2col_batch(w_size, channel_num, filter_size, stride, padding, cols, dilation);
 
-    cuMat r = stacked.dot(w->data.transpose()) + ones->data.dot(b->data.transpose());
+    // r_i = ones * b^T + cols_i * w^T
+    cuMat bias(out_size, filter_num);
+    ones->data.dot_transpose_plus(b->data, bias);
+    bias.vec_to_mat(r->data);
+
+    for (int g = 0; g < groups; g++){
+        cols.dot_batch(CUBLAS_OP_N, g * out_size * group_cols, out_size, (long long)out_size * col_size,
+                       w->data, CUBLAS_OP_T, g * group_filters, filter_num, 0,
+                       r->data, g * out_size * group_filters, out_size, (long long)out_size * filter_num,
+                       out_size, group_filters, group_cols, batch_num, 1);
+    }
 
     return r;
 }
 
+void FunctionConv2D::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
 
-cuMat FunctionConv2D::backward_one(cuMat &col, cuMat &p_grad) {
+    PVariable x = inputs[0];
 
-    cuMat p_grad_t = p_grad.transpose();
+    int out_size = outputDim_w * outputDim_h;
+    int col_size = filter_size * filter_size * channel_num;
+    int group_cols = col_size / groups;
+    int group_filters = filter_num / groups;
+
+    // w->grad += sum_i p_grad_i^T * cols_i
+    cuMat w_grads(filter_num * group_cols, batch_num);
+    for (int g = 0; g < groups; g++){
+        p_grad.dot_batch(CUBLAS_OP_T, g * out_size * group_filters, out_size, (long long)out_size * filter_num,
+                         cols, CUBLAS_OP_N, g * out_size * group_cols, out_size, (long long)out_size * col_size,
+                         w_grads, g * group_filters, filter_num, (long long)filter_num * group_cols,
+                         group_filters, group_cols, out_size, batch_num, 0);
+    }
+    w_grads.batch_sum(w->grad);
+
+    // b->grad += (sum_i p_grad_i)^T * ones
+    cuMat p_grad_sum(out_size, filter_num);
+    p_grad.batch_sum(p_grad_sum);
+    p_grad_sum.transpose_dot_plus(ones->data, b->grad);
+
+    if (x->isGetGrad) {
+        cuMat dcols(out_size, col_size * batch_num);
+        for (int g = 0; g < groups; g++){
+            p_grad.dot_batch(CUBLAS_OP_N, g * out_size * group_filters, out_size, (long long)out_size * filter_num,
+                             w->data, CUBLAS_OP_N, g * group_filters, filter_num, 0,
+                             dcols, g * out_size * group_cols, out_size, (long long)out_size * col_size,
+                             out_size, group_cols, group_filters, batch_num, 0);
+        }
+        dcols.col2im_batch(w_size, channel_num, filter_size, stride, padding, x->grad, dilation);
+    }
+}
 
-    w->grad += p_grad_t.dot(col);
+void FunctionConv2D::release_saved() {
+    cols.release();
+}
 
-    b->grad += p_grad_t.dot(ones->data);
+void FunctionConv2D::recompute_saved() {
+    PVariable x = inputs[0];
 
-    cuMat dcol = p_grad.dot(w->data);
+    cols.new_matrix(outputDim_w * outputDim_h, filter_size * filter_size * channel_num * batch_num);
+    x->data.im2col_batch(w_size, channel_num, filter_size, stride, padding, cols, dilation);
+}
 
-    cuMat dx = dcol.col2im(w_size, h_size, channel_num, filter_size, filter_size, stride, stride, padding, padding, padding, padding);
 
-    return dx;
+FunctionLinearInt8::FunctionLinearInt8(cuMatInt8 *wq, Variable *w_scale, Variable *x_scale, Variable *b) : Function() {
+    name = "FunctionLinearInt8";
+    this->wq = wq;
+    this->w_scale = w_scale;
+    this->x_scale = x_scale;
+    this->b = b;
 }
 
+PVariable FunctionLinearInt8::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
 
+    PVariable x = inputs[0];
 
-PVariable FunctionConv2D::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+    PVariable r = variable_construct_for_function(this, wq->rows, x->data.cols);
+
+    xq.quantize_cols(x->data, x->data.rows, x->data.cols, 1, x_scale->data);
+    wq->dot_dequantize(xq, w_scale->data, x_scale->data, b == NULL ? NULL : &b->data, r->data);
+
+    return r;
+}
+
+void FunctionLinearInt8::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+    // the int8 weights are inference only, training has to go back to the float weights
+    FatalError("FunctionLinearInt8::backward: int8 layers do not train, call Model::set_int8(false) first");
+}
+
+
+FunctionConv2DInt8::FunctionConv2DInt8(cuMatInt8 *wq, Variable *w_scale, Variable *x_scale, Variable *b,
+                                       int batch_num, int channel_num, int w_size, int h_size,
+                                       int filter_size, int filter_num, int stride, int padding, int dilation)
+        : FunctionConv2D(NULL, b, batch_num, channel_num, w_size, h_size, filter_size, filter_num, stride, padding, 1, dilation) {
+    name = "FunctionConv2DInt8";
+    this->wq = wq;
+    this->w_scale = w_scale;
+    this->x_scale = x_scale;
+}
+
+PVariable FunctionConv2DInt8::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
 
     PVariable x = inputs[0];
 
-    PVariable r = PVariable(new Variable(this, filter_num * outputDim_w * outputDim_h, batch_num));
+    int out_size = outputDim_w * outputDim_h;
+    int col_size = filter_size * filter_size * channel_num;
+
+    PVariable r = variable_construct_for_function(this, filter_num * out_size, batch_num);
+
+    cols.new_matrix(out_size, col_size * batch_num);
+    x->data.im2col_batch(w_size, channel_num, filter_size, stride, padding, cols, dilation);
+
+    // row i*out_size+p of xq is pixel p of sample i, r is written in the FunctionConv2D layout
+    xq.quantize_cols(cols, col_size, out_size * batch_num, out_size, x_scale->data);
+    wq->dot_dequantize(xq, w_scale->data, x_scale->data, &b->data, r->data, out_size);
+
+    return r;
+}
+
+void FunctionConv2DInt8::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+    // the int8 weights are inference only, training has to go back to the float weights
+    FatalError("FunctionConv2DInt8::backward: int8 layers do not train, call Model::set_int8(false) first");
+}
+
 
+FunctionLinearSparse::FunctionLinearSparse(cuMatBsr *w, Variable *b) : Function() {
+    name = "FunctionLinearSparse";
+    this->w = w;
+    this->b = b;
+}
 
-    for(int i=0; i<batch_num; i++) {
-        int data_index = i*(channel_num * w_size * h_size);
-        float *one_m = x->data.mDevice + data_index;
-        cuMat one_m_dev(w_size * h_size, channel_num);
-        one_m_dev.memSetDevice(one_m);
-        cuMat r_array = forward_one(one_m_dev);
-        r->data.memSetDeviceCol(r_array.mDevice, i);
+PVariable FunctionLinearSparse::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs.at(0);
+
+    PVariable r = variable_construct_for_function(this, w->rows, x->data.cols);
+
+    float beta = 0;
+    if (b != NULL) {
+        if (i1.cols == 0 || i1.cols != x->data.cols){
+            i1 = cuMat(1, x->data.cols);
+            i1.ones();
+        }
+        b->data.dot(i1, r->data);
+        beta = 1;
     }
+    w->s_d_dot(x->data, r->data, beta);
+
     return r;
 }
 
-void FunctionConv2D::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
+void FunctionLinearSparse::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+    // the BSR weights are inference only, training has to go back to the dense weights
+    FatalError("FunctionLinearSparse::backward: sparse layers do not train, call Model::set_sparse(false) first");
+}
 
-    PVariable x = inputs[0];
 
-    cuMat dx(channel_num * w_size * h_size, batch_num);
+FunctionLinearHalf::FunctionLinearHalf(Variable *w, Variable *b, cuMatHalf *wh, bool isTranspose)
+        : FunctionLinear(w, b, isTranspose) {
+    name = "FunctionLinearHalf";
+    noBias = b == NULL;
+    this->wh = wh;
+    xh.dtype = wh->dtype;
+    gh.dtype = wh->dtype;
+}
 
-    for(int i=0; i<batch_num; i++) {
+PVariable FunctionLinearHalf::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
 
-        int data_index = i*(filter_num * outputDim_w * outputDim_h);
+    PVariable x = inputs.at(0);
 
-        float *p_grad_one = p_grad.mDevice + data_index;
+    int w_size = w->data.rows;
+    if (isTranspose) w_size = w->data.cols;
 
-        cuMat p_grad_one_dev(outputDim_w * outputDim_h, filter_num);
-        p_grad_one_dev.memSetDevice(p_grad_one);
+    PVariable r = variable_construct_for_function(this, w_size, x->data.cols);
 
-        cuMat r_array = backward_one(cols[i], p_grad_one_dev);
+    xh.from(x->data);
 
-        dx.memSetDeviceCol(r_array.mDevice, i);
+    float beta = 0;
+    if (!noBias) {
+        if (i1.cols == 0 || i1.cols != x->data.cols){
+            i1 = cuMat(1, x->data.cols);
+            i1.ones();
+        }
+        b->data.dot(i1, r->data);
+        beta = 1;
     }
+    wh->gemm(isTranspose, xh, false, r->data, beta);
+
+    return r;
+}
+
+void FunctionLinearHalf::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs.at(0);
+
+    gh.from(p_grad);
+
+    if (x->isGetGrad) wh->gemm(!isTranspose, gh, false, x->grad);
+
+    if (!isTranspose) gh.gemm(false, xh, true, w->grad);
+    else xh.gemm(false, gh, true, w->grad);
+
+    if (!noBias) p_grad.dot_transpose_plus(i1, b->grad);
+}
+
+
+FunctionDepthwiseConv2D::FunctionDepthwiseConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size,
+                                                 int filter_size, int stride, int padding, int dilation){
+
+    this->batch_num = batch_num;
+    this->channel_num = channel_num;
+    this->w_size = w_size;
+    this->h_size = h_size;
+    this->filter_size = filter_size;
+    this->stride = stride;
+    this->padding = padding;
+    this->dilation = dilation;
+
+    this->w = w;
+    this->b = b;
+
+    this->name = "FunctionDepthwiseConv2D";
 
-    x->grad += dx;
+    this->outputDim_w = 1 + (w_size + (padding+padding) - (dilation*(filter_size-1)+1)) / stride;
+    this->outputDim_h = 1 + (h_size + (padding+padding) - (dilation*(filter_size-1)+1)) / stride;
+}
+
+PVariable FunctionDepthwiseConv2D::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs[0];
+
+    PVariable r = variable_construct_for_function(this, channel_num * outputDim_w * outputDim_h, batch_num);
+
+    x->data.depthwise_conv_forward(w_size, channel_num, filter_size, stride, padding, dilation, w->data, b->data, r->data);
+
+    return r;
+}
+
+void FunctionDepthwiseConv2D::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
+
+    PVariable x = inputs[0];
+
+    p_grad.depthwise_conv_backward(w_size, channel_num, filter_size, stride, padding, dilation,
+                                   x->data, w->data, w->grad, b->grad, x->isGetGrad ? &x->grad : NULL);
+}
+
+
+FunctionPointwiseConv2D::FunctionPointwiseConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_num){
+
+    this->batch_num = batch_num;
+    this->channel_num = channel_num;
+    this->w_size = w_size;
+    this->h_size = h_size;
+    this->filter_num = filter_num;
+
+    this->w = w;
+    this->b = b;
+
+    this->name = "FunctionPointwiseConv2D";
+
+    ones = new Variable(w_size * h_size, 1);
+    ones->ones();
+}
+
+FunctionPointwiseConv2D::~FunctionPointwiseConv2D(){
+    delete ones;
+}
+
+/*
+ * Image i of x is already a (pixels x channel_num) matrix, so r_i = ones * b^T + x_i * w^T
+ * and nothing needs to be saved for the backward.
+ */
+PVariable FunctionPointwiseConv2D::forward(vector<PVariable> &inputs, vector<PVariable> &outputs){
+
+    PVariable x = inputs[0];
+
+    int pixels = w_size * h_size;
+
+    PVariable r = variable_construct_for_function(this, filter_num * pixels, batch_num);
+
+    cuMat bias(pixels, filter_num);
+    ones->data.dot_transpose_plus(b->data, bias);
+    bias.vec_to_mat(r->data);
+
+    x->data.dot_batch(CUBLAS_OP_N, w->data, CUBLAS_OP_T, true, r->data, pixels, filter_num, channel_num, batch_num, 1);
+
+    return r;
+}
+
+void FunctionPointwiseConv2D::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs) {
+
+    PVariable x = inputs[0];
+
+    int pixels = w_size * h_size;
+
+    cuMat w_grads(filter_num * channel_num, batch_num);
+    p_grad.dot_batch(CUBLAS_OP_T, x->data, CUBLAS_OP_N, false, w_grads, filter_num, channel_num, pixels, batch_num, 0);
+    w_grads.batch_sum(w->grad);
+
+    cuMat p_grad_sum(pixels, filter_num);
+    p_grad.batch_sum(p_grad_sum);
+    p_grad_sum.transpose_dot_plus(ones->data, b->grad);
+
+    if (x->isGetGrad) {
+        p_grad.dot_batch(CUBLAS_OP_N, w->data, CUBLAS_OP_N, true, x->grad, pixels, channel_num, filter_num, batch_num, 1);
+    }
 }
 
 
@@ -1495,7 +2243,7 @@ PVariable FunctionPooling::forward(vector<PVariable> &inputs, vector<PVariable>
     int pooled_w = 1 + (width + (padding+padding) - windowWidth)/stride;
     int pooled_h = 1 + (height + (padding+padding) - windowHeight)/stride;
 
-    PVariable r = PVariable(new Variable(this, depth * pooled_w * pooled_h, batch_num));
+    PVariable r = variable_construct_for_function(this, depth * pooled_w * pooled_h, batch_num);
 
     r->data = x->data.pooling(batch_num, width, height, depth, windowWidth, windowHeight, stride, stride, padding, padding, padding, padding);
     return r;
@@ -1510,5 +2258,5 @@ void FunctionPooling::backward(cuMat &p_grad, vector<PVariable> &inputs, vector<
     int pooled_w = 1 + (width + (padding+padding) - windowWidth)/stride;
     int pooled_h = 1 + (height + (padding+padding) - windowHeight)/stride;
 
-    x->grad = x->data.pooling_backward(batch_num, p_grad.mDevice, width, height, depth, windowWidth, windowHeight, stride, stride, padding, padding, padding, padding);
+    if (x->isGetGrad) x->grad = x->data.pooling_backward(batch_num, p_grad.mDevice, width, height, depth, windowWidth, windowHeight, stride, stride, padding, padding, padding, padding);
 }
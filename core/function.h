@@ -13,6 +13,8 @@ using namespace std;
 #define _FUNCTION_
 
 #include "variable.h"
+#include "cuMatInt8.h"
+#include "cuMatHalf.h"
 
 
 
@@ -31,6 +33,14 @@ public:
     string custom_name;
     int inner_count = 0;
 
+    // activation checkpointing: saved intermediates are dropped after forward
+    // and recomputed from the inputs right before backward.
+    bool is_checkpoint = false;
+    bool is_released = false;
+
+    // set while a Plan replays this function: the output is written into this variable
+    PVariable bound_output = NULL;
+
     Function();
     virtual ~Function();
 
@@ -43,6 +53,7 @@ public:
                               PVariable input5, PVariable input6, PVariable input7, PVariable input8,
                               PVariable input9, PVariable input10, PVariable input11, PVariable input12
     );
+    virtual PVariable forward(const vector<PVariable> &xs);
 
     virtual void backward(cuMat &p_grad);
 
@@ -56,6 +67,12 @@ public:
 
     virtual void reset_state();
 
+    void forward_done(PVariable r);
+    void release();
+    void restore();
+    virtual void release_saved();
+    virtual void recompute_saved();
+
 private:
     friend class boost::serialization::access;
     template<class Archive> void serialize(Archive & ar, const unsigned int version) {
@@ -103,6 +120,7 @@ public:
 
 class FunctionLog : public Function {
 public:
+    PVariable rr = NULL;
     FunctionLog() ;
     PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
     void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
@@ -110,6 +128,7 @@ public:
 
 class FunctionSqrt : public Function {
 public:
+    PVariable rr = NULL;
     FunctionSqrt() ;
     PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
     void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
@@ -117,6 +136,7 @@ public:
 
 class FunctionInverse : public Function {
 public:
+    PVariable rr = NULL;
     FunctionInverse() ;
     PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
     void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
@@ -232,6 +252,21 @@ private:
 };
 
 
+/**
+ * Embedding lookup. w is the table (embed_size x vocab_size, one column per id),
+ * the input x (1 x B) holds the ids as floats. forward gathers the columns,
+ * backward scatter-adds into the touched columns of w->grad only (isSparseGrad).
+ */
+class FunctionEmbedding: public Function {
+public:
+    Variable *w;
+
+    FunctionEmbedding(Variable *w);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+
 
 
 
@@ -314,6 +349,53 @@ public:
 };
 
 
+/**
+ * Joins the columns of the inputs (same rows) in order, e.g. the hidden states
+ * h_1..h_T (H x B each) into one [H x T*B] sequence.
+ */
+class FunctionConcat: public Function {
+public:
+    FunctionConcat();
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+/**
+ * Attention of a query q (d x B) over a sequence, inputs (q, keys, values) with keys (d x T*B)
+ * and values (dv x T*B) in the sequence layout (step t of column b in column t*B+b).
+ * The result is the softmax(score) weighted sum of the values (dv x B), per head when heads > 1.
+ * score = scale * q.k, or scale * v.tanh(q + k) when v is given (additive attention).
+ * Only the logsumexp of the scores is kept, the backward recomputes them.
+ */
+class FunctionAttention: public Function {
+public:
+    Variable *v;
+    int heads;
+    float scale;
+
+    cuMat lse;
+
+    FunctionAttention(int heads, float scale, Variable *v = NULL);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+
+/**
+ * State update of a recurrent layer for a batch sorted by length, longest first:
+ * the first active columns take the new state, the ended ones keep the previous one.
+ * inputs are (new, previous).
+ */
+class FunctionSequenceMask: public Function {
+public:
+    int active;
+
+    FunctionSequenceMask(int active);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+
 class FunctionIdentity: public Function {
 public:
     FunctionIdentity();
@@ -323,10 +405,34 @@ public:
 
 
 
+/**
+ * The cell state of a per step recurrent function in a variable length batch. The columns
+ * from active on have ended: c_next keeps their c, and in the backward their gradient of
+ * c_next goes back to c unchanged instead of through the cell, which gets none for them.
+ */
+class CellMask {
+public:
+    int active = -1;    // every column runs
+
+    cuMat ended;
+
+    // forward, before c_next (which may be c) is written and after
+    void save(cuMat &c);
+    void restore(cuMat &c_next);
+
+    // backward, around the backward of the cell; c_overwritten when it sets c->grad
+    void begin_backward(cuMat &gc_next);
+    void end_backward(cuMat &gc_next, Variable *c, bool c_overwritten);
+
+private:
+    bool masked(int cols){ return active >= 0 && active < cols; }
+};
+
+
 class FunctionLSTM: public Function {
 public:
 
-    cuMat i, f, g, o;
+    CellMask cell_mask;
 
     FunctionLSTM();
     PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
@@ -338,6 +444,37 @@ public:
 
 };
 
+/**
+ * LSTM over a whole sequence. x is [input x T*batch] with the batch of step t in
+ * columns t*batch..(t+1)*batch, the result holds h_1..h_T in the same layout.
+ * The states start from zero.
+ *
+ * Variable length batches: the columns are sorted by length, longest first, and
+ * batch_sizes[t] is the number of sequences still running at step t. The recurrent
+ * work of step t covers only those columns, the outputs of ended sequences are zero.
+ */
+class FunctionSequenceLSTM: public Function {
+public:
+
+    Variable *x_w, *x_b, *h_w, *h_b;
+    int seq_len;
+    vector<int> batch_sizes;    // empty: every sequence runs seq_len steps
+
+    cuMat gates;    // pre-activations [i f g o] of all steps
+    cuMat c_all;    // c_0..c_T
+    cuMat ones;
+
+    FunctionSequenceLSTM(Variable *x_w, Variable *x_b, Variable *h_w, Variable *h_b, int seq_len,
+                         vector<int> batch_sizes = vector<int>());
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+
+    void forward_sequence(cuMat &x, cuMat &h_all);
+
+    void release_saved();
+    void recompute_saved();
+};
+
 class FunctionFullLSTM: public Function {
 public:
 
@@ -349,6 +486,8 @@ public:
     cuMat f, i, g, o;
     cuMat f_hat, i_hat, g_hat, o_hat;
 
+    CellMask cell_mask;
+
     FunctionFullLSTM(Variable *f_c_w, Variable *f_h_w, Variable *f_x_w, Variable *f_x_b,
             Variable *i_c_w, Variable *i_h_w, Variable *i_x_w, Variable *i_x_b,
             Variable *o_c_w, Variable *o_h_w, Variable *o_x_w, Variable *o_x_b,
@@ -359,6 +498,44 @@ public:
 
     void backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs);
 
+    void forward_gates(cuMat &x, cuMat &h, cuMat &c);
+    void forward_output_gate(cuMat &x, cuMat &h, cuMat &c_next);
+
+    void release_saved();
+    void recompute_saved();
+
+};
+
+
+/**
+ * One step of a peephole LSTM with diagonal peepholes and optional layer normalized gates.
+ * w_x (4H x input), w_h (4H x H) and b (4H x 1) give the pre-activations [i f g o] with two
+ * GEMMs, peep (3H x 1) holds [p_i p_f p_o]. ln_gamma/ln_beta (4H x 1) are NULL without layer norm.
+ * inputs are x, h, c and c_next, c_next is written.
+ */
+class FunctionPeepholeLSTM: public Function {
+public:
+
+    Variable *w_x, *w_h, *b, *peep;
+    Variable *ln_gamma, *ln_beta;
+
+    cuMat a;        // pre-activations, normalized with layer norm
+    cuMat rstd;
+    cuMat ones;
+
+    CellMask cell_mask;
+
+    FunctionPeepholeLSTM(Variable *w_x, Variable *w_h, Variable *b, Variable *peep,
+                         Variable *ln_gamma = NULL, Variable *ln_beta = NULL);
+
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+
+    void backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs);
+
+    void forward_gates(cuMat &x, cuMat &h);
+
+    void release_saved();
+    void recompute_saved();
 };
 
 
@@ -381,16 +558,55 @@ public:
 };
 
 
+/**
+ * GRU over a whole sequence, same layout and batch_sizes as FunctionSequenceLSTM.
+ * The gates [r z g] of the input and of the recurrent side are concatenated
+ * (w_x: 3H x input, w_h: 3H x H) and the reset gate is applied after the
+ * recurrent GEMM: g = tanh(W_xg x + b_xg + r * (W_hg h + b_hg)).
+ */
+class FunctionSequenceGRU: public Function {
+public:
+
+    Variable *w_x, *b_x, *w_h, *b_h;
+    int seq_len;
+    vector<int> batch_sizes;
+
+    cuMat gx;   // W_x x + b_x of all steps
+    cuMat gh;   // W_h h_{t-1} + b_h of all steps
+    cuMat h0;
+    cuMat ones;
+
+    FunctionSequenceGRU(Variable *w_x, Variable *b_x, Variable *w_h, Variable *b_h, int seq_len,
+                        vector<int> batch_sizes = vector<int>());
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+
+    void forward_sequence(cuMat &x, cuMat &h_all);
+
+    void release_saved();
+    void recompute_saved();
+};
+
+
+/**
+ * Batch normalization of every row of x over the batch in one kernel for all channels
+ * (x has element_size*channel_num rows). In training the running statistics x_mean/x_var
+ * are updated by the forward itself: lambda * running + (1 - lambda) * batch, with the batch
+ * statistics only while *is_first is set.
+ */
 class FunctionBatchNorm: public Function {
 
 public:
     Variable *gamma, *beta;
 
-    vector<cuMat> xhat, rmu, xmu, ivar, sqrtvar, var;
+    cuMat mean, rstd;
 
     bool is_train = true;
     Variable *x_mean, *x_var;
 
+    float lambda = 0.9;
+    bool *is_first = NULL;
+
     int element_size, channel_num;
 
 
@@ -401,6 +617,23 @@ public:
 
     void backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs);
 
+    void release_saved();
+    void recompute_saved();
+
+};
+
+/**
+ * r = x * scale + shift with one scale and shift per row, the result of folding a
+ * BatchNorm that can not be merged into the weights (see Model::fold_batch_norm).
+ */
+class FunctionScaleShift: public Function {
+public:
+    Variable *scale, *shift;
+
+    FunctionScaleShift(Variable *scale, Variable *shift);
+
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
 };
 
 class FunctionConv2D: public Function {
@@ -410,13 +643,18 @@ public:
 
     int batch_num, channel_num, w_size, h_size, filter_size, filter_num,  stride, padding;
 
+    // channels and filters are split into groups convolved separately, w is (filter_num x filter_size^2 * channel_num / groups)
+    int groups, dilation;
+
     int outputDim_w, outputDim_h;
 
-    vector<cuMat> cols;
+    // im2col of the whole minibatch, (outputDim^2 x filter_size^2 * channel_num * batch_num)
+    cuMat cols;
 
     Variable *ones;
 
-    FunctionConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_size, int filter_num,  int stride, int padding);
+    FunctionConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_size, int filter_num,  int stride, int padding,
+                   int groups = 1, int dilation = 1);
 
     ~FunctionConv2D();
 
@@ -424,9 +662,8 @@ public:
 
     void backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs);
 
-
-    cuMat forward_one(cuMat &data);
-    cuMat backward_one(cuMat &data, cuMat &p_grad);
+    void release_saved();
+    void recompute_saved();
 
 private:
     friend class boost::serialization::access;
@@ -438,6 +675,115 @@ private:
 
 };
 
+/**
+ * Inference only FunctionLinear with int8 weights wq (one scale per row in w_scale):
+ * x is quantized with x_scale (1 x 1) and multiplied with an int8 GEMM, the int32
+ * result is dequantized and the bias added in the same kernel. No backward.
+ */
+class FunctionLinearInt8: public Function {
+public:
+    cuMatInt8 *wq;
+    Variable *w_scale, *x_scale, *b;
+
+    cuMatInt8 xq;
+
+    FunctionLinearInt8(cuMatInt8 *wq, Variable *w_scale, Variable *x_scale, Variable *b = NULL);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+/**
+ * Inference only FunctionConv2D with int8 weights, the im2col columns of the batch are
+ * quantized with x_scale, see FunctionLinearInt8. No backward.
+ */
+class FunctionConv2DInt8: public FunctionConv2D {
+public:
+    cuMatInt8 *wq;
+    Variable *w_scale, *x_scale;
+
+    cuMatInt8 xq;
+
+    FunctionConv2DInt8(cuMatInt8 *wq, Variable *w_scale, Variable *x_scale, Variable *b, int batch_num, int channel_num,
+                       int w_size, int h_size, int filter_size, int filter_num, int stride, int padding, int dilation = 1);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+/**
+ * Inference only FunctionLinear with block sparse weights, see PrunedWeights. No backward.
+ */
+class FunctionLinearSparse: public Function {
+public:
+    cuMatBsr *w;
+    Variable *b;
+    cuMat i1;
+
+    FunctionLinearSparse(cuMatBsr *w, Variable *b = NULL);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+/**
+ * Mixed precision FunctionLinear: w stays the fp32 master weight, the GEMMs read its 16 bit
+ * copy wh (refreshed by Linear on every forward) and a 16 bit copy of x made in forward,
+ * and accumulate in fp32 into r, x->grad and w->grad.
+ */
+class FunctionLinearHalf: public FunctionLinear {
+public:
+    cuMatHalf *wh;
+    cuMatHalf xh, gh;
+
+    FunctionLinearHalf(Variable *w, Variable *b, cuMatHalf *wh, bool isTranspose = false);
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+    void backward(cuMat &p_grad, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+
+
+/**
+ * Depthwise convolution, one filter per channel: w is (channel_num x filter_size^2), b is (channel_num x 1).
+ * Runs its own kernel, no im2col.
+ */
+class FunctionDepthwiseConv2D: public Function {
+
+public:
+    Variable *w, *b;
+
+    int batch_num, channel_num, w_size, h_size, filter_size, stride, padding, dilation;
+
+    int outputDim_w, outputDim_h;
+
+    FunctionDepthwiseConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_size,
+                            int stride, int padding, int dilation);
+
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+
+    void backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
+
+/**
+ * 1x1 convolution: every pixel of every image is multiplied by w (filter_num x channel_num),
+ * a batched GEMM on the input itself without im2col.
+ */
+class FunctionPointwiseConv2D: public Function {
+
+public:
+    Variable *w, *b;
+
+    int batch_num, channel_num, w_size, h_size, filter_num;
+
+    Variable *ones;
+
+    FunctionPointwiseConv2D(Variable *w, Variable *b, int batch_num, int channel_num, int w_size, int h_size, int filter_num);
+
+    ~FunctionPointwiseConv2D();
+
+    PVariable forward(vector<PVariable> &inputs, vector<PVariable> &outputs);
+
+    void backward(cuMat &gh, vector<PVariable> &inputs, vector<PVariable> &outputs);
+};
+
 
 class FunctionPooling: public Function {
 
@@ -457,5 +803,21 @@ public:
 
 using PFunction = shared_ptr<Function>;
 
+
+/**
+ * Receives the function calls of the running step while installed in gRecorder.
+ * Used by Plan (plan.h) to capture a static execution order.
+ */
+class FunctionRecorder {
+public:
+    virtual ~FunctionRecorder() {}
+
+    virtual void function_created(PFunction f) = 0;
+    virtual void forward_called(Function *f, PVariable r) = 0;
+    virtual void backward_called(Function *f, Variable *v) = 0;
+};
+
+extern FunctionRecorder *gRecorder;
+
 #endif
 
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "graph.h"
 
 using namespace std;
@@ -18,23 +20,182 @@ void Graph::remove_chain(){
     funcs_chain.clear();
 }
 
+/**
+ * Keep the function alive until remove_chain().
+ * Nothing is kept in inference mode, so the function is freed after its forward
+ * unless a Plan is capturing it.
+ */
+void Graph::record(PFunction f){
+    if (gRecorder != NULL) gRecorder->function_created(f);
+    if (!gNoGrad) funcs_chain.push_back(f);
+}
+
 vector<Variable *> Graph::getParams() {
     vector < Variable * > params;
 
     return params;
 }
 
+vector<Variable *> Graph::getBuffers() {
+    return getParams();
+}
+
+vector<cuMatInt8 *> Graph::getInt8Buffers() {
+    vector<cuMatInt8 *> buffers;
+
+    return buffers;
+}
+
+void Graph::calibrate(bool status) {}
+bool Graph::quantize() { return false; }
+void Graph::set_int8(bool status) {}
+
+bool Graph::prune(float sparsity, int block) { return false; }
+bool Graph::sparsify() { return false; }
+void Graph::set_sparse(bool status) {}
+
+void Graph::set_mixed_precision(bool status, int dtype) {}
+
 PVariable Graph::forward(PVariable input) {}
 PVariable Graph::forward(PVariable x, PVariable t) {}
 
 void Graph::zero_grads() {}
 void Graph::reset_state() {}
 
+void Graph::setCheckpoint(bool status){
+    is_checkpoint = status;
+}
+
+void Graph::setLengths(vector<int> lengths){
+    // activeColumns takes the running sequences as a prefix of the columns
+    for (int i = 1; i < lengths.size(); i++){
+        if (lengths[i] > lengths[i-1]){
+            stringstream message;
+            message << "Graph::setLengths: the batch must be sorted by length, longest first, column " << i
+                    << " has length " << lengths[i] << " after " << lengths[i-1];
+            FatalError(message.str());
+        }
+    }
+    this->lengths = lengths;
+    step = 0;
+}
+
+// number of sequences (a prefix of the columns) still running at step t
+int Graph::activeColumns(int t, int batch){
+    if (lengths.empty()) return batch;
+
+    int active = 0;
+    while (active < lengths.size() && lengths[active] > t) active++;
+    return active;
+}
+
+// activeColumns of every step, empty when all sequences are full length
+vector<int> Graph::batchSizes(int seq_len){
+    vector<int> batch_sizes;
+    if (lengths.empty()) return batch_sizes;
+
+    for (int t = 0; t < seq_len; t++) batch_sizes.push_back(activeColumns(t, lengths.size()));
+    return batch_sizes;
+}
+
+/**
+ * For the per step recurrent layers: the sequences that have ended keep h_prev.
+ * Their padded steps are still computed but don't reach the state. A layer with
+ * more than one state masks the others with next_step false first, or through the
+ * CellMask of its function when the function writes the cell state itself.
+ */
+PVariable Graph::maskState(PVariable h, PVariable h_prev, bool next_step){
+    int active = activeColumns(step, h->data.cols);
+    if (next_step) step++;
+
+    if (active == h->data.cols || h_prev.get() == NULL || h_prev->data.rows != h->data.rows) return h;
+
+    PFunction p_mask(new FunctionSequenceMask(active));
+    record(p_mask);
+    return p_mask->forward(h, h_prev);
+}
+
 void Graph::toHostArray(){}
 void Graph::fromHostArray(){}
 
 
 
+Int8Weights::~Int8Weights() {
+    if (w_scale != NULL) delete w_scale;
+    if (x_scale != NULL) delete x_scale;
+}
+
+void Int8Weights::calibrate(cuMat &x) {
+    input_max = max(input_max, x.abs_max());
+}
+
+void Int8Weights::quantize(Variable *w) {
+    if (input_max == 0) cout << "Int8Weights::quantize: not calibrated, the input scale is 1/127" << endl;
+
+    if (w_scale == NULL) w_scale = new Variable(w->data.rows, 1);
+    if (x_scale == NULL) x_scale = new Variable(1, 1);
+
+    wq.quantize_rows(w->data, w_scale->data);
+    x_scale->data.fill(input_max > 0 ? input_max / 127.0 : 1.0 / 127.0);
+
+    enabled = true;
+}
+
+
+void PrunedWeights::prune(Variable *w, float sparsity, int block) {
+    int rows = w->data.rows;
+    int cols = w->data.cols;
+    int mb = (rows + block - 1) / block;
+    int kb = (cols + block - 1) / block;
+
+    vector<float> h(rows * cols);
+    cudaError_t error = cudaMemcpy(h.data(), w->data.mDevice, h.size() * sizeof(float), cudaMemcpyDeviceToHost);
+    if (error != cudaSuccess) {
+        cout << "PrunedWeights::prune: cudaMemcpy error " << cudaGetErrorString(error) << endl;
+        return;
+    }
+
+    // squared L2 norm of every block, the squared magnitude for block 1
+    vector<float> score(mb * kb, 0);
+    for (int j = 0; j < cols; j++) {
+        for (int i = 0; i < rows; i++) score[IDX2F(i / block, j / block, mb)] += h[IDX2F(i, j, rows)] * h[IDX2F(i, j, rows)];
+    }
+
+    int k = sparsity * score.size();
+    vector<int> order(score.size());
+    for (int n = 0; n < order.size(); n++) order[n] = n;
+    nth_element(order.begin(), order.begin() + k, order.end(), [&score](int a, int b){ return score[a] < score[b]; });
+
+    vector<char> keep(score.size(), 1);
+    for (int n = 0; n < k; n++) keep[order[n]] = 0;
+
+    for (int j = 0; j < cols; j++) {
+        for (int i = 0; i < rows; i++) h[IDX2F(i, j, rows)] = keep[IDX2F(i / block, j / block, mb)];
+    }
+    mask.new_matrix(rows, cols);
+    error = cudaMemcpy(mask.mDevice, h.data(), h.size() * sizeof(float), cudaMemcpyHostToDevice);
+    if (error != cudaSuccess) {
+        cout << "PrunedWeights::prune: cudaMemcpy error " << cudaGetErrorString(error) << endl;
+        return;
+    }
+
+    this->sparsity = sparsity;
+    this->block = block;
+    apply(w);
+}
+
+void PrunedWeights::apply(Variable *w) {
+    if (mask.rows > 0) w->data.mul(mask, w->data);
+}
+
+bool PrunedWeights::sparsify(Variable *w) {
+    if (!bsr.from_dense(w->data, block)) return false;
+
+    enabled = true;
+    return true;
+}
+
+
 Linear::Linear() : Graph() {}
 Linear::Linear(int output_size, int input_size, bool no_bias) : Graph() {
     noBias = no_bias;
@@ -72,17 +233,91 @@ vector<Variable *> Linear::getParams(){
     return params;
 }
 
+vector<Variable *> Linear::getBuffers(){
+    vector<Variable *> buffers = getParams();
+    if (int8.enabled) {
+        buffers.push_back(int8.w_scale);
+        buffers.push_back(int8.x_scale);
+    }
+
+    return buffers;
+}
+
+vector<cuMatInt8 *> Linear::getInt8Buffers(){
+    vector<cuMatInt8 *> buffers;
+    if (int8.enabled) buffers.push_back(&int8.wq);
+
+    return buffers;
+}
+
+void Linear::calibrate(bool status){
+    int8.calibrating = status;
+}
+
+bool Linear::quantize(){
+    // only the layers that saw calibration data
+    if (int8.input_max == 0) return false;
+
+    if (isTranpose) {
+        cout << "Linear::quantize: a transposed (shared) weight is not quantized" << endl;
+        return false;
+    }
+    int8.quantize(w);
+
+    return true;
+}
+
+void Linear::set_int8(bool status){
+    int8.enabled = status && int8.w_scale != NULL;
+}
+
+bool Linear::prune(float sparsity, int block){
+    if (sparsity > pruned.sparsity) pruned.prune(w, sparsity, block);
+    else pruned.apply(w);
+
+    return true;
+}
+
+bool Linear::sparsify(){
+    if (pruned.sparsity == 0) return false;
+
+    if (isTranpose) {
+        cout << "Linear::sparsify: a transposed (shared) weight is not sparsified" << endl;
+        return false;
+    }
+    return pruned.sparsify(w);
+}
+
+void Linear::set_sparse(bool status){
+    pruned.enabled = status && pruned.bsr.rows > 0;
+}
+
+void Linear::set_mixed_precision(bool status, int dtype){
+    mixed = status;
+    wh.dtype = dtype;
+}
+
 PVariable Linear::forward(PVariable v){
 
+    if (int8.calibrating) int8.calibrate(v->data);
+
     Function *f;
-    if (noBias)
+    if (int8.enabled)
+        f = new FunctionLinearInt8(&int8.wq, int8.w_scale, int8.x_scale, noBias ? NULL : b);
+    else if (pruned.enabled)
+        f = new FunctionLinearSparse(&pruned.bsr, noBias ? NULL : b);
+    else if (mixed) {
+        wh.from(w->data);
+        f = new FunctionLinearHalf(w, noBias ? NULL : b, &wh, isTranpose);
+    }
+    else if (noBias)
         f = new FunctionLinear(w, isTranpose);
     else
         f = new FunctionLinear(w, b, isTranpose);
 
     PFunction pf(f);
 
-    funcs_chain.push_back(pf);
+    record(pf);
 
     return pf->forward(v);
 }
@@ -141,6 +376,14 @@ vector<Variable *> SparseLinear::getParams(){
     return params;
 }
 
+// the running average of the activations, once the first forward has allocated it
+vector<Variable *> SparseLinear::getBuffers(){
+    vector<Variable *> buffers = getParams();
+    if (ph != NULL) buffers.push_back(ph);
+
+    return buffers;
+}
+
 PVariable SparseLinear::forward(PVariable v){
 
     if (this->ph == NULL){
@@ -153,7 +396,7 @@ PVariable SparseLinear::forward(PVariable v){
     else
         f = new FunctionSparseLinear(w, b, beta, p, ph);
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
 
     PVariable r = pf->forward(v);
 
@@ -188,7 +431,7 @@ Sigmoid::Sigmoid() : Graph() {
 PVariable Sigmoid::forward(PVariable v){
     Function *f = new FunctionSigmoid();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
     return pf->forward(v);
 }
 
@@ -199,7 +442,7 @@ ReLU::ReLU() : Graph() {
 PVariable ReLU::forward(PVariable v){
         Function *f = new FunctionReLU();
         PFunction pf(f);
-        funcs_chain.push_back(pf);
+        record(pf);
         return pf->forward(v);
 }
 
@@ -216,7 +459,7 @@ PReLU::PReLU(int rows, int cols) {
 PVariable PReLU::forward(PVariable v){
     Function *f = new FunctionPReLU(this->a);
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
     return pf->forward(v);
 }
 
@@ -246,7 +489,7 @@ Tanh::Tanh() : Graph() {
 PVariable Tanh::forward(PVariable v){
     Function *f = new FunctionTanh();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
     return pf->forward(v);
 }
 
@@ -257,7 +500,7 @@ Sqrt::Sqrt() : Graph() {
 PVariable Sqrt::forward(PVariable v){
     Function *f = new FunctionSqrt();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
     return pf->forward(v);
 }
 
@@ -267,7 +510,7 @@ Inverse::Inverse() : Graph() {
 PVariable Inverse::forward(PVariable v){
     Function *f = new FunctionInverse();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
     return pf->forward(v);
 }
 
@@ -284,7 +527,7 @@ PVariable Dropout::forward(PVariable v){
     if (this->is_train) {
         Function *f = new FunctionDropout(dropout_rate);
         PFunction pf(f);
-        funcs_chain.push_back(pf);
+        record(pf);
         return pf->forward(v);
     }
     else{
@@ -307,7 +550,7 @@ PVariable SoftmaxCrossEntropy::forward(PVariable v1, PVariable v2) {
 
         Function *f = new FunctionSoftmaxCrossEntropy();
         PFunction pf(f);
-        funcs_chain.push_back(pf);
+        record(pf);
 
         return pf->forward(v1, v2);
 }
@@ -320,7 +563,7 @@ PVariable Softmax::forward(PVariable v1) {
 
         Function *f = new FunctionSoftmax();
         PFunction pf(f);
-        funcs_chain.push_back(pf);
+        record(pf);
 
         return pf->forward(v1);
 }
@@ -334,7 +577,7 @@ PVariable MeanSquaredError::forward(PVariable v1, PVariable v2) {
 
     Function *f = new FunctionMeanSquaredError();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
 
     return pf->forward(v1, v2);
 }
@@ -346,19 +589,63 @@ Plus::Plus() {
 PVariable Plus::forward(PVariable v1, PVariable v2) {
     Function *f = new FunctionPlus();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
 
     return pf->forward(v1, v2);
 }
 
 
+Embedding::Embedding() : Graph() {
+}
+
+Embedding::Embedding(int embed_size, int vocab_size) : Graph() {
+    this->embed_size = embed_size;
+    this->vocab_size = vocab_size;
+
+    w = new Variable(embed_size, vocab_size);
+    w->randoms(0., 1.0);
+    w->isSparseGrad = true;
+}
+
+Embedding::~Embedding() {
+    if (w != NULL) delete w;
+}
+
+vector<Variable *> Embedding::getParams() {
+    vector<Variable *> params;
+    params.push_back(w);
+
+    return params;
+}
+
+PVariable Embedding::forward(PVariable x) {
+    Function *f = new FunctionEmbedding(w);
+    PFunction pf(f);
+    record(pf);
+
+    return pf->forward(x);
+}
+
+void Embedding::zero_grads() {
+    w->zero_grad();
+}
+
+void Embedding::toHostArray() {
+    w->data.toHostArray();
+}
+
+void Embedding::fromHostArray() {
+    w->data.fromHostArray();
+}
+
+
 Identity::Identity() : Graph() {
 
 }
 PVariable Identity::forward(PVariable v1) {
     Function *f = new FunctionIdentity();
     PFunction pf(f);
-    funcs_chain.push_back(pf);
+    record(pf);
 
     return pf->forward(v1);
 }
@@ -394,20 +681,20 @@ PVariable LSTM::forward(PVariable x) {
     // prepare functions -------------------------
     Function *f_x = new FunctionLinear(x_w, x_b);
     PFunction p_f_x(f_x);
-    funcs_chain.push_back(p_f_x);
+    record(p_f_x);
 
     Function *f_h = new FunctionLinear(h_w, h_b);
     PFunction p_f_h(f_h);
-    funcs_chain.push_back(p_f_h);
+    record(p_f_h);
 
     Function *f_plus = new FunctionPlus();
     PFunction p_f_plus(f_plus);
-    funcs_chain.push_back(p_f_plus);
+    record(p_f_plus);
 
 
     Function *f_lstm = new FunctionLSTM();
     PFunction p_f_lstm(f_lstm);
-    funcs_chain.push_back(p_f_lstm);
+    record(p_f_lstm);
     //--------------------------------------------
 
 
@@ -435,7 +722,10 @@ PVariable LSTM::forward(PVariable x) {
 
     PVariable h_d = f_plus->forward(f_x->forward(x), f_h->forward(h));
 
+    PVariable h_prev = h;
+    ((FunctionLSTM *) f_lstm)->cell_mask.active = activeColumns(step, x->data.cols);
     h = f_lstm->forward(h_d, c, c_next);
+    h = maskState(h, h_prev);
 
     c = c_next;
 
@@ -454,6 +744,8 @@ PVariable LSTM::forward(PVariable x) {
 
 void LSTM::reset_state(){
 
+    step = 0;
+
     x_w->grad *= 0;
     x_b->grad *= 0;
     h_w->grad *= 0;
@@ -493,6 +785,16 @@ void LSTM::toHostArray(){
 
 }
 
+vector<Variable *> LSTM::getParams(){
+    vector<Variable *> params;
+    params.push_back(x_w);
+    params.push_back(x_b);
+    params.push_back(h_w);
+    params.push_back(h_b);
+
+    return params;
+}
+
 void LSTM::zero_grads() {
     x_w->zero_grad();
     x_b->zero_grad();
@@ -515,6 +817,77 @@ void LSTM::fromHostArray(){
 }
 
 
+SequenceLSTM::SequenceLSTM() : Graph() {
+}
+
+SequenceLSTM::SequenceLSTM(int output_size, int input_size, int seq_len) {
+
+    this->output_size = output_size;
+    this->input_size = input_size;
+    this->seq_len = seq_len;
+
+    // same parameter layout as LSTM, gates stacked as [i f g o]
+    x_w = new Variable(output_size*4, input_size);
+    x_b = new Variable(output_size*4, 1);
+    x_w->randoms(0., sqrt((1./(float)input_size)));
+
+    h_w = new Variable(output_size*4, output_size);
+    h_b = new Variable(output_size*4, 1);
+    h_w->randoms(0., sqrt((1./(float)output_size)));
+}
+
+SequenceLSTM::~SequenceLSTM() {
+    delete x_w; delete x_b;
+    delete h_w; delete h_b;
+}
+
+vector<Variable *> SequenceLSTM::getParams() {
+    vector < Variable * > params;
+
+    params.push_back(x_w);
+    params.push_back(x_b);
+    params.push_back(h_w);
+    params.push_back(h_b);
+
+    return params;
+}
+
+PVariable SequenceLSTM::forward(PVariable x) {
+
+    Function *f = new FunctionSequenceLSTM(x_w, x_b, h_w, h_b, seq_len, batchSizes(seq_len));
+    f->is_checkpoint = is_checkpoint;
+    PFunction p_f(f);
+    record(p_f);
+
+    return f->forward(x);
+}
+
+void SequenceLSTM::setSeqLen(int seq_len) {
+    this->seq_len = seq_len;
+}
+
+void SequenceLSTM::zero_grads() {
+    x_w->zero_grad();
+    x_b->zero_grad();
+    h_w->zero_grad();
+    h_b->zero_grad();
+}
+
+void SequenceLSTM::toHostArray(){
+    x_w->data.toHostArray();
+    x_b->data.toHostArray();
+    h_w->data.toHostArray();
+    h_b->data.toHostArray();
+}
+
+void SequenceLSTM::fromHostArray(){
+    x_w->data.fromHostArray();
+    x_b->data.fromHostArray();
+    h_w->data.fromHostArray();
+    h_b->data.fromHostArray();
+}
+
+
 FullLSTM::FullLSTM() : Graph() {
 
 }
@@ -582,8 +955,9 @@ PVariable FullLSTM::forward(PVariable x) {
                                             o_c_w, o_h_w, o_x_w, o_x_b,
                                             g_h_w, g_x_w, g_x_b
     );
+    f_lstm->is_checkpoint = is_checkpoint;
     PFunction p_f_lstm(f_lstm);
-    funcs_chain.push_back(p_f_lstm);
+    record(p_f_lstm);
     //--------------------------------------------
 
 
@@ -634,7 +1008,10 @@ PVariable FullLSTM::forward(PVariable x) {
         id++;
     }
 
+    PVariable h_prev = h;
+    ((FunctionFullLSTM *) f_lstm)->cell_mask.active = activeColumns(step, x->data.cols);
     h = f_lstm->forward(x, h, c, c_next, f, f_next, i, i_next, o, o_next, g, g_next);
+    h = maskState(h, h_prev);
 
     c = c_next;
     f = f_next;
@@ -655,6 +1032,8 @@ PVariable FullLSTM::forward(PVariable x) {
 
 void FullLSTM::reset_state(){
 
+    step = 0;
+
 
     if (f_c_w->grad.mDevice != NULL) f_c_w->grad *= 0;
     if (f_h_w->grad.mDevice != NULL) f_h_w->grad *= 0;
@@ -782,6 +1161,31 @@ void FullLSTM::toHostArray(){
     g_x_b->data.toHostArray();
 
 }
+
+vector<Variable *> FullLSTM::getParams(){
+    vector<Variable *> params;
+
+    params.push_back(f_c_w);
+    params.push_back(f_h_w);
+    params.push_back(f_x_w);
+    params.push_back(f_x_b);
+
+    params.push_back(i_c_w);
+    params.push_back(i_h_w);
+    params.push_back(i_x_w);
+    params.push_back(i_x_b);
+
+    params.push_back(o_c_w);
+    params.push_back(o_h_w);
+    params.push_back(o_x_w);
+    params.push_back(o_x_b);
+
+    params.push_back(g_h_w);
+    params.push_back(g_x_w);
+    params.push_back(g_x_b);
+
+    return params;
+}
 void FullLSTM::fromHostArray(){
 
     f_c_w->data.fromHostArray();
@@ -944,18 +1348,25 @@ vector<Variable *> FullLSTM2::getParams(){
     params.push_back(beta_g);
     params.push_back(beta_o);
 
-    params.push_back(x_mean_f);
-    params.push_back(x_mean_i);
-    params.push_back(x_mean_g);
-    params.push_back(x_mean_o);
-    params.push_back(x_var_f);
-    params.push_back(x_var_i);
-    params.push_back(x_var_g);
-    params.push_back(x_var_o);
-
     return params;
 }
 
+// the running statistics are stored but not trained
+vector<Variable *> FullLSTM2::getBuffers(){
+    vector<Variable *> buffers = getParams();
+
+    buffers.push_back(x_mean_f);
+    buffers.push_back(x_mean_i);
+    buffers.push_back(x_mean_g);
+    buffers.push_back(x_mean_o);
+    buffers.push_back(x_var_f);
+    buffers.push_back(x_var_i);
+    buffers.push_back(x_var_g);
+    buffers.push_back(x_var_o);
+
+    return buffers;
+}
+
 
 void FullLSTM2::set_train_status(bool status){
     is_train = status;
@@ -966,64 +1377,64 @@ PVariable FullLSTM2::forward(PVariable x) {
 
     // prepare function
     PFunction p_f_x(new FunctionLinear(f_x_w, f_x_b));
-    funcs_chain.push_back(p_f_x);
+    record(p_f_x);
     PFunction p_f_h(new FunctionLinear(f_h_w));
-    funcs_chain.push_back(p_f_h);
+    record(p_f_h);
     PFunction p_f_c(new FunctionLinear(f_c_w));
-    funcs_chain.push_back(p_f_c);
+    record(p_f_c);
     PFunction p_f_sig(new FunctionSigmoid());
-    funcs_chain.push_back(p_f_sig);
+    record(p_f_sig);
     PFunction p_f_sum1(new FunctionPlus());
-    funcs_chain.push_back(p_f_sum1);
+    record(p_f_sum1);
     PFunction p_f_sum2(new FunctionPlus());
-    funcs_chain.push_back(p_f_sum2);
+    record(p_f_sum2);
 
     PFunction p_i_x(new FunctionLinear(i_x_w, i_x_b));
-    funcs_chain.push_back(p_i_x);
+    record(p_i_x);
     PFunction p_i_h(new FunctionLinear(i_h_w));
-    funcs_chain.push_back(p_i_h);
+    record(p_i_h);
     PFunction p_i_c(new FunctionLinear(i_c_w));
-    funcs_chain.push_back(p_i_c);
+    record(p_i_c);
     PFunction p_i_sig(new FunctionSigmoid());
-    funcs_chain.push_back(p_i_sig);
+    record(p_i_sig);
     PFunction p_i_sum1(new FunctionPlus());
-    funcs_chain.push_back(p_i_sum1);
+    record(p_i_sum1);
     PFunction p_i_sum2(new FunctionPlus());
-    funcs_chain.push_back(p_i_sum2);
+    record(p_i_sum2);
 
     PFunction p_g_x(new FunctionLinear(g_x_w, g_x_b));
-    funcs_chain.push_back(p_g_x);
+    record(p_g_x);
     PFunction p_g_h(new FunctionLinear(g_h_w));
-    funcs_chain.push_back(p_g_h);
+    record(p_g_h);
     PFunction p_g_tanh(new FunctionTanh());
-    funcs_chain.push_back(p_g_tanh);
+    record(p_g_tanh);
     PFunction p_g_sum(new FunctionPlus());
-    funcs_chain.push_back(p_g_sum);
+    record(p_g_sum);
 
     PFunction p_c_mul1(new FunctionMul());
-    funcs_chain.push_back(p_c_mul1);
+    record(p_c_mul1);
     PFunction p_c_mul2(new FunctionMul());
-    funcs_chain.push_back(p_c_mul2);
+    record(p_c_mul2);
     PFunction p_c_plus(new FunctionPlus());
-    funcs_chain.push_back(p_c_plus);
+    record(p_c_plus);
 
     PFunction p_o_x(new FunctionLinear(o_x_w, o_x_b));
-    funcs_chain.push_back(p_o_x);
+    record(p_o_x);
     PFunction p_o_h(new FunctionLinear(o_h_w));
-    funcs_chain.push_back(p_o_h);
+    record(p_o_h);
     PFunction p_o_c(new FunctionLinear(o_c_w));
-    funcs_chain.push_back(p_o_c);
+    record(p_o_c);
     PFunction p_o_sig(new FunctionSigmoid());
-    funcs_chain.push_back(p_o_sig);
+    record(p_o_sig);
     PFunction p_o_sum1(new FunctionPlus());
-    funcs_chain.push_back(p_o_sum1);
+    record(p_o_sum1);
     PFunction p_o_sum2(new FunctionPlus());
-    funcs_chain.push_back(p_o_sum2);
+    record(p_o_sum2);
 
     PFunction p_h_tanh(new FunctionTanh());
-    funcs_chain.push_back(p_h_tanh);
+    record(p_h_tanh);
     PFunction p_h_mul(new FunctionMul());
-    funcs_chain.push_back(p_h_mul);
+    record(p_h_mul);
 
 
     //--------------------------------------------
@@ -1054,48 +1465,35 @@ PVariable FullLSTM2::forward(PVariable x) {
         // we chose algo of 2.
 
 
-        FunctionBatchNorm *f_batch_norm  = new FunctionBatchNorm(input_size, 1, gamma_f, beta_f, x_mean_f, x_var_f);
-        FunctionBatchNorm *i_batch_norm  = new FunctionBatchNorm(input_size, 1, gamma_i, beta_i, x_mean_i, x_var_i);
-        FunctionBatchNorm *g_batch_norm  = new FunctionBatchNorm(input_size, 1, gamma_g, beta_g, x_mean_g, x_var_g);
-        FunctionBatchNorm *o_batch_norm  = new FunctionBatchNorm(input_size, 1, gamma_o, beta_o, x_mean_o, x_var_o);
+        FunctionBatchNorm *f_batch_norm  = new FunctionBatchNorm(output_size, 1, gamma_f, beta_f, x_mean_f, x_var_f);
+        FunctionBatchNorm *i_batch_norm  = new FunctionBatchNorm(output_size, 1, gamma_i, beta_i, x_mean_i, x_var_i);
+        FunctionBatchNorm *g_batch_norm  = new FunctionBatchNorm(output_size, 1, gamma_g, beta_g, x_mean_g, x_var_g);
+        FunctionBatchNorm *o_batch_norm  = new FunctionBatchNorm(output_size, 1, gamma_o, beta_o, x_mean_o, x_var_o);
 
-        f_batch_norm->is_train = this->is_train;
-        i_batch_norm->is_train = this->is_train;
-        g_batch_norm->is_train = this->is_train;
-        o_batch_norm->is_train = this->is_train;
+        FunctionBatchNorm *batch_norms[] = {f_batch_norm, i_batch_norm, g_batch_norm, o_batch_norm};
+        for (FunctionBatchNorm *bn : batch_norms) {
+            bn->is_train = this->is_train;
+            bn->lambda = lambda;
+            bn->is_first = &is_first;
+        }
 
         PFunction p_f_batch_norm(f_batch_norm);
         PFunction p_i_batch_norm(i_batch_norm);
         PFunction p_g_batch_norm(g_batch_norm);
         PFunction p_o_batch_norm(o_batch_norm);
-        funcs_chain.push_back(p_f_batch_norm);
-        funcs_chain.push_back(p_i_batch_norm);
-        funcs_chain.push_back(p_g_batch_norm);
-        funcs_chain.push_back(p_o_batch_norm);
+        record(p_f_batch_norm);
+        record(p_i_batch_norm);
+        record(p_g_batch_norm);
+        record(p_o_batch_norm);
 
 
+        // the running statistics are updated inside the functions
         f_x = p_f_batch_norm->forward(p_f_x->forward(x));
         i_x = p_i_batch_norm->forward(p_i_x->forward(x));
         g_x = p_g_batch_norm->forward(p_g_x->forward(x));
         o_x = p_o_batch_norm->forward(p_o_x->forward(x));
 
-
-        if (this->is_train) {
-            float lam = lambda;
-            if (is_first) {
-                lam = 0.0;
-                is_first = false;
-            }
-            x_mean_f->data = lam * x_mean_f->data + (1.0 - lam) * f_batch_norm->rmu[0];
-            x_mean_i->data = lam * x_mean_i->data + (1.0 - lam) * i_batch_norm->rmu[0];
-            x_mean_g->data = lam * x_mean_g->data + (1.0 - lam) * g_batch_norm->rmu[0];
-            x_mean_o->data = lam * x_mean_o->data + (1.0 - lam) * o_batch_norm->rmu[0];
-
-            x_var_f->data = lam * x_var_f->data + (1.0 - lam) * f_batch_norm->var[0];
-            x_var_i->data = lam * x_var_i->data + (1.0 - lam) * i_batch_norm->var[0];
-            x_var_g->data = lam * x_var_g->data + (1.0 - lam) * g_batch_norm->var[0];
-            x_var_o->data = lam * x_var_o->data + (1.0 - lam) * o_batch_norm->var[0];
-        }
+        if (this->is_train) is_first = false;
     }
     else{
         f_x = p_f_x->forward(x);
@@ -1114,10 +1512,12 @@ PVariable FullLSTM2::forward(PVariable x) {
     PVariable g = p_g_tanh->forward(g_sum);
 
 
+    PVariable c_prev = c;
     c = p_c_plus->forward(
             p_c_mul1->forward(i, g),
             p_c_mul2->forward(f, c)
     );
+    c = maskState(c, c_prev, false);
 
 
 
@@ -1125,7 +1525,9 @@ PVariable FullLSTM2::forward(PVariable x) {
     PVariable o = p_o_sig->forward(o_sum);
 
 
+    PVariable h_prev = h;
     h = p_h_mul->forward(o, p_h_tanh->forward(c));
+    h = maskState(h, h_prev);
 
 
 
@@ -1143,6 +1545,8 @@ PVariable FullLSTM2::forward(PVariable x) {
 
 void FullLSTM2::reset_state(){
 
+    step = 0;
+
     if (f_c_w->grad.mDevice != NULL) f_c_w->grad *= 0;
     if (f_h_w->grad.mDevice != NULL) f_h_w->grad *= 0;
     if (f_x_w->grad.mDevice != NULL) f_x_w->grad *= 0;
@@ -1317,104 +1721,72 @@ void FullLSTM2::fromHostArray(){
 
 
 
-GRU::GRU() : Graph() {
+PeepholeLSTM::PeepholeLSTM() : Graph() {
 
 }
-GRU::GRU(int output_size, int input_size) {
+PeepholeLSTM::PeepholeLSTM(int output_size, int input_size, bool layer_norm) {
 
     this->output_size = output_size;
     this->input_size = input_size;
+    this->layer_norm = layer_norm;
 
+    w_x = new Variable(output_size*4, input_size);
+    w_h = new Variable(output_size*4, output_size);
+    b = new Variable(output_size*4, 1);
+    peep = new Variable(output_size*3, 1);
 
-    u_r = new Variable(output_size, output_size);
-    w_r = new Variable(output_size, input_size);
-    b_r = new Variable(output_size, 1);
-
-    u_z = new Variable(output_size, output_size);
-    w_z = new Variable(output_size, input_size);
-    b_z = new Variable(output_size, 1);
-
-    u_g = new Variable(output_size, output_size);
-    w_g = new Variable(output_size, input_size);
-    b_g = new Variable(output_size, 1);
-
-    u_r->randoms(0., sqrt((1./(float)output_size)));
-    w_r->randoms(0., sqrt((1./(float)input_size)));
-    u_z->randoms(0., sqrt((1./(float)output_size)));
-    w_z->randoms(0., sqrt((1./(float)input_size)));
-    u_g->randoms(0., sqrt((1./(float)output_size)));
-    w_g->randoms(0., sqrt((1./(float)input_size)));
+    w_x->randoms(0., sqrt((1./(float)input_size)));
+    w_h->randoms(0., sqrt((1./(float)output_size)));
+    peep->randoms(0., sqrt((1./(float)output_size)));
 
+    ln_gamma = new Variable(output_size*4, 1);
+    ln_beta = new Variable(output_size*4, 1);
+    ln_gamma->data.ones();
 
+    // initialize forget gate bias to 1, after the normalization when it is used
+    vector<float> bias(output_size*4);
+    for (int i = 0; i < output_size*4; i++) bias[i] = (i >= output_size && i < output_size*2) ? 1.0 : 0.0;
+    if (layer_norm) ln_beta->data.memSetHost(bias.data());
+    else b->data.memSetHost(bias.data());
 }
-GRU::~GRU() {
-    delete w_r; delete u_r, delete b_r;
-    delete w_z; delete u_z, delete b_z;
-    delete w_g; delete u_g, delete b_g;
+
+PeepholeLSTM::~PeepholeLSTM() {
+    delete w_x; delete w_h; delete b; delete peep;
+    delete ln_gamma; delete ln_beta;
 }
 
-vector<Variable *> GRU::getParams() {
-    vector < Variable * > params;
+vector<Variable *> PeepholeLSTM::getParams(){
+    vector<Variable *> params;
 
-    params.push_back(w_r);
-    params.push_back(u_r);
-    params.push_back(b_r);
-    params.push_back(w_z);
-    params.push_back(u_z);
-    params.push_back(b_z);
-    params.push_back(w_g);
-    params.push_back(u_g);
-    params.push_back(b_g);
+    params.push_back(w_x);
+    params.push_back(w_h);
+    params.push_back(b);
+    params.push_back(peep);
+
+    if (layer_norm) {
+        params.push_back(ln_gamma);
+        params.push_back(ln_beta);
+    }
 
     return params;
 }
 
-PVariable GRU::forward(PVariable x) {
-    // prepare function
-    PFunction p_f_w_r_linear(new FunctionLinear(w_r));
-    funcs_chain.push_back(p_f_w_r_linear);
-    PFunction p_f_u_r_linear(new FunctionLinear(u_r, b_r));
-    funcs_chain.push_back(p_f_u_r_linear);
-    PFunction p_f_r_plus(new FunctionPlus());
-    funcs_chain.push_back(p_f_r_plus);
-    PFunction p_f_r_sig(new FunctionSigmoid());
-    funcs_chain.push_back(p_f_r_sig);
-
-    PFunction p_f_w_z_linear(new FunctionLinear(w_z));
-    funcs_chain.push_back(p_f_w_z_linear);
-    PFunction p_f_u_z_linear(new FunctionLinear(u_z, b_z));
-    funcs_chain.push_back(p_f_u_z_linear);
-    PFunction p_f_z_plus(new FunctionPlus());
-    funcs_chain.push_back(p_f_z_plus);
-    PFunction p_f_z_sig(new FunctionSigmoid());
-    funcs_chain.push_back(p_f_z_sig);
-
-    PFunction p_f_w_g_linear(new FunctionLinear(w_g));
-    funcs_chain.push_back(p_f_w_g_linear);
-    PFunction p_f_u_g_linear(new FunctionLinear(u_g, b_g));
-    funcs_chain.push_back(p_f_u_g_linear);
-    PFunction p_f_g_plus(new FunctionPlus());
-    funcs_chain.push_back(p_f_g_plus);
-    PFunction p_f_g_tanh(new FunctionTanh());
-    funcs_chain.push_back(p_f_g_tanh);
-    PFunction p_f_g_mul(new FunctionMul());
-    funcs_chain.push_back(p_f_g_mul);
-
-    PFunction p_f_minus(new FunctionMinus());
-    funcs_chain.push_back(p_f_minus);
-    PFunction p_f_mul1(new FunctionMul());
-    funcs_chain.push_back(p_f_mul1);
-    PFunction p_f_mul2(new FunctionMul());
-    funcs_chain.push_back(p_f_mul2);
-    PFunction p_f_plus(new FunctionPlus());
-    funcs_chain.push_back(p_f_plus);
+PVariable PeepholeLSTM::forward(PVariable x) {
+
+    Function *f;
+    if (layer_norm) f = new FunctionPeepholeLSTM(w_x, w_h, b, peep, ln_gamma, ln_beta);
+    else f = new FunctionPeepholeLSTM(w_x, w_h, b, peep);
+    f->is_checkpoint = is_checkpoint;
+    PFunction p_f(f);
+    record(p_f);
 
-    //--------------------------------------------
 
+    if (c.get() == NULL || c->data.rows == 0 || c->data.cols != x->data.cols) {
+        c = PVariable(variable_construct(output_size, x->data.cols), variable_destroy);
+    }
 
     if (h.get() == NULL || h->data.rows == 0 || h->data.cols != x->data.cols) {
         h = PVariable(variable_construct(output_size, x->data.cols), variable_destroy);
-
         h->opt = id;
 
         last_opt = id;
@@ -1422,35 +1794,160 @@ PVariable GRU::forward(PVariable x) {
         h->last_opt = &last_opt;
         h->is_last_backward = &is_last_backward;
         id++;
-
-    }
-    if (ones.get() == NULL || ones->data.rows == 0 || ones->data.cols != x->data.cols){
-        ones = PVariable(new Variable(output_size, x->data.cols, false));
-        ones->ones();
     }
 
+    // c is still needed by the backward of this step, so every step gets its own c_next
+    PVariable c_next = PVariable(variable_construct(output_size, x->data.cols), variable_destroy);
 
-    PVariable r = p_f_r_sig->forward(
-            p_f_r_plus->forward(
-                    p_f_w_r_linear->forward(x), p_f_u_r_linear->forward(h)
-            )
-    );
+    PVariable h_prev = h;
+    ((FunctionPeepholeLSTM *) f)->cell_mask.active = activeColumns(step, x->data.cols);
+    h = f->forward(x, h, c, c_next);
+    h = maskState(h, h_prev);
+    c = c_next;
 
-    PVariable z = p_f_z_sig->forward(
-            p_f_z_plus->forward(
-                    p_f_w_z_linear->forward(x), p_f_u_z_linear->forward(h)
-            )
-    );
+    h->opt = id;
 
-    PVariable g = p_f_g_tanh->forward(
-            p_f_g_plus->forward(
-                    p_f_w_g_linear->forward(x), p_f_u_g_linear->forward(p_f_g_mul->forward(r, h))
-            )
-    );
+    last_opt = id;
 
-    h = p_f_plus->forward(
-      p_f_mul1->forward(p_f_minus->forward(ones, z), h), p_f_mul2->forward(z, g)
-    );
+    h->last_opt = &last_opt;
+    h->is_last_backward = &is_last_backward;
+    id++;
+
+    return h;
+}
+
+void PeepholeLSTM::reset_state(){
+
+    step = 0;
+
+    c->zeros();
+    c->unchain();
+
+    h->zeros();
+    h->unchain();
+
+    last_opt = 0;
+    is_last_backward = false;
+
+    id = 0;
+
+    h->opt = id;
+
+    last_opt = id;
+
+    h->last_opt = &last_opt;
+    h->is_last_backward = &is_last_backward;
+    id++;
+}
+
+void PeepholeLSTM::zero_grads() {
+    w_x->zero_grad();
+    w_h->zero_grad();
+    b->zero_grad();
+    peep->zero_grad();
+    ln_gamma->zero_grad();
+    ln_beta->zero_grad();
+
+    c->zero_grad();
+    h->zero_grad();
+}
+
+void PeepholeLSTM::toHostArray(){
+    w_x->data.toHostArray();
+    w_h->data.toHostArray();
+    b->data.toHostArray();
+    peep->data.toHostArray();
+    ln_gamma->data.toHostArray();
+    ln_beta->data.toHostArray();
+}
+
+void PeepholeLSTM::fromHostArray(){
+    w_x->data.fromHostArray();
+    w_h->data.fromHostArray();
+    b->data.fromHostArray();
+    peep->data.fromHostArray();
+    ln_gamma->data.fromHostArray();
+    ln_beta->data.fromHostArray();
+}
+
+
+
+GRU::GRU() : Graph() {
+
+}
+GRU::GRU(int output_size, int input_size) {
+
+    this->output_size = output_size;
+    this->input_size = input_size;
+
+
+    u_r = new Variable(output_size, output_size);
+    w_r = new Variable(output_size, input_size);
+    b_r = new Variable(output_size, 1);
+
+    u_z = new Variable(output_size, output_size);
+    w_z = new Variable(output_size, input_size);
+    b_z = new Variable(output_size, 1);
+
+    u_g = new Variable(output_size, output_size);
+    w_g = new Variable(output_size, input_size);
+    b_g = new Variable(output_size, 1);
+
+    u_r->randoms(0., sqrt((1./(float)output_size)));
+    w_r->randoms(0., sqrt((1./(float)input_size)));
+    u_z->randoms(0., sqrt((1./(float)output_size)));
+    w_z->randoms(0., sqrt((1./(float)input_size)));
+    u_g->randoms(0., sqrt((1./(float)output_size)));
+    w_g->randoms(0., sqrt((1./(float)input_size)));
+
+
+}
+GRU::~GRU() {
+    delete w_r; delete u_r, delete b_r;
+    delete w_z; delete u_z, delete b_z;
+    delete w_g; delete u_g, delete b_g;
+}
+
+vector<Variable *> GRU::getParams() {
+    vector < Variable * > params;
+
+    params.push_back(w_r);
+    params.push_back(u_r);
+    params.push_back(b_r);
+    params.push_back(w_z);
+    params.push_back(u_z);
+    params.push_back(b_z);
+    params.push_back(w_g);
+    params.push_back(u_g);
+    params.push_back(b_g);
+
+    return params;
+}
+
+PVariable GRU::forward(PVariable x) {
+    // prepare function
+    // FunctionGRU names the recurrent weights w_* and the input weights u_*
+    PFunction p_f_gru(new FunctionGRU(u_r, w_r, b_r, u_z, w_z, b_z, u_g, w_g, b_g));
+    record(p_f_gru);
+
+    //--------------------------------------------
+
+
+    if (h.get() == NULL || h->data.rows == 0 || h->data.cols != x->data.cols) {
+        h = PVariable(variable_construct(output_size, x->data.cols), variable_destroy);
+
+        h->opt = id;
+
+        last_opt = id;
+
+        h->last_opt = &last_opt;
+        h->is_last_backward = &is_last_backward;
+        id++;
+
+    }
+    PVariable h_prev = h;
+    h = p_f_gru->forward(x, h);
+    h = maskState(h, h_prev);
 
 
     h->opt = id;
@@ -1467,6 +1964,8 @@ PVariable GRU::forward(PVariable x) {
 
 void GRU::reset_state(){
 
+    step = 0;
+
     w_r->zero_grad();
     u_r->zero_grad();
     b_r->zero_grad();
@@ -1476,7 +1975,6 @@ void GRU::reset_state(){
     w_g->zero_grad();
     u_g->zero_grad();
     b_g->zero_grad();
-    ones->zero_grad();
 
     h->zeros();
     h->unchain();
@@ -1507,7 +2005,6 @@ void GRU::zero_grads() {
     w_g->zero_grad();
     u_g->zero_grad();
     b_g->zero_grad();
-    ones->zero_grad();
 
     h->zero_grad();
 }
@@ -1539,6 +2036,77 @@ void GRU::fromHostArray(){
 
 
 
+
+SequenceGRU::SequenceGRU() : Graph() {
+}
+
+SequenceGRU::SequenceGRU(int output_size, int input_size, int seq_len) {
+
+    this->output_size = output_size;
+    this->input_size = input_size;
+    this->seq_len = seq_len;
+
+    w_x = new Variable(output_size*3, input_size);
+    b_x = new Variable(output_size*3, 1);
+    w_x->randoms(0., sqrt((1./(float)input_size)));
+
+    w_h = new Variable(output_size*3, output_size);
+    b_h = new Variable(output_size*3, 1);
+    w_h->randoms(0., sqrt((1./(float)output_size)));
+}
+
+SequenceGRU::~SequenceGRU() {
+    delete w_x; delete b_x;
+    delete w_h; delete b_h;
+}
+
+vector<Variable *> SequenceGRU::getParams() {
+    vector < Variable * > params;
+
+    params.push_back(w_x);
+    params.push_back(b_x);
+    params.push_back(w_h);
+    params.push_back(b_h);
+
+    return params;
+}
+
+PVariable SequenceGRU::forward(PVariable x) {
+
+    Function *f = new FunctionSequenceGRU(w_x, b_x, w_h, b_h, seq_len, batchSizes(seq_len));
+    f->is_checkpoint = is_checkpoint;
+    PFunction p_f(f);
+    record(p_f);
+
+    return f->forward(x);
+}
+
+void SequenceGRU::setSeqLen(int seq_len) {
+    this->seq_len = seq_len;
+}
+
+void SequenceGRU::zero_grads() {
+    w_x->zero_grad();
+    b_x->zero_grad();
+    w_h->zero_grad();
+    b_h->zero_grad();
+}
+
+void SequenceGRU::toHostArray(){
+    w_x->data.toHostArray();
+    b_x->data.toHostArray();
+    w_h->data.toHostArray();
+    b_h->data.toHostArray();
+}
+
+void SequenceGRU::fromHostArray(){
+    w_x->data.fromHostArray();
+    b_x->data.fromHostArray();
+    w_h->data.fromHostArray();
+    b_h->data.fromHostArray();
+}
+
+
 BatchNorm::BatchNorm() : Graph() {
 }
 
@@ -1572,39 +2140,29 @@ vector<Variable *> BatchNorm::getParams(){
     return params;
 }
 
+vector<Variable *> BatchNorm::getBuffers(){
+    vector<Variable *> buffers = getParams();
+    buffers.push_back(x_mean);
+    buffers.push_back(x_var);
+
+    return buffers;
+}
+
 PVariable BatchNorm::forward(PVariable x) {
 
     // prepare function
     FunctionBatchNorm *f = new FunctionBatchNorm(element_size, channel_num, gamma, beta, x_mean, x_var);
-    PFunction p_batch_norm(f);
-    funcs_chain.push_back(p_batch_norm);
-
-
-    PVariable x_h;
-
     f->is_train = is_train;
-    x_h = p_batch_norm->forward(x);
-
-    if (is_train) {
-
-        float lam = lambda;
-        if (is_first){
-            lam = 0.0;
-            is_first = false;
-        }
-
-        cuMat current_mean(element_size, channel_num);
-        cuMat current_var(element_size, channel_num);
+    f->lambda = lambda;
+    f->is_first = &is_first;
+    f->is_checkpoint = is_checkpoint;
+    PFunction p_batch_norm(f);
+    record(p_batch_norm);
 
-        for(int i=0; i<channel_num; i++){
-            current_mean.memSetDeviceCol(f->rmu[i].mDevice, i);
-            current_var.memSetDeviceCol(f->var[i].mDevice, i);
-        }
-
-        x_mean->data = lam * x_mean->data + (1.0-lam) * current_mean;
-        x_var->data = lam * x_var->data  + (1.0-lam) * current_var;
-    }
+    // the running statistics are updated inside the function
+    PVariable x_h = p_batch_norm->forward(x);
 
+    if (is_train) is_first = false;
 
     return x_h;
 }
@@ -1616,11 +2174,15 @@ void BatchNorm::setTrainStatus(bool status) {
 void BatchNorm::toHostArray() {
     gamma->data.toHostArray();
     beta->data.toHostArray();
+    x_mean->data.toHostArray();
+    x_var->data.toHostArray();
 }
 
 void BatchNorm::fromHostArray() {
     gamma->data.fromHostArray();
     beta->data.fromHostArray();
+    x_mean->data.fromHostArray();
+    x_var->data.fromHostArray();
 }
 
 void BatchNorm::zero_grads() {
@@ -1656,6 +2218,8 @@ Conv2D::Conv2D(int batch_num, int channel_num, int w_size, int h_size, int filte
 Conv2D::~Conv2D() {
     delete w;
     delete b;
+    if (scale != NULL) delete scale;
+    if (shift != NULL) delete shift;
 }
 
 vector<Variable *> Conv2D::getParams(){
@@ -1666,17 +2230,69 @@ vector<Variable *> Conv2D::getParams(){
     return params;
 }
 
+vector<Variable *> Conv2D::getBuffers(){
+    vector<Variable *> buffers = getParams();
+    if (scale != NULL) {
+        buffers.push_back(scale);
+        buffers.push_back(shift);
+    }
+    if (int8.enabled) {
+        buffers.push_back(int8.w_scale);
+        buffers.push_back(int8.x_scale);
+    }
+
+    return buffers;
+}
+
+
+vector<cuMatInt8 *> Conv2D::getInt8Buffers(){
+    vector<cuMatInt8 *> buffers;
+    if (int8.enabled) buffers.push_back(&int8.wq);
+
+    return buffers;
+}
+
+void Conv2D::calibrate(bool status){
+    int8.calibrating = status;
+}
+
+bool Conv2D::quantize(){
+    if (int8.input_max == 0) return false;
+
+    int8.quantize(w);
+
+    return true;
+}
+
+void Conv2D::set_int8(bool status){
+    int8.enabled = status && int8.w_scale != NULL;
+}
 
 PVariable Conv2D::forward(PVariable x) {
 
+    if (int8.calibrating) int8.calibrate(x->data);
+
     // prepare function
-    FunctionConv2D *f = new FunctionConv2D(w, b, batch_num, channel_num, w_size, h_size, filter_size, filter_num,  stride, padding);
+    FunctionConv2D *f;
+    if (int8.enabled)
+        f = new FunctionConv2DInt8(&int8.wq, int8.w_scale, int8.x_scale, b, batch_num, channel_num, w_size, h_size,
+                                   filter_size, filter_num, stride, padding);
+    else
+        f = new FunctionConv2D(w, b, batch_num, channel_num, w_size, h_size, filter_size, filter_num,  stride, padding);
+    f->is_checkpoint = is_checkpoint;
     PFunction p_conv2d(f);
-    funcs_chain.push_back(p_conv2d);
+    record(p_conv2d);
 
 
-    return p_conv2d->forward(x);
+    PVariable r = p_conv2d->forward(x);
+
+    if (scale != NULL) {
+        PFunction p_scale_shift(new FunctionScaleShift(scale, shift));
+        record(p_scale_shift);
+        r = p_scale_shift->forward(r);
+    }
 
+    return r;
 }
 
 void Conv2D::zero_grads() {
@@ -1688,11 +2304,399 @@ void Conv2D::zero_grads() {
 void Conv2D::toHostArray() {
     w->data.toHostArray();
     b->data.toHostArray();
+    if (scale != NULL) {
+        scale->data.toHostArray();
+        shift->data.toHostArray();
+    }
 }
 
 void Conv2D::fromHostArray() {
     w->data.fromHostArray();
     b->data.fromHostArray();
+    if (scale != NULL) {
+        scale->data.fromHostArray();
+        shift->data.fromHostArray();
+    }
+}
+
+
+DepthwiseConv2D::DepthwiseConv2D() : Graph() {
+
+}
+
+DepthwiseConv2D::DepthwiseConv2D(int batch_num, int channel_num, int w_size, int h_size, int filter_size, int stride, int padding, int dilation) {
+
+    this->batch_num = batch_num;
+    this->channel_num = channel_num;
+    this->w_size = w_size;
+    this->h_size = h_size;
+    this->filter_size = filter_size;
+    this->stride = stride;
+    this->padding = padding;
+    this->dilation = dilation;
+
+    w = new Variable(channel_num, filter_size * filter_size);
+    //He-Normal, every filter sees one channel
+    w->randoms(0., sqrt(2.0/((float)filter_size*filter_size)));
+
+    b = new Variable(channel_num, 1);
+}
+DepthwiseConv2D::~DepthwiseConv2D() {
+    delete w;
+    delete b;
+}
+
+vector<Variable *> DepthwiseConv2D::getParams(){
+    vector<Variable *> params;
+    params.push_back(w);
+    params.push_back(b);
+
+    return params;
+}
+
+void DepthwiseConv2D::calibrate(bool status){
+    if (status) cout << "DepthwiseConv2D::calibrate: no int8 kernel, the layer stays float" << endl;
+}
+
+PVariable DepthwiseConv2D::forward(PVariable x) {
+
+    PFunction p_conv(new FunctionDepthwiseConv2D(w, b, batch_num, channel_num, w_size, h_size, filter_size, stride, padding, dilation));
+    record(p_conv);
+
+    return p_conv->forward(x);
+}
+
+void DepthwiseConv2D::zero_grads() {
+    w->zero_grad();
+    b->zero_grad();
+}
+
+void DepthwiseConv2D::toHostArray() {
+    w->data.toHostArray();
+    b->data.toHostArray();
+}
+
+void DepthwiseConv2D::fromHostArray() {
+    w->data.fromHostArray();
+    b->data.fromHostArray();
+}
+
+
+PointwiseConv2D::PointwiseConv2D() : Graph() {
+
+}
+
+PointwiseConv2D::PointwiseConv2D(int batch_num, int channel_num, int w_size, int h_size, int filter_num) {
+
+    this->batch_num = batch_num;
+    this->channel_num = channel_num;
+    this->w_size = w_size;
+    this->h_size = h_size;
+    this->filter_num = filter_num;
+
+    w = new Variable(filter_num, channel_num);
+    //He-Normal
+    w->randoms(0., sqrt(2.0/((float)channel_num)));
+
+    b = new Variable(filter_num, 1);
+}
+PointwiseConv2D::~PointwiseConv2D() {
+    delete w;
+    delete b;
+}
+
+vector<Variable *> PointwiseConv2D::getParams(){
+    vector<Variable *> params;
+    params.push_back(w);
+    params.push_back(b);
+
+    return params;
+}
+
+vector<Variable *> PointwiseConv2D::getBuffers(){
+    vector<Variable *> buffers = getParams();
+    if (int8.enabled) {
+        buffers.push_back(int8.w_scale);
+        buffers.push_back(int8.x_scale);
+    }
+
+    return buffers;
+}
+
+vector<cuMatInt8 *> PointwiseConv2D::getInt8Buffers(){
+    vector<cuMatInt8 *> buffers;
+    if (int8.enabled) buffers.push_back(&int8.wq);
+
+    return buffers;
+}
+
+void PointwiseConv2D::calibrate(bool status){
+    int8.calibrating = status;
+}
+
+bool PointwiseConv2D::quantize(){
+    if (int8.input_max == 0) return false;
+
+    // w is filter_num x channel_num, the weight of a 1x1 Conv2D
+    int8.quantize(w);
+
+    return true;
+}
+
+void PointwiseConv2D::set_int8(bool status){
+    int8.enabled = status && int8.w_scale != NULL;
+}
+
+PVariable PointwiseConv2D::forward(PVariable x) {
+
+    if (int8.calibrating) int8.calibrate(x->data);
+
+    Function *f;
+    if (int8.enabled)
+        f = new FunctionConv2DInt8(&int8.wq, int8.w_scale, int8.x_scale, b, batch_num, channel_num, w_size, h_size,
+                                   1, filter_num, 1, 0);
+    else
+        f = new FunctionPointwiseConv2D(w, b, batch_num, channel_num, w_size, h_size, filter_num);
+    PFunction p_conv(f);
+    record(p_conv);
+
+    return p_conv->forward(x);
+}
+
+void PointwiseConv2D::zero_grads() {
+    w->zero_grad();
+    b->zero_grad();
+}
+
+void PointwiseConv2D::toHostArray() {
+    w->data.toHostArray();
+    b->data.toHostArray();
+}
+
+void PointwiseConv2D::fromHostArray() {
+    w->data.fromHostArray();
+    b->data.fromHostArray();
+}
+
+
+GroupedConv2D::GroupedConv2D() : Graph() {
+
+}
+
+GroupedConv2D::GroupedConv2D(int batch_num, int channel_num, int w_size, int h_size, int filter_size, int filter_num, int groups,
+                             int stride, int padding, int dilation) {
+
+    // the group offsets of FunctionConv2D would run past x and w
+    if (channel_num % groups != 0 || filter_num % groups != 0){
+        stringstream message;
+        message << "GroupedConv2D: channel_num " << channel_num << " and filter_num " << filter_num
+                << " must be divisible by groups " << groups;
+        FatalError(message.str());
+    }
+
+    this->batch_num = batch_num;
+    this->channel_num = channel_num;
+    this->w_size = w_size;
+    this->h_size = h_size;
+    this->filter_size = filter_size;
+    this->filter_num = filter_num;
+    this->groups = groups;
+    this->stride = stride;
+    this->padding = padding;
+    this->dilation = dilation;
+
+    w = new Variable(filter_num, filter_size * filter_size * channel_num / groups);
+    //He-Normal
+    w->randoms(0., sqrt(2.0/((float)filter_size*filter_size * channel_num / groups)));
+
+    b = new Variable(filter_num, 1);
+}
+GroupedConv2D::~GroupedConv2D() {
+    delete w;
+    delete b;
+}
+
+vector<Variable *> GroupedConv2D::getParams(){
+    vector<Variable *> params;
+    params.push_back(w);
+    params.push_back(b);
+
+    return params;
+}
+
+vector<Variable *> GroupedConv2D::getBuffers(){
+    vector<Variable *> buffers = getParams();
+    if (int8.enabled) {
+        buffers.push_back(int8.w_scale);
+        buffers.push_back(int8.x_scale);
+    }
+
+    return buffers;
+}
+
+vector<cuMatInt8 *> GroupedConv2D::getInt8Buffers(){
+    vector<cuMatInt8 *> buffers;
+    if (int8.enabled) buffers.push_back(&int8.wq);
+
+    return buffers;
+}
+
+void GroupedConv2D::calibrate(bool status){
+    if (groups > 1) {
+        if (status) cout << "GroupedConv2D::calibrate: no int8 kernel for groups > 1, the layer stays float" << endl;
+        return;
+    }
+    int8.calibrating = status;
+}
+
+bool GroupedConv2D::quantize(){
+    if (int8.input_max == 0) return false;
+
+    int8.quantize(w);
+
+    return true;
+}
+
+void GroupedConv2D::set_int8(bool status){
+    int8.enabled = status && int8.w_scale != NULL;
+}
+
+PVariable GroupedConv2D::forward(PVariable x) {
+
+    if (int8.calibrating) int8.calibrate(x->data);
+
+    FunctionConv2D *f;
+    if (int8.enabled)
+        f = new FunctionConv2DInt8(&int8.wq, int8.w_scale, int8.x_scale, b, batch_num, channel_num, w_size, h_size,
+                                   filter_size, filter_num, stride, padding, dilation);
+    else
+        f = new FunctionConv2D(w, b, batch_num, channel_num, w_size, h_size, filter_size, filter_num, stride, padding,
+                               groups, dilation);
+    f->is_checkpoint = is_checkpoint;
+    PFunction p_conv2d(f);
+    record(p_conv2d);
+
+    return p_conv2d->forward(x);
+}
+
+void GroupedConv2D::zero_grads() {
+    w->zero_grad();
+    b->zero_grad();
+}
+
+void GroupedConv2D::toHostArray() {
+    w->data.toHostArray();
+    b->data.toHostArray();
+}
+
+void GroupedConv2D::fromHostArray() {
+    w->data.fromHostArray();
+    b->data.fromHostArray();
+}
+
+
+Attention::Attention() : Graph() {
+
+}
+
+Attention::Attention(int heads, bool scaled) : Graph() {
+    this->heads = heads;
+    this->scaled = scaled;
+}
+
+Attention::Attention(int attn_size, int query_size, int state_size) : Graph() {
+    additive = true;
+
+    w_q = new Variable(attn_size, query_size);
+    w_q->randoms(0., sqrt(1.0/((float)query_size)));
+
+    w_k = new Variable(attn_size, state_size);
+    w_k->randoms(0., sqrt(1.0/((float)state_size)));
+
+    v = new Variable(attn_size, 1);
+    v->randoms(0., sqrt(1.0/((float)attn_size)));
+}
+
+Attention::~Attention() {
+    if (w_q != NULL) delete w_q;
+    if (w_k != NULL) delete w_k;
+    if (v != NULL) delete v;
+}
+
+vector<Variable *> Attention::getParams(){
+    vector<Variable *> params;
+    if (additive) {
+        params.push_back(w_q);
+        params.push_back(w_k);
+        params.push_back(v);
+    }
+
+    return params;
+}
+
+PVariable Attention::stack(vector<PVariable> &states) {
+
+    PFunction p_concat(new FunctionConcat());
+    record(p_concat);
+
+    return p_concat->forward(states);
+}
+
+PVariable Attention::forward(PVariable q, PVariable states) {
+
+    PVariable keys = states;
+    float scale = 1.0;
+
+    if (additive) {
+        PFunction p_q(new FunctionLinear(w_q));
+        PFunction p_k(new FunctionLinear(w_k));
+        record(p_q);
+        record(p_k);
+
+        q = p_q->forward(q);
+        keys = p_k->forward(states);
+    }
+    else if (scaled) {
+        scale = 1.0 / sqrt((float)(q->data.rows / heads));
+    }
+
+    // the kernels index states by the shape of q
+    if (q->data.rows != keys->data.rows || keys->data.cols % q->data.cols != 0
+        || (!additive && q->data.rows % heads != 0)) {
+        stringstream message;
+        message << "Attention: query " << q->data.rows << "x" << q->data.cols << " does not match states "
+                << keys->data.rows << "x" << keys->data.cols << " with " << heads << " heads";
+        FatalError(message.str());
+    }
+
+    PFunction p_attention(new FunctionAttention(additive ? 1 : heads, scale, additive ? v : NULL));
+    record(p_attention);
+
+    return p_attention->forward(q, keys, states);
+}
+
+void Attention::zero_grads() {
+    if (additive) {
+        w_q->zero_grad();
+        w_k->zero_grad();
+        v->zero_grad();
+    }
+}
+
+void Attention::toHostArray() {
+    if (additive) {
+        w_q->data.toHostArray();
+        w_k->data.toHostArray();
+        v->data.toHostArray();
+    }
+}
+
+void Attention::fromHostArray() {
+    if (additive) {
+        w_q->data.fromHostArray();
+        w_k->data.fromHostArray();
+        v->data.fromHostArray();
+    }
 }
 
 
@@ -1713,7 +2717,7 @@ PVariable Pooling::forward(PVariable x){
     FunctionPooling *f = new FunctionPooling(width, height, depth, windowWidth, windowHeight,  stride, padding);
 
     PFunction p_pooling(f);
-    funcs_chain.push_back(p_pooling);
+    record(p_pooling);
 
 
     return p_pooling->forward(x);
@@ -3,9 +3,14 @@
 
 #include <random>
 #include <vector>
+#include <typeinfo>
+#include <algorithm>
 
 #include <boost/serialization/export.hpp>
 #include <boost/serialization/serialization.hpp>
+#include <boost/serialization/version.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
 
 #include "function.h"
 
@@ -17,16 +22,40 @@ public:
 
     vector<PFunction > funcs_chain;
 
+    // drop the saved intermediates of this layer and recompute them in backward
+    bool is_checkpoint = false;
+
+    // recurrent layers: lengths of the sequences in the batch columns, longest first,
+    // empty when all run every step. step counts the per step forwards since reset_state.
+    vector<int> lengths;
+    int step = 0;
+
     Graph();
     virtual ~Graph();
 
     virtual vector<Variable *> getParams();
+    // every tensor a checkpoint stores, the params plus running statistics and the like
+    virtual vector<Variable *> getBuffers();
+    virtual vector<cuMatInt8 *> getInt8Buffers();
+
+    // int8 inference (Model::calibrate/quantize/set_int8), quantize() is true if the layer switched
+    virtual void calibrate(bool status);
+    virtual bool quantize();
+    virtual void set_int8(bool status);
+
+    // pruning and BSR weights (Pruner, Model::sparsify/set_sparse), prune() is false without a mask
+    virtual bool prune(float sparsity, int block);
+    virtual bool sparsify();
+    virtual void set_sparse(bool status);
+
+    virtual void set_mixed_precision(bool status, int dtype);
 
     virtual void toHostArray();
     virtual void fromHostArray();
 
     void init();
     void remove_chain();
+    void record(PFunction f);
 
     virtual PVariable forward(PVariable input);
     virtual PVariable forward(PVariable x, PVariable t);
@@ -34,6 +63,13 @@ public:
     virtual void zero_grads();
     virtual void reset_state();
 
+    void setCheckpoint(bool status);
+
+    void setLengths(vector<int> lengths);
+    int activeColumns(int t, int batch);
+    vector<int> batchSizes(int seq_len);
+    PVariable maskState(PVariable h, PVariable h_prev, bool next_step = true);
+
 private:
     friend class boost::serialization::access;
 
@@ -42,6 +78,54 @@ private:
 
 
 
+/**
+ * int8 weights of a Linear or convolution for inference (Model::quantize). While calibrating
+ * the layer records the largest |input| it sees, quantize() sets the input scale from it
+ * and quantizes w with one scale per output row. enabled switches the layer between the
+ * int8 and the float path.
+ */
+class Int8Weights {
+public:
+
+    bool calibrating = false;
+    float input_max = 0;
+
+    bool enabled = false;
+
+    cuMatInt8 wq;
+    Variable *w_scale = NULL;
+    Variable *x_scale = NULL;
+
+    ~Int8Weights();
+
+    void calibrate(cuMat &x);
+    void quantize(Variable *w);
+};
+
+
+/**
+ * Pruning mask of a Linear, driven by a Pruner: prune() zeroes the fraction sparsity of
+ * the weights with the smallest magnitude, single weights (block 1) or block x block
+ * blocks by their L2 norm, and apply() keeps them zero after an update. sparsify() stores
+ * the pruned weights as BSR for inference, enabled switches between the BSR and the dense
+ * path.
+ */
+class PrunedWeights {
+public:
+
+    cuMat mask;
+    float sparsity = 0;
+    int block = 1;
+
+    bool enabled = false;
+    cuMatBsr bsr;
+
+    void prune(Variable *w, float sparsity, int block);
+    void apply(Variable *w);
+    bool sparsify(Variable *w);
+};
+
+
 class Linear : public Graph {
 
 private:
@@ -64,6 +148,13 @@ public:
     bool noBias = false;
     bool isTranpose = false;
 
+    Int8Weights int8;
+    PrunedWeights pruned;
+
+    // mixed precision: the GEMMs use the 16 bit copy wh of w (Model::set_mixed_precision)
+    bool mixed = false;
+    cuMatHalf wh;
+
 
     Linear();
 
@@ -74,6 +165,18 @@ public:
     ~Linear();
 
     vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
+    vector<cuMatInt8 *> getInt8Buffers();
+
+    void calibrate(bool status);
+    bool quantize();
+    void set_int8(bool status);
+
+    bool prune(float sparsity, int block);
+    bool sparsify();
+    void set_sparse(bool status);
+
+    void set_mixed_precision(bool status, int dtype);
 
     PVariable forward(PVariable v);
 
@@ -120,6 +223,7 @@ public:
     ~SparseLinear();
 
     vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
 
     PVariable forward(PVariable v);
 
@@ -342,6 +446,48 @@ private:
 
 };
 
+/**
+ * Embedding layer: x (1 x B) holds token ids as floats, the result is embed_size x B.
+ * Only the rows (columns of w) of the ids in the batch receive a gradient and the
+ * optimizers update only those (see Variable::isSparseGrad).
+ */
+class Embedding : public Graph {
+public:
+
+    int embed_size = 0;
+    int vocab_size = 0;
+
+    Variable *w = NULL;     // embed_size x vocab_size
+
+    Embedding();
+    Embedding(int embed_size, int vocab_size);
+    ~Embedding();
+
+    vector<Variable *> getParams();
+
+    PVariable forward(PVariable x);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & w;
+        ar & embed_size;
+        ar & vocab_size;
+
+        // not archived
+        w->isSparseGrad = true;
+    }
+
+};
+
+
 class LSTM : public Graph {
 public:
 
@@ -368,6 +514,8 @@ public:
 
     ~LSTM();
 
+    vector<Variable *> getParams();
+
     PVariable forward(PVariable x);
 
 
@@ -395,6 +543,56 @@ private:
 };
 
 
+/**
+ * LSTM over a whole sequence in one function (see FunctionSequenceLSTM).
+ * x is [input_size x seq_len*batch], step t in columns t*batch..(t+1)*batch,
+ * and the result holds the hidden state of every step in the same layout.
+ * After setLengths the padded steps are skipped.
+ */
+class SequenceLSTM : public Graph {
+public:
+
+    int input_size = 0;
+    int output_size = 0;
+    int seq_len = 0;
+
+    Variable *x_w, *x_b;
+    Variable *h_w, *h_b;
+
+
+    SequenceLSTM();
+    SequenceLSTM(int output_size, int input_size, int seq_len);
+
+    ~SequenceLSTM();
+
+    vector<Variable *> getParams();
+
+    PVariable forward(PVariable x);
+
+    void setSeqLen(int seq_len);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & x_w;
+        ar & x_b;
+        ar & h_w;
+        ar & h_b;
+        ar & input_size;
+        ar & output_size;
+        ar & seq_len;
+    }
+
+};
+
+
 class FullLSTM : public Graph {
 public:
 
@@ -437,6 +635,8 @@ public:
 
     ~FullLSTM();
 
+    vector<Variable *> getParams();
+
     PVariable forward(PVariable x);
 
 
@@ -524,6 +724,7 @@ public:
     ~FullLSTM2();
 
     vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
 
     PVariable forward(PVariable x);
 
@@ -595,6 +796,67 @@ private:
 
 
 
+/**
+ * Peephole LSTM in one fused function per step (see FunctionPeepholeLSTM).
+ * Unlike FullLSTM2 the peepholes are diagonal (one weight per cell) and the gates are
+ * projected with two GEMMs. With layer_norm the four gate blocks are layer normalized,
+ * which replaces the per step batch normalization of FullLSTM2.
+ */
+class PeepholeLSTM : public Graph {
+public:
+
+
+    int id = 0;
+    int last_opt = 0;
+    bool is_last_backward = false;
+
+    int input_size = 0;
+    int output_size = 0;
+
+    bool layer_norm = false;
+
+    Variable *w_x, *w_h, *b;    // [i f g o], 4*output_size rows
+    Variable *peep;             // [p_i p_f p_o]
+    Variable *ln_gamma, *ln_beta;
+
+    PVariable c;
+    PVariable h;
+
+
+    PeepholeLSTM();
+    PeepholeLSTM(int output_size, int input_size, bool layer_norm = false);
+
+    ~PeepholeLSTM();
+
+    vector<Variable *> getParams();
+
+    PVariable forward(PVariable x);
+
+    void reset_state();
+    void zero_grads();
+
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & w_x;
+        ar & w_h;
+        ar & b;
+        ar & peep;
+        ar & ln_gamma;
+        ar & ln_beta;
+        ar & input_size;
+        ar & output_size;
+        ar & layer_norm;
+    }
+
+};
+
 class GRU : public Graph {
 public:
 
@@ -614,8 +876,6 @@ public:
 
     PVariable h;
 
-    PVariable ones;
-
     GRU();
     GRU(int output_size, int input_size);
 
@@ -655,6 +915,54 @@ private:
 };
 
 
+/**
+ * GRU over a whole sequence in one function (see FunctionSequenceGRU),
+ * same input/output layout as SequenceLSTM.
+ */
+class SequenceGRU : public Graph {
+public:
+
+    int input_size = 0;
+    int output_size = 0;
+    int seq_len = 0;
+
+    Variable *w_x, *b_x;    // [r z g] input weights, 3*output_size rows
+    Variable *w_h, *b_h;    // [r z g] recurrent weights
+
+
+    SequenceGRU();
+    SequenceGRU(int output_size, int input_size, int seq_len);
+
+    ~SequenceGRU();
+
+    vector<Variable *> getParams();
+
+    PVariable forward(PVariable x);
+
+    void setSeqLen(int seq_len);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & w_x;
+        ar & b_x;
+        ar & w_h;
+        ar & b_h;
+        ar & input_size;
+        ar & output_size;
+        ar & seq_len;
+    }
+
+};
+
+
 class BatchNorm : public Graph {
 public:
 
@@ -675,6 +983,7 @@ public:
     ~BatchNorm();
 
     vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
 
     PVariable forward(PVariable x);
 
@@ -711,7 +1020,19 @@ public:
     Variable *w = NULL;
     Variable *b = NULL;
 
+    // per output row scale/shift of a folded BatchNorm (Model::fold_batch_norm), NULL otherwise
+    Variable *scale = NULL;
+    Variable *shift = NULL;
+
+    Int8Weights int8;
+
     vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
+    vector<cuMatInt8 *> getInt8Buffers();
+
+    void calibrate(bool status);
+    bool quantize();
+    void set_int8(bool status);
 
 
     Conv2D();
@@ -742,8 +1063,219 @@ private:
         ar & filter_num;
             ar & stride;
             ar & padding;
+
+        if (version > 0) {
+            ar & scale;
+            ar & shift;
+        }
+    }
+
+};
+
+BOOST_CLASS_VERSION(Conv2D, 1)
+
+
+/**
+ * Depthwise convolution: channel c of the output is channel c of x convolved with its own filter.
+ * The output is channel_num x outputDim^2 per image.
+ */
+class DepthwiseConv2D : public Graph {
+public:
+
+    int batch_num, channel_num, w_size, h_size, filter_size, stride, padding, dilation;
+
+    Variable *w = NULL;
+    Variable *b = NULL;
+
+    vector<Variable *> getParams();
+
+    // no int8 kernel, calibrate(true) says so and the layer stays float
+    void calibrate(bool status);
+
+    DepthwiseConv2D();
+    DepthwiseConv2D(int batch_num, int channel_num, int w_size, int h_size, int filter_size, int stride, int padding, int dilation = 1);
+    ~DepthwiseConv2D();
+
+    PVariable forward(PVariable x);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & w;
+        ar & b;
+
+        ar & batch_num;
+        ar & channel_num;
+        ar & w_size;
+        ar & h_size;
+        ar & filter_size;
+        ar & stride;
+        ar & padding;
+        ar & dilation;
+    }
+};
+
+
+/**
+ * 1x1 convolution mixing the channels of every pixel, the pointwise half of a depthwise separable convolution.
+ */
+class PointwiseConv2D : public Graph {
+public:
+
+    int batch_num, channel_num, w_size, h_size, filter_num;
+
+    Variable *w = NULL;
+    Variable *b = NULL;
+
+    Int8Weights int8;
+
+    vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
+    vector<cuMatInt8 *> getInt8Buffers();
+
+    // int8 runs as a 1x1 FunctionConv2DInt8
+    void calibrate(bool status);
+    bool quantize();
+    void set_int8(bool status);
+
+    PointwiseConv2D();
+    PointwiseConv2D(int batch_num, int channel_num, int w_size, int h_size, int filter_num);
+    ~PointwiseConv2D();
+
+    PVariable forward(PVariable x);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & w;
+        ar & b;
+
+        ar & batch_num;
+        ar & channel_num;
+        ar & w_size;
+        ar & h_size;
+        ar & filter_num;
+    }
+};
+
+
+/**
+ * Conv2D with the channels and filters split into groups, filter g*filter_num/groups.. only sees
+ * channels g*channel_num/groups.. . Both counts must be divisible by groups.
+ */
+class GroupedConv2D : public Graph {
+public:
+
+    int batch_num, channel_num, w_size, h_size, filter_size, filter_num, groups, stride, padding, dilation;
+
+    Variable *w = NULL;
+    Variable *b = NULL;
+
+    Int8Weights int8;
+
+    vector<Variable *> getParams();
+    vector<Variable *> getBuffers();
+    vector<cuMatInt8 *> getInt8Buffers();
+
+    // int8 only for groups == 1, FunctionConv2DInt8 has no group offsets
+    void calibrate(bool status);
+    bool quantize();
+    void set_int8(bool status);
+
+    GroupedConv2D();
+    GroupedConv2D(int batch_num, int channel_num, int w_size, int h_size, int filter_size, int filter_num, int groups,
+                  int stride, int padding, int dilation = 1);
+    ~GroupedConv2D();
+
+    PVariable forward(PVariable x);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & w;
+        ar & b;
+
+        ar & batch_num;
+        ar & channel_num;
+        ar & w_size;
+        ar & h_size;
+        ar & filter_size;
+        ar & filter_num;
+        ar & groups;
+        ar & stride;
+        ar & padding;
+        ar & dilation;
     }
+};
+
 
+/**
+ * Attention of a query over the hidden states of a sequence, the states stacked into one
+ * [H x T*B] variable with stack(). Scaled dot-product (optionally split into heads) or
+ * additive (Bahdanau) scoring with its own w_q, w_k and v.
+ */
+class Attention : public Graph {
+public:
+
+    int heads = 1;
+    bool scaled = true;
+    bool additive = false;
+
+    Variable *w_q = NULL;
+    Variable *w_k = NULL;
+    Variable *v = NULL;
+
+    vector<Variable *> getParams();
+
+    Attention();
+    Attention(int heads, bool scaled = true);
+    Attention(int attn_size, int query_size, int state_size);
+    ~Attention();
+
+    PVariable stack(vector<PVariable> &states);
+    PVariable forward(PVariable q, PVariable states);
+
+    void zero_grads();
+
+    void toHostArray();
+    void fromHostArray();
+
+private:
+    friend class boost::serialization::access;
+    template<class Archive> void serialize(Archive & ar, const unsigned int version) {
+
+        ar & boost::serialization::base_object<Graph>(*this);
+        ar & heads;
+        ar & scaled;
+        ar & additive;
+
+        if (additive) {
+            ar & w_q;
+            ar & w_k;
+            ar & v;
+        }
+    }
 };
 
 
@@ -778,4 +1310,105 @@ public:
 };
 
 
+/**
+ * The Graph types a Model can hold. REGISTER_GRAPH(T, order) marks T at compile time
+ * (GraphTraits<T>, checked by Model::putG) and adds it to the types Model::save/load
+ * register with the boost archive. The archive numbers the types in registration order,
+ * so order fixes it: a new graph takes the next free number and keeps it once models are
+ * saved with it. Params, buffers and host copies go through the virtual Graph methods.
+ */
+template<class T> struct GraphTraits {
+    static const bool registered = false;
+};
+
+class GraphRegistry {
+public:
+
+    struct Entry {
+        int order;
+        const char *name;
+        const type_info *type;
+        void (*save)(boost::archive::binary_oarchive &);
+        void (*load)(boost::archive::binary_iarchive &);
+    };
+
+    static vector<Entry> &entries(){
+        static vector<Entry> list;
+        return list;
+    }
+
+    // every translation unit registers the types it sees, the first one adds them
+    template<class T> static bool add(int order, const char *name){
+        vector<Entry> &list = entries();
+        for (Entry &e : list) {
+            if (e.order != order) continue;
+            if (*e.type != typeid(T)) cout << "REGISTER_GRAPH: " << name << " and " << e.name << " both use " << order << endl;
+            return false;
+        }
+
+        Entry entry = {order, name, &typeid(T), &register_type<T, boost::archive::binary_oarchive>,
+                       &register_type<T, boost::archive::binary_iarchive>};
+        auto it = find_if(list.begin(), list.end(), [order](const Entry &e){ return e.order > order; });
+        list.insert(it, entry);
+        return true;
+    }
+
+    static bool registered(const type_info &type){
+        for (Entry &e : entries()) {
+            if (*e.type == type) return true;
+        }
+        return false;
+    }
+
+    static void register_types(boost::archive::binary_oarchive &ar){
+        for (Entry &e : entries()) e.save(ar);
+    }
+
+    static void register_types(boost::archive::binary_iarchive &ar){
+        for (Entry &e : entries()) e.load(ar);
+    }
+
+private:
+
+    template<class T, class Archive> static void register_type(Archive &ar){
+        ar.template register_type<T>();
+    }
+};
+
+#define REGISTER_GRAPH(T, order) \
+    template<> struct GraphTraits<T> { static const bool registered = true; }; \
+    static const bool graph_registered_##T = GraphRegistry::add<T>(order, #T);
+
+// the order of the register_type calls of the archives saved so far
+REGISTER_GRAPH(Linear, 0)
+REGISTER_GRAPH(LSTM, 1)
+REGISTER_GRAPH(FullLSTM, 2)
+REGISTER_GRAPH(FullLSTM2, 3)
+REGISTER_GRAPH(GRU, 4)
+REGISTER_GRAPH(Tanh, 5)
+REGISTER_GRAPH(ReLU, 6)
+REGISTER_GRAPH(Dropout, 7)
+REGISTER_GRAPH(SoftmaxCrossEntropy, 8)
+REGISTER_GRAPH(Softmax, 9)
+REGISTER_GRAPH(MeanSquaredError, 10)
+REGISTER_GRAPH(Plus, 11)
+REGISTER_GRAPH(BatchNorm, 12)
+REGISTER_GRAPH(Conv2D, 13)
+REGISTER_GRAPH(Pooling, 14)
+REGISTER_GRAPH(PReLU, 15)
+REGISTER_GRAPH(SequenceLSTM, 16)
+REGISTER_GRAPH(SequenceGRU, 17)
+REGISTER_GRAPH(PeepholeLSTM, 18)
+REGISTER_GRAPH(Identity, 19)
+REGISTER_GRAPH(Embedding, 20)
+REGISTER_GRAPH(DepthwiseConv2D, 21)
+REGISTER_GRAPH(PointwiseConv2D, 22)
+REGISTER_GRAPH(GroupedConv2D, 23)
+REGISTER_GRAPH(Attention, 24)
+REGISTER_GRAPH(SparseLinear, 25)
+REGISTER_GRAPH(Sigmoid, 26)
+REGISTER_GRAPH(Sqrt, 27)
+REGISTER_GRAPH(Inverse, 28)
+
+
 #endif //GRAPH_H
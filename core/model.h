@@ -8,8 +8,12 @@
 #define FUNCTION_SET_H_
 
 #include <typeinfo>
+#include <cmath>
 #include <vector>
 #include <map>
+#include <set>
+#include <functional>
+#include <type_traits>
 
 #include <fstream>
 #include <boost/serialization/serialization.hpp>
@@ -33,6 +37,89 @@ public:
     }
 };
 
+/**
+ * All dense parameters packed into one device buffer and their gradients into another,
+ * each Variable's data and grad become views (cuMat::view_of) into them. param is the
+ * whole buffer as a size x 1 Variable, so an optimizer step, gradient clipping, zeroing
+ * or an all-reduce of the gradients is one call over param instead of one per tensor.
+ */
+class FlatBuffer {
+public:
+    Variable *param = NULL;
+    vector<Variable *> vars;
+    vector<int> offsets;
+
+    // what an optimizer updates: param plus the parameters that were not packed
+    vector<UpdateParams *> updateParams;
+
+    // every tensor starts at a multiple of 32 floats (128 bytes)
+    static const int ALIGN = 32;
+
+    ~FlatBuffer(){
+        unpack();
+    }
+
+    int size(){
+        return param == NULL ? 0 : param->data.rows;
+    }
+
+    void pack(vector<Variable *> &dense, vector<Variable *> &others){
+        unpack();
+        if (dense.empty()) return;
+
+        int n = 0;
+        for (Variable *v : dense){
+            offsets.push_back(n);
+            n += (v->data.rows * v->data.cols + ALIGN - 1) / ALIGN * ALIGN;
+        }
+        param = new Variable(n, 1);
+        vars = dense;
+
+        for (int i = 0; i < vars.size(); i++){
+            Variable *v = vars[i];
+            int rows = v->data.rows, cols = v->data.cols;
+
+            cudaMemcpy(param->data.mDevice + offsets[i], v->data.mDevice,
+                       rows * cols * sizeof(float), cudaMemcpyDeviceToDevice);
+            if (v->grad.mDevice != NULL){
+                cudaMemcpy(param->grad.mDevice + offsets[i], v->grad.mDevice,
+                           rows * cols * sizeof(float), cudaMemcpyDeviceToDevice);
+            }
+            v->data.view_of(param->data.mDevice + offsets[i], rows, cols);
+            v->grad.view_of(param->grad.mDevice + offsets[i], rows, cols);
+        }
+
+        UpdateParams *p = new UpdateParams();
+        p->add(param);
+        updateParams.push_back(p);
+        for (Variable *v : others){
+            p = new UpdateParams();
+            p->add(v);
+            updateParams.push_back(p);
+        }
+    }
+
+    // every parameter gets its own memory again
+    void unpack(){
+        for (Variable *v : vars){
+            cuMat data = v->data;
+            cuMat grad = v->grad;
+            v->data.release();
+            v->grad.release();
+            v->data = data;
+            v->grad = grad;
+        }
+        vars.clear();
+        offsets.clear();
+
+        for (int i=0; i<updateParams.size(); i++) delete updateParams.at(i);
+        updateParams.clear();
+
+        delete param;
+        param = NULL;
+    }
+};
+
 class Model {
 private:
 
@@ -47,172 +134,122 @@ public:
     map<string, Graph *> graphs;
     vector<UpdateParams *> updateParams;
 
+    // parameters packed by flatten()
+    FlatBuffer flat;
+
+    // changes whenever the UpdateParams handed to optimizers may be rebuilt or deleted
+    int params_version = 0;
+
+    // graphs whose weights lazy_loader reads on their first G() (load_checkpoint_lazy)
+    set<string> pending;
+    function<void(const string &, Graph *)> lazy_loader;
+
     ~Model(){
         for (int i=0; i<updateParams.size(); i++){
             delete updateParams.at(i);
         }
     }
 
-    void putG(string name, Graph *f){
+    // the graph type has to be registered (REGISTER_GRAPH) to be saved, loaded and trained
+    template<class T> void putG(string name, T *f){
+        static_assert(is_same<T, Graph>::value || GraphTraits<T>::registered,
+                      "putG: REGISTER_GRAPH the graph type (see graph.h)");
+        if (is_same<T, Graph>::value && !GraphRegistry::registered(typeid(*f)))
+            cout << "putG: " << name << " has an unregistered graph type" << endl;
+
         graphs[name] = f;
+        params_version++;
     }
     Graph *G(string name){
-        return graphs.at(name);
+        Graph *g = graphs.at(name);
+        if (!pending.empty() && pending.erase(name)) lazy_loader(name, g);
+        return g;
     }
 
-    vector<UpdateParams *> &getUpdateParams(){
-        for(auto gs : graphs){
-            Graph *g = gs.second;
-
-            const type_info& id = typeid(*g);
-
-            if (typeid(Linear) == id){
-                UpdateParams *p = new UpdateParams();
-                Variable *w = ((Linear *)g)->w;
-                p->add(w);
-                if (!((Linear *)g)->noBias){
-                    Variable *b = ((Linear *)g)->b;
-                    p->add(b);
-                }
-                updateParams.push_back(p);
-
-            } else if (typeid(LSTM) == id){
-
-                UpdateParams *p = new UpdateParams();
-                LSTM *lstm = (LSTM *)g;
-
-                p->add(lstm->x_w);
-                p->add(lstm->x_b);
-                p->add(lstm->h_w);
-                p->add(lstm->h_b);
-
-                updateParams.push_back(p);
-
-            } else if (typeid(FullLSTM) == id) {
-
-                UpdateParams *p = new UpdateParams();
-                FullLSTM *lstm = (FullLSTM *) g;
-
-                p->add(lstm->f_c_w);
-                p->add(lstm->f_h_w);
-                p->add(lstm->f_x_w);
-                p->add(lstm->f_x_b);
-                p->add(lstm->i_c_w);
-                p->add(lstm->i_h_w);
-                p->add(lstm->i_x_w);
-                p->add(lstm->i_x_b);
-                p->add(lstm->o_c_w);
-                p->add(lstm->o_h_w);
-                p->add(lstm->o_x_w);
-                p->add(lstm->o_x_b);
-                p->add(lstm->g_h_w);
-                p->add(lstm->g_x_w);
-                p->add(lstm->g_x_b);
-
-                updateParams.push_back(p);
-
-            }else if (typeid(FullLSTM2) == id){
-
-                UpdateParams *p = new UpdateParams();
-                FullLSTM2 *lstm = (FullLSTM2 *)g;
-
-                p->add(lstm->f_c_w); p->add(lstm->f_h_w); p->add(lstm->f_x_w); p->add(lstm->f_x_b);
-                p->add(lstm->i_c_w); p->add(lstm->i_h_w); p->add(lstm->i_x_w); p->add(lstm->i_x_b);
-                p->add(lstm->o_c_w); p->add(lstm->o_h_w); p->add(lstm->o_x_w); p->add(lstm->o_x_b);
-                p->add(lstm->g_h_w); p->add(lstm->g_x_w); p->add(lstm->g_x_b);
-
-                p->add(lstm->gamma_f); p->add(lstm->beta_f);
-                p->add(lstm->gamma_i); p->add(lstm->beta_i);
-                p->add(lstm->gamma_g); p->add(lstm->beta_g);
-                p->add(lstm->gamma_o); p->add(lstm->beta_o);
-
-                updateParams.push_back(p);
-
-            } else if (typeid(GRU) == id) {
-
-                UpdateParams *p = new UpdateParams();
-                GRU *lstm = (GRU *) g;
-
-                p->add(lstm->u_g); p->add(lstm->u_r); p->add(lstm->u_z);
-                p->add(lstm->w_g); p->add(lstm->w_r); p->add(lstm->w_z);
-                p->add(lstm->b_g); p->add(lstm->b_r); p->add(lstm->b_z);
-
-                updateParams.push_back(p);
-            } else if (typeid(BatchNorm) == id){
-                UpdateParams *p = new UpdateParams();
-                BatchNorm *batch_norm = (BatchNorm *) g;
-
-                p->add(batch_norm->gamma); p->add(batch_norm->beta);
-
-                updateParams.push_back(p);
-            } else if (typeid(Conv2D) == id){
-                UpdateParams *p = new UpdateParams();
-                Conv2D *conv2d = (Conv2D *) g;
-
-                p->add(conv2d->w); p->add(conv2d->b);
+    // reads the weights of the graphs still pending, for the paths that go over all graphs
+    void load_pending(){
+        while (!pending.empty()) G(*pending.begin());
+    }
 
-                updateParams.push_back(p);
-            }else if (typeid(PReLU) == id){
-                UpdateParams *p = new UpdateParams();
-                PReLU *prelu = (PReLU *) g;
+    vector<UpdateParams *> &getUpdateParams(){
+        // a weight shared by two graphs (e.g. a transposed Linear) is updated once
+        set<Variable *> seen;
 
-                p->add(prelu->a);
+        load_pending();
 
-                updateParams.push_back(p);
+        // rebuilt in place, an optimizer holding the UpdateParams of an earlier call sees
+        // params_version change if they do not stay the same
+        int n = 0;
+        bool changed = false;
+        for(auto gs : graphs){
+            vector<Variable *> params = gs.second->getParams();
+            if (params.empty()) continue;
+
+            if (n == updateParams.size()) updateParams.push_back(new UpdateParams());
+            UpdateParams *p = updateParams.at(n++);
+            vector<Variable *> prev = p->params;
+            p->params.clear();
+            for (Variable *v : params) {
+                if (seen.insert(v).second) p->add(v);
             }
-
-
+            if (p->params != prev) changed = true;
         }
+        while (updateParams.size() > n){
+            delete updateParams.back();
+            updateParams.pop_back();
+            changed = true;
+        }
+        if (changed) params_version++;
         return updateParams;
     }
 
-
-    void save(string path){
-        for(auto gs : graphs){
-            Graph *g = gs.second;
-
-            const type_info& id = typeid(*g);
-
-            if (typeid(Linear) == id){
-                ((Linear *)g)->toHostArray();
-            } else if (typeid(LSTM) == id){
-                ((LSTM *)g)->toHostArray();
-            } else if (typeid(FullLSTM) == id) {
-                ((FullLSTM *) g)->toHostArray();
-            }else if (typeid(FullLSTM2) == id){
-                ((FullLSTM2 *)g)->toHostArray();
-            } else if (typeid(GRU) == id){
-                ((GRU *)g)->toHostArray();
-            } else if (typeid(BatchNorm) == id){
-                ((BatchNorm *)g)->toHostArray();
-            } else if (typeid(Conv2D) == id){
-                ((Conv2D *)g)->toHostArray();
-            }else if (typeid(PReLU) == id) {
-                ((PReLU *) g)->toHostArray();
+    /**
+     * Packs all dense parameters into one contiguous buffer and their gradients into
+     * another (see FlatBuffer), returns the number of packed parameters. Parameters with a
+     * sparse gradient stay separate. Optimizers initialized afterwards update the packed
+     * parameters with one kernel per step; call it again after the parameters change
+     * (fold_batch_norm, putG) and initialize the optimizer again. set_flat(false) unpacks.
+     * An optimizer initialized before flatten() stops in update() until init() is called.
+     */
+    int flatten(){
+        vector<Variable *> dense, others;
+        flat.unpack();
+
+        for (UpdateParams *p : getUpdateParams()){
+            for (Variable *v : p->params){
+                if (v->isSparse || v->isSparseGrad || v->data.mDevice == NULL) others.push_back(v);
+                else dense.push_back(v);
             }
+        }
+        flat.pack(dense, others);
+        params_version++;
+        return dense.size();
+    }
 
+    void set_flat(bool status){
+        if (status) flatten();
+        else if (flat.param != NULL) {
+            flat.unpack();
+            params_version++;
+        }
+    }
 
+    // the parameters an optimizer updates, packed if flatten() was called
+    vector<UpdateParams *> &getOptimizerParams(){
+        if (flat.param != NULL) return flat.updateParams;
+        return getUpdateParams();
+    }
 
+
+    void save(string path){
+        load_pending();
+        for(auto gs : graphs){
+            gs.second->toHostArray();
         }
 
         std::ofstream ofs(path);
         boost::archive::binary_oarchive oa(ofs);
-        oa.register_type<Linear>(); // add if you define new function
-        oa.register_type<LSTM>(); // add if you define new function
-        oa.register_type<FullLSTM>(); // add if you define new function
-        oa.register_type<FullLSTM2>(); // add if you define new function
-        oa.register_type<GRU>(); // add if you define new function
-        oa.register_type<Tanh>(); // add if you define new function
-        oa.register_type<ReLU>(); // add if you define new function
-        oa.register_type<Dropout>(); // add if you define new function
-        oa.register_type<SoftmaxCrossEntropy>(); // add if you define new function
-        oa.register_type<Softmax>(); // add if you define new function
-        oa.register_type<MeanSquaredError>(); // add if you define new function
-        oa.register_type<Plus>(); // add if you define new function
-        oa.register_type<BatchNorm>(); // add if you define new function
-        oa.register_type<Conv2D>(); // add if you define new function
-        oa.register_type<Pooling>(); // add if you define new function
-        oa.register_type<PReLU>(); // add if you define new function
+        GraphRegistry::register_types(oa);
 
         oa << *this;
 
@@ -223,51 +260,14 @@ public:
         std::ifstream ifs(path);
         boost::archive::binary_iarchive ia(ifs);
 
-        ia.register_type<Linear>(); // add if you define new function
-        ia.register_type<LSTM>(); // add if you define new function
-        ia.register_type<FullLSTM>(); // add if you define new function
-        ia.register_type<FullLSTM2>(); // add if you define new function
-        ia.register_type<GRU>(); // add if you define new function
-        ia.register_type<Tanh>(); // add if you define new function
-        ia.register_type<ReLU>(); // add if you define new function
-        ia.register_type<Dropout>(); // add if you define new function
-        ia.register_type<SoftmaxCrossEntropy>(); // add if you define new function
-        ia.register_type<Softmax>(); // add if you define new function
-        ia.register_type<MeanSquaredError>(); // add if you define new function
-        ia.register_type<Plus>(); // add if you define new function
-        ia.register_type<BatchNorm>(); // add if you define new function
-        ia.register_type<Conv2D>(); // add if you define new function
-        ia.register_type<Pooling>(); // add if you define new function
-        ia.register_type<PReLU>(); // add if you define new function
-
+        GraphRegistry::register_types(ia);
 
         ia >> *this;
 
         ifs.close();
 
         for(auto gs : graphs){
-
-            Graph *g = gs.second;
-
-            const type_info& id = typeid(*g);
-
-            if (typeid(Linear) == id){
-                ((Linear *)g)->fromHostArray();
-            } else if (typeid(LSTM) == id){
-                ((LSTM *)g)->fromHostArray();
-            } else if (typeid(FullLSTM) == id){
-                ((FullLSTM *)g)->fromHostArray();
-            } else if (typeid(FullLSTM2) == id){
-                ((FullLSTM2 *)g)->fromHostArray();
-            } else if (typeid(GRU) == id){
-                ((GRU *)g)->fromHostArray();
-            } else if (typeid(BatchNorm) == id){
-                ((BatchNorm *)g)->fromHostArray();
-            } else if (typeid(Conv2D) == id){
-                ((Conv2D *)g)->fromHostArray();
-            } else if (typeid(PReLU) == id){
-                ((PReLU *)g)->fromHostArray();
-            }
+            gs.second->fromHostArray();
         }
 
         getUpdateParams();
@@ -290,6 +290,193 @@ public:
             g->zero_grads();
         }
     }
+
+    /**
+     * Inference only: fold the BatchNorm bn_name (with its running statistics) into the
+     * Linear or Conv2D layer_name that feeds it, and replace the BatchNorm by an Identity.
+     *
+     *   y = gamma * (W x + b - mean) / sqrt(var + eps) + beta
+     *
+     * A Linear gets s = gamma / sqrt(var + eps) multiplied into the rows of w and b.
+     * The statistics of a Conv2D output differ per pixel while its filters are shared,
+     * so a Conv2D keeps a per row scale/shift applied right after the convolution.
+     * Optimizers initialized before have to be initialized again.
+     */
+    bool fold_batch_norm(string layer_name, string bn_name){
+        Graph *g = G(layer_name);
+        Graph *g_bn = G(bn_name);
+
+        if (typeid(*g_bn) != typeid(BatchNorm)){
+            cout << "fold_batch_norm: " << bn_name << " is not a BatchNorm" << endl;
+            return false;
+        }
+        BatchNorm *bn = (BatchNorm *)g_bn;
+
+        int rows = bn->gamma->data.rows * bn->gamma->data.cols;
+
+        bn->gamma->data.memDeviceToHost();
+        bn->beta->data.memDeviceToHost();
+        bn->x_mean->data.memDeviceToHost();
+        bn->x_var->data.memDeviceToHost();
+
+        // same epsilon as batch_norm_kernel
+        vector<float> s(rows), t(rows);
+        for (int i = 0; i < rows; i++){
+            s[i] = bn->gamma->data.mHost[i] / std::sqrt(bn->x_var->data.mHost[i] + 1e-5);
+            t[i] = bn->beta->data.mHost[i] - bn->x_mean->data.mHost[i] * s[i];
+        }
+
+        if (typeid(*g) == typeid(Linear) && !((Linear *)g)->isTranpose){
+            Linear *linear = (Linear *)g;
+            cuMat &w = linear->w->data;
+
+            if (w.rows != rows){
+                cout << "fold_batch_norm: " << layer_name << " has " << w.rows << " outputs, " << bn_name << " " << rows << endl;
+                return false;
+            }
+            if (linear->noBias){
+                linear->b = new Variable(rows, 1);
+                linear->noBias = false;
+            }
+            cuMat &b = linear->b->data;
+
+            w.memDeviceToHost();
+            b.memDeviceToHost();
+            for (int i = 0; i < rows; i++){
+                for (int j = 0; j < w.cols; j++) w.mHost[IDX2F(i, j, rows)] *= s[i];
+                b.mHost[i] = b.mHost[i] * s[i] + t[i];
+            }
+            w.memHostToDevice();
+            b.memHostToDevice();
+        }
+        else if (typeid(*g) == typeid(Conv2D)){
+            Conv2D *conv = (Conv2D *)g;
+
+            int out_w = 1 + (conv->w_size + 2*conv->padding - conv->filter_size) / conv->stride;
+            int out_h = 1 + (conv->h_size + 2*conv->padding - conv->filter_size) / conv->stride;
+            if (out_w * out_h * conv->filter_num != rows){
+                cout << "fold_batch_norm: " << layer_name << " has " << out_w * out_h * conv->filter_num << " outputs, " << bn_name << " " << rows << endl;
+                return false;
+            }
+
+            if (conv->scale == NULL){
+                conv->scale = new Variable(rows, 1, false);
+                conv->shift = new Variable(rows, 1, false);
+                conv->scale->data.ones();
+            }
+            cuMat &scale = conv->scale->data;
+            cuMat &shift = conv->shift->data;
+
+            scale.memDeviceToHost();
+            shift.memDeviceToHost();
+            for (int i = 0; i < rows; i++){
+                shift.mHost[i] = shift.mHost[i] * s[i] + t[i];
+                scale.mHost[i] *= s[i];
+            }
+            scale.memHostToDevice();
+            shift.memHostToDevice();
+        }
+        else {
+            cout << "fold_batch_norm: " << layer_name << " is not a Linear or Conv2D" << endl;
+            return false;
+        }
+
+        // gamma and beta may be views into the flat buffer
+        bool was_flat = flat.param != NULL;
+        flat.unpack();
+
+        delete bn;
+        graphs[bn_name] = new Identity();
+
+        if (was_flat) flatten();
+        else getUpdateParams();
+
+        return true;
+    }
+
+    /**
+     * Post-training int8 quantization for inference:
+     *
+     *   model.calibrate(true);  // a few forwards over calibration data
+     *   model.calibrate(false);
+     *   model.quantize();       // layers that saw data run int8 GEMMs
+     *
+     * Calibration records the largest |input| of every layer with an int8 path (Linear,
+     * Conv2D, PointwiseConv2D, GroupedConv2D without groups), quantize() uses it as the
+     * input range and quantizes the weights per output row, the other layers stay float
+     * (see Graph::calibrate). set_int8(false) switches back to the float weights, e.g. to
+     * compare accuracy.
+     */
+    void calibrate(bool status){
+        for(auto gs : graphs) {
+            gs.second->calibrate(status);
+        }
+    }
+
+    int quantize(){
+        load_pending();
+        int count = 0;
+        for(auto gs : graphs) {
+            if (gs.second->quantize()) count++;
+        }
+        return count;
+    }
+
+    void set_int8(bool status){
+        for(auto gs : graphs) {
+            gs.second->set_int8(status);
+        }
+    }
+
+    /**
+     * Stores the pruned weights of the Linear layers (see Pruner) as BSR and runs them with
+     * a sparse x dense GEMM, returns the number of layers switched. set_sparse(false) goes
+     * back to the dense weights.
+     */
+    int sparsify(){
+        load_pending();
+        int count = 0;
+        for(auto gs : graphs) {
+            if (gs.second->sparsify()) count++;
+        }
+        return count;
+    }
+
+    void set_sparse(bool status){
+        for(auto gs : graphs) {
+            gs.second->set_sparse(status);
+        }
+    }
+
+    /**
+     * Mixed precision training: the Linear layers multiply fp16 (HALF_FP16) or bf16
+     * (HALF_BF16) copies of their weights and inputs with fp32 accumulation, the weights,
+     * gradients and optimizer state stay fp32. Use it with Optimizer::set_loss_scale()
+     * so that small fp16 gradients do not flush to zero.
+     */
+    void set_mixed_precision(bool status, int dtype = HALF_FP16){
+        for(auto gs : graphs) {
+            gs.second->set_mixed_precision(status, dtype);
+        }
+    }
+
+    /**
+     * Turn activation checkpointing on/off for every graph.
+     */
+    void setCheckpoint(bool status){
+        for(auto gs : graphs) {
+            gs.second->setCheckpoint(status);
+        }
+    }
+
+    /**
+     * Turn activation checkpointing on/off for a segment of the model only.
+     */
+    void setCheckpoint(vector<string> names, bool status){
+        for(int i=0; i<names.size(); i++){
+            G(names[i])->setCheckpoint(status);
+        }
+    }
 };
 
 #endif /* FUNCTION_SET_H_ */
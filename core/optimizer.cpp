@@ -4,8 +4,10 @@
  */
 
 #include <thread>
+#include <algorithm>
 
 #include "optimizer.h"
+#include "pruner.h"
 #include "variable.h"
 
 
@@ -49,7 +51,8 @@ OptimizerParams *Optimizer::createOptimizerParams(Variable *v){
 void Optimizer::init() {
 
     epoch = 1;
-    updateParams = model->getUpdateParams();
+    updateParams = model->getOptimizerParams();
+    params_version = model->params_version;
 
     delOpts();
 
@@ -69,6 +72,10 @@ void Optimizer::update_param(Variable *w, OptimizerParams &opp) {
     cout << "update_param" << endl;
 }
 
+void Optimizer::update_param_sparse(Variable *w, OptimizerParams &opp) {
+    update_param(w, opp);
+}
+
 
 void Optimizer::zero_grads() {
 
@@ -76,7 +83,7 @@ void Optimizer::zero_grads() {
         UpdateParams *up = updateParams.at(i);
         for(int j=0; j < up->params.size(); j++){
             Variable *v = up->params.at(j);
-            v->grad *= 0.0;
+            v->zero_grad();
 
         }
     }
@@ -89,8 +96,57 @@ void Optimizer::clip_grad(Variable *v){
     }
 }
 
+void Optimizer::set_loss_scale(float init_scale, int window) {
+    dynamic_loss_scale = true;
+    loss_scale = init_scale;
+    loss_scale_window = window;
+    good_steps = 0;
+}
+
+bool Optimizer::unscale_grads() {
+
+    for (int i = 0; i < updateParams.size(); i++) {
+        UpdateParams *up = updateParams.at(i);
+        for(int j=0; j < up->params.size(); j++){
+            Variable *v = up->params.at(j);
+
+            if (v->grad.rows * v->grad.cols > 0 && v->grad.has_non_finite()) {
+                loss_scale = max(1.0f, loss_scale / 2);
+                good_steps = 0;
+                skipped_steps++;
+                return false;
+            }
+        }
+    }
+
+    for (int i = 0; i < updateParams.size(); i++) {
+        UpdateParams *up = updateParams.at(i);
+        for(int j=0; j < up->params.size(); j++){
+            Variable *v = up->params.at(j);
+
+            if (v->grad.rows * v->grad.cols > 0) v->grad.mul(1.0f / loss_scale, v->grad);
+        }
+    }
+
+    if (++good_steps >= loss_scale_window) {
+        loss_scale *= 2;
+        good_steps = 0;
+    }
+    return true;
+}
+
 void Optimizer::update() {
 
+    // the UpdateParams taken by init() may have been deleted since
+    if (params_version != model->params_version) {
+        FatalError("Optimizer::update: the parameters of the model changed (flatten, set_flat, putG, fold_batch_norm), call init() again");
+    }
+
+    if (dynamic_loss_scale && !unscale_grads()) {
+        zero_grads();
+        return;
+    }
+
     int k = 0;
 
     for (int i = 0; i < updateParams.size(); i++) {
@@ -99,10 +155,12 @@ void Optimizer::update() {
             Variable *v = up->params.at(j);
 
             clip_grad(v);
-            update_param(v, *opts.at(k));
+            if (v->isSparseGrad) update_param_sparse(v, *opts.at(k));
+            else update_param(v, *opts.at(k));
             k++;
         }
     }
+    if (pruner != NULL) pruner->step(epoch);
     epoch++;
 
     zero_grads();
@@ -13,6 +13,8 @@
 #include "variable.h"
 
 
+class Pruner;
+
 class OptimizerParams {
 public:
 
@@ -31,11 +33,23 @@ public:
     vector<thread *> ts;
 
     vector<UpdateParams *> updateParams;
+    // model->params_version when updateParams was taken
+    int params_version = -1;
 
     float lr;
 
     float clip_grad_threshold = 0;
 
+    // dynamic loss scaling, see set_loss_scale()
+    bool dynamic_loss_scale = false;
+    float loss_scale = 1;
+    int loss_scale_window = 2000;
+    int good_steps = 0;
+    int skipped_steps = 0;
+
+    // gradual pruning stepped after every update, see Pruner
+    Pruner *pruner = NULL;
+
 
     Optimizer(Model *model, float learning_rate);
     Optimizer(Model *model, float learning_rate, float clip_grad_threshold);
@@ -50,11 +64,28 @@ public:
 
     virtual void update_param(Variable *w, OptimizerParams &opp);
 
+    // parameters with a row sparse gradient (Variable::isSparseGrad), dense update by default
+    virtual void update_param_sparse(Variable *w, OptimizerParams &opp);
+
     void zero_grads();
 
     void update();
 
     void clip_grad(Variable *v);
+
+    /**
+     * Dynamic loss scaling for mixed precision training:
+     *
+     *   loss->backward(optimizer.loss_scale);
+     *   optimizer.update();
+     *
+     * update() first checks the gradients: with an inf or a NaN the step is skipped and the
+     * scale halved, otherwise the gradients are divided by the scale before the update, and
+     * after window steps without overflow the scale is doubled.
+     */
+    void set_loss_scale(float init_scale = 65536, int window = 2000);
+
+    bool unscale_grads();
 };
 
 
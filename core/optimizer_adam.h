@@ -66,6 +66,18 @@ public:
         w->data.plus(op.ndw, w->data);
     }
 
+    // lazy Adam: the moments of the columns that were not touched are left as they are
+    void update_param_sparse(Variable *w, OptimizerParams &opp) {
+
+        if (w->grad_cols.empty()) return;
+
+        OptimizerAdamParams &op = (OptimizerAdamParams &)opp;
+
+        cuMat ids;
+        w->grad_cols_ids(ids);
+        op.adam_w_m.adam_cols(op.adam_w_v, w->grad, ids, w->data, beta1, beta2, lr_f(-lr, epoch), 1e-8);
+    }
+
 };
 
 #endif /* OPTIMIZER_ADAM_H_ */
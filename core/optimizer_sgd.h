@@ -49,6 +49,16 @@ public:
         w->data.plus(op.ndw, w->data);
     }
 
+    // only the touched columns
+    void update_param_sparse(Variable *w, OptimizerParams &opp) {
+
+        if (w->grad_cols.empty()) return;
+
+        cuMat ids;
+        w->grad_cols_ids(ids);
+        w->data.plus_cols(-lr, &w->grad, ids);
+    }
+
 };
 
 #endif /* OPTIMIZER_SGD_H_ */
@@ -0,0 +1,178 @@
+/*
+ * plan.h
+ *
+ */
+
+#ifndef PLAN_H_
+#define PLAN_H_
+
+#include <vector>
+#include <map>
+#include <set>
+
+#include "variable.h"
+#include "function.h"
+
+using namespace std;
+
+
+/**
+ * Static execution plan of one step of a define-by-run model.
+ *
+ * Between begin() and end() the step runs as usual while every executed Function is
+ * recorded in order, together with its inputs and its output variable. replay() then
+ * runs the recorded functions directly on the same buffers: no Graph::forward, no new
+ * Function objects and no new output variables. New data is fed by overwriting the
+ * input variables used during the capture.
+ *
+ *   plan.begin();
+ *   PVariable loss = model.G("loss")->forward(model.G("g1")->forward(x), d);
+ *   loss->backward();
+ *   plan.end();
+ *   ...
+ *   asMatrix(x, X); asMatrix(d, D);
+ *   plan.replay();         // same forward and backward, loss->val() is updated
+ *
+ * Only what happens inside Function::forward/backward is replayed, so the topology and
+ * the shapes have to stay the same. Work done by a Graph outside of its functions
+ * is not part of the plan (the running statistics of BatchNorm are updated by
+ * FunctionBatchNorm, so they are).
+ *
+ * The kernels run on the default stream with a synchronization after every launch,
+ * so the replay is a plain host loop rather than a captured cudaGraph.
+ */
+class Plan : public FunctionRecorder {
+public:
+
+    class Step {
+    public:
+        Function *f;
+        vector<PVariable> inputs;
+        vector<PVariable> outputs;
+        PVariable output;
+    };
+
+    class BackwardStep {
+    public:
+        int step;
+        Variable *v;
+    };
+
+    vector<PFunction> funcs;
+    vector<Step> steps;
+    vector<BackwardStep> backward_steps;
+    map<Function *, int> step_index;
+
+    // gradients of these variables are zeroed before every backward replay
+    vector<Variable *> intermediates;
+    Variable *root = NULL;
+
+    FunctionRecorder *prev = NULL;
+
+
+    ~Plan(){
+        if (gRecorder == this) gRecorder = prev;
+    }
+
+    void clear(){
+        funcs.clear();
+        steps.clear();
+        backward_steps.clear();
+        step_index.clear();
+        intermediates.clear();
+        root = NULL;
+    }
+
+    void begin(){
+        clear();
+        prev = gRecorder;
+        gRecorder = this;
+    }
+
+    void end(){
+        gRecorder = prev;
+
+        set<Variable *> seen;
+        for (Step &s : steps){
+            for (PVariable &v : s.inputs){
+                if (seen.insert(v.get()).second) intermediates.push_back(v.get());
+            }
+            if (s.output != NULL && seen.insert(s.output.get()).second) intermediates.push_back(s.output.get());
+        }
+    }
+
+    int size(){
+        return steps.size();
+    }
+
+
+    void function_created(PFunction f){
+        funcs.push_back(f);
+    }
+
+    void forward_called(Function *f, PVariable r){
+        Step s;
+        s.f = f;
+        s.inputs = f->inputs;
+        s.outputs = f->outputs;
+        s.output = r;
+
+        step_index[f] = steps.size();
+        steps.push_back(s);
+    }
+
+    void backward_called(Function *f, Variable *v){
+        auto it = step_index.find(f);
+        if (it == step_index.end()){
+            cout << "Plan: " << f->name << " was not forwarded during the capture" << endl;
+            return;
+        }
+        if (root == NULL) root = v;
+
+        BackwardStep b;
+        b.step = it->second;
+        b.v = v;
+        backward_steps.push_back(b);
+    }
+
+
+    void forward(){
+        for (Step &s : steps){
+            Function *f = s.f;
+
+            s.outputs.clear();
+            f->bound_output = s.output;
+            PVariable r = f->forward(s.inputs, s.outputs);
+            f->bound_output = NULL;
+
+            // the function built its result without variable_construct_for_function
+            if (r != NULL && s.output != NULL && r.get() != s.output.get()) s.output->data = r->data;
+
+            f->is_released = false;
+            if (f->is_checkpoint) f->release();
+        }
+    }
+
+    void backward(){
+        if (root == NULL) return;
+
+        for (Variable *v : intermediates) v->zero_grad();
+        root->grad.ones();
+
+        for (BackwardStep &b : backward_steps){
+            Step &s = steps[b.step];
+
+            s.f->restore();
+            s.f->backward(b.v->grad, s.inputs, s.outputs);
+            if (s.f->is_checkpoint) s.f->release();
+        }
+    }
+
+    void replay(){
+        forward();
+        backward();
+    }
+};
+
+
+#endif
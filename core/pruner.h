@@ -0,0 +1,84 @@
+/*
+ * pruner.h
+ *
+ */
+
+#ifndef PRUNER_H_
+#define PRUNER_H_
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "model.h"
+
+using namespace std;
+
+
+/**
+ * Gradual magnitude pruning of the Linear layers of a model, stepped by the optimizer:
+ *
+ *   Pruner pruner(&model, 0.9, 1000, 10000);    // 90% sparse between step 1000 and 10000
+ *   optimizer.pruner = &pruner;
+ *   ...
+ *   model.sparsify();                            // BSR weights for inference
+ *
+ * Every frequency steps from begin_step to end_step the masks are recomputed for
+ *
+ *   s(t) = final + (initial - final) * (1 - (t - begin_step) / (end_step - begin_step))^3
+ *
+ * so most weights go early while the network can still recover, and after every step the
+ * pruned weights are zeroed again. block > 1 prunes block x block blocks, which run much
+ * faster as BSR than single weights. layers names the graphs, all of them if empty; graphs
+ * without a pruning mask (Graph::prune, so far only Linear has one) are left alone.
+ */
+class Pruner {
+public:
+
+    Model *model;
+    vector<string> layers;
+
+    float initial_sparsity = 0;
+    float final_sparsity;
+    int begin_step;
+    int end_step;
+    int frequency = 100;
+    int block = 1;
+
+
+    Pruner(Model *model, float final_sparsity, int begin_step, int end_step, int block = 1,
+           vector<string> layers = vector<string>()){
+        this->model = model;
+        this->final_sparsity = final_sparsity;
+        this->begin_step = begin_step;
+        this->end_step = end_step;
+        this->block = block;
+
+        if (layers.empty()) {
+            for (auto gs : model->graphs) layers.push_back(gs.first);
+        }
+        this->layers = layers;
+    }
+
+    float sparsity(int step){
+        if (step < begin_step) return 0;
+        if (step >= end_step) return final_sparsity;
+
+        float p = 1.0 - (step - begin_step) / (float) (end_step - begin_step);
+        return final_sparsity + (initial_sparsity - final_sparsity) * p * p * p;
+    }
+
+    // called by Optimizer::update() after the weights are updated
+    void step(int step){
+        if (step < begin_step) return;
+
+        bool update = step <= end_step && ((step - begin_step) % frequency == 0 || step == end_step);
+        float s = sparsity(step);
+
+        // a sparsity not above the current one only zeroes the pruned weights again
+        for (string &name : layers) model->G(name)->prune(update ? s : 0, block);
+    }
+};
+
+
+#endif /* PRUNER_H_ */
@@ -16,6 +16,9 @@ int count_variable = 0;
 
 map<Variable *, bool> variable_pool;
 
+bool gNoGrad = false;
+float gLossScale = 1;
+
 /**
  * Construct new variable.
  * @param {rows} # of rows of the data
@@ -39,8 +42,8 @@ Variable *variable_construct(int rows, int cols){
         }
     }
 
-    // allocate memory for the Variable.
-    Variable *r = new Variable(rows, cols);
+    // allocate memory for the Variable (grad is allocated when backward needs it).
+    Variable *r = new Variable((Function *) NULL, rows, cols);
     // set the flag value as true, so that the program does not re-allocate values to this variable.
     variable_pool[r] = true;
 
@@ -99,11 +102,12 @@ Variable::Variable(const Variable &a) {
     data = a.data;
     grad = a.grad;
     data_sparse = a.data_sparse;
-    seed = a.seed;
     creator = a.creator;
 
     this->isGetGrad = a.isGetGrad;
     this->isSparse = a.isSparse;
+    this->isSparseGrad = a.isSparseGrad;
+    this->grad_cols = a.grad_cols;
 }
 
 Variable::Variable(int rows, int cols) {
@@ -111,10 +115,8 @@ Variable::Variable(int rows, int cols) {
     this->id = allocateVarId();
 
     data = cuMat(rows, cols);
-    grad = cuMat(rows, cols);
-
-    seed = cuMat(grad.rows, grad.cols);
-    seed.ones();
+    // parameters get their gradient buffer up front
+    if (!gNoGrad) alloc_grad();
 
     creator = NULL;
 }
@@ -135,10 +137,7 @@ Variable::Variable(int rows, int cols, bool is_get_grad){
     }
 
     data = cuMat(rows, cols);
-    grad = cuMat(rows, cols);
-
-    seed = cuMat(grad.rows, grad.cols);
-    seed.ones();
+    if (!gNoGrad && is_get_grad) alloc_grad();
 
     creator = NULL;
 }
@@ -148,10 +147,6 @@ Variable::Variable(cuMat &input) {
     this->id = allocateVarId();
 
     data = input;
-    grad = cuMat(input.rows, input.cols);
-
-    seed = cuMat(grad.rows, grad.cols);
-    seed.ones();
 
     creator = NULL;
 }
@@ -161,10 +156,6 @@ Variable::Variable(Function *f, int rows, int cols) {
     this->id = allocateVarId();
 
     data = cuMat(rows, cols);
-    grad = cuMat(rows, cols);
-
-    seed = cuMat(grad.rows, grad.cols);
-    seed.ones();
 
     creator = f;
 }
@@ -174,10 +165,6 @@ Variable::Variable(Function *f, cuMat &input) {
     this->id = allocateVarId();
 
     data = input;
-    grad = cuMat(input.rows, input.cols);
-
-    seed = cuMat(grad.rows, grad.cols);
-    seed.ones();
 
     creator = f;
 }
@@ -187,10 +174,6 @@ Variable::Variable(vector<float> &ids, int nums){
     this->id = allocateVarId();
 
     data_sparse = cuMatSparse(ids, nums);
-    grad = cuMat(data_sparse.rows, data_sparse.cols);
-
-    seed = cuMat(grad.rows, grad.cols);
-    seed.ones();
 
     creator = NULL;
 
@@ -215,13 +198,13 @@ Variable &Variable::operator=(const Variable &a) {
     data = a.data;
     grad = a.grad;
 
-    seed = a.seed;
-
     creator = a.creator;
 
 
     this->isGetGrad = a.isGetGrad;
     this->isSparse = a.isSparse;
+    this->isSparseGrad = a.isSparseGrad;
+    this->grad_cols = a.grad_cols;
 
     return *this;
 }
@@ -232,8 +215,20 @@ void Variable::setCreator(Function *f) {
 }
 
 void Variable::backward() {
-    this->grad = seed;
+    // implicit seed: d(this)/d(this) = 1
+    alloc_grad();
+    this->grad.ones();
+    this->backward(this);
+}
+
+void Variable::backward(float loss_scale) {
+    alloc_grad();
+    this->grad.fill(loss_scale);
+
+    // the loss functions scale their gradient by it without reading the seed back
+    gLossScale = loss_scale;
     this->backward(this);
+    gLossScale = 1;
 }
 
 void Variable::backward(Variable *v) {
@@ -253,7 +248,19 @@ void Variable::backward(Variable *v) {
 
         if (v->forward_count != 0) return;
 
+        // gradients are materialized right before the first function accumulates into them
+        v->alloc_grad();
+        for (int i = 0; i< v->creator->inputs.size(); i++) {
+            PVariable nv = v->creator->inputs[i];
+            if (nv->isGetGrad) nv->alloc_grad();
+        }
+
+        if (gRecorder != NULL) gRecorder->backward_called(v->creator, v);
+
+        // rebuild checkpointed intermediates only for the duration of this backward
+        v->creator->restore();
         v->creator->backward(v->grad);
+        if (v->creator->is_checkpoint) v->creator->release();
 
         for (int i = 0; i< v->creator->inputs.size(); i++) {
             PVariable nv = v->creator->inputs[i];
@@ -285,7 +292,7 @@ void Variable::zero_grads(Variable *v) {
     if (v == NULL)
         return;
 
-    v->grad.mul(0, v->grad);
+    if (v->grad.mDevice != NULL) v->grad.mul(0, v->grad);
     v->forward_count = 0;
 
     if (v->creator != NULL) {
@@ -302,7 +309,7 @@ void Variable::zero_grads(Variable *v) {
  */
 void Variable::ones() {
     data.ones();
-    grad.mul(0, grad);
+    if (grad.mDevice != NULL) grad.mul(0, grad);
 
 }
 
@@ -311,7 +318,7 @@ void Variable::ones() {
  */
 void Variable::zeros() {
     data.mul(0, data);
-    grad.mul(0, grad);
+    if (grad.mDevice != NULL) grad.mul(0, grad);
     forward_count = 0;
     last_opt = NULL;
     is_last_backward = NULL;
@@ -329,9 +336,48 @@ void Variable::unchain(){
  * Zero out the gradients.
  */
 void Variable::zero_grad(){
+    if (grad.mDevice == NULL) return;
+
+    // only the touched columns of a row sparse gradient are non-zero
+    if (isSparseGrad){
+        if (!grad_cols.empty()){
+            cuMat ids;
+            grad_cols_ids(ids);
+            grad.plus_cols(0, NULL, ids);
+        }
+        grad_cols.clear();
+        return;
+    }
     grad.mul(0, grad);
 }
 
+/**
+ * Mark the columns ids (1 x K, ids as floats on the device) of a row sparse gradient as touched.
+ */
+void Variable::add_grad_cols(cuMat &ids){
+    ids.memDeviceToHost();
+    for (int i = 0; i < ids.cols; i++) grad_cols.insert((int) ids.mHost[i]);
+}
+
+/**
+ * The touched columns as a 1 x K device matrix, every id once.
+ */
+void Variable::grad_cols_ids(cuMat &ids){
+    vector<float> v(grad_cols.begin(), grad_cols.end());
+    ids = cuMat(1, v.size());
+    ids.memSetHost(v.data());
+}
+
+/**
+ * Allocate a zero filled grad if it is not allocated yet.
+ */
+void Variable::alloc_grad(){
+    if (grad.mDevice != NULL) return;
+
+    if (isSparse) grad = cuMat(data_sparse.rows, data_sparse.cols);
+    else grad = cuMat(data.rows, data.cols);
+}
+
 /**
  * Fill the variable with random values.
  */
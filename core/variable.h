@@ -2,6 +2,7 @@
 #define _VARIABLE_
 
 #include <list>
+#include <set>
 #include <random>
 #include <memory>
 #include <boost/intrusive_ptr.hpp>
@@ -15,6 +16,12 @@ using namespace std;
 
 class Function;
 
+// true while a NoGrad scope is alive
+extern bool gNoGrad;
+
+// the loss scale of the running Variable::backward(loss_scale), 1 otherwise
+extern float gLossScale;
+
 
 class Variable {
 
@@ -56,12 +63,16 @@ public:
     cuMat data;
     cuMatSparse data_sparse;
     cuMat grad;
-    cuMat seed;
+    cuMat seed; // not allocated any more, kept for archive compatibility
 
     int grad_num;
     bool isGetGrad;
     bool isSparse;
 
+    // row sparse gradient (embedding tables): grad is zero except for the columns in grad_cols
+    bool isSparseGrad = false;
+    set<int> grad_cols;
+
 
     // constructors
     Variable();
@@ -83,6 +94,8 @@ public:
     Variable log();
 
     void backward();
+    // seeds the gradient with loss_scale instead of 1, see Optimizer::set_loss_scale()
+    void backward(float loss_scale);
     void backward(Variable *v);
 
 
@@ -97,6 +110,9 @@ public:
     void zeros();
     void unchain();
     void zero_grad();
+    void alloc_grad();
+    void add_grad_cols(cuMat &ids);
+    void grad_cols_ids(cuMat &ids);
     void randoms(float m, float a);
     void binominal_randoms(float ratio);
     float val();
@@ -106,6 +122,23 @@ public:
 using PVariable = shared_ptr<Variable>;
 
 
+/**
+ * Inference mode for the lifetime of the object:
+ * variables allocate only data and functions do not record the graph.
+ */
+class NoGrad {
+    bool prev;
+public:
+    NoGrad() {
+        prev = gNoGrad;
+        gNoGrad = true;
+    }
+    ~NoGrad() {
+        gNoGrad = prev;
+    }
+};
+
+
 Variable *variable_construct(int rows, int cols);
 void variable_destroy(Variable *ptr);
 
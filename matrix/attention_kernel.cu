@@ -0,0 +1,216 @@
+#include "attention_kernel.h"
+
+#define ATT_THREADS 128
+#define ATT_WARPS (ATT_THREADS / 32)
+#define ATT_TILE 32
+
+/*
+ * Attention of one query per batch column over the steps of a sequence.
+ * q is (d x batch), the keys k (d x steps*batch) and the values val (dv x steps*batch)
+ * hold step t of column b in column t*batch+b, out is (dv x batch).
+ * With heads > 1 the rows are split evenly and every head has its own softmax.
+ *
+ * score = scale * q.k, or scale * v.tanh(q + k) for additive attention (v not NULL).
+ *
+ * One block per (column, head) walks the steps in tiles: a warp per key computes the
+ * scores of the tile, then the running max/sum of an online softmax rescale the output
+ * accumulated so far. The scores of all steps are never stored, only lse = log(sum exp(score))
+ * (heads x batch) for the backward, which recomputes them.
+ */
+
+__device__ float att_warp_sum(float x){
+    for (int offset = 16; offset > 0; offset /= 2) x += __shfl_down_sync(0xffffffff, x, offset);
+    return __shfl_sync(0xffffffff, x, 0);
+}
+
+__device__ float att_score(const float *q, const float *k, const float *v, int dk, int lane){
+    float s = 0;
+    for (int i = lane; i < dk; i += 32){
+        s += v != NULL ? v[i] * tanhf(q[i] + k[i]) : q[i] * k[i];
+    }
+    return att_warp_sum(s);
+}
+
+__global__ void attention_forward_kernel (const float * __restrict__ q, const float * __restrict__ k,
+                                const float * __restrict__ val, const float * __restrict__ v,
+                                float * __restrict__ out, float * __restrict__ lse,
+                                int d, int dv, int heads, int steps, int batch, float scale){
+    extern __shared__ float shared[];
+
+    int b = blockIdx.x;
+    int hd = blockIdx.y;
+    int dk = d / heads;
+    int dvh = dv / heads;
+    int warp = threadIdx.x / 32;
+    int lane = threadIdx.x % 32;
+
+    float *acc = shared;        // dvh
+    float *p = shared + dvh;    // ATT_TILE
+
+    const float *qb = q + b * d + hd * dk;
+    const float *vh = v != NULL ? v + hd * dk : NULL;
+
+    for (int i = threadIdx.x; i < dvh; i += blockDim.x) acc[i] = 0;
+
+    float m = -INFINITY;
+    float l = 0;
+
+    for (int t0 = 0; t0 < steps; t0 += ATT_TILE){
+        int n = min(ATT_TILE, steps - t0);
+
+        for (int j = warp; j < n; j += ATT_WARPS){
+            float s = att_score(qb, k + ((t0 + j) * batch + b) * d + hd * dk, vh, dk, lane);
+            if (lane == 0) p[j] = s * scale;
+        }
+        __syncthreads();
+
+        float m_tile = m;
+        for (int j = 0; j < n; j++) m_tile = fmaxf(m_tile, p[j]);
+        float corr = expf(m - m_tile);
+        __syncthreads();
+
+        if (threadIdx.x < n) p[threadIdx.x] = expf(p[threadIdx.x] - m_tile);
+        __syncthreads();
+
+        float l_tile = 0;
+        for (int j = 0; j < n; j++) l_tile += p[j];
+        l = l * corr + l_tile;
+
+        for (int i = threadIdx.x; i < dvh; i += blockDim.x){
+            float a = acc[i] * corr;
+            for (int j = 0; j < n; j++) a += p[j] * val[((t0 + j) * batch + b) * dv + hd * dvh + i];
+            acc[i] = a;
+        }
+        m = m_tile;
+        __syncthreads();
+    }
+
+    for (int i = threadIdx.x; i < dvh; i += blockDim.x) out[b * dv + hd * dvh + i] = acc[i] / l;
+    if (threadIdx.x == 0) lse[b * heads + hd] = m + logf(l);
+}
+
+/*
+ * gq, gk, gval and gv are accumulated and may be NULL. gk and gval may be the same matrix
+ * (keys == values), a thread then updates the same rows of both.
+ * With p = exp(score - lse) and D = gout.out: ds = p * (gout.val - D).
+ */
+__global__ void attention_backward_kernel (const float * __restrict__ q, const float * __restrict__ k,
+                                const float * __restrict__ val, const float * __restrict__ v,
+                                const float * __restrict__ out, const float * __restrict__ lse,
+                                const float * __restrict__ gout, float *gq, float *gk, float *gval, float *gv,
+                                int d, int dv, int heads, int steps, int batch, float scale){
+    extern __shared__ float shared[];
+
+    int b = blockIdx.x;
+    int hd = blockIdx.y;
+    int dk = d / heads;
+    int dvh = dv / heads;
+    int warp = threadIdx.x / 32;
+    int lane = threadIdx.x % 32;
+
+    float *dq = shared;                 // dk
+    float *dvv = shared + dk;           // dk, additive only
+    float *p = shared + 2 * dk;         // ATT_TILE
+    float *ds = p + ATT_TILE;           // ATT_TILE
+    float *red = ds + ATT_TILE;         // ATT_WARPS
+
+    const float *qb = q + b * d + hd * dk;
+    const float *vh = v != NULL ? v + hd * dk : NULL;
+    const float *go = gout + b * dv + hd * dvh;
+    const float *ob = out + b * dv + hd * dvh;
+
+    float part = 0;
+    for (int i = threadIdx.x; i < dvh; i += blockDim.x) part += go[i] * ob[i];
+    part = att_warp_sum(part);
+    if (lane == 0) red[warp] = part;
+
+    for (int i = threadIdx.x; i < dk; i += blockDim.x){
+        dq[i] = 0;
+        dvv[i] = 0;
+    }
+    __syncthreads();
+
+    float dsum = 0;
+    for (int w = 0; w < ATT_WARPS; w++) dsum += red[w];
+    float lse_b = lse[b * heads + hd];
+
+    for (int t0 = 0; t0 < steps; t0 += ATT_TILE){
+        int n = min(ATT_TILE, steps - t0);
+
+        for (int j = warp; j < n; j += ATT_WARPS){
+            int col = (t0 + j) * batch + b;
+            float s = att_score(qb, k + col * d + hd * dk, vh, dk, lane);
+
+            float dp = 0;
+            const float *vj = val + col * dv + hd * dvh;
+            for (int i = lane; i < dvh; i += 32) dp += go[i] * vj[i];
+            dp = att_warp_sum(dp);
+
+            if (lane == 0){
+                float pj = expf(s * scale - lse_b);
+                p[j] = pj;
+                ds[j] = pj * (dp - dsum) * scale;
+            }
+        }
+        __syncthreads();
+
+        if (gval != NULL){
+            for (int i = threadIdx.x; i < dvh; i += blockDim.x){
+                for (int j = 0; j < n; j++) gval[((t0 + j) * batch + b) * dv + hd * dvh + i] += p[j] * go[i];
+            }
+        }
+
+        for (int i = threadIdx.x; i < dk; i += blockDim.x){
+            float qi = qb[i];
+            float dqi = 0;
+            float dvi = 0;
+            for (int j = 0; j < n; j++){
+                int idx = ((t0 + j) * batch + b) * d + hd * dk + i;
+                float kji = k[idx];
+                if (vh != NULL){
+                    float u = tanhf(qi + kji);
+                    float g = ds[j] * vh[i] * (1 - u * u);
+                    dqi += g;
+                    dvi += ds[j] * u;
+                    if (gk != NULL) gk[idx] += g;
+                }
+                else {
+                    dqi += ds[j] * kji;
+                    if (gk != NULL) gk[idx] += ds[j] * qi;
+                }
+            }
+            dq[i] += dqi;
+            dvv[i] += dvi;
+        }
+        __syncthreads();
+    }
+
+    for (int i = threadIdx.x; i < dk; i += blockDim.x){
+        if (gq != NULL) gq[b * d + hd * dk + i] += dq[i];
+        if (gv != NULL) atomicAdd(&gv[hd * dk + i], dvv[i]);
+    }
+}
+
+void attention_forward_kernel_exec(const float *q, const float *k, const float *val, const float *v,
+                                   float *out, float *lse,
+                                   int d, int dv, int heads, int steps, int batch, float scale){
+    dim3 grid(batch, heads);
+    size_t shared_size = (dv / heads + ATT_TILE) * sizeof(float);
+
+    /* lunch kernel */
+    attention_forward_kernel<<<grid, ATT_THREADS, shared_size>>>(q, k, val, v, out, lse, d, dv, heads, steps, batch, scale);
+    cudaThreadSynchronize();
+}
+
+void attention_backward_kernel_exec(const float *q, const float *k, const float *val, const float *v,
+                                    const float *out, const float *lse, const float *gout,
+                                    float *gq, float *gk, float *gval, float *gv,
+                                    int d, int dv, int heads, int steps, int batch, float scale){
+    dim3 grid(batch, heads);
+    size_t shared_size = (2 * (d / heads) + 2 * ATT_TILE + ATT_WARPS) * sizeof(float);
+
+    /* lunch kernel */
+    attention_backward_kernel<<<grid, ATT_THREADS, shared_size>>>(q, k, val, v, out, lse, gout, gq, gk, gval, gv,
+                                                                  d, dv, heads, steps, batch, scale);
+    cudaThreadSynchronize();
+}
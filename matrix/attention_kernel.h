@@ -0,0 +1,30 @@
+#include <cuda_runtime.h>
+
+#ifndef _attention_kernel_
+#define _attention_kernel_
+
+__global__ void attention_forward_kernel (const float * __restrict__ q, const float * __restrict__ k,
+                                const float * __restrict__ val, const float * __restrict__ v,
+                                float * __restrict__ out, float * __restrict__ lse,
+                                int d, int dv, int heads, int steps, int batch, float scale);
+
+__global__ void attention_backward_kernel (const float * __restrict__ q, const float * __restrict__ k,
+                                const float * __restrict__ val, const float * __restrict__ v,
+                                const float * __restrict__ out, const float * __restrict__ lse,
+                                const float * __restrict__ gout, float *gq, float *gk, float *gval, float *gv,
+                                int d, int dv, int heads, int steps, int batch, float scale);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void attention_forward_kernel_exec(const float *q, const float *k, const float *val, const float *v,
+                                       float *out, float *lse,
+                                       int d, int dv, int heads, int steps, int batch, float scale);
+    void attention_backward_kernel_exec(const float *q, const float *k, const float *val, const float *v,
+                                        const float *out, const float *lse, const float *gout,
+                                        float *gq, float *gk, float *gval, float *gv,
+                                        int d, int dv, int heads, int steps, int batch, float scale);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+#include "batch_norm_kernel.h"
+
+#define BLOCK_SIZE 32
+#define BN_EPS 1e-5f
+
+/*
+ * Batch normalization of x (n x m) over the batch (columns), every row has its own
+ * statistics, gamma and beta (n x 1). One thread per row walks the batch, so
+ * neighbouring threads read neighbouring rows of the same column.
+ *
+ * Training: mean and variance come from a single Welford pass and the running
+ * statistics are updated in place (running = lambda * running + (1 - lambda) * batch),
+ * the running variance with the unbiased batch variance.
+ * Inference: the running statistics are used as they are.
+ * mean and rstd (n x 1) keep what the backward needs.
+ */
+__global__ void batch_norm_forward_kernel (const float * __restrict__ x, const float * __restrict__ gamma,
+                                const float * __restrict__ beta, float * __restrict__ running_mean,
+                                float * __restrict__ running_var, float * __restrict__ mean,
+                                float * __restrict__ rstd, float * __restrict__ y,
+                                int is_train, float lambda, int m, int n){
+    int row = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < n){
+        float mu, var;
+
+        if (is_train){
+            mu = 0;
+            float m2 = 0;
+            for (int k = 0; k < m; k++){
+                float v = x[k * n + row];
+                float d = v - mu;
+                mu += d / (k + 1);
+                m2 += d * (v - mu);
+            }
+            var = m2 / m;
+
+            if (running_mean != NULL){
+                float unbiased = m > 1 ? m2 / (m - 1) : var;
+                running_mean[row] = lambda * running_mean[row] + (1.0f - lambda) * mu;
+                running_var[row] = lambda * running_var[row] + (1.0f - lambda) * unbiased;
+            }
+        }
+        else {
+            mu = running_mean[row];
+            var = running_var[row];
+        }
+
+        float r = 1.0f / std::sqrt(var + BN_EPS);
+        mean[row] = mu;
+        rstd[row] = r;
+
+        float g = gamma[row] * r;
+        float b = beta[row] - mu * g;
+        for (int k = 0; k < m; k++){
+            y[k * n + row] = x[k * n + row] * g + b;
+        }
+    }
+}
+
+/*
+ * ggamma and gbeta are accumulated, gx (if not NULL) too. Two passes over the batch:
+ * the sums of gy and gy * xhat, then the input gradient.
+ */
+__global__ void batch_norm_backward_kernel (const float * __restrict__ x, const float * __restrict__ gamma,
+                                const float * __restrict__ mean, const float * __restrict__ rstd,
+                                const float * __restrict__ gy, float * __restrict__ ggamma,
+                                float * __restrict__ gbeta, float * __restrict__ gx,
+                                int is_train, int m, int n){
+    int row = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < n){
+        float mu = mean[row];
+        float r = rstd[row];
+
+        float sum_gy = 0;
+        float sum_gy_xhat = 0;
+        for (int k = 0; k < m; k++){
+            float g = gy[k * n + row];
+            sum_gy += g;
+            sum_gy_xhat += g * (x[k * n + row] - mu) * r;
+        }
+        gbeta[row] += sum_gy;
+        ggamma[row] += sum_gy_xhat;
+
+        if (gx != NULL){
+            float s = gamma[row] * r;
+
+            // with the running statistics mean and rstd do not depend on x
+            if (!is_train){
+                for (int k = 0; k < m; k++) gx[k * n + row] += s * gy[k * n + row];
+                return;
+            }
+
+            sum_gy /= m;
+            sum_gy_xhat /= m;
+            for (int k = 0; k < m; k++){
+                float xhat = (x[k * n + row] - mu) * r;
+                gx[k * n + row] += s * (gy[k * n + row] - sum_gy - xhat * sum_gy_xhat);
+            }
+        }
+    }
+}
+
+/*
+ * y = x * scale + shift with one scale and shift (may be NULL) per row of x (n x m).
+ * With accumulate y is added to instead of overwritten, x and y may be the same.
+ */
+__global__ void row_affine_kernel (const float *x, const float * __restrict__ scale,
+                                const float * __restrict__ shift, float *y,
+                                int accumulate, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        float v = x[row * n + col] * scale[col];
+        if (shift != NULL) v += shift[col];
+        if (accumulate) v += y[row * n + col];
+        y[row * n + col] = v;
+    }
+}
+
+void batch_norm_forward_kernel_exec(const float *x, const float *gamma, const float *beta,
+                                    float *running_mean, float *running_var, float *mean, float *rstd,
+                                    float *y, int is_train, float lambda, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE * 8);
+    dim3 grid((n+block.x-1)/block.x);
+
+    /* lunch kernel */
+    batch_norm_forward_kernel<<<grid, block>>>(x, gamma, beta, running_mean, running_var, mean, rstd, y,
+                                               is_train, lambda, m, n);
+    cudaThreadSynchronize();
+}
+
+void batch_norm_backward_kernel_exec(const float *x, const float *gamma, const float *mean, const float *rstd,
+                                     const float *gy, float *ggamma, float *gbeta, float *gx,
+                                     int is_train, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE * 8);
+    dim3 grid((n+block.x-1)/block.x);
+
+    /* lunch kernel */
+    batch_norm_backward_kernel<<<grid, block>>>(x, gamma, mean, rstd, gy, ggamma, gbeta, gx, is_train, m, n);
+    cudaThreadSynchronize();
+}
+
+void row_affine_kernel_exec(const float *x, const float *scale, const float *shift, float *y,
+                            int accumulate, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    row_affine_kernel<<<grid, block>>>(x, scale, shift, y, accumulate, m, n);
+    cudaThreadSynchronize();
+}
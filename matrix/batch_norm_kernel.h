@@ -0,0 +1,36 @@
+#include <cuda_runtime.h>
+
+#ifndef _batch_norm_kernel_
+#define _batch_norm_kernel_
+
+__global__ void batch_norm_forward_kernel (const float * __restrict__ x, const float * __restrict__ gamma,
+                                const float * __restrict__ beta, float * __restrict__ running_mean,
+                                float * __restrict__ running_var, float * __restrict__ mean,
+                                float * __restrict__ rstd, float * __restrict__ y,
+                                int is_train, float lambda, int m, int n);
+
+__global__ void batch_norm_backward_kernel (const float * __restrict__ x, const float * __restrict__ gamma,
+                                const float * __restrict__ mean, const float * __restrict__ rstd,
+                                const float * __restrict__ gy, float * __restrict__ ggamma,
+                                float * __restrict__ gbeta, float * __restrict__ gx,
+                                int is_train, int m, int n);
+
+__global__ void row_affine_kernel (const float *x, const float * __restrict__ scale,
+                                const float * __restrict__ shift, float *y,
+                                int accumulate, int m, int n);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void batch_norm_forward_kernel_exec(const float *x, const float *gamma, const float *beta,
+                                        float *running_mean, float *running_var, float *mean, float *rstd,
+                                        float *y, int is_train, float lambda, int m, int n);
+    void batch_norm_backward_kernel_exec(const float *x, const float *gamma, const float *mean, const float *rstd,
+                                         const float *gy, float *ggamma, float *gbeta, float *gx,
+                                         int is_train, int m, int n);
+    void row_affine_kernel_exec(const float *x, const float *scale, const float *shift, float *y,
+                                int accumulate, int m, int n);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -53,6 +53,15 @@
 #include "batch_sum_kernel.h"
 #include "vec_to_mat_kernel.h"
 #include "slice_rows_kernel.h"
+#include "lstm_kernel.h"
+#include "gru_kernel.h"
+#include "peephole_lstm_kernel.h"
+#include "batch_norm_kernel.h"
+#include "embed_kernel.h"
+#include "depthwise_conv_kernel.h"
+#include "attention_kernel.h"
+#include "quantize_kernel.h"
+#include "half_kernel.h"
 
 #include "im2col.h"
 #include "pooling.h"
@@ -101,17 +110,43 @@ using namespace std;
 class MallocCounter {
 public:
     int num = 0;
-    void up(){
+    long total = 0;
+    size_t bytes = 0;
+    size_t peak_bytes = 0;
+
+    void up(size_t size = 0){
         num++;
+        total++;
+        bytes += size;
+        if (bytes > peak_bytes) peak_bytes = bytes;
     }
-    void down(){
+    void down(size_t size = 0){
         num--;
+        bytes -= size;
     }
 
     int get(){
         return num;
     }
 
+    // number of device allocations made so far, never decremented
+    long getTotal(){
+        return total;
+    }
+
+    size_t getBytes(){
+        return bytes;
+    }
+
+    // peak device memory held by cuMat since the last resetPeak()
+    size_t getPeakBytes(){
+        return peak_bytes;
+    }
+
+    void resetPeak(){
+        peak_bytes = bytes;
+    }
+
 };
 
 extern MallocCounter mallocCounter;
@@ -134,6 +169,9 @@ public:
     int rows = 0;
     int cols = 0;
 
+    // mDevice points into memory owned elsewhere, see view_of()
+    bool view = false;
+
     cublasHandle_t cudaHandle;
 
 
@@ -214,16 +252,19 @@ public:
 
             cudaMemset(mDevice, 0x00, rows * cols * sizeof(*mDevice));
             cudaThreadSynchronize();
-            mallocCounter.up();
+            mallocCounter.up(rows * cols * sizeof(*mDevice));
 
         }
     }
 
     void del_matrix() {
         if (mDevice != NULL){
-            cudaFree(mDevice);
+            if (!view) {
+                cudaFree(mDevice);
+                mallocCounter.down(rows * cols * sizeof(*mDevice));
+            }
             mDevice = NULL;
-            mallocCounter.down();
+            view = false;
         }
         if (mHost != NULL){
             free(mHost);
@@ -232,6 +273,29 @@ public:
         cudaThreadSynchronize();
     }
 
+    /**
+     * Make this matrix a view of the rows x cols floats at p, e.g. a slice of a flat
+     * parameter buffer. Nothing is copied and p is never freed by this matrix; a
+     * new_matrix() with another shape gives it its own memory again.
+     */
+    void view_of(float *p, int rows, int cols) {
+        del_matrix();
+        mDevice = p;
+        this->rows = rows;
+        this->cols = cols;
+        view = true;
+    }
+
+    /**
+     * Free the device memory and reset the shape to 0x0,
+     * so that the next new_matrix() allocates again.
+     */
+    void release() {
+        del_matrix();
+        rows = 0;
+        cols = 0;
+    }
+
     void memHostToDevice() {
         cudaError_t error = cudaMemcpy(mDevice, mHost,
                 rows * cols * sizeof(*mDevice), cudaMemcpyHostToDevice);
@@ -559,6 +623,27 @@ public:
 
 
 
+    // the same on a block of columns: r[:, r_col:r_col+n] += alpha * this[:, col:col+n]
+    void mul_plus_cols(const float alpha, int col, int n, cuMat &r, int r_col) {
+        float beta = 1;
+
+        cublasStatus_t stat = cublasSgeam(r.cudaHandle, CUBLAS_OP_N,
+                CUBLAS_OP_N, rows, n, &alpha, mDevice + col * rows, rows, &beta,
+                r.mDevice + r_col * r.rows, r.rows, r.mDevice + r_col * r.rows, r.rows);
+
+        if (stat != CUBLAS_STATUS_SUCCESS)
+            cout << "cannot cublasSgeam" << endl;
+        cudaThreadSynchronize();
+    }
+
+    // this[:, col:col+n] = a[:, a_col:a_col+n]
+    void copy_cols(const cuMat &a, int a_col, int n, int col) {
+        cudaError_t error = cudaMemcpy(mDevice + col * rows, a.mDevice + a_col * a.rows,
+                rows * n * sizeof(*mDevice), cudaMemcpyDeviceToDevice);
+        if (error != cudaSuccess)
+            printf("cudaMemcpy error\n");
+    }
+
     void plus(const float beta, cuMat &r) {
         cuMat i(rows, cols);
         i.ones();
@@ -666,6 +751,100 @@ public:
             cudaThreadSynchronize();
     }
 
+    /**
+     * GEMMs on blocks of n consecutive columns (one time step of a [T x batch] sequence):
+     * r[:, r_col:r_col+n] += this * b[:, b_col:b_col+n]
+     */
+    void dot_plus_cols(const cuMat &b, int b_col, int n, cuMat &r, int r_col) {
+
+            float alpha = 1;
+            float beta = 1;
+
+            cublasStatus_t stat = cublasSgemm(cudaHandle,
+                    CUBLAS_OP_N, CUBLAS_OP_N,
+                    rows, n, cols,
+                    &alpha, mDevice, rows,
+                    b.mDevice + b_col * b.rows, b.rows,
+                    &beta, r.mDevice + r_col * r.rows, r.rows);
+        checkCublasErrors(stat);
+            if (stat != CUBLAS_STATUS_SUCCESS)
+                cout << "cannot cublasSgemm dot_plus_cols" << endl;
+            cudaThreadSynchronize();
+    }
+
+    // r[:, r_col:r_col+n] += this^T * b[:, b_col:b_col+n]
+    void transpose_dot_plus_cols(const cuMat &b, int b_col, int n, cuMat &r, int r_col) {
+
+            float alpha = 1;
+            float beta = 1;
+
+            cublasStatus_t stat = cublasSgemm(cudaHandle,
+                    CUBLAS_OP_T, CUBLAS_OP_N,
+                    cols, n, rows,
+                    &alpha, mDevice, rows,
+                    b.mDevice + b_col * b.rows, b.rows,
+                    &beta, r.mDevice + r_col * r.rows, r.rows);
+        checkCublasErrors(stat);
+            if (stat != CUBLAS_STATUS_SUCCESS)
+                cout << "cannot cublasSgemm transpose_dot_plus_cols" << endl;
+            cudaThreadSynchronize();
+    }
+
+    // r += this[:, col:col+n] * b[:, b_col:b_col+n]^T
+    void dot_transpose_plus_cols(int col, const cuMat &b, int b_col, int n, cuMat &r) {
+
+            float alpha = 1;
+            float beta = 1;
+
+            cublasStatus_t stat = cublasSgemm(cudaHandle,
+                    CUBLAS_OP_N, CUBLAS_OP_T,
+                    rows, b.rows, n,
+                    &alpha, mDevice + col * rows, rows,
+                    b.mDevice + b_col * b.rows, b.rows,
+                    &beta, r.mDevice, r.rows);
+        checkCublasErrors(stat);
+            if (stat != CUBLAS_STATUS_SUCCESS)
+                cout << "cannot cublasSgemm dot_transpose_plus_cols" << endl;
+            cudaThreadSynchronize();
+    }
+
+    /**
+     * Strided batched GEMM over batch blocks stored one after another:
+     * r_i = op_a(this_i) * op_b(b_i) + beta * r_i, r_i is (m x n), the inner dimension is k.
+     * Blocks are packed (leading dimension = block rows), b_shared uses b itself for every i.
+     */
+    void dot_batch(cublasOperation_t op_a, const cuMat &b, cublasOperation_t op_b, bool b_shared,
+                   cuMat &r, int m, int n, int k, int batch, float beta) {
+
+            int lda = op_a == CUBLAS_OP_N ? m : k;
+            int ldb = b_shared ? b.rows : (op_b == CUBLAS_OP_N ? k : n);
+
+            dot_batch(op_a, 0, lda, (long long)m * k,
+                      b, op_b, 0, ldb, b_shared ? 0 : (long long)k * n,
+                      r, 0, m, (long long)m * n, m, n, k, batch, beta);
+    }
+
+    // the same on sub-blocks, block i of this starts at mDevice + a_offset + i * a_stride
+    void dot_batch(cublasOperation_t op_a, int a_offset, int lda, long long a_stride,
+                   const cuMat &b, cublasOperation_t op_b, int b_offset, int ldb, long long b_stride,
+                   cuMat &r, int r_offset, int ldr, long long r_stride,
+                   int m, int n, int k, int batch, float beta) {
+
+            float alpha = 1;
+
+            cublasStatus_t stat = cublasSgemmStridedBatched(cudaHandle,
+                    op_a, op_b,
+                    m, n, k,
+                    &alpha, mDevice + a_offset, lda, a_stride,
+                    b.mDevice + b_offset, ldb, b_stride,
+                    &beta, r.mDevice + r_offset, ldr, r_stride,
+                    batch);
+        checkCublasErrors(stat);
+            if (stat != CUBLAS_STATUS_SUCCESS)
+                cout << "cannot cublasSgemmStridedBatched dot_batch" << endl;
+            cudaThreadSynchronize();
+    }
+
     cuMat transpose() {
         cuMat r(cols, rows);
         transpose(r);
@@ -879,6 +1058,34 @@ public:
             return std::sqrt(sum_h);
         }
 
+    // largest absolute value
+    float abs_max() {
+        int idx = 0;
+        cublasIsamax(cudaHandle, rows * cols, mDevice, 1, &idx);
+
+        float v = 0;
+        if (idx > 0) {
+            cudaError_t error = cudaMemcpy(&v, mDevice + idx - 1, sizeof(v), cudaMemcpyDeviceToHost);
+            if (error != cudaSuccess) printf("abs_max cudaMemcpy error\n");
+        }
+        return std::fabs(v);
+    }
+
+    // true if any element is an inf or a NaN
+    bool has_non_finite() {
+        int *flag_d;
+        int flag_h = 0;
+        cudaError_t error = cudaMalloc((void**) &flag_d, sizeof(*flag_d));
+        if (error != cudaSuccess) printf("has_non_finite cudaMalloc error\n");
+        cudaMemset(flag_d, 0x00, sizeof(*flag_d));
+        non_finite_kernel_exec(mDevice, rows * cols, flag_d);
+
+        error = cudaMemcpy(&flag_h, flag_d, sizeof(*flag_d), cudaMemcpyDeviceToHost);
+        if (error != cudaSuccess) printf("has_non_finite cudaMemcpy error\n");
+        cudaFree(flag_d);
+        return flag_h != 0;
+    }
+
     void maxRowIndex(int *idx) {
 
         if (mHost == NULL)
@@ -994,6 +1201,185 @@ public:
         vec_to_mat_kernel_exec(mDevice, r.mDevice, r.cols, r.rows);
     }
 
+
+    /**
+     * this holds the LSTM gate pre-activations [i f g o] (4H x B).
+     * c_next and h (H x B) are written, c_next may be the same matrix as c.
+     */
+    void lstm_forward(const cuMat &c, cuMat &c_next, cuMat &h){
+        lstm_forward_kernel_exec(mDevice, c.mDevice, c_next.mDevice, h.mDevice, h.cols, h.rows);
+    }
+
+    /**
+     * gc is overwritten with the gradient of c, the gate gradients are added to gx.
+     * gx may be NULL when the gates do not need a gradient.
+     */
+    void lstm_backward(const cuMat &c, const cuMat &c_next, const cuMat &gh, const cuMat &gc_next,
+                       cuMat &gc, cuMat *gx){
+        lstm_backward_kernel_exec(mDevice, c.mDevice, c_next.mDevice, gh.mDevice, gc_next.mDevice,
+                                  gc.mDevice, gx == NULL ? NULL : gx->mDevice, gh.cols, gh.rows);
+    }
+
+    /**
+     * Step t of a sequence: this holds the pre-activations of all steps (4H x T*batch),
+     * c_all the cell states c_0..c_T (H x (T+1)*batch) and h_all the outputs (H x T*batch).
+     * Only the first active columns of the step are computed (the sequences still running).
+     */
+    void lstm_step_forward(cuMat &c_all, cuMat &h_all, int t, int batch, int active){
+        int hidden = h_all.rows;
+        lstm_forward_kernel_exec(mDevice + t * batch * rows,
+                                 c_all.mDevice + t * batch * hidden, c_all.mDevice + (t+1) * batch * hidden,
+                                 h_all.mDevice + t * batch * hidden, active, hidden);
+    }
+
+    /**
+     * dc (H x batch) carries the cell gradient from step t+1 and is replaced by the one of step t,
+     * the gate gradients of step t are added to dgates.
+     */
+    void lstm_step_backward(const cuMat &c_all, const cuMat &dh_all, cuMat &dc, cuMat &dgates, int t, int batch, int active){
+        int hidden = dh_all.rows;
+        lstm_backward_kernel_exec(mDevice + t * batch * rows,
+                                  c_all.mDevice + t * batch * hidden, c_all.mDevice + (t+1) * batch * hidden,
+                                  dh_all.mDevice + t * batch * hidden, dc.mDevice, dc.mDevice,
+                                  dgates.mDevice + t * batch * rows, active, hidden);
+    }
+
+    /**
+     * Step t of a GRU sequence: this holds W_x x + b_x of all steps (3H x T*batch),
+     * gh the recurrent part W_h h_{t-1} + b_h (3H x T*batch) and h_all the outputs.
+     * h0 (H x batch) is the state before the first step. Only the first active columns are computed.
+     */
+    void gru_step_forward(const cuMat &gh, const cuMat &h0, cuMat &h_all, int t, int batch, int active){
+        int hidden = h_all.rows;
+        const float *h_prev = t == 0 ? h0.mDevice : h_all.mDevice + (t-1) * batch * hidden;
+        gru_forward_kernel_exec(mDevice + t * batch * rows, gh.mDevice + t * batch * rows,
+                                h_prev, h_all.mDevice + t * batch * hidden, active, hidden);
+    }
+
+    /**
+     * Writes the gate gradients of step t into dgx/dgh and adds the direct part of the
+     * h_{t-1} gradient to dh_all (the recurrent GEMM part is left to the caller).
+     */
+    void gru_step_backward(const cuMat &gh, const cuMat &h0, const cuMat &h_all, cuMat &dh_all,
+                           cuMat &dgx, cuMat &dgh, int t, int batch, int active){
+        int hidden = h_all.rows;
+        const float *h_prev = t == 0 ? h0.mDevice : h_all.mDevice + (t-1) * batch * hidden;
+        float *dh_prev = t == 0 ? NULL : dh_all.mDevice + (t-1) * batch * hidden;
+        gru_backward_kernel_exec(mDevice + t * batch * rows, gh.mDevice + t * batch * rows, h_prev,
+                                 dh_all.mDevice + t * batch * hidden,
+                                 dgx.mDevice + t * batch * rows, dgh.mDevice + t * batch * rows,
+                                 dh_prev, active, hidden);
+    }
+
+    /**
+     * Peephole LSTM step: this holds the gate pre-activations [i f g o] (4H x B), peep the
+     * diagonal peepholes [p_i p_f p_o] (3H x 1). gamma and beta (4H x 1) are the layer norm
+     * scale and shift applied to this, NULL when the gates are not normalized.
+     */
+    void peephole_lstm_forward(const cuMat *gamma, const cuMat *beta, const cuMat &peep,
+                               const cuMat &c, cuMat &c_next, cuMat &h){
+        peephole_lstm_forward_kernel_exec(mDevice, gamma == NULL ? NULL : gamma->mDevice,
+                                          beta == NULL ? NULL : beta->mDevice, peep.mDevice,
+                                          c.mDevice, c_next.mDevice, h.mDevice, h.cols, h.rows);
+    }
+
+    /**
+     * ga (4H x B) and gpeep (3H x B) are overwritten, gc (may be NULL) is accumulated.
+     */
+    void peephole_lstm_backward(const cuMat *gamma, const cuMat *beta, const cuMat &peep,
+                                const cuMat &c, const cuMat &c_next, const cuMat &gh, const cuMat &gc_next,
+                                cuMat *gc, cuMat &ga, cuMat &gpeep){
+        peephole_lstm_backward_kernel_exec(mDevice, gamma == NULL ? NULL : gamma->mDevice,
+                                           beta == NULL ? NULL : beta->mDevice, peep.mDevice,
+                                           c.mDevice, c_next.mDevice, gh.mDevice, gc_next.mDevice,
+                                           gc == NULL ? NULL : gc->mDevice, ga.mDevice, gpeep.mDevice,
+                                           gh.cols, gh.rows);
+    }
+
+    /**
+     * Layer normalizes each of the gates row blocks of every column in place,
+     * rstd (gates x cols) receives 1/sigma of every block.
+     */
+    void gate_layer_norm(int gates, cuMat &rstd){
+        rstd.new_matrix(gates, cols);
+        gate_layer_norm_kernel_exec(mDevice, rstd.mDevice, gates, cols, rows / gates);
+    }
+
+    /**
+     * this holds the normalized values. gy, the gradient of gamma * this + beta, is replaced
+     * by the gradient of the values before the normalization, ggamma receives gy * this.
+     */
+    void gate_layer_norm_backward(int gates, const cuMat &gamma, const cuMat &rstd, cuMat &gy, cuMat &ggamma){
+        gate_layer_norm_backward_kernel_exec(mDevice, gamma.mDevice, rstd.mDevice, gy.mDevice, ggamma.mDevice,
+                                             gates, cols, rows / gates);
+    }
+
+    /**
+     * Batch normalization of every row over the columns, gamma and beta have one value per row.
+     * In training the running statistics (may be NULL) are updated with lambda,
+     * otherwise they are used instead of the batch statistics. mean and rstd keep 1/sigma for backward.
+     */
+    void batch_norm_forward(const cuMat &gamma, const cuMat &beta, cuMat *running_mean, cuMat *running_var,
+                            cuMat &mean, cuMat &rstd, cuMat &r, bool is_train, float lambda){
+        mean.new_matrix(rows, 1);
+        rstd.new_matrix(rows, 1);
+        batch_norm_forward_kernel_exec(mDevice, gamma.mDevice, beta.mDevice,
+                                       running_mean == NULL ? NULL : running_mean->mDevice,
+                                       running_var == NULL ? NULL : running_var->mDevice,
+                                       mean.mDevice, rstd.mDevice, r.mDevice, is_train, lambda, cols, rows);
+    }
+
+    /**
+     * this is the input of batch_norm_forward. ggamma, gbeta and gx (may be NULL) are accumulated.
+     */
+    void batch_norm_backward(const cuMat &gamma, const cuMat &mean, const cuMat &rstd, const cuMat &gy,
+                             cuMat &ggamma, cuMat &gbeta, cuMat *gx, bool is_train){
+        batch_norm_backward_kernel_exec(mDevice, gamma.mDevice, mean.mDevice, rstd.mDevice, gy.mDevice,
+                                        ggamma.mDevice, gbeta.mDevice, gx == NULL ? NULL : gx->mDevice,
+                                        is_train, cols, rows);
+    }
+
+    /**
+     * r = this * scale + shift with one value per row, shift may be NULL.
+     * With accumulate the result is added to r.
+     */
+    void row_affine(const cuMat &scale, const cuMat *shift, cuMat &r, bool accumulate = false){
+        row_affine_kernel_exec(mDevice, scale.mDevice, shift == NULL ? NULL : shift->mDevice, r.mDevice,
+                               accumulate, cols, rows);
+    }
+
+    /**
+     * this is an embedding table with one column per id, ids (1 x B) holds ids as floats.
+     * r (rows x B) receives the columns of the ids.
+     */
+    void embed_gather(const cuMat &ids, cuMat &r){
+        embed_gather_kernel_exec(mDevice, ids.mDevice, r.mDevice, ids.cols, rows);
+    }
+
+    /**
+     * this (rows x B) is added to the columns ids of grad, ids may repeat.
+     */
+    void embed_scatter_add(const cuMat &ids, cuMat &grad){
+        embed_scatter_add_kernel_exec(mDevice, ids.mDevice, grad.mDevice, ids.cols, rows);
+    }
+
+    /**
+     * this[:, id] += alpha * x[:, id] for every id of ids (1 x K, no repeats),
+     * x == NULL zeros the columns.
+     */
+    void plus_cols(float alpha, const cuMat *x, const cuMat &ids){
+        cols_axpy_kernel_exec(alpha, x == NULL ? NULL : x->mDevice, ids.mDevice, mDevice, ids.cols, rows);
+    }
+
+    /**
+     * adam2 restricted to the columns ids (no repeats), this and mv are the moments,
+     * w is updated in place.
+     */
+    void adam_cols(cuMat &mv, const cuMat &mg, const cuMat &ids, cuMat &w, float beta1, float beta2, float lr, float e){
+        adam_cols_kernel_exec(mDevice, mv.mDevice, mg.mDevice, ids.mDevice, w.mDevice,
+                              beta1, beta2, lr, e, ids.cols, rows);
+    }
+
     cuMat im2col(int w_size, int h_size, int channel_num, int filter_size_w, int filter_size_h,
         int stride_x, int stride_y, int pad_left, int pad_right, int pad_top, int pad_bottom, int &outputDimW, int &outputDimH){
 
@@ -1026,6 +1412,69 @@ public:
     }
 
 
+    /**
+     * Attention of the queries in this (d x batch) over keys (d x steps*batch) and values
+     * (dv x steps*batch), step t of column b in column t*batch+b. r is (dv x batch),
+     * lse (heads x batch) is kept for the backward. v (d x 1) selects additive scores, NULL dot products.
+     */
+    void attention_forward(const cuMat &keys, const cuMat &values, const cuMat *v, int heads, float scale,
+                           cuMat &r, cuMat &lse){
+        attention_forward_kernel_exec(mDevice, keys.mDevice, values.mDevice, v == NULL ? NULL : v->mDevice,
+                                      r.mDevice, lse.mDevice, rows, values.rows, heads, keys.cols / cols, cols, scale);
+    }
+
+    // this is the output gradient, the gradients that are not NULL are accumulated
+    void attention_backward(const cuMat &q, const cuMat &keys, const cuMat &values, const cuMat *v, int heads, float scale,
+                            const cuMat &out, const cuMat &lse, cuMat *gq, cuMat *gkeys, cuMat *gvalues, cuMat *gv){
+        attention_backward_kernel_exec(q.mDevice, keys.mDevice, values.mDevice, v == NULL ? NULL : v->mDevice,
+                                       out.mDevice, lse.mDevice, mDevice,
+                                       gq == NULL ? NULL : gq->mDevice, gkeys == NULL ? NULL : gkeys->mDevice,
+                                       gvalues == NULL ? NULL : gvalues->mDevice, gv == NULL ? NULL : gv->mDevice,
+                                       q.rows, values.rows, heads, keys.cols / q.cols, q.cols, scale);
+    }
+
+    /**
+     * Depthwise convolution of the images in the columns of this (channels * w_size^2 x batch),
+     * w (channels x filter_size^2), b (channels x 1). r is (channels * outputDim^2 x batch).
+     */
+    void depthwise_conv_forward(int w_size, int channel_num, int filter_size, int stride, int padding, int dilation,
+                                const cuMat &w, const cuMat &b, cuMat &r){
+        depthwise_conv_forward_kernel_exec(mDevice, w.mDevice, b.mDevice, r.mDevice, cols, channel_num,
+                                           w_size, w_size, filter_size, stride, padding, dilation);
+    }
+
+    // this is the output gradient, gw, gb and gx (if not NULL) are accumulated
+    void depthwise_conv_backward(int w_size, int channel_num, int filter_size, int stride, int padding, int dilation,
+                                 const cuMat &x, const cuMat &w, cuMat &gw, cuMat &gb, cuMat *gx){
+        depthwise_conv_backward_kernel_exec(x.mDevice, w.mDevice, mDevice, gw.mDevice, gb.mDevice,
+                                            gx == NULL ? NULL : gx->mDevice, cols, channel_num,
+                                            w_size, w_size, filter_size, stride, padding, dilation);
+    }
+
+    /*
+     * im2col / col2im of all batch images (one per column) in one launch,
+     * image b gets the columns b*k..(b+1)*k-1 of stacked (outputDim^2 x k*batch), k = filter^2 * channels.
+     * col2im_batch adds to dest.
+     */
+    void im2col_batch(int w_size, int channel_num, int filter_size, int stride, int padding, cuMat &stacked,
+                      int dilation = 1){
+
+        im2col_batch_ongpu(mDevice, cols,
+                           channel_num, w_size, w_size,
+                           filter_size, stride, padding, dilation, stacked.mDevice);
+        cudaThreadSynchronize();
+    }
+
+    void col2im_batch(int w_size, int channel_num, int filter_size, int stride, int padding, cuMat &dest,
+                      int dilation = 1){
+
+        col2im_batch_ongpu(mDevice, dest.cols,
+                           channel_num, w_size, w_size,
+                           filter_size, stride, padding, dilation, dest.mDevice);
+        cudaThreadSynchronize();
+    }
+
+
     cuMat pooling(int batch_size, int width, int height, int depth, int windowWidth, int windowHeight,
                   int strideX, int strideY, int padLeft, int padRight, int padTop, int padBottom){
 
@@ -0,0 +1,164 @@
+#include "depthwise_conv_kernel.h"
+
+#define BLOCK_SIZE 32
+#define REDUCE_THREADS 256
+
+/*
+ * Depthwise convolution: every channel is convolved with its own ksize x ksize filter,
+ * w is (channels x ksize^2), b is (channels x 1). Images are columns (channel, h, w) as for
+ * FunctionConv2D. There is nothing to share between channels, so instead of im2col
+ * every output pixel reads its taps straight from x.
+ *
+ * m is the batch, n is the size of one output (or input for the backward data) column.
+ */
+__global__ void depthwise_conv_forward_kernel (const float * __restrict__ x, const float * __restrict__ w,
+                                const float * __restrict__ b, float * __restrict__ y,
+                                int channels, int height, int width, int ksize, int stride, int pad, int dilation,
+                                int height_col, int width_col, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        int w_out = col % width_col;
+        int h_out = (col / width_col) % height_col;
+        int c = col / (width_col * height_col);
+
+        const float *x_c = x + (row * channels + c) * height * width;
+        int h_in = h_out * stride - pad;
+        int w_in = w_out * stride - pad;
+
+        float sum = b[c];
+        for (int i = 0; i < ksize; i++){
+            int h = h_in + i * dilation;
+            if (h < 0 || h >= height) continue;
+            for (int j = 0; j < ksize; j++){
+                int ww = w_in + j * dilation;
+                if (ww < 0 || ww >= width) continue;
+                sum += w[(i * ksize + j) * channels + c] * x_c[h * width + ww];
+            }
+        }
+        y[row * n + col] = sum;
+    }
+}
+
+// gx += the gradient of x, one thread per input pixel gathers the outputs it fed
+__global__ void depthwise_conv_backward_data_kernel (const float * __restrict__ gy, const float * __restrict__ w,
+                                float * __restrict__ gx,
+                                int channels, int height, int width, int ksize, int stride, int pad, int dilation,
+                                int height_col, int width_col, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        int w_in = col % width;
+        int h_in = (col / width) % height;
+        int c = col / (width * height);
+
+        const float *gy_c = gy + (row * channels + c) * height_col * width_col;
+
+        float sum = 0;
+        for (int i = 0; i < ksize; i++){
+            int h = h_in + pad - i * dilation;
+            if (h < 0 || h % stride != 0 || h / stride >= height_col) continue;
+            for (int j = 0; j < ksize; j++){
+                int ww = w_in + pad - j * dilation;
+                if (ww < 0 || ww % stride != 0 || ww / stride >= width_col) continue;
+                sum += w[(i * ksize + j) * channels + c] * gy_c[(h / stride) * width_col + ww / stride];
+            }
+        }
+        gx[row * n + col] += sum;
+    }
+}
+
+/*
+ * gw and gb are accumulated. One block per (tap, channel), blockIdx.x == ksize^2 is the bias;
+ * the threads stride over batch x output pixels and the block reduces in shared memory,
+ * so the sum order is fixed.
+ */
+__global__ void depthwise_conv_backward_filter_kernel (const float * __restrict__ x, const float * __restrict__ gy,
+                                float * __restrict__ gw, float * __restrict__ gb,
+                                int channels, int height, int width, int ksize, int stride, int pad, int dilation,
+                                int height_col, int width_col, int batch){
+    __shared__ float partial[REDUCE_THREADS];
+
+    int tap = blockIdx.x;
+    int c = blockIdx.y;
+    int out_size = height_col * width_col;
+    int di = (tap / ksize) * dilation - pad;
+    int dj = (tap % ksize) * dilation - pad;
+
+    float sum = 0;
+    for (int k = threadIdx.x; k < batch * out_size; k += blockDim.x){
+        int s = k / out_size;
+        int p = k % out_size;
+        float g = gy[(s * channels + c) * out_size + p];
+
+        if (tap == ksize * ksize){
+            sum += g;
+        }
+        else {
+            int h = (p / width_col) * stride + di;
+            int ww = (p % width_col) * stride + dj;
+            if (h >= 0 && h < height && ww >= 0 && ww < width){
+                sum += g * x[((s * channels + c) * height + h) * width + ww];
+            }
+        }
+    }
+    partial[threadIdx.x] = sum;
+    __syncthreads();
+
+    for (int half = blockDim.x / 2; half > 0; half /= 2){
+        if (threadIdx.x < half) partial[threadIdx.x] += partial[threadIdx.x + half];
+        __syncthreads();
+    }
+
+    if (threadIdx.x == 0){
+        if (tap == ksize * ksize) gb[c] += partial[0];
+        else gw[tap * channels + c] += partial[0];
+    }
+}
+
+void depthwise_conv_forward_kernel_exec(const float *x, const float *w, const float *b, float *y,
+                                        int batch, int channels, int height, int width,
+                                        int ksize, int stride, int pad, int dilation){
+    int extent = dilation * (ksize - 1) + 1;
+    int height_col = (height + 2 * pad - extent) / stride + 1;
+    int width_col = (width + 2 * pad - extent) / stride + 1;
+    int m = batch;
+    int n = channels * height_col * width_col;
+
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    depthwise_conv_forward_kernel<<<grid, block>>>(x, w, b, y, channels, height, width, ksize, stride, pad, dilation,
+                                                   height_col, width_col, m, n);
+    cudaThreadSynchronize();
+}
+
+void depthwise_conv_backward_kernel_exec(const float *x, const float *w, const float *gy,
+                                         float *gw, float *gb, float *gx,
+                                         int batch, int channels, int height, int width,
+                                         int ksize, int stride, int pad, int dilation){
+    int extent = dilation * (ksize - 1) + 1;
+    int height_col = (height + 2 * pad - extent) / stride + 1;
+    int width_col = (width + 2 * pad - extent) / stride + 1;
+
+    /* lunch kernel */
+    dim3 reduce_grid(ksize * ksize + 1, channels);
+    depthwise_conv_backward_filter_kernel<<<reduce_grid, REDUCE_THREADS>>>(x, gy, gw, gb, channels, height, width,
+                                                   ksize, stride, pad, dilation, height_col, width_col, batch);
+
+    if (gx != NULL){
+        int m = batch;
+        int n = channels * height * width;
+
+        dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+        dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+        depthwise_conv_backward_data_kernel<<<grid, block>>>(gy, w, gx, channels, height, width, ksize, stride, pad,
+                                                   dilation, height_col, width_col, m, n);
+    }
+    cudaThreadSynchronize();
+}
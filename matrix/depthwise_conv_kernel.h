@@ -0,0 +1,34 @@
+#include <cuda_runtime.h>
+
+#ifndef _depthwise_conv_kernel_
+#define _depthwise_conv_kernel_
+
+__global__ void depthwise_conv_forward_kernel (const float * __restrict__ x, const float * __restrict__ w,
+                                const float * __restrict__ b, float * __restrict__ y,
+                                int channels, int height, int width, int ksize, int stride, int pad, int dilation,
+                                int height_col, int width_col, int m, int n);
+
+__global__ void depthwise_conv_backward_data_kernel (const float * __restrict__ gy, const float * __restrict__ w,
+                                float * __restrict__ gx,
+                                int channels, int height, int width, int ksize, int stride, int pad, int dilation,
+                                int height_col, int width_col, int m, int n);
+
+__global__ void depthwise_conv_backward_filter_kernel (const float * __restrict__ x, const float * __restrict__ gy,
+                                float * __restrict__ gw, float * __restrict__ gb,
+                                int channels, int height, int width, int ksize, int stride, int pad, int dilation,
+                                int height_col, int width_col, int batch);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void depthwise_conv_forward_kernel_exec(const float *x, const float *w, const float *b, float *y,
+                                            int batch, int channels, int height, int width,
+                                            int ksize, int stride, int pad, int dilation);
+    void depthwise_conv_backward_kernel_exec(const float *x, const float *w, const float *gy,
+                                             float *gw, float *gb, float *gx,
+                                             int batch, int channels, int height, int width,
+                                             int ksize, int stride, int pad, int dilation);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
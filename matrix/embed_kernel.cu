@@ -0,0 +1,102 @@
+#include "embed_kernel.h"
+
+#define BLOCK_SIZE 32
+
+/*
+ * w is the embedding table (n x vocab), one column per id, ids (m) holds the ids as floats.
+ * Every kernel works on the n x m block of the columns picked by ids.
+ */
+
+/* r (n x m): column j is the column ids[j] of w */
+__global__ void embed_gather_kernel (const float * __restrict__ w, const float * __restrict__ ids,
+                                float * __restrict__ r, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        int id = (int)ids[row];
+        r[row * n + col] = w[id * n + col];
+    }
+}
+
+/* column j of gy is added to the column ids[j] of grad, an id may appear more than once */
+__global__ void embed_scatter_add_kernel (const float * __restrict__ gy, const float * __restrict__ ids,
+                                float * __restrict__ grad, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        int id = (int)ids[row];
+        atomicAdd(&grad[id * n + col], gy[row * n + col]);
+    }
+}
+
+/* y[:, id] += alpha * x[:, id] for the unique ids, with x == NULL the columns are zeroed */
+__global__ void cols_axpy_kernel (float alpha, const float * __restrict__ x, const float * __restrict__ ids,
+                                float * __restrict__ y, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        int idx = (int)ids[row] * n + col;
+        if (x == NULL) y[idx] = 0;
+        else y[idx] += alpha * x[idx];
+    }
+}
+
+/* adam2_kernel on the unique ids only, w is updated in place */
+__global__ void adam_cols_kernel (float * __restrict__ mm, float * __restrict__ mv,
+                                const float * __restrict__ mg, const float * __restrict__ ids,
+                                float * __restrict__ w, float beta1, float beta2,
+                                float lr, float e, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        int idx = (int)ids[row] * n + col;
+        mm[idx] += (1.0f - beta1) * (mg[idx] - mm[idx]);
+        mv[idx] += (1.0f - beta2) * (mg[idx]*mg[idx] - mv[idx]);
+        w[idx] += lr * mm[idx] / (std::sqrt(mv[idx]) + e);
+    }
+}
+
+void embed_gather_kernel_exec(const float *w, const float *ids, float *r, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    embed_gather_kernel<<<grid, block>>>(w, ids, r, m, n);
+    cudaThreadSynchronize();
+}
+
+void embed_scatter_add_kernel_exec(const float *gy, const float *ids, float *grad, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    embed_scatter_add_kernel<<<grid, block>>>(gy, ids, grad, m, n);
+    cudaThreadSynchronize();
+}
+
+void cols_axpy_kernel_exec(float alpha, const float *x, const float *ids, float *y, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    cols_axpy_kernel<<<grid, block>>>(alpha, x, ids, y, m, n);
+    cudaThreadSynchronize();
+}
+
+void adam_cols_kernel_exec(float *mm, float *mv, const float *mg, const float *ids, float *w,
+                           float beta1, float beta2, float lr, float e, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    adam_cols_kernel<<<grid, block>>>(mm, mv, mg, ids, w, beta1, beta2, lr, e, m, n);
+    cudaThreadSynchronize();
+}
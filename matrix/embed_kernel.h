@@ -0,0 +1,31 @@
+#include <cuda_runtime.h>
+
+#ifndef _embed_kernel_
+#define _embed_kernel_
+
+__global__ void embed_gather_kernel (const float * __restrict__ w, const float * __restrict__ ids,
+                                float * __restrict__ r, int m, int n);
+
+__global__ void embed_scatter_add_kernel (const float * __restrict__ gy, const float * __restrict__ ids,
+                                float * __restrict__ grad, int m, int n);
+
+__global__ void cols_axpy_kernel (float alpha, const float * __restrict__ x, const float * __restrict__ ids,
+                                float * __restrict__ y, int m, int n);
+
+__global__ void adam_cols_kernel (float * __restrict__ mm, float * __restrict__ mv,
+                                const float * __restrict__ mg, const float * __restrict__ ids,
+                                float * __restrict__ w, float beta1, float beta2,
+                                float lr, float e, int m, int n);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void embed_gather_kernel_exec(const float *w, const float *ids, float *r, int m, int n);
+    void embed_scatter_add_kernel_exec(const float *gy, const float *ids, float *grad, int m, int n);
+    void cols_axpy_kernel_exec(float alpha, const float *x, const float *ids, float *y, int m, int n);
+    void adam_cols_kernel_exec(float *mm, float *mv, const float *mg, const float *ids, float *w,
+                               float beta1, float beta2, float lr, float e, int m, int n);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
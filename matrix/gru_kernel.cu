@@ -0,0 +1,90 @@
+#include "gru_kernel.h"
+
+#define BLOCK_SIZE 32
+
+/*
+ * gx = W_x x + b_x and gh = W_h h_prev + b_h hold the gates [r z g] stacked by rows (3n x m).
+ *   r = sigmoid(gx_r + gh_r)
+ *   z = sigmoid(gx_z + gh_z)
+ *   g = tanh(gx_g + r * gh_g)
+ *   h = (1 - z) * h_prev + z * g
+ */
+
+__device__ __forceinline__ float gru_sigmoid (float a){
+    return 1.0f/(1.0f + std::exp(-a));
+}
+
+__global__ void gru_forward_kernel (const float * __restrict__ gx, const float * __restrict__ gh,
+                                const float * __restrict__ h_prev, float * __restrict__ h, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        const float *xr = gx + row * n * 3;
+        const float *hr = gh + row * n * 3;
+
+        float r = gru_sigmoid(xr[col] + hr[col]);
+        float z = gru_sigmoid(xr[n + col] + hr[n + col]);
+        float g = std::tanh(xr[n * 2 + col] + r * hr[n * 2 + col]);
+
+        h[row * n + col] = (1.0f - z) * h_prev[row * n + col] + z * g;
+    }
+}
+
+/* dgx and dgh are overwritten, dh_prev (if not NULL) is accumulated */
+__global__ void gru_backward_kernel (const float * __restrict__ gx, const float * __restrict__ gh,
+                                const float * __restrict__ h_prev, const float * __restrict__ dh,
+                                float * __restrict__ dgx, float * __restrict__ dgh, float * __restrict__ dh_prev, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        const float *xr = gx + row * n * 3;
+        const float *hr = gh + row * n * 3;
+
+        float r = gru_sigmoid(xr[col] + hr[col]);
+        float z = gru_sigmoid(xr[n + col] + hr[n + col]);
+        float g = std::tanh(xr[n * 2 + col] + r * hr[n * 2 + col]);
+
+        float hp = h_prev[row * n + col];
+        float d = dh[row * n + col];
+
+        float dg = d * z * (1.0f - g * g);
+        float dz = d * (g - hp) * (1.0f - z) * z;
+        float dr = dg * hr[n * 2 + col] * (1.0f - r) * r;
+
+        float *dxr = dgx + row * n * 3;
+        float *dhr = dgh + row * n * 3;
+
+        dxr[col] = dr;
+        dxr[n + col] = dz;
+        dxr[n * 2 + col] = dg;
+
+        dhr[col] = dr;
+        dhr[n + col] = dz;
+        dhr[n * 2 + col] = dg * r;
+
+        if (dh_prev != NULL) dh_prev[row * n + col] += d * (1.0f - z);
+    }
+}
+
+void gru_forward_kernel_exec(const float *gx, const float *gh, const float *h_prev, float *h, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    gru_forward_kernel<<<grid, block>>>(gx, gh, h_prev, h, m, n);
+    cudaThreadSynchronize();
+}
+
+void gru_backward_kernel_exec(const float *gx, const float *gh, const float *h_prev, const float *dh,
+                              float *dgx, float *dgh, float *dh_prev, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    gru_backward_kernel<<<grid, block>>>(gx, gh, h_prev, dh, dgx, dgh, dh_prev, m, n);
+    cudaThreadSynchronize();
+}
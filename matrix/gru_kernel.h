@@ -0,0 +1,22 @@
+#include <cuda_runtime.h>
+
+#ifndef _gru_kernel_
+#define _gru_kernel_
+
+__global__ void gru_forward_kernel (const float * __restrict__ gx, const float * __restrict__ gh,
+                                const float * __restrict__ h_prev, float * __restrict__ h, int m, int n);
+
+__global__ void gru_backward_kernel (const float * __restrict__ gx, const float * __restrict__ gh,
+                                const float * __restrict__ h_prev, const float * __restrict__ dh,
+                                float * __restrict__ dgx, float * __restrict__ dgh, float * __restrict__ dh_prev, int m, int n);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void gru_forward_kernel_exec(const float *gx, const float *gh, const float *h_prev, float *h, int m, int n);
+    void gru_backward_kernel_exec(const float *gx, const float *gh, const float *h_prev, const float *dh,
+                                  float *dgx, float *dgh, float *dh_prev, int m, int n);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
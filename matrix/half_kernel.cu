@@ -0,0 +1,62 @@
+#include <cuda_fp16.h>
+
+#include "half_kernel.h"
+
+#define HALF_THREADS 256
+
+/*
+ * 16 bit storage of float data: fp16 with the cuda_fp16 conversions, bf16 as the upper
+ * half of the float bits rounded to nearest even, so it needs no bf16 hardware.
+ */
+
+__device__ unsigned short float_to_bf16(float f){
+    unsigned int u = __float_as_uint(f);
+    if ((u & 0x7fffffff) > 0x7f800000) return (u >> 16) | 0x40;    // keep NaN a quiet NaN
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+}
+
+__device__ float bf16_to_float(unsigned short h){
+    return __uint_as_float(((unsigned int) h) << 16);
+}
+
+__global__ void float_to_half_kernel (const float * __restrict__ x, unsigned short * __restrict__ h, int n, int bf16){
+    int i = blockIdx.x*blockDim.x+threadIdx.x;
+    if (i < n){
+        h[i] = bf16 ? float_to_bf16(x[i]) : __half_as_ushort(__float2half_rn(x[i]));
+    }
+}
+
+__global__ void half_to_float_kernel (const unsigned short * __restrict__ h, float * __restrict__ x, int n, int bf16){
+    int i = blockIdx.x*blockDim.x+threadIdx.x;
+    if (i < n){
+        x[i] = bf16 ? bf16_to_float(h[i]) : __half2float(__ushort_as_half(h[i]));
+    }
+}
+
+/* flag is set to 1 if x has an inf or a NaN */
+__global__ void non_finite_kernel (const float * __restrict__ x, int n, int * __restrict__ flag){
+    int i = blockIdx.x*blockDim.x+threadIdx.x;
+    if (i < n && !isfinite(x[i])) *flag = 1;
+}
+
+void float_to_half_kernel_exec(const float *x, unsigned short *h, int n, int bf16){
+
+    /* lunch kernel */
+    float_to_half_kernel<<<(n + HALF_THREADS - 1) / HALF_THREADS, HALF_THREADS>>>(x, h, n, bf16);
+    cudaThreadSynchronize();
+}
+
+void half_to_float_kernel_exec(const unsigned short *h, float *x, int n, int bf16){
+
+    /* lunch kernel */
+    half_to_float_kernel<<<(n + HALF_THREADS - 1) / HALF_THREADS, HALF_THREADS>>>(h, x, n, bf16);
+    cudaThreadSynchronize();
+}
+
+void non_finite_kernel_exec(const float *x, int n, int *flag){
+
+    /* lunch kernel */
+    non_finite_kernel<<<(n + HALF_THREADS - 1) / HALF_THREADS, HALF_THREADS>>>(x, n, flag);
+    cudaThreadSynchronize();
+}
@@ -0,0 +1,21 @@
+#include <cuda_runtime.h>
+
+#ifndef _half_kernel_
+#define _half_kernel_
+
+__global__ void float_to_half_kernel (const float * __restrict__ x, unsigned short * __restrict__ h, int n, int bf16);
+
+__global__ void half_to_float_kernel (const unsigned short * __restrict__ h, float * __restrict__ x, int n, int bf16);
+
+__global__ void non_finite_kernel (const float * __restrict__ x, int n, int * __restrict__ flag);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void float_to_half_kernel_exec(const float *x, unsigned short *h, int n, int bf16);
+    void half_to_float_kernel_exec(const unsigned short *h, float *x, int n, int bf16);
+    void non_finite_kernel_exec(const float *x, int n, int *flag);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -1,30 +1,42 @@
+#include "im2col.h"
+
 #define BLOCK 1024
 
+/*
+ * n covers batch * channels * height_col * width_col, sample b reads the image at
+ * data_im + b * im_size and writes its columns at data_col + b * col_size.
+ * Filter taps are dilation pixels apart.
+ */
 __global__ void im2col_gpu_kernel(const int n, const float* data_im,
-        const int height, const int width, const int ksize,
+        const int channels, const int height, const int width, const int ksize,
         const int pad,
         const int stride,
+        const int dilation,
         const int height_col, const int width_col,
         float *data_col) {
     int index = blockIdx.x*blockDim.x+threadIdx.x;
+    int im_size = channels * height * width;
+    int col_size = channels * ksize * ksize * height_col * width_col;
     for(; index < n; index += blockDim.x*gridDim.x){
         int w_out = index % width_col;
         int h_index = index / width_col;
         int h_out = h_index % height_col;
-        int channel_in = h_index / height_col;
+        int c_index = h_index / height_col;
+        int channel_in = c_index % channels;
+        int b = c_index / channels;
         int channel_out = channel_in * ksize * ksize;
         int h_in = h_out * stride - pad;
         int w_in = w_out * stride - pad;
-        float* data_col_ptr = data_col;
+        float* data_col_ptr = data_col + b * col_size;
         data_col_ptr += (channel_out * height_col + h_out) * width_col + w_out;
-        const float* data_im_ptr = data_im;
+        const float* data_im_ptr = data_im + b * im_size;
         data_im_ptr += (channel_in * height + h_in) * width + w_in;
         for (int i = 0; i < ksize; ++i) {
             for (int j = 0; j < ksize; ++j) {
-                int h = h_in + i;
-                int w = w_in + j;
+                int h = h_in + i * dilation;
+                int w = w_in + j * dilation;
                 *data_col_ptr = (h >= 0 && w >= 0 && h < height && w < width) ?
-                    data_im_ptr[i * width + j] : 0;
+                    data_im_ptr[(i * width + j) * dilation] : 0;
                 data_col_ptr += height_col * width_col;
             }
         }
@@ -35,43 +47,63 @@ void im2col_ongpu(float *im,
          int channels, int height, int width,
          int ksize, int stride, int pad, float *data_col){
 
-    int height_col = (height + 2 * pad - ksize) / stride + 1;
-    int width_col = (width + 2 * pad - ksize) / stride + 1;
-    int num_kernels = channels * height_col * width_col;
+    im2col_batch_ongpu(im, 1, channels, height, width, ksize, stride, pad, 1, data_col);
+}
+
+void im2col_batch_ongpu(float *im, int batch,
+         int channels, int height, int width,
+         int ksize, int stride, int pad, int dilation, float *data_col){
+
+    int extent = dilation * (ksize - 1) + 1;
+    int height_col = (height + 2 * pad - extent) / stride + 1;
+    int width_col = (width + 2 * pad - extent) / stride + 1;
+    int num_kernels = batch * channels * height_col * width_col;
     im2col_gpu_kernel<<<(num_kernels+BLOCK-1)/BLOCK,
         BLOCK>>>(
-                num_kernels, im, height, width, ksize, pad,
-                stride, height_col,
+                num_kernels, im, channels, height, width, ksize, pad,
+                stride, dilation, height_col,
                 width_col, data_col);
 }
 
 
 
+/*
+ * n covers batch * channels * height * width, each sample only reads its own columns,
+ * so the samples need no reduction. Adds to data_im.
+ */
 __global__ void col2im_gpu_kernel(const int n, const float* data_col,
-        const int height, const int width, const int ksize,
+        const int channels, const int height, const int width, const int ksize,
         const int pad,
         const int stride,
+        const int dilation,
         const int height_col, const int width_col,
         float *data_im) {
     int index = blockIdx.x*blockDim.x+threadIdx.x;
+    int col_size = channels * ksize * ksize * height_col * width_col;
+    int extent = dilation * (ksize - 1) + 1;
     for(; index < n; index += blockDim.x*gridDim.x){
         float val = 0;
         int w = index % width + pad;
         int h = (index / width) % height + pad;
-        int c = index / (width * height);
+        int c = (index / (width * height)) % channels;
+        int b = index / (width * height * channels);
 
-        int w_col_start = (w < ksize) ? 0 : (w - ksize) / stride + 1;
+        int w_col_start = (w < extent) ? 0 : (w - extent) / stride + 1;
         int w_col_end = min(w / stride + 1, width_col);
-        int h_col_start = (h < ksize) ? 0 : (h - ksize) / stride + 1;
+        int h_col_start = (h < extent) ? 0 : (h - extent) / stride + 1;
         int h_col_end = min(h / stride + 1, height_col);
 
-        int offset =
-            (c * ksize * ksize + h * ksize + w) * height_col * width_col;
-        int coeff_h_col = (1 - stride * ksize * height_col) * width_col;
-        int coeff_w_col = (1 - stride * height_col * width_col);
+        const float *data_col_b = data_col + b * col_size;
         for (int h_col = h_col_start; h_col < h_col_end; ++h_col) {
             for (int w_col = w_col_start; w_col < w_col_end; ++w_col) {
-                val += data_col[offset + h_col * coeff_h_col + w_col * coeff_w_col];
+                int h_k = h - h_col * stride;
+                int w_k = w - w_col * stride;
+                if (h_k % dilation == 0 && w_k % dilation == 0) {
+                    h_k /= dilation;
+                    w_k /= dilation;
+                    int col_index = (((c * ksize + h_k) * ksize + w_k) * height_col + h_col) * width_col + w_col;
+                    val += data_col_b[col_index];
+                }
             }
         }
         data_im[index] += val;
@@ -82,14 +114,20 @@ void col2im_ongpu(float *data_col,
         int channels, int height, int width,
         int ksize, int stride, int pad, float *data_im){
 
-    int height_col = (height + 2 * pad - ksize) / stride + 1;
-    int width_col = (width + 2 * pad - ksize) / stride + 1;
-    int num_kernels = channels * height * width;
+    col2im_batch_ongpu(data_col, 1, channels, height, width, ksize, stride, pad, 1, data_im);
+}
+
+void col2im_batch_ongpu(float *data_col, int batch,
+        int channels, int height, int width,
+        int ksize, int stride, int pad, int dilation, float *data_im){
+
+    int extent = dilation * (ksize - 1) + 1;
+    int height_col = (height + 2 * pad - extent) / stride + 1;
+    int width_col = (width + 2 * pad - extent) / stride + 1;
+    int num_kernels = batch * channels * height * width;
     col2im_gpu_kernel<<<(num_kernels+BLOCK-1)/BLOCK,
         BLOCK>>>(
-                num_kernels, data_col, height, width, ksize, pad,
-                stride, height_col,
+                num_kernels, data_col, channels, height, width, ksize, pad,
+                stride, dilation, height_col,
                 width_col, data_im);
 }
-
-
@@ -11,6 +11,19 @@ void im2col_ongpu(float *im,
 void col2im_ongpu(float *data_col,
                   int channels, int height, int width,
                   int ksize, int stride, int pad, float *data_im);
+
+/*
+ * The same over batch images stored one after another,
+ * the columns of image b start at data_col + b * (channels * ksize * ksize * height_col * width_col).
+ * With dilation d the filter covers d * (ksize - 1) + 1 pixels.
+ */
+void im2col_batch_ongpu(float *im, int batch,
+                  int channels, int height, int width,
+                  int ksize, int stride, int pad, int dilation, float *data_col);
+
+void col2im_batch_ongpu(float *data_col, int batch,
+                  int channels, int height, int width,
+                  int ksize, int stride, int pad, int dilation, float *data_im);
 #endif
 
 
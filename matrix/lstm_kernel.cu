@@ -0,0 +1,87 @@
+#include "lstm_kernel.h"
+
+#define BLOCK_SIZE 32
+
+/*
+ * x holds the gate pre-activations [i f g o] stacked by rows (4n x m),
+ * c, c_next, h and their gradients are n x m.
+ * c and c_next may point to the same buffer, so every element is read before it is written.
+ */
+
+__device__ __forceinline__ float lstm_sigmoid (float a){
+    return 1.0f/(1.0f + std::exp(-a));
+}
+
+__global__ void lstm_forward_kernel (const float * __restrict__ x, const float *c,
+                                float *c_next, float * __restrict__ h, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        const float *xr = x + row * n * 4;
+
+        float i = lstm_sigmoid(xr[col]);
+        float f = lstm_sigmoid(xr[n + col]);
+        float g = std::tanh(xr[n * 2 + col]);
+        float o = lstm_sigmoid(xr[n * 3 + col]);
+
+        float cn = g * i + f * c[row * n + col];
+
+        c_next[row * n + col] = cn;
+        h[row * n + col] = o * std::tanh(cn);
+    }
+}
+
+/* gc is overwritten with the gradient of c, gx (if not NULL) is accumulated */
+__global__ void lstm_backward_kernel (const float * __restrict__ x, const float *c,
+                                const float *c_next, const float * __restrict__ gh,
+                                const float *gc_next, float *gc, float * __restrict__ gx, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        const float *xr = x + row * n * 4;
+
+        float i = lstm_sigmoid(xr[col]);
+        float f = lstm_sigmoid(xr[n + col]);
+        float g = std::tanh(xr[n * 2 + col]);
+        float o = lstm_sigmoid(xr[n * 3 + col]);
+
+        float cp = c[row * n + col];
+        float co = std::tanh(c_next[row * n + col]);
+        float dh = gh[row * n + col];
+
+        float dc = dh * o * (1.0f - co * co) + gc_next[row * n + col];
+
+        gc[row * n + col] = dc * f;
+
+        if (gx != NULL){
+            float *gxr = gx + row * n * 4;
+            gxr[col] += dc * g * (1.0f - i) * i;
+            gxr[n + col] += dc * cp * (1.0f - f) * f;
+            gxr[n * 2 + col] += dc * i * (1.0f - g * g);
+            gxr[n * 3 + col] += dh * co * (1.0f - o) * o;
+        }
+    }
+}
+
+void lstm_forward_kernel_exec(const float *x, const float *c, float *c_next, float *h, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    lstm_forward_kernel<<<grid, block>>>(x, c, c_next, h, m, n);
+    cudaThreadSynchronize();
+}
+
+void lstm_backward_kernel_exec(const float *x, const float *c, const float *c_next, const float *gh,
+                               const float *gc_next, float *gc, float *gx, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    lstm_backward_kernel<<<grid, block>>>(x, c, c_next, gh, gc_next, gc, gx, m, n);
+    cudaThreadSynchronize();
+}
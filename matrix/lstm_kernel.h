@@ -0,0 +1,22 @@
+#include <cuda_runtime.h>
+
+#ifndef _lstm_kernel_
+#define _lstm_kernel_
+
+__global__ void lstm_forward_kernel (const float * __restrict__ x, const float *c,
+                                float *c_next, float * __restrict__ h, int m, int n);
+
+__global__ void lstm_backward_kernel (const float * __restrict__ x, const float *c,
+                                const float *c_next, const float * __restrict__ gh,
+                                const float *gc_next, float *gc, float * __restrict__ gx, int m, int n);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void lstm_forward_kernel_exec(const float *x, const float *c, float *c_next, float *h, int m, int n);
+    void lstm_backward_kernel_exec(const float *x, const float *c, const float *c_next, const float *gh,
+                                   const float *gc_next, float *gc, float *gx, int m, int n);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
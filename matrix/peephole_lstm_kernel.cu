@@ -0,0 +1,198 @@
+#include "peephole_lstm_kernel.h"
+
+#define BLOCK_SIZE 32
+#define LN_EPS 1e-5f
+
+/*
+ * a holds the gate pre-activations [i f g o] stacked by rows (4n x m), peep the diagonal
+ * peephole weights [p_i p_f p_o] (3n x 1), c, c_next, h and their gradients are n x m.
+ *
+ *   i = sigmoid(a_i + p_i * c)   f = sigmoid(a_f + p_f * c)   g = tanh(a_g)
+ *   c_next = f * c + i * g
+ *   o = sigmoid(a_o + p_o * c_next)   h = o * tanh(c_next)
+ *
+ * When gamma is not NULL, a is the layer normalized pre-activation and
+ * gamma * a + beta (4n x 1 each) is used in its place.
+ */
+
+__device__ __forceinline__ float peephole_sigmoid (float a){
+    return 1.0f/(1.0f + std::exp(-a));
+}
+
+__device__ __forceinline__ float peephole_pre (const float *a, const float *gamma, const float *beta, int k){
+    return gamma == NULL ? a[k] : a[k] * gamma[k] + beta[k];
+}
+
+__global__ void peephole_lstm_forward_kernel (const float * __restrict__ a, const float * __restrict__ gamma,
+                                const float * __restrict__ beta, const float * __restrict__ peep,
+                                const float * __restrict__ c, float * __restrict__ c_next,
+                                float * __restrict__ h, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        const float *ar = a + row * n * 4;
+        float cp = c[row * n + col];
+
+        float i = peephole_sigmoid(peephole_pre(ar, gamma, beta, col) + peep[col] * cp);
+        float f = peephole_sigmoid(peephole_pre(ar, gamma, beta, n + col) + peep[n + col] * cp);
+        float g = std::tanh(peephole_pre(ar, gamma, beta, n * 2 + col));
+
+        float cn = f * cp + i * g;
+        float o = peephole_sigmoid(peephole_pre(ar, gamma, beta, n * 3 + col) + peep[n * 2 + col] * cn);
+
+        c_next[row * n + col] = cn;
+        h[row * n + col] = o * std::tanh(cn);
+    }
+}
+
+/*
+ * ga (4n x m) is overwritten with the gradient of the gate pre-activations (before gamma/beta),
+ * gpeep (3n x m) with the per column peephole gradients, gc (if not NULL) is accumulated.
+ */
+__global__ void peephole_lstm_backward_kernel (const float * __restrict__ a, const float * __restrict__ gamma,
+                                const float * __restrict__ beta, const float * __restrict__ peep,
+                                const float * __restrict__ c, const float * __restrict__ c_next,
+                                const float * __restrict__ gh, const float * __restrict__ gc_next,
+                                float * __restrict__ gc, float * __restrict__ ga, float * __restrict__ gpeep,
+                                int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < n){
+        const float *ar = a + row * n * 4;
+        float cp = c[row * n + col];
+        float cn = c_next[row * n + col];
+
+        float i = peephole_sigmoid(peephole_pre(ar, gamma, beta, col) + peep[col] * cp);
+        float f = peephole_sigmoid(peephole_pre(ar, gamma, beta, n + col) + peep[n + col] * cp);
+        float g = std::tanh(peephole_pre(ar, gamma, beta, n * 2 + col));
+        float o = peephole_sigmoid(peephole_pre(ar, gamma, beta, n * 3 + col) + peep[n * 2 + col] * cn);
+
+        float co = std::tanh(cn);
+        float dh = gh[row * n + col];
+
+        float d_o = dh * co * (1.0f - o) * o;
+        float dc = dh * o * (1.0f - co * co) + gc_next[row * n + col] + d_o * peep[n * 2 + col];
+
+        float d_i = dc * g * (1.0f - i) * i;
+        float d_f = dc * cp * (1.0f - f) * f;
+        float d_g = dc * i * (1.0f - g * g);
+
+        if (gc != NULL) gc[row * n + col] += dc * f + d_i * peep[col] + d_f * peep[n + col];
+
+        float *gar = ga + row * n * 4;
+        gar[col] = d_i;
+        gar[n + col] = d_f;
+        gar[n * 2 + col] = d_g;
+        gar[n * 3 + col] = d_o;
+
+        float *gpr = gpeep + row * n * 3;
+        gpr[col] = d_i * cp;
+        gpr[n + col] = d_f * cp;
+        gpr[n * 2 + col] = d_o * cn;
+    }
+}
+
+/*
+ * Layer normalization of each of the gates blocks of n rows, per column.
+ * a (gates*n x m) is replaced by the normalized values, rstd (gates x m) keeps 1/sigma.
+ * One thread per block and column.
+ */
+__global__ void gate_layer_norm_kernel (float * __restrict__ a, float * __restrict__ rstd, int gates, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < gates){
+        float *ab = a + row * n * gates + col * n;
+
+        float mean = 0;
+        for (int k = 0; k < n; k++) mean += ab[k];
+        mean /= n;
+
+        float var = 0;
+        for (int k = 0; k < n; k++) var += (ab[k] - mean) * (ab[k] - mean);
+        float r = 1.0f / std::sqrt(var / n + LN_EPS);
+
+        for (int k = 0; k < n; k++) ab[k] = (ab[k] - mean) * r;
+        rstd[row * gates + col] = r;
+    }
+}
+
+/*
+ * gy holds the gradient of gamma * xhat + beta and is replaced by the gradient of the
+ * pre-normalized values, ggamma (gates*n x m) is overwritten with gy * xhat.
+ */
+__global__ void gate_layer_norm_backward_kernel (const float * __restrict__ xhat, const float * __restrict__ gamma,
+                                const float * __restrict__ rstd, float * __restrict__ gy,
+                                float * __restrict__ ggamma, int gates, int m, int n){
+    int row = blockIdx.y*blockDim.y+threadIdx.y;
+    int col = blockIdx.x*blockDim.x+threadIdx.x;
+
+    if (row < m && col < gates){
+        int offset = row * n * gates + col * n;
+        const float *xb = xhat + offset;
+        const float *gb = gamma + col * n;
+        float *gyb = gy + offset;
+
+        float sum_dx = 0;
+        float sum_dx_x = 0;
+        for (int k = 0; k < n; k++){
+            float dx = gyb[k] * gb[k];
+            sum_dx += dx;
+            sum_dx_x += dx * xb[k];
+            ggamma[offset + k] = gyb[k] * xb[k];
+        }
+        sum_dx /= n;
+        sum_dx_x /= n;
+
+        float r = rstd[row * gates + col];
+        for (int k = 0; k < n; k++){
+            gyb[k] = r * (gyb[k] * gb[k] - sum_dx - xb[k] * sum_dx_x);
+        }
+    }
+}
+
+void peephole_lstm_forward_kernel_exec(const float *a, const float *gamma, const float *beta, const float *peep,
+                                       const float *c, float *c_next, float *h, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    peephole_lstm_forward_kernel<<<grid, block>>>(a, gamma, beta, peep, c, c_next, h, m, n);
+    cudaThreadSynchronize();
+}
+
+void peephole_lstm_backward_kernel_exec(const float *a, const float *gamma, const float *beta, const float *peep,
+                                        const float *c, const float *c_next, const float *gh, const float *gc_next,
+                                        float *gc, float *ga, float *gpeep, int m, int n){
+    /* specified block and grid size */
+    dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+    dim3 grid((n+block.x-1)/block.x, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    peephole_lstm_backward_kernel<<<grid, block>>>(a, gamma, beta, peep, c, c_next, gh, gc_next, gc, ga, gpeep, m, n);
+    cudaThreadSynchronize();
+}
+
+void gate_layer_norm_kernel_exec(float *a, float *rstd, int gates, int m, int n){
+    /* specified block and grid size */
+    dim3 block(gates, BLOCK_SIZE);
+    dim3 grid(1, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    gate_layer_norm_kernel<<<grid, block>>>(a, rstd, gates, m, n);
+    cudaThreadSynchronize();
+}
+
+void gate_layer_norm_backward_kernel_exec(const float *xhat, const float *gamma, const float *rstd,
+                                          float *gy, float *ggamma, int gates, int m, int n){
+    /* specified block and grid size */
+    dim3 block(gates, BLOCK_SIZE);
+    dim3 grid(1, (m+block.y-1)/block.y);
+
+    /* lunch kernel */
+    gate_layer_norm_backward_kernel<<<grid, block>>>(xhat, gamma, rstd, gy, ggamma, gates, m, n);
+    cudaThreadSynchronize();
+}
@@ -0,0 +1,38 @@
+#include <cuda_runtime.h>
+
+#ifndef _peephole_lstm_kernel_
+#define _peephole_lstm_kernel_
+
+__global__ void peephole_lstm_forward_kernel (const float * __restrict__ a, const float * __restrict__ gamma,
+                                const float * __restrict__ beta, const float * __restrict__ peep,
+                                const float * __restrict__ c, float * __restrict__ c_next,
+                                float * __restrict__ h, int m, int n);
+
+__global__ void peephole_lstm_backward_kernel (const float * __restrict__ a, const float * __restrict__ gamma,
+                                const float * __restrict__ beta, const float * __restrict__ peep,
+                                const float * __restrict__ c, const float * __restrict__ c_next,
+                                const float * __restrict__ gh, const float * __restrict__ gc_next,
+                                float * __restrict__ gc, float * __restrict__ ga, float * __restrict__ gpeep,
+                                int m, int n);
+
+__global__ void gate_layer_norm_kernel (float * __restrict__ a, float * __restrict__ rstd, int gates, int m, int n);
+
+__global__ void gate_layer_norm_backward_kernel (const float * __restrict__ xhat, const float * __restrict__ gamma,
+                                const float * __restrict__ rstd, float * __restrict__ gy,
+                                float * __restrict__ ggamma, int gates, int m, int n);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void peephole_lstm_forward_kernel_exec(const float *a, const float *gamma, const float *beta, const float *peep,
+                                           const float *c, float *c_next, float *h, int m, int n);
+    void peephole_lstm_backward_kernel_exec(const float *a, const float *gamma, const float *beta, const float *peep,
+                                            const float *c, const float *c_next, const float *gh, const float *gc_next,
+                                            float *gc, float *ga, float *gpeep, int m, int n);
+    void gate_layer_norm_kernel_exec(float *a, float *rstd, int gates, int m, int n);
+    void gate_layer_norm_backward_kernel_exec(const float *xhat, const float *gamma, const float *rstd,
+                                              float *gy, float *ggamma, int gates, int m, int n);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
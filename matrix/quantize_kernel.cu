@@ -0,0 +1,128 @@
+#include "quantize_kernel.h"
+
+#define QUANT_THREADS 128
+#define GEMM_TILE 16
+
+/*
+ * Symmetric int8 quantization, q = round(x / scale) clipped to [-127, 127].
+ * A quantized matrix is stored row by row, one row of ld (a multiple of 4) chars,
+ * the padding is zero, so a row can be read as ld/4 packed ints.
+ */
+
+__device__ char quantize_value(float x, float inv_scale){
+    float q = rintf(x * inv_scale);
+    return (char) fmaxf(-127.0f, fminf(127.0f, q));
+}
+
+/* row i of w (m x n, column-major) with its own scale = max|w_i.| / 127, one block per row */
+__global__ void quantize_rows_kernel (const float * __restrict__ w, char * __restrict__ q,
+                                float * __restrict__ scale, int m, int n, int ld){
+    __shared__ float s_max[QUANT_THREADS];
+
+    int row = blockIdx.x;
+    float v = 0;
+    for (int j = threadIdx.x; j < n; j += blockDim.x) v = fmaxf(v, fabsf(w[row + j * m]));
+    s_max[threadIdx.x] = v;
+    __syncthreads();
+
+    for (int s = blockDim.x / 2; s > 0; s >>= 1){
+        if (threadIdx.x < s) s_max[threadIdx.x] = fmaxf(s_max[threadIdx.x], s_max[threadIdx.x + s]);
+        __syncthreads();
+    }
+
+    float row_scale = s_max[0] > 0 ? s_max[0] / 127.0f : 1.0f;
+    if (threadIdx.x == 0) scale[row] = row_scale;
+
+    for (int j = threadIdx.x; j < ld; j += blockDim.x){
+        q[row * ld + j] = j < n ? quantize_value(w[row + j * m], 1.0f / row_scale) : 0;
+    }
+}
+
+/*
+ * Row j of q gets column j of x with the one scale[0], x element (k, j) is at
+ * x[(j/inner)*inner*m + j%inner + k*inner]: inner == 1 is an ordinary m x n matrix,
+ * inner == out_size the im2col columns of a batch.
+ */
+__global__ void quantize_cols_kernel (const float * __restrict__ x, char * __restrict__ q,
+                                const float * __restrict__ scale, int m, int n, int ld, int inner){
+    int idx = blockIdx.x*blockDim.x+threadIdx.x;
+    int k = idx % ld;
+    int j = idx / ld;
+
+    if (j < n){
+        int src = (j / inner) * inner * m + j % inner + k * inner;
+        q[j * ld + k] = k < m ? quantize_value(x[src], 1.0f / scale[0]) : 0;
+    }
+}
+
+__device__ int dot4(int a, int b, int c){
+#if __CUDA_ARCH__ >= 610
+    return __dp4a(a, b, c);
+#else
+    const signed char *pa = (const signed char *) &a;
+    const signed char *pb = (const signed char *) &b;
+    return c + pa[0]*pb[0] + pa[1]*pb[1] + pa[2]*pb[2] + pa[3]*pb[3];
+#endif
+}
+
+/*
+ * r(i, j) = (sum_k a_ik b_jk) * a_scale[i] * b_scale[0] + bias[i] for the int8 rows of
+ * a (m rows) and b (n rows), both of ld4 packed ints. The int32 sum is dequantized
+ * and the bias added in the store, r(i, j) goes to r[(j/inner)*m*inner + j%inner + i*inner].
+ */
+__global__ void int8_gemm_kernel (const int * __restrict__ a, const int * __restrict__ b,
+                                const float * __restrict__ a_scale, const float * __restrict__ b_scale,
+                                const float * __restrict__ bias, float * __restrict__ r,
+                                int m, int n, int ld4, int inner){
+    __shared__ int sa[GEMM_TILE][GEMM_TILE + 1];
+    __shared__ int sb[GEMM_TILE][GEMM_TILE + 1];
+
+    int tx = threadIdx.x;
+    int ty = threadIdx.y;
+    int i = blockIdx.y * GEMM_TILE + ty;
+    int j = blockIdx.x * GEMM_TILE + tx;
+    int b_row = blockIdx.x * GEMM_TILE + ty;
+
+    int acc = 0;
+    for (int p = 0; p < ld4; p += GEMM_TILE){
+        sa[ty][tx] = (i < m && p + tx < ld4) ? a[i * ld4 + p + tx] : 0;
+        sb[ty][tx] = (b_row < n && p + tx < ld4) ? b[b_row * ld4 + p + tx] : 0;
+        __syncthreads();
+
+        for (int k = 0; k < GEMM_TILE; k++) acc = dot4(sa[ty][k], sb[tx][k], acc);
+        __syncthreads();
+    }
+
+    if (i < m && j < n){
+        float v = acc * a_scale[i] * b_scale[0];
+        if (bias != NULL) v += bias[i];
+        r[(j / inner) * m * inner + j % inner + i * inner] = v;
+    }
+}
+
+void quantize_rows_kernel_exec(const float *w, char *q, float *scale, int m, int n, int ld){
+
+    /* lunch kernel */
+    quantize_rows_kernel<<<m, QUANT_THREADS>>>(w, q, scale, m, n, ld);
+    cudaThreadSynchronize();
+}
+
+void quantize_cols_kernel_exec(const float *x, char *q, const float *scale, int m, int n, int ld, int inner){
+
+    int blocks = ((long long) n * ld + QUANT_THREADS - 1) / QUANT_THREADS;
+
+    /* lunch kernel */
+    quantize_cols_kernel<<<blocks, QUANT_THREADS>>>(x, q, scale, m, n, ld, inner);
+    cudaThreadSynchronize();
+}
+
+void int8_gemm_kernel_exec(const char *a, const char *b, const float *a_scale, const float *b_scale,
+                           const float *bias, float *r, int m, int n, int ld, int inner){
+
+    dim3 block(GEMM_TILE, GEMM_TILE);
+    dim3 grid((n + GEMM_TILE - 1) / GEMM_TILE, (m + GEMM_TILE - 1) / GEMM_TILE);
+
+    /* lunch kernel */
+    int8_gemm_kernel<<<grid, block>>>((const int *) a, (const int *) b, a_scale, b_scale, bias, r, m, n, ld / 4, inner);
+    cudaThreadSynchronize();
+}
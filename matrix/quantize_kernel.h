@@ -0,0 +1,27 @@
+#include <cuda_runtime.h>
+
+#ifndef _quantize_kernel_
+#define _quantize_kernel_
+
+__global__ void quantize_rows_kernel (const float * __restrict__ w, char * __restrict__ q,
+                                float * __restrict__ scale, int m, int n, int ld);
+
+__global__ void quantize_cols_kernel (const float * __restrict__ x, char * __restrict__ q,
+                                const float * __restrict__ scale, int m, int n, int ld, int inner);
+
+__global__ void int8_gemm_kernel (const int * __restrict__ a, const int * __restrict__ b,
+                                const float * __restrict__ a_scale, const float * __restrict__ b_scale,
+                                const float * __restrict__ bias, float * __restrict__ r,
+                                int m, int n, int ld4, int inner);
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void quantize_rows_kernel_exec(const float *w, char *q, float *scale, int m, int n, int ld);
+    void quantize_cols_kernel_exec(const float *x, char *q, const float *scale, int m, int n, int ld, int inner);
+    void int8_gemm_kernel_exec(const char *a, const char *b, const float *a_scale, const float *b_scale,
+                               const float *bias, float *r, int m, int n, int ld, int inner);
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * bench.cpp
+ *
+ * Latency of an exported model on the runtime:
+ *
+ *   ./bench model.dnng [batch] [iterations]
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+#include "runtime.h"
+
+using namespace std;
+
+
+int main(int argc, char *argv[]){
+
+    if (argc < 2){
+        cout << "usage: " << argv[0] << " model.dnng [batch] [iterations]" << endl;
+        return 1;
+    }
+    int batch = argc > 2 ? atoi(argv[2]) : 0;
+    int iterations = argc > 3 ? atoi(argv[3]) : 100;
+
+    Runtime rt;
+    if (!rt.load(argv[1], batch)) return 1;
+
+    cout << argv[1] << ": " << rt.graph.ops.size() << " ops, weights " << rt.graph.const_bytes() / 1024 << "KB"
+         << ", arena " << rt.arena_bytes() / 1024 << "KB (" << rt.unplanned_bytes() / 1024 << "KB unplanned)"
+         << ", batch " << rt.batch << endl;
+
+    mt19937 mt(1);
+    normal_distribution<float> dist(0., 1.);
+    for (int i = 0; i < rt.graph.inputs.size(); i++){
+        float *x = rt.input(i);
+        for (int k = 0; k < rt.input_size(i); k++) x[k] = dist(mt);
+    }
+
+    // warm up caches and page in the arena
+    for (int i = 0; i < min(10, iterations); i++) rt.run();
+
+    vector<double> us(iterations);
+    for (int i = 0; i < iterations; i++){
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        rt.run();
+        us[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    }
+    sort(us.begin(), us.end());
+
+    double sum = 0;
+    for (double u : us) sum += u;
+    double mean = sum / iterations;
+
+    cout << "latency mean " << mean << " us, p50 " << us[iterations / 2] << " us, p99 " << us[iterations * 99 / 100]
+         << " us, " << rt.batch / (mean / 1e6) << " samples/s" << endl;
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * bench_fixed.cpp
+ *
+ * Single call latency of the code codegen generated for a model (fixed_model.h) against
+ * the generic runtime on the same graph, after checking that both give the same output:
+ *
+ *   make bench_fixed MODEL=../core/mlp.dnng && ./bench_fixed
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cmath>
+
+#include "runtime.h"
+#include "fixed_model.h"
+
+using namespace std;
+
+
+// per call latencies in us, in batches of calls so that the clock resolution does not matter
+vector<double> measure(function<void()> f, int rounds, int calls){
+    for (int i = 0; i < calls; i++) f();
+
+    vector<double> us(rounds);
+    for (int i = 0; i < rounds; i++){
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int k = 0; k < calls; k++) f();
+        us[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / calls;
+    }
+    sort(us.begin(), us.end());
+    return us;
+}
+
+void report(string what, vector<double> &us){
+    cout << what << " p50 " << us[us.size() / 2] << " us, min " << us[0] << " us" << endl;
+}
+
+
+int main(int argc, char *argv[]){
+
+    string path = argc > 1 ? argv[1] : FIXED_MODEL_PATH;
+
+    Runtime rt;
+    if (!rt.load(path, FIXED_MODEL_BATCH)) return 1;
+    if (rt.input_size(0) != FIXED_MODEL_INPUT_SIZE || rt.output_size(0) != FIXED_MODEL_OUTPUT_SIZE){
+        cout << "fixed_model.h was not generated from " << path << endl;
+        return 1;
+    }
+
+    mt19937 mt(1);
+    normal_distribution<float> dist(0., 1.);
+    vector<float> x(FIXED_MODEL_INPUT_SIZE), y(FIXED_MODEL_OUTPUT_SIZE);
+    for (float &f : x) f = dist(mt);
+
+    memcpy(rt.input(0), x.data(), x.size() * sizeof(float));
+    rt.run();
+    fixed_model(x.data(), y.data());
+
+    float diff = 0, scale = 0;
+    for (int i = 0; i < y.size(); i++){
+        diff = max(diff, fabs(y[i] - rt.output(0)[i]));
+        scale = max(scale, fabs(rt.output(0)[i]));
+    }
+    cout << path << " batch " << FIXED_MODEL_BATCH << ": max diff " << diff << endl;
+    if (diff > 1e-4 * max(scale, 1.0f)){
+        cout << "FAILED: the generated code does not match the runtime" << endl;
+        return 1;
+    }
+
+    int calls = 100, rounds = 200;
+    vector<double> generic = measure([&](){
+        memcpy(rt.input(0), x.data(), x.size() * sizeof(float));
+        rt.run();
+    }, rounds, calls);
+    vector<double> fixed = measure([&](){ fixed_model(x.data(), y.data()); }, rounds, calls);
+
+    report("runtime  ", generic);
+    report("generated", fixed);
+    cout << "speedup " << generic[rounds / 2] / fixed[rounds / 2] << "x" << endl;
+    return 0;
+}
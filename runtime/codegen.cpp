@@ -0,0 +1,197 @@
+/*
+ * codegen.cpp
+ *
+ * Emits a C++ header that runs an exported graph (see core/exporter.h) for one fixed
+ * batch size with no runtime shapes, dispatch or heap:
+ *
+ *   ./codegen model.dnng model.h [name] [batch]
+ *
+ *   #include "model.h"
+ *   name(x, y);   // x: NAME_INPUT_SIZE floats, y: NAME_OUTPUT_SIZE floats
+ *
+ * Every op becomes a call of a fixed_kernels.h template with its shapes as template
+ * arguments, the weights are aligned static arrays and the activations live in one
+ * static arena laid out by Runtime::plan(), so the function is not reentrant.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "runtime.h"
+#include "fixed_kernels.h"
+
+using namespace std;
+
+
+string identifier(string s){
+    size_t slash = s.find_last_of("/\\");
+    if (slash != string::npos) s = s.substr(slash + 1);
+    size_t dot = s.find('.');
+    if (dot != string::npos) s = s.substr(0, dot);
+
+    for (char &c : s) if (!isalnum((unsigned char)c)) c = '_';
+    if (s.empty() || isdigit((unsigned char)s[0])) s = "model_" + s;
+    return s;
+}
+
+string upper(string s){
+    for (char &c : s) c = toupper((unsigned char)c);
+    return s;
+}
+
+string float_literal(float f){
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", f);
+    string s = buf;
+    if (s.find_first_of(".e") == string::npos && s.find("inf") == string::npos && s.find("nan") == string::npos) s += ".";
+    return s + "f";
+}
+
+
+int main(int argc, char *argv[]){
+
+    if (argc < 3){
+        cout << "usage: " << argv[0] << " model.dnng model.h [name] [batch]" << endl;
+        return 1;
+    }
+    string name = argc > 3 ? identifier(argv[3]) : identifier(argv[1]);
+    int batch = argc > 4 ? atoi(argv[4]) : 1;
+
+    Runtime rt;
+    if (!rt.load(argv[1], batch)) return 1;
+    GraphFile &g = rt.graph;
+
+    if (g.inputs.size() != 1 || g.outputs.size() != 1){
+        cout << "codegen: only graphs with one input and one output, " << argv[1] << " has "
+             << g.inputs.size() << " and " << g.outputs.size() << endl;
+        return 1;
+    }
+    int input = g.inputs[0], output = g.outputs[0];
+    if (g.tensors[output].kind != TENSOR_ACTIVATION){
+        cout << "codegen: the output of " << argv[1] << " is not computed" << endl;
+        return 1;
+    }
+
+    // the expression of every tensor in the generated function
+    vector<string> ref(g.tensors.size());
+    for (int t = 0; t < g.tensors.size(); t++){
+        if (t == input) ref[t] = "x";
+        else if (t == output) ref[t] = "y";
+        else if (g.tensors[t].kind == TENSOR_CONST) ref[t] = name + "_c" + to_string(t);
+        else if (rt.ptr[t] != NULL) ref[t] = name + "_arena + " + to_string(rt.ptr[t] - rt.arena.data());
+    }
+
+    ofstream out(argv[2]);
+    if (!out){
+        cout << "codegen: can not write " << argv[2] << endl;
+        return 1;
+    }
+
+    string guard = upper(name) + "_H_";
+    out << "/*\n * " << identifier(argv[2]) << ".h\n *\n * Generated by runtime/codegen from " << argv[1]
+        << " for batch " << batch << ", do not edit.\n */\n\n";
+    out << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+    out << "#include \"fixed_kernels.h\"\n\n";
+    out << "#define " << upper(name) << "_BATCH " << batch << "\n";
+    out << "#define " << upper(name) << "_INPUT_SIZE " << rt.input_size(0) << "\n";
+    out << "#define " << upper(name) << "_OUTPUT_SIZE " << rt.output_size(0) << "\n\n";
+
+    // the weights of a Linear are stored in the order fixed_linear reads them, as a copy
+    // since a tied weight may also be read transposed
+    map<int, int> packed;
+    for (GraphOp &op : g.ops){
+        if (op.type != OP_LINEAR || op.attrs[0]) continue;
+
+        int w = op.inputs[1];
+        if (packed.find(w) == packed.end()){
+            GraphTensor p = g.tensors[w];
+            fixed_linear_pack(g.tensors[w].data.data(), p.rows, p.cols, p.data.data());
+            p.name = "packed " + p.name;
+            g.tensors.push_back(p);
+            ref.push_back(name + "_c" + to_string(g.tensors.size() - 1));
+            packed[w] = g.tensors.size() - 1;
+        }
+        op.inputs[1] = packed[w];
+    }
+
+    set<int> used;
+    for (GraphOp &op : g.ops) used.insert(op.inputs.begin(), op.inputs.end());
+
+    size_t weight_bytes = 0;
+    for (int t = 0; t < g.tensors.size(); t++){
+        GraphTensor &c = g.tensors[t];
+        if (c.kind != TENSOR_CONST || used.find(t) == used.end()) continue;
+        weight_bytes += c.data.size() * sizeof(float);
+
+        out << "// " << (c.name.empty() ? "constant" : c.name) << " " << c.rows << " x " << c.cols << "\n";
+        out << "alignas(64) static const float " << ref[t] << "[" << max((size_t)1, c.data.size()) << "] = {";
+        for (size_t i = 0; i < c.data.size(); i++){
+            if (i % 8 == 0) out << "\n    ";
+            out << float_literal(c.data[i]) << (i + 1 < c.data.size() ? ", " : "");
+        }
+        out << "\n};\n\n";
+    }
+
+    out << "alignas(64) static float " << name << "_arena[" << max((size_t)1, rt.arena.size()) << "];\n\n";
+
+    out << "static inline void " << name << "(const float *__restrict__ x, float *__restrict__ y){\n";
+    for (GraphOp &op : g.ops){
+        int rows = g.tensors[op.output].rows;
+        int n = rows * batch;
+        string x = ref[op.inputs[0]], r = ref[op.output];
+        vector<int> &a = op.attrs;
+
+        stringstream call;
+        switch (op.type){
+        case OP_LINEAR: {
+            GraphTensor &w = g.tensors[op.inputs[1]];
+            bool transpose = a[0];
+            string b = a[1] && op.inputs.size() > 2 ? ref[op.inputs[2]] : "NULL";
+            call << "fixed_linear<" << rows << ", " << (transpose ? w.rows : w.cols) << ", " << batch << ", "
+                 << (transpose ? "true" : "false") << ">(" << x << ", " << ref[op.inputs[1]] << ", " << b << ", " << r << ")";
+            break;
+        }
+        case OP_RELU:    call << "fixed_relu<" << n << ">(" << x << ", " << r << ")"; break;
+        case OP_SIGMOID: call << "fixed_sigmoid<" << n << ">(" << x << ", " << r << ")"; break;
+        case OP_TANH:    call << "fixed_tanh<" << n << ">(" << x << ", " << r << ")"; break;
+        case OP_COPY:    call << "fixed_copy<" << n << ">(" << x << ", " << r << ")"; break;
+        case OP_SOFTMAX: call << "fixed_softmax<" << rows << ", " << batch << ">(" << x << ", " << r << ")"; break;
+        case OP_PLUS:
+        case OP_MINUS:
+        case OP_MUL:
+            call << (op.type == OP_PLUS ? "fixed_plus<" : op.type == OP_MINUS ? "fixed_minus<" : "fixed_mul<")
+                 << n << ">(" << x << ", " << ref[op.inputs[1]] << ", " << r << ")";
+            break;
+        case OP_SCALE_SHIFT:
+            call << "fixed_scale_shift<" << rows << ", " << batch << ">(" << x << ", " << ref[op.inputs[1]] << ", "
+                 << ref[op.inputs[2]] << ", " << r << ")";
+            break;
+        case OP_CONV2D:
+            call << "fixed_conv2d<" << a[CONV_CHANNELS] << ", " << a[CONV_WIDTH] << ", " << a[CONV_HEIGHT] << ", "
+                 << a[CONV_FILTER] << ", " << a[CONV_FILTERS] << ", " << a[CONV_STRIDE] << ", " << a[CONV_PADDING] << ", "
+                 << a[CONV_GROUPS] << ", " << a[CONV_DILATION] << ", " << a[CONV_OUT_WIDTH] << ", " << a[CONV_OUT_HEIGHT] << ", "
+                 << batch << ">(" << x << ", " << ref[op.inputs[1]] << ", " << ref[op.inputs[2]] << ", " << r << ")";
+            break;
+        case OP_MAX_POOL:
+            call << "fixed_max_pool<" << a[POOL_WIDTH] << ", " << a[POOL_HEIGHT] << ", " << a[POOL_DEPTH] * batch << ", "
+                 << a[POOL_WINDOW_W] << ", " << a[POOL_WINDOW_H] << ", " << a[POOL_STRIDE] << ", " << a[POOL_PADDING]
+                 << ">(" << x << ", " << r << ")";
+            break;
+        }
+        out << "    " << call.str() << ";\n";
+    }
+    out << "}\n\n#endif /* " << guard << " */\n";
+
+    cout << "codegen: " << g.ops.size() << " ops, " << weight_bytes / 1024 << "KB weights, "
+         << rt.arena_bytes() / 1024 << "KB arena -> " << argv[2] << endl;
+    return 0;
+}
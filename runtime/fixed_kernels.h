@@ -0,0 +1,270 @@
+/*
+ * fixed_kernels.h
+ *
+ */
+
+#ifndef FIXED_KERNELS_H_
+#define FIXED_KERNELS_H_
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+/*
+ * The operators of runtime.cpp with every shape a template parameter, used by the code
+ * that codegen emits for a fixed-shape model. All loop bounds are compile time constants,
+ * so the compiler unrolls and vectorizes them for the exact sizes, and the outputs of a
+ * Linear are accumulated in registers (FIXED_LINEAR_BLOCK at a time) while its packed
+ * weights are streamed once.
+ */
+
+// outputs of a Linear kept in registers while the inputs are streamed
+#define FIXED_LINEAR_BLOCK 32
+
+// independent partial sums of a dot product (transposed Linear)
+#define FIXED_DOT_LANES 8
+
+// four floats in one SSE/NEON register (GCC and clang vector extension)
+typedef float fixed_v4 __attribute__((vector_size(16)));
+
+
+// rows in the block of outputs of a Linear that starts at o0, see fixed_linear_pack()
+constexpr int fixed_linear_block_rows(int o_size, int o0){
+    return o_size - o0 >= FIXED_LINEAR_BLOCK ? FIXED_LINEAR_BLOCK
+         : o_size - o0 >= 4 ? (o_size - o0) / 4 * 4 : o_size - o0;
+}
+
+// the layout fixed_linear expects for a column-major (o_size x i_size) w: blocks of outputs,
+// each stored as i_size rows of its weights
+inline void fixed_linear_pack(const float *w, int o_size, int i_size, float *packed){
+    for (int o0 = 0; o0 < o_size; o0 += fixed_linear_block_rows(o_size, o0)){
+        int block = fixed_linear_block_rows(o_size, o0);
+        for (int k = 0; k < i_size; k++){
+            for (int o = 0; o < block; o++) packed[(size_t)o0 * i_size + k * block + o] = w[o0 + o + (size_t)k * o_size];
+        }
+    }
+}
+
+// r[0..OB) = b + w x for a block of OB (a multiple of 4) outputs, the sums stay in OB / 4 registers
+template<int I, int OB>
+inline void fixed_linear_block(const float *__restrict__ x, const float *__restrict__ w,
+                               const float *__restrict__ b, float *__restrict__ r){
+    fixed_v4 acc[OB / 4];
+    for (int v = 0; v < OB / 4; v++){
+        if (b != NULL) memcpy(&acc[v], b + 4 * v, sizeof(fixed_v4));
+        else acc[v] = fixed_v4{0, 0, 0, 0};
+    }
+
+    for (int k = 0; k < I; k++){
+        fixed_v4 xv = {x[k], x[k], x[k], x[k]};
+        const float *wk = w + (size_t)k * OB;
+        for (int v = 0; v < OB / 4; v++){
+            fixed_v4 wv;
+            memcpy(&wv, wk + 4 * v, sizeof(fixed_v4));
+            acc[v] += wv * xv;
+        }
+    }
+    for (int v = 0; v < OB / 4; v++) memcpy(r + 4 * v, &acc[v], sizeof(fixed_v4));
+}
+
+// the last 1 to 3 outputs
+template<int I, int OB>
+inline void fixed_linear_tail(const float *__restrict__ x, const float *__restrict__ w,
+                              const float *__restrict__ b, float *__restrict__ r){
+    float acc[OB];
+    for (int o = 0; o < OB; o++) acc[o] = b != NULL ? b[o] : 0;
+    for (int k = 0; k < I; k++){
+        for (int o = 0; o < OB; o++) acc[o] += w[k * OB + o] * x[k];
+    }
+    for (int o = 0; o < OB; o++) r[o] = acc[o];
+}
+
+/*
+ * r (O x B) = w x + b. Without T, w (O x I) is packed by fixed_linear_pack() so that
+ * every block of outputs reads its weights contiguously; with T, r = w^T x for the
+ * column-major (I x O) w as it is.
+ */
+template<int O, int I, int B, bool T>
+inline void fixed_linear(const float *__restrict__ x, const float *__restrict__ w,
+                         const float *__restrict__ b, float *__restrict__ r){
+    constexpr int main_end = O / FIXED_LINEAR_BLOCK * FIXED_LINEAR_BLOCK;
+    constexpr int tail4 = fixed_linear_block_rows(O, main_end) / 4 * 4;
+    constexpr int tail = O - main_end - tail4;
+
+    for (int j = 0; j < B; j++){
+        const float *xj = x + (size_t)j * I;
+        float *rj = r + (size_t)j * O;
+
+        if (T){
+            constexpr int dot_end = I / FIXED_DOT_LANES * FIXED_DOT_LANES;
+            for (int o = 0; o < O; o++){
+                const float *wo = w + (size_t)o * I;
+                float lanes[FIXED_DOT_LANES] = {0};
+
+                for (int k = 0; k < dot_end; k += FIXED_DOT_LANES){
+                    for (int l = 0; l < FIXED_DOT_LANES; l++) lanes[l] += wo[k + l] * xj[k + l];
+                }
+                float s = b != NULL ? b[o] : 0;
+                for (int k = dot_end; k < I; k++) s += wo[k] * xj[k];
+                for (int l = 0; l < FIXED_DOT_LANES; l++) s += lanes[l];
+                rj[o] = s;
+            }
+            continue;
+        }
+
+        for (int o = 0; o < main_end; o += FIXED_LINEAR_BLOCK){
+            fixed_linear_block<I, FIXED_LINEAR_BLOCK>(xj, w + (size_t)o * I, b != NULL ? b + o : NULL, rj + o);
+        }
+        if (tail4 > 0){
+            fixed_linear_block<I, (tail4 > 0 ? tail4 : 4)>(xj, w + (size_t)main_end * I,
+                                                           b != NULL ? b + main_end : NULL, rj + main_end);
+        }
+        if (tail > 0){
+            constexpr int o = main_end + tail4;
+            fixed_linear_tail<I, (tail > 0 ? tail : 1)>(xj, w + (size_t)o * I, b != NULL ? b + o : NULL, rj + o);
+        }
+    }
+}
+
+template<int N>
+inline void fixed_relu(const float *__restrict__ x, float *__restrict__ r){
+    for (int i = 0; i < N; i++) r[i] = x[i] > 0 ? x[i] : 0;
+}
+
+template<int N>
+inline void fixed_sigmoid(const float *__restrict__ x, float *__restrict__ r){
+    for (int i = 0; i < N; i++) r[i] = 1 / (1 + std::exp(-x[i]));
+}
+
+template<int N>
+inline void fixed_tanh(const float *__restrict__ x, float *__restrict__ r){
+    for (int i = 0; i < N; i++) r[i] = std::tanh(x[i]);
+}
+
+// over the R rows of every one of the B columns
+template<int R, int B>
+inline void fixed_softmax(const float *__restrict__ x, float *__restrict__ r){
+    for (int j = 0; j < B; j++){
+        const float *xj = x + (size_t)j * R;
+        float *rj = r + (size_t)j * R;
+
+        float m = xj[0];
+        for (int i = 1; i < R; i++) m = std::max(m, xj[i]);
+        float sum = 0;
+        for (int i = 0; i < R; i++){
+            rj[i] = std::exp(xj[i] - m);
+            sum += rj[i];
+        }
+        float inv = 1 / sum;
+        for (int i = 0; i < R; i++) rj[i] *= inv;
+    }
+}
+
+template<int N>
+inline void fixed_plus(const float *x, const float *y, float *r){
+    for (int i = 0; i < N; i++) r[i] = x[i] + y[i];
+}
+
+template<int N>
+inline void fixed_minus(const float *x, const float *y, float *r){
+    for (int i = 0; i < N; i++) r[i] = x[i] - y[i];
+}
+
+template<int N>
+inline void fixed_mul(const float *x, const float *y, float *r){
+    for (int i = 0; i < N; i++) r[i] = x[i] * y[i];
+}
+
+template<int R, int B>
+inline void fixed_scale_shift(const float *__restrict__ x, const float *__restrict__ scale,
+                              const float *__restrict__ shift, float *__restrict__ r){
+    for (int j = 0; j < B; j++){
+        for (int i = 0; i < R; i++) r[j * R + i] = x[j * R + i] * scale[i] + shift[i];
+    }
+}
+
+template<int N>
+inline void fixed_copy(const float *x, float *r){
+    memcpy(r, x, N * sizeof(float));
+}
+
+// the output positions [lo, hi) whose input p * S - P + offset is in [0, SIZE)
+template<int SIZE, int OUT, int S, int P>
+inline void fixed_valid_range(int offset, int &lo, int &hi){
+    int d = P - offset;
+    lo = d > 0 ? (d + S - 1) / S : 0;
+    hi = SIZE + d > 0 ? (SIZE + d - 1) / S + 1 : 0;
+    lo = std::min(lo, OUT);
+    hi = std::min(hi, OUT);
+}
+
+// direct convolution like conv2d() in runtime.cpp
+template<int C, int W, int H, int K, int F, int S, int P, int G, int D, int OW, int OH, int B>
+inline void fixed_conv2d(const float *__restrict__ x, const float *__restrict__ w,
+                         const float *__restrict__ b, float *__restrict__ r){
+    constexpr int group_channels = C / G;
+    constexpr int group_filters = F / G;
+    constexpr int out_size = OW * OH;
+
+    for (int j = 0; j < B; j++){
+        const float *xj = x + (size_t)j * C * W * H;
+        float *rj = r + (size_t)j * F * out_size;
+
+        for (int f = 0; f < F; f++){
+            int g = f / group_filters;
+            float *rf = rj + (size_t)f * out_size;
+            for (int p = 0; p < out_size; p++) rf[p] = b[f];
+
+            for (int cl = 0; cl < group_channels; cl++){
+                const float *xc = xj + (size_t)(g * group_channels + cl) * W * H;
+
+                for (int ki = 0; ki < K; ki++){
+                    int y_lo, y_hi;
+                    fixed_valid_range<H, OH, S, P>(ki * D, y_lo, y_hi);
+
+                    for (int kj = 0; kj < K; kj++){
+                        int x_lo, x_hi;
+                        fixed_valid_range<W, OW, S, P>(kj * D, x_lo, x_hi);
+
+                        float wv = w[f + (size_t)((cl * K + ki) * K + kj) * F];
+                        int x0 = kj * D - P;
+                        for (int oy = y_lo; oy < y_hi; oy++){
+                            const float *xrow = xc + (size_t)(oy * S - P + ki * D) * W;
+                            float *rrow = rf + oy * OW;
+                            for (int ox = x_lo; ox < x_hi; ox++) rrow[ox] += wv * xrow[ox * S + x0];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// max pooling of the Z = depth * batch planes like max_pool() in runtime.cpp
+template<int W, int H, int Z, int WW, int WH, int S, int P>
+inline void fixed_max_pool(const float *__restrict__ x, float *__restrict__ r){
+    constexpr int pooled_w = 1 + (W + 2 * P - WW) / S;
+    constexpr int pooled_h = 1 + (H + 2 * P - WH) / S;
+
+    for (int z = 0; z < Z; z++){
+        const float *data = x + (size_t)z * W * H;
+        float *out = r + (size_t)z * pooled_w * pooled_h;
+
+        for (int py = 0; py < pooled_h; py++){
+            for (int px = 0; px < pooled_w; px++){
+                int x1 = px * S - P, y1 = py * S - P;
+                int x2 = std::min(x1 + WW, W), y2 = std::min(y1 + WH, H);
+                x1 = std::max(x1, 0);
+                y1 = std::max(y1, 0);
+
+                float best = data[y1 * W + x1];
+                for (int y = y1; y < y2; y++){
+                    for (int xx = x1; xx < x2; xx++) best = std::max(best, data[y * W + xx]);
+                }
+                out[py * pooled_w + px] = best;
+            }
+        }
+    }
+}
+
+#endif /* FIXED_KERNELS_H_ */
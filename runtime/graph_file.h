@@ -0,0 +1,262 @@
+/*
+ * graph_file.h
+ *
+ */
+
+#ifndef GRAPH_FILE_H_
+#define GRAPH_FILE_H_
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+
+/*
+ * Operators of an exported graph. Every tensor is column-major with one column per
+ * sample, so the batch size is the number of columns and can change at run time.
+ */
+#define OP_LINEAR       0   // in: x, w, [b]   attrs: transpose, bias
+#define OP_RELU         1
+#define OP_SIGMOID      2
+#define OP_TANH         3
+#define OP_SOFTMAX      4   // over the rows of every column
+#define OP_PLUS         5   // in: a, b
+#define OP_MINUS        6
+#define OP_MUL          7   // element-wise
+#define OP_SCALE_SHIFT  8   // in: x, scale, shift   x * scale + shift per row (folded BatchNorm)
+#define OP_CONV2D       9   // in: x, w, b   attrs: see CONV_*
+#define OP_MAX_POOL    10   // attrs: see POOL_*
+#define OP_COPY        11
+
+#define OP_NUM         12
+
+// OP_CONV2D attrs, the input is channel x height x width per column like FunctionConv2D
+#define CONV_CHANNELS   0
+#define CONV_WIDTH      1
+#define CONV_HEIGHT     2
+#define CONV_FILTER     3
+#define CONV_FILTERS    4
+#define CONV_STRIDE     5
+#define CONV_PADDING    6
+#define CONV_GROUPS     7
+#define CONV_DILATION   8
+#define CONV_OUT_WIDTH  9
+#define CONV_OUT_HEIGHT 10
+
+// OP_MAX_POOL attrs, same as FunctionPooling
+#define POOL_WIDTH      0
+#define POOL_HEIGHT     1
+#define POOL_DEPTH      2
+#define POOL_WINDOW_W   3
+#define POOL_WINDOW_H   4
+#define POOL_STRIDE     5
+#define POOL_PADDING    6
+
+#define TENSOR_ACTIVATION 0
+#define TENSOR_INPUT      1
+#define TENSOR_CONST      2
+
+#define GRAPH_FILE_MAGIC   0x474e4e44  // "DNNG"
+#define GRAPH_FILE_VERSION 1
+
+
+class GraphTensor {
+public:
+    int kind = TENSOR_ACTIVATION;
+    int rows = 0;
+    int cols = 0;       // the batch size of the trace for activations and inputs
+    string name;
+    vector<float> data; // TENSOR_CONST only
+};
+
+class GraphOp {
+public:
+    int type;
+    vector<int> inputs;
+    int output;
+    vector<int> attrs;
+};
+
+
+/**
+ * An exported inference graph: tensors, operators in execution order and the graph
+ * inputs and outputs (tensor indices). Written by Exporter (core/exporter.h) and read
+ * by Runtime (runtime.h); plain std C++ so that both sides can include it.
+ *
+ * Little-endian binary: magic, version, the number of tensors, ops, inputs, outputs,
+ * then every tensor (kind, rows, cols, name, the floats of a constant), every op
+ * (type, inputs, output, attrs) and the input and output indices.
+ */
+class GraphFile {
+public:
+    vector<GraphTensor> tensors;
+    vector<GraphOp> ops;
+    vector<int> inputs;
+    vector<int> outputs;
+
+    int add_tensor(int kind, int rows, int cols, string name = ""){
+        GraphTensor t;
+        t.kind = kind;
+        t.rows = rows;
+        t.cols = cols;
+        t.name = name;
+        tensors.push_back(t);
+        return tensors.size() - 1;
+    }
+
+    void add_op(int type, vector<int> inputs, int output, vector<int> attrs = {}){
+        GraphOp op;
+        op.type = type;
+        op.inputs = inputs;
+        op.output = output;
+        op.attrs = attrs;
+        ops.push_back(op);
+    }
+
+    size_t const_bytes(){
+        size_t n = 0;
+        for (GraphTensor &t : tensors) n += t.data.size() * sizeof(float);
+        return n;
+    }
+
+    bool save(string path){
+        ofstream ofs(path, ios::binary);
+        if (!ofs){
+            cout << "GraphFile: can not write " << path << endl;
+            return false;
+        }
+
+        put(ofs, GRAPH_FILE_MAGIC);
+        put(ofs, GRAPH_FILE_VERSION);
+        put(ofs, tensors.size());
+        put(ofs, ops.size());
+        put(ofs, inputs.size());
+        put(ofs, outputs.size());
+
+        for (GraphTensor &t : tensors){
+            put(ofs, t.kind);
+            put(ofs, t.rows);
+            put(ofs, t.cols);
+            put(ofs, t.name.size());
+            ofs.write(t.name.data(), t.name.size());
+            put(ofs, t.data.size());
+            ofs.write((const char *)t.data.data(), t.data.size() * sizeof(float));
+        }
+        for (GraphOp &op : ops){
+            put(ofs, op.type);
+            put(ofs, op.output);
+            put(ofs, op.inputs);
+            put(ofs, op.attrs);
+        }
+        for (int i : inputs) put(ofs, i);
+        for (int i : outputs) put(ofs, i);
+
+        return ofs.good();
+    }
+
+    bool load(string path){
+        ifstream ifs(path, ios::binary);
+        if (!ifs){
+            cout << "GraphFile: can not read " << path << endl;
+            return false;
+        }
+
+        if (get(ifs) != GRAPH_FILE_MAGIC){
+            cout << "GraphFile: " << path << " is not an exported graph" << endl;
+            return false;
+        }
+        int version = get(ifs);
+        if (version != GRAPH_FILE_VERSION){
+            cout << "GraphFile: " << path << " has version " << version << ", expected " << GRAPH_FILE_VERSION << endl;
+            return false;
+        }
+
+        int n_tensors = get(ifs), n_ops = get(ifs), n_inputs = get(ifs), n_outputs = get(ifs);
+        if (n_tensors < 0 || n_ops < 0 || n_inputs < 0 || n_outputs < 0){
+            cout << "GraphFile: " << path << " is broken" << endl;
+            return false;
+        }
+        tensors.resize(n_tensors);
+        ops.resize(n_ops);
+        inputs.resize(n_inputs);
+        outputs.resize(n_outputs);
+
+        for (GraphTensor &t : tensors){
+            t.kind = get(ifs);
+            t.rows = get(ifs);
+            t.cols = get(ifs);
+            int len = get(ifs);
+            if (len < 0 || !ifs) break;
+            t.name.resize(len);
+            ifs.read(&t.name[0], len);
+
+            len = get(ifs);
+            if (len < 0 || !ifs) break;
+            t.data.resize(len);
+            ifs.read((char *)t.data.data(), len * sizeof(float));
+        }
+        for (GraphOp &op : ops){
+            op.type = get(ifs);
+            op.output = get(ifs);
+            get(ifs, op.inputs);
+            get(ifs, op.attrs);
+        }
+        for (int &i : inputs) i = get(ifs);
+        for (int &i : outputs) i = get(ifs);
+
+        if (!ifs){
+            cout << "GraphFile: " << path << " is truncated" << endl;
+            return false;
+        }
+        return check();
+    }
+
+    // tensor indices and op types are in range, every op writes an activation and has its inputs and attrs
+    bool check(){
+        //                           LIN RELU SIG TANH SMAX PLUS MIN MUL SS CONV POOL COPY
+        static const int n_inputs[] = {2,  1,   1,  1,   1,   2,   2,  2,  3, 3,   1,   1};
+        static const int n_attrs[]  = {2,  0,   0,  0,   0,   0,   0,  0,  0, 11,  7,   0};
+
+        int n = tensors.size();
+        for (GraphOp &op : ops){
+            bool ok = op.type >= 0 && op.type < OP_NUM && op.output >= 0 && op.output < n
+                      && tensors[op.output].kind == TENSOR_ACTIVATION;
+            ok = ok && op.inputs.size() >= n_inputs[op.type] && op.attrs.size() >= n_attrs[op.type];
+            for (int i : op.inputs) ok = ok && i >= 0 && i < n;
+            if (!ok){
+                cout << "GraphFile: broken op of type " << op.type << endl;
+                return false;
+            }
+        }
+        for (int i : inputs) if (i < 0 || i >= n) return false;
+        for (int i : outputs) if (i < 0 || i >= n) return false;
+        return true;
+    }
+
+private:
+    static void put(ofstream &ofs, int64_t v){
+        int32_t i = (int32_t) v;
+        ofs.write((const char *)&i, sizeof(i));
+    }
+    static void put(ofstream &ofs, const vector<int> &v){
+        put(ofs, v.size());
+        for (int i : v) put(ofs, i);
+    }
+    static int get(ifstream &ifs){
+        int32_t i = 0;
+        ifs.read((char *)&i, sizeof(i));
+        return i;
+    }
+    static void get(ifstream &ifs, vector<int> &v){
+        int n = get(ifs);
+        if (n < 0 || !ifs) n = 0;
+        v.clear();
+        for (int k = 0; k < n && ifs; k++) v.push_back(get(ifs));
+    }
+};
+
+#endif /* GRAPH_FILE_H_ */
@@ -0,0 +1,345 @@
+/*
+ * runtime.cpp
+ *
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "runtime.h"
+
+using namespace std;
+
+
+// every tensor in the arena starts at a multiple of 16 floats (64 bytes)
+#define ARENA_ALIGN 16
+
+// columns of a Linear computed together, every weight column is read once per block
+#define LINEAR_BLOCK 8
+
+
+bool Runtime::load(string path, int batch){
+    if (!graph.load(path)) return false;
+
+    if (batch <= 0) batch = graph.inputs.empty() ? 1 : graph.tensors[graph.inputs[0]].cols;
+    return plan(batch);
+}
+
+int Runtime::size(int t){
+    GraphTensor &g = graph.tensors[t];
+    if (g.kind == TENSOR_CONST) return g.data.size();
+    return g.rows * batch;
+}
+
+size_t Runtime::unplanned_bytes(){
+    size_t n = 0;
+    for (int t = 0; t < graph.tensors.size(); t++){
+        if (graph.tensors[t].kind != TENSOR_CONST) n += size(t) * sizeof(float);
+    }
+    return n;
+}
+
+bool Runtime::plan(int batch){
+    this->batch = batch;
+
+    int n = graph.tensors.size();
+    int n_ops = graph.ops.size();
+
+    // element-wise operands have to match, a constant one too
+    for (GraphOp &op : graph.ops){
+        if (op.type != OP_PLUS && op.type != OP_MINUS && op.type != OP_MUL) continue;
+        if (size(op.inputs[0]) != size(op.inputs[1]) || size(op.inputs[0]) != size(op.output)){
+            cout << "Runtime: the operands of an element-wise op do not match for batch " << batch << endl;
+            return false;
+        }
+    }
+
+    // index of the op that reads a tensor last, graph inputs and outputs live through the run
+    vector<int> last(n, -1);
+    for (int k = 0; k < n_ops; k++){
+        for (int i : graph.ops[k].inputs) last[i] = k;
+    }
+    for (int i : graph.inputs) last[i] = n_ops;
+    for (int i : graph.outputs) last[i] = n_ops;
+
+    // every activation gets a slot, a slot is reused once the tensor in it is dead
+    vector<size_t> slot_size;
+    vector<int> slot_of(n, -1);
+    vector<int> free_slots;
+
+    auto alloc = [&](int t){
+        size_t need = (size(t) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+        // the smallest free slot that fits, else the largest one grown
+        int best = -1;
+        for (int i = 0; i < free_slots.size(); i++){
+            if (best < 0) { best = i; continue; }
+
+            size_t s = slot_size[free_slots[i]];
+            size_t b = slot_size[free_slots[best]];
+            if (s >= need ? (b < need || s < b) : (b < need && s > b)) best = i;
+        }
+
+        if (best < 0){
+            slot_size.push_back(need);
+            slot_of[t] = slot_size.size() - 1;
+        }
+        else {
+            slot_of[t] = free_slots[best];
+            slot_size[slot_of[t]] = max(slot_size[slot_of[t]], need);
+            free_slots.erase(free_slots.begin() + best);
+        }
+    };
+
+    for (int i : graph.inputs) alloc(i);
+
+    vector<bool> freed(n, false);
+    for (int k = 0; k < n_ops; k++){
+        GraphOp &op = graph.ops[k];
+
+        // the output never shares memory with the inputs of its own op
+        if (slot_of[op.output] < 0) alloc(op.output);
+
+        for (int i : op.inputs){
+            if (slot_of[i] >= 0 && last[i] == k && !freed[i]){
+                free_slots.push_back(slot_of[i]);
+                freed[i] = true;
+            }
+        }
+        if (last[op.output] < 0){
+            free_slots.push_back(slot_of[op.output]);
+            freed[op.output] = true;
+        }
+    }
+
+    vector<size_t> offset(slot_size.size());
+    size_t total = 0;
+    for (int i = 0; i < slot_size.size(); i++){
+        offset[i] = total;
+        total += slot_size[i];
+    }
+    arena.assign(total, 0);
+
+    ptr.assign(n, NULL);
+    for (int t = 0; t < n; t++){
+        if (graph.tensors[t].kind == TENSOR_CONST) ptr[t] = graph.tensors[t].data.data();
+        else if (slot_of[t] >= 0) ptr[t] = arena.data() + offset[slot_of[t]];
+    }
+    return true;
+}
+
+void Runtime::run(){
+    for (GraphOp &op : graph.ops) run(op);
+}
+
+
+/*
+ * r (o_size x batch) = w (o_size x i_size) x + b, or w^T x with a transposed
+ * w (i_size x o_size), all column-major like cuMat.
+ */
+static void linear(const float *x, const float *w, const float *b, float *r,
+                   int o_size, int i_size, int batch, bool transpose){
+    if (transpose){
+        for (int j = 0; j < batch; j++){
+            const float *xj = x + (size_t)j * i_size;
+            for (int o = 0; o < o_size; o++){
+                const float *wo = w + (size_t)o * i_size;
+                float s = b != NULL ? b[o] : 0;
+                for (int k = 0; k < i_size; k++) s += wo[k] * xj[k];
+                r[(size_t)j * o_size + o] = s;
+            }
+        }
+        return;
+    }
+
+    for (int j0 = 0; j0 < batch; j0 += LINEAR_BLOCK){
+        int j1 = min(batch, j0 + LINEAR_BLOCK);
+
+        for (int j = j0; j < j1; j++){
+            float *rj = r + (size_t)j * o_size;
+            if (b != NULL) memcpy(rj, b, o_size * sizeof(float));
+            else memset(rj, 0, o_size * sizeof(float));
+        }
+        for (int k = 0; k < i_size; k++){
+            const float *wk = w + (size_t)k * o_size;
+            for (int j = j0; j < j1; j++){
+                float v = x[(size_t)j * i_size + k];
+                if (v == 0) continue;
+                float *rj = r + (size_t)j * o_size;
+                for (int o = 0; o < o_size; o++) rj[o] += wk[o] * v;
+            }
+        }
+    }
+}
+
+// first and one past the last output position whose input p * stride - pad + offset is in [0, size)
+static void valid_range(int size, int out, int stride, int pad, int offset, int &lo, int &hi){
+    int d = pad - offset;
+    lo = d > 0 ? (d + stride - 1) / stride : 0;
+    hi = size + d > 0 ? (size + d - 1) / stride + 1 : 0;
+    lo = min(lo, out);
+    hi = min(hi, out);
+}
+
+/*
+ * Direct convolution with the layout of FunctionConv2D: x is channel x height x width per
+ * column, w (filters x filter^2 * channels / groups) column-major, r filter x out_h x out_w.
+ */
+static void conv2d(const float *x, const float *w, const float *b, float *r, const vector<int> &a, int batch){
+    int channels = a[CONV_CHANNELS], width = a[CONV_WIDTH], height = a[CONV_HEIGHT];
+    int k_size = a[CONV_FILTER], filters = a[CONV_FILTERS], stride = a[CONV_STRIDE], pad = a[CONV_PADDING];
+    int groups = a[CONV_GROUPS], dilation = a[CONV_DILATION];
+    int out_w = a[CONV_OUT_WIDTH], out_h = a[CONV_OUT_HEIGHT];
+
+    int group_channels = channels / groups;
+    int group_filters = filters / groups;
+    int out_size = out_w * out_h;
+
+    for (int j = 0; j < batch; j++){
+        const float *xj = x + (size_t)j * channels * width * height;
+        float *rj = r + (size_t)j * filters * out_size;
+
+        for (int f = 0; f < filters; f++){
+            int g = f / group_filters;
+            float *rf = rj + (size_t)f * out_size;
+            for (int p = 0; p < out_size; p++) rf[p] = b[f];
+
+            for (int cl = 0; cl < group_channels; cl++){
+                const float *xc = xj + (size_t)(g * group_channels + cl) * width * height;
+
+                for (int ki = 0; ki < k_size; ki++){
+                    int y_lo, y_hi;
+                    valid_range(height, out_h, stride, pad, ki * dilation, y_lo, y_hi);
+
+                    for (int kj = 0; kj < k_size; kj++){
+                        int x_lo, x_hi;
+                        valid_range(width, out_w, stride, pad, kj * dilation, x_lo, x_hi);
+
+                        float wv = w[f + (size_t)((cl * k_size + ki) * k_size + kj) * filters];
+                        if (wv == 0) continue;
+
+                        int x0 = kj * dilation - pad;
+                        for (int oy = y_lo; oy < y_hi; oy++){
+                            const float *xrow = xc + (size_t)(oy * stride - pad + ki * dilation) * width;
+                            float *rrow = rf + oy * out_w;
+                            if (stride == 1){
+                                for (int ox = x_lo; ox < x_hi; ox++) rrow[ox] += wv * xrow[ox + x0];
+                            }
+                            else {
+                                for (int ox = x_lo; ox < x_hi; ox++) rrow[ox] += wv * xrow[ox * stride + x0];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// max pooling of every width x height plane like maxPooling_gpu_kernel, windows clipped at the border
+static void max_pool(const float *x, float *r, const vector<int> &a, int batch){
+    int width = a[POOL_WIDTH], height = a[POOL_HEIGHT], depth = a[POOL_DEPTH];
+    int window_w = a[POOL_WINDOW_W], window_h = a[POOL_WINDOW_H], stride = a[POOL_STRIDE], pad = a[POOL_PADDING];
+
+    int pooled_w = 1 + (width + 2 * pad - window_w) / stride;
+    int pooled_h = 1 + (height + 2 * pad - window_h) / stride;
+
+    for (int z = 0; z < depth * batch; z++){
+        const float *data = x + (size_t)z * width * height;
+        float *out = r + (size_t)z * pooled_w * pooled_h;
+
+        for (int py = 0; py < pooled_h; py++){
+            for (int px = 0; px < pooled_w; px++){
+                int x1 = px * stride - pad, y1 = py * stride - pad;
+                int x2 = min(x1 + window_w, width), y2 = min(y1 + window_h, height);
+                x1 = max(x1, 0);
+                y1 = max(y1, 0);
+
+                float best = data[y1 * width + x1];
+                for (int y = y1; y < y2; y++){
+                    for (int xx = x1; xx < x2; xx++) best = max(best, data[y * width + xx]);
+                }
+                out[py * pooled_w + px] = best;
+            }
+        }
+    }
+}
+
+static void softmax(const float *x, float *r, int rows, int batch){
+    for (int j = 0; j < batch; j++){
+        const float *xj = x + (size_t)j * rows;
+        float *rj = r + (size_t)j * rows;
+
+        float m = xj[0];
+        for (int i = 1; i < rows; i++) m = max(m, xj[i]);
+        float sum = 0;
+        for (int i = 0; i < rows; i++){
+            rj[i] = exp(xj[i] - m);
+            sum += rj[i];
+        }
+        for (int i = 0; i < rows; i++) rj[i] /= sum;
+    }
+}
+
+void Runtime::run(GraphOp &op){
+    float *r = ptr[op.output];
+    const float *x = ptr[op.inputs[0]];
+    int rows = graph.tensors[op.output].rows;
+    size_t n = (size_t)rows * batch;
+
+    switch (op.type){
+    case OP_LINEAR: {
+        GraphTensor &w = graph.tensors[op.inputs[1]];
+        bool transpose = op.attrs[0];
+        const float *b = op.attrs[1] && op.inputs.size() > 2 ? ptr[op.inputs[2]] : NULL;
+        linear(x, ptr[op.inputs[1]], b, r, rows, transpose ? w.rows : w.cols, batch, transpose);
+        break;
+    }
+    case OP_RELU:
+        for (size_t i = 0; i < n; i++) r[i] = x[i] > 0 ? x[i] : 0;
+        break;
+    case OP_SIGMOID:
+        for (size_t i = 0; i < n; i++) r[i] = 1 / (1 + exp(-x[i]));
+        break;
+    case OP_TANH:
+        for (size_t i = 0; i < n; i++) r[i] = tanh(x[i]);
+        break;
+    case OP_SOFTMAX:
+        softmax(x, r, rows, batch);
+        break;
+    case OP_PLUS: {
+        const float *y = ptr[op.inputs[1]];
+        for (size_t i = 0; i < n; i++) r[i] = x[i] + y[i];
+        break;
+    }
+    case OP_MINUS: {
+        const float *y = ptr[op.inputs[1]];
+        for (size_t i = 0; i < n; i++) r[i] = x[i] - y[i];
+        break;
+    }
+    case OP_MUL: {
+        const float *y = ptr[op.inputs[1]];
+        for (size_t i = 0; i < n; i++) r[i] = x[i] * y[i];
+        break;
+    }
+    case OP_SCALE_SHIFT: {
+        const float *scale = ptr[op.inputs[1]];
+        const float *shift = ptr[op.inputs[2]];
+        for (int j = 0; j < batch; j++){
+            for (int i = 0; i < rows; i++) r[(size_t)j * rows + i] = x[(size_t)j * rows + i] * scale[i] + shift[i];
+        }
+        break;
+    }
+    case OP_CONV2D:
+        conv2d(x, ptr[op.inputs[1]], ptr[op.inputs[2]], r, op.attrs, batch);
+        break;
+    case OP_MAX_POOL:
+        max_pool(x, r, op.attrs, batch);
+        break;
+    case OP_COPY:
+        memcpy(r, x, n * sizeof(float));
+        break;
+    }
+}
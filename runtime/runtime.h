@@ -0,0 +1,63 @@
+/*
+ * runtime.h
+ *
+ */
+
+#ifndef RUNTIME_H_
+#define RUNTIME_H_
+
+#include <string>
+#include <vector>
+
+#include "graph_file.h"
+
+using namespace std;
+
+
+/**
+ * CPU inference runtime for graphs exported by Exporter (core/exporter.h), std C++ only.
+ *
+ *   Runtime rt;
+ *   rt.load("model.dnng");     // plans the memory for the traced batch size
+ *   rt.plan(1);                // or for another one
+ *   memcpy(rt.input(0), x, rt.input_size(0) * sizeof(float));
+ *   rt.run();
+ *   float *y = rt.output(0);   // rows x batch, column-major
+ *
+ * plan() assigns every tensor a fixed offset in one arena: tensors whose lifetimes do
+ * not overlap share memory, so run() does no allocation at all.
+ */
+class Runtime {
+public:
+    GraphFile graph;
+
+    int batch = 0;
+    vector<float> arena;
+    vector<float *> ptr;
+
+    Runtime() {}
+    // ptr points into arena and graph
+    Runtime(const Runtime &) = delete;
+
+    bool load(string path, int batch = 0);
+
+    // lay out the tensors for batch columns, returns false if the graph can not run with it
+    bool plan(int batch);
+
+    void run();
+
+    float *input(int i) { return ptr[graph.inputs[i]]; }
+    float *output(int i) { return ptr[graph.outputs[i]]; }
+    int input_size(int i) { return graph.tensors[graph.inputs[i]].rows * batch; }
+    int output_size(int i) { return graph.tensors[graph.outputs[i]].rows * batch; }
+
+    // bytes of the arena and of all tensors if each had its own buffer
+    size_t arena_bytes() { return arena.size() * sizeof(float); }
+    size_t unplanned_bytes();
+
+private:
+    int size(int t);
+    void run(GraphOp &op);
+};
+
+#endif /* RUNTIME_H_ */
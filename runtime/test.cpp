@@ -0,0 +1,297 @@
+/*
+ * test.cpp
+ *
+ * Checks of the runtime operators against naive implementations, and of an exported
+ * model against the outputs the training code computed for it:
+ *
+ *   ./test                          operator checks
+ *   ./test model.dnng model.ref     exported model (see core/test.cpp.export)
+ */
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "runtime.h"
+
+using namespace std;
+
+
+int failures = 0;
+
+void check(bool ok, string what){
+    cout << (ok ? "ok     " : "FAILED ") << what << endl;
+    if (!ok) failures++;
+}
+
+float max_diff(const float *a, const float *b, int n){
+    float d = 0;
+    for (int i = 0; i < n; i++) d = max(d, fabs(a[i] - b[i]));
+    return d;
+}
+
+vector<float> randoms(int n, mt19937 &mt){
+    normal_distribution<float> dist(0., 1.);
+    vector<float> v(n);
+    for (float &f : v) f = dist(mt);
+    return v;
+}
+
+int constant(GraphFile &g, int rows, int cols, vector<float> data){
+    int t = g.add_tensor(TENSOR_CONST, rows, cols);
+    g.tensors[t].data = data;
+    return t;
+}
+
+// a one op graph x (rows x batch) -> rows_out x batch, rt keeps pointers into its graph so it is filled in place
+void single(Runtime &rt, int type, int rows, int rows_out, int batch, vector<int> consts, vector<int> attrs, GraphFile g){
+    int x = g.add_tensor(TENSOR_INPUT, rows, batch, "x");
+    int y = g.add_tensor(TENSOR_ACTIVATION, rows_out, batch, "y");
+    consts.insert(consts.begin(), x);
+    g.add_op(type, consts, y, attrs);
+    g.inputs = {x};
+    g.outputs = {y};
+
+    rt.graph = g;
+    rt.plan(batch);
+}
+
+
+void test_linear(mt19937 &mt){
+    int o_size = 5, i_size = 7, batch = 11;
+
+    for (int transpose = 0; transpose < 2; transpose++){
+        GraphFile g;
+        vector<float> w = randoms(o_size * i_size, mt), b = randoms(o_size, mt);
+        int wt = transpose ? constant(g, i_size, o_size, w) : constant(g, o_size, i_size, w);
+        int bt = constant(g, o_size, 1, b);
+
+        Runtime rt;
+        single(rt, OP_LINEAR, i_size, o_size, batch, {wt, bt}, {transpose, 1}, g);
+        vector<float> x = randoms(i_size * batch, mt);
+        memcpy(rt.input(0), x.data(), x.size() * sizeof(float));
+        rt.run();
+
+        vector<float> r(o_size * batch);
+        for (int j = 0; j < batch; j++){
+            for (int o = 0; o < o_size; o++){
+                float s = b[o];
+                for (int k = 0; k < i_size; k++){
+                    s += (transpose ? w[k + o * i_size] : w[o + k * o_size]) * x[k + j * i_size];
+                }
+                r[o + j * o_size] = s;
+            }
+        }
+        check(max_diff(r.data(), rt.output(0), r.size()) < 1e-4, transpose ? "linear transposed" : "linear");
+    }
+}
+
+/*
+ * The convolution through im2col like FunctionConv2D: cols(p, c * k^2 + i * k + j) and
+ * r(p, f) = b(f) + sum cols(p, group columns) w(f, group columns)^T.
+ */
+void test_conv2d(mt19937 &mt){
+    struct Case { int channels, size, k, filters, stride, pad, groups, dilation; };
+    vector<Case> cases = {
+        {1, 5, 3, 2, 1, 0, 1, 1},
+        {3, 8, 3, 4, 1, 1, 1, 1},
+        {4, 9, 3, 6, 2, 1, 2, 1},
+        {2, 10, 3, 2, 1, 2, 1, 2},
+        {4, 7, 1, 4, 1, 0, 4, 1},
+    };
+    int batch = 3;
+
+    for (Case &c : cases){
+        int extent = c.dilation * (c.k - 1) + 1;
+        int out = 1 + (c.size + 2 * c.pad - extent) / c.stride;
+        int group_cols = c.channels * c.k * c.k / c.groups;
+        int in_size = c.channels * c.size * c.size;
+        int out_size = out * out;
+
+        GraphFile g;
+        vector<float> w = randoms(c.filters * group_cols, mt), b = randoms(c.filters, mt);
+        int wt = constant(g, c.filters, group_cols, w);
+        int bt = constant(g, c.filters, 1, b);
+
+        Runtime rt;
+        single(rt, OP_CONV2D, in_size, c.filters * out_size, batch, {wt, bt},
+               {c.channels, c.size, c.size, c.k, c.filters, c.stride, c.pad, c.groups, c.dilation, out, out}, g);
+        vector<float> x = randoms(in_size * batch, mt);
+        memcpy(rt.input(0), x.data(), x.size() * sizeof(float));
+        rt.run();
+
+        vector<float> r(c.filters * out_size * batch);
+        for (int s = 0; s < batch; s++){
+            for (int f = 0; f < c.filters; f++){
+                int grp = f / (c.filters / c.groups);
+                for (int p = 0; p < out_size; p++){
+                    float v = b[f];
+                    for (int cc = 0; cc < group_cols; cc++){
+                        int col = grp * group_cols + cc;
+                        int ch = col / (c.k * c.k), i = col / c.k % c.k, j = col % c.k;
+                        int h = p / out * c.stride - c.pad + i * c.dilation;
+                        int ww = p % out * c.stride - c.pad + j * c.dilation;
+                        if (h < 0 || ww < 0 || h >= c.size || ww >= c.size) continue;
+                        v += w[f + cc * c.filters] * x[s * in_size + (ch * c.size + h) * c.size + ww];
+                    }
+                    r[s * c.filters * out_size + f * out_size + p] = v;
+                }
+            }
+        }
+        check(max_diff(r.data(), rt.output(0), r.size()) < 1e-4,
+              "conv2d " + to_string(c.channels) + "x" + to_string(c.size) + "x" + to_string(c.size)
+              + " k" + to_string(c.k) + " s" + to_string(c.stride) + " p" + to_string(c.pad)
+              + " g" + to_string(c.groups) + " d" + to_string(c.dilation));
+    }
+}
+
+void test_max_pool(){
+    // one 4x4 plane, 2x2 windows with stride 2
+    GraphFile g;
+    Runtime rt;
+    single(rt, OP_MAX_POOL, 16, 4, 1, {}, {4, 4, 1, 2, 2, 2, 0}, g);
+    float x[16] = { 1,  2,  3,  4,
+                    5,  6,  7,  8,
+                   -1, -2, -3, -4,
+                   -5, -6,  9, -8};
+    float r[4] = {6, 8, -1, 9};
+    memcpy(rt.input(0), x, sizeof(x));
+    rt.run();
+    check(max_diff(r, rt.output(0), 4) == 0, "max pool");
+}
+
+void test_element_wise(mt19937 &mt){
+    int rows = 6, batch = 4, n = rows * batch;
+    vector<float> x = randoms(n, mt);
+
+    GraphFile g;
+    Runtime rt;
+    single(rt, OP_SOFTMAX, rows, rows, batch, {}, {}, g);
+    memcpy(rt.input(0), x.data(), n * sizeof(float));
+    rt.run();
+    bool ok = true;
+    for (int j = 0; j < batch; j++){
+        float sum = 0, m = -1e30, arg_r = 0, arg_x = 0;
+        for (int i = 0; i < rows; i++){
+            sum += rt.output(0)[i + j * rows];
+            if (x[i + j * rows] > m) { m = x[i + j * rows]; arg_x = i; }
+        }
+        m = -1;
+        for (int i = 0; i < rows; i++) if (rt.output(0)[i + j * rows] > m) { m = rt.output(0)[i + j * rows]; arg_r = i; }
+        ok = ok && fabs(sum - 1) < 1e-5 && arg_r == arg_x;
+    }
+    check(ok, "softmax");
+
+    vector<float> scale = randoms(rows, mt), shift = randoms(rows, mt);
+    GraphFile g2;
+    int st = constant(g2, rows, 1, scale), ht = constant(g2, rows, 1, shift);
+    single(rt, OP_SCALE_SHIFT, rows, rows, batch, {st, ht}, {}, g2);
+    memcpy(rt.input(0), x.data(), n * sizeof(float));
+    rt.run();
+    vector<float> r(n);
+    for (int i = 0; i < n; i++) r[i] = x[i] * scale[i % rows] + shift[i % rows];
+    check(max_diff(r.data(), rt.output(0), n) < 1e-6, "scale shift");
+}
+
+/*
+ * A chain of layers: the planned arena has to be smaller than one buffer per tensor,
+ * give the same result for every batch size and survive a save/load.
+ */
+void test_plan(mt19937 &mt){
+    int size = 32, layers = 6, batch = 8;
+
+    GraphFile g;
+    int x = g.add_tensor(TENSOR_INPUT, size, batch, "x");
+    int h = x, skip = x;
+    for (int i = 0; i < layers; i++){
+        int w = constant(g, size, size, randoms(size * size, mt));
+        int b = constant(g, size, 1, randoms(size, mt));
+        int l = g.add_tensor(TENSOR_ACTIVATION, size, batch);
+        g.add_op(OP_LINEAR, {h, w, b}, l, {0, 1});
+        int a = g.add_tensor(TENSOR_ACTIVATION, size, batch);
+        g.add_op(i % 2 ? OP_TANH : OP_RELU, {l}, a);
+        h = a;
+        if (i == 2){
+            int p = g.add_tensor(TENSOR_ACTIVATION, size, batch);
+            g.add_op(OP_PLUS, {h, skip}, p);
+            h = p;
+        }
+    }
+    g.inputs = {x};
+    g.outputs = {h};
+
+    g.save("test_plan.dnng");
+    Runtime rt;
+    check(rt.load("test_plan.dnng"), "save and load");
+    remove("test_plan.dnng");
+
+    check(rt.arena_bytes() < rt.unplanned_bytes(), "arena " + to_string(rt.arena_bytes()) + " bytes, "
+          + to_string(rt.unplanned_bytes()) + " without planning");
+
+    vector<float> in = randoms(size * batch, mt);
+    memcpy(rt.input(0), in.data(), in.size() * sizeof(float));
+    rt.run();
+    vector<float> out(rt.output(0), rt.output(0) + rt.output_size(0));
+
+    // column by column with batch 1
+    bool ok = rt.plan(1);
+    for (int j = 0; j < batch; j++){
+        memcpy(rt.input(0), in.data() + j * size, size * sizeof(float));
+        rt.run();
+        ok = ok && max_diff(out.data() + j * size, rt.output(0), size) < 1e-5;
+    }
+    check(ok, "batch 1 plan");
+}
+
+// the outputs of an exported model for the inputs stored next to it by Exporter::save_reference
+void test_reference(string model_path, string ref_path){
+    Runtime rt;
+    GraphFile ref;
+    if (!rt.load(model_path) || !ref.load(ref_path)){
+        check(false, "load " + model_path + " and " + ref_path);
+        return;
+    }
+    if (ref.inputs.size() != rt.graph.inputs.size() || ref.outputs.size() != rt.graph.outputs.size()){
+        check(false, ref_path + " does not match " + model_path);
+        return;
+    }
+
+    int batch = ref.tensors[ref.inputs[0]].cols;
+    rt.plan(batch);
+    for (int i = 0; i < ref.inputs.size(); i++){
+        vector<float> &x = ref.tensors[ref.inputs[i]].data;
+        memcpy(rt.input(i), x.data(), min((size_t)rt.input_size(i), x.size()) * sizeof(float));
+    }
+    rt.run();
+
+    for (int i = 0; i < ref.outputs.size(); i++){
+        vector<float> &y = ref.tensors[ref.outputs[i]].data;
+        float scale = 0;
+        for (float v : y) scale = max(scale, fabs(v));
+
+        float d = y.size() == rt.output_size(i) ? max_diff(y.data(), rt.output(i), y.size()) : 1e30;
+        check(d <= 1e-4 * max(scale, 1.0f), model_path + " output " + to_string(i) + " max diff " + to_string(d));
+    }
+}
+
+
+int main(int argc, char *argv[]){
+
+    if (argc == 3){
+        test_reference(argv[1], argv[2]);
+    }
+    else {
+        mt19937 mt(1);
+        test_linear(mt);
+        test_conv2d(mt);
+        test_max_pool();
+        test_element_wise(mt);
+        test_plan(mt);
+    }
+
+    cout << (failures ? to_string(failures) + " failed" : "all passed") << endl;
+    return failures ? 1 : 0;
+}